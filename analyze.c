@@ -0,0 +1,245 @@
+// vim: sw=8:ts=8:noexpandtab
+/*
+ * Offline per channel statistics of a capture: edges, duty cycle, pulse
+ * widths and frequency, see stats.h. raw and blockz captures are cut into
+ * one piece per thread; zlib and rle ones can only be read start to end.
+ *
+ *   analyze [-j <threads>] [-r <sample rate>] [-F <format>] [-H] <capture>
+ */
+#include "capture.h"
+#include "stats.h"
+#include "log.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ANALYZE_CHUNK (1024 * 1024)		/* samples read at a time */
+#define ANALYZE_MIN_PIECE (16 * 1024 * 1024)	/* not worth a thread below this */
+#define ANALYZE_MAX_THREADS 256
+
+struct analyze_piece {
+	pthread_t			thread;
+	const char			*filename;
+	const char			*format;
+	struct capture_reader		*shared;	/* raw captures are mapped once for all */
+	uint64_t			start;
+	uint64_t			end;
+	struct stats			stats;
+	int				error;
+};
+
+static void usage(const char *name){
+	fprintf(stderr, "usage: %s [-j <threads>] [-r <sample rate>] [-F raw|blockz|zlib|rle] [-H] <capture>\n", name);
+	fprintf(stderr, " -j: Threads for raw and blockz captures. Defaults to one per cpu.\n");
+	fprintf(stderr, " -r: Sample rate (\"24MHz\", \"500k\", \"16000000\"), for times and frequencies.\n");
+	fprintf(stderr, "     blockz captures carry theirs.\n");
+	fprintf(stderr, " -F: Capture format, told from the file by default.\n");
+	fprintf(stderr, " -H: Print the pulse width histograms.\n");
+}
+
+static void *analyze_thread(void *arg){
+struct analyze_piece *piece = arg;
+struct capture_reader *c = piece->shared;
+uint64_t at = piece->start;
+uint8_t *buf = NULL;
+ssize_t n;
+
+	if (!c && !(c = capture_open(piece->filename, piece->format))) {
+		piece->error = 1;
+		return NULL;
+	}
+	if (c->map) {
+		/* the first sample of a capture is its own predecessor, it cannot be an edge */
+		piece->stats.prev = c->map[piece->start ? piece->start - 1 : 0];
+		stats_scan(&piece->stats, c->map + piece->start, piece->end - piece->start);
+		return NULL;
+	}
+	if (!(buf = malloc(ANALYZE_CHUNK)) ||
+	    (piece->start && capture_read(c, piece->start - 1, &piece->stats.prev, 1) != 1)) {
+		piece->error = 1;
+		goto out;
+	}
+	while (at < piece->end) {
+		n = capture_read(c, at, buf, piece->end - at < ANALYZE_CHUNK ? piece->end - at : ANALYZE_CHUNK);
+		if (n <= 0) {
+			/* the end of a stream, or of a file shorter than it says */
+			piece->error = n < 0 || piece->end != CAPTURE_UNKNOWN;
+			break;
+		}
+		if (!at) {
+			piece->stats.prev = buf[0];
+		}
+		stats_scan(&piece->stats, buf, n);
+		at += n;
+	}
+out:
+	free(buf);
+	if (!piece->shared) {
+		capture_close(c);
+	}
+	return NULL;
+}
+
+static void print_widths(const char *name, const struct stats_widths *w, uint32_t rate, bool histogram){
+unsigned int k;
+
+	if (!w->count) {
+		printf("    %s pulses: none complete\n", name);
+		return;
+	}
+	printf("    %s pulses: %llu, min %llu max %llu mean %.2f samples", name, (unsigned long long)w->count,
+	       (unsigned long long)w->min, (unsigned long long)w->max, (double)w->sum / w->count);
+	if (rate) {
+		printf(" (min %.9fs max %.9fs mean %.9fs)", (double)w->min / rate, (double)w->max / rate,
+		       (double)w->sum / w->count / rate);
+	}
+	printf("\n");
+	if (!histogram) {
+		return;
+	}
+	for (k = 0; k < STATS_HIST_BUCKETS; k++) {
+		if (w->hist[k]) {
+			printf("      [%llu, %llu): %llu\n", 1ull << k, k == 63 ? ~0ull : 2ull << k,
+			       (unsigned long long)w->hist[k]);
+		}
+	}
+}
+
+static void print_stats(const struct stats *s, uint32_t rate, bool histogram){
+const struct stats_channel *ch;
+unsigned int c;
+
+	for (c = 0; c < STATS_CHANNELS; c++) {
+		ch = &s->ch[c];
+		if (ch->first_edge == STATS_NONE) {
+			printf("channel %u: no edges, %s\n", c, (s->first >> c) & 1 ? "high" : "low");
+			continue;
+		}
+		printf("channel %u: %llu rising, %llu falling, high %.3f%%", c, (unsigned long long)ch->rising,
+		       (unsigned long long)ch->falling, 100.0 * ch->high / s->n_samples);
+		if (ch->rising > 1) {
+			/* rising edge to rising edge, averaged over all of them */
+			printf(", period %.2f samples", (double)(ch->last_rise - ch->first_rise) / (ch->rising - 1));
+			if (rate) {
+				printf(", %.6f Hz", (double)(ch->rising - 1) * rate / (ch->last_rise - ch->first_rise));
+			}
+		}
+		printf("\n");
+		print_widths("high", &ch->high_pulses, rate, histogram);
+		print_widths("low", &ch->low_pulses, rate, histogram);
+	}
+}
+
+int main(int argc, char **argv){
+struct capture_reader *c;
+struct analyze_piece *pieces;
+struct stats total;
+struct timespec t0, t1;
+const char *format = NULL;
+uint32_t rate = 0;
+long threads = sysconf(_SC_NPROCESSORS_ONLN);
+bool histogram = false;
+unsigned int i, n_pieces = 1;
+double elapsed;
+int ch, failed = 0;
+
+	current_log_level = ERR;
+	while ((ch = getopt(argc, argv, "j:r:F:Hh")) != -1) {
+		switch (ch) {
+		case 'j':
+			threads = strtol(optarg, NULL, 10);
+			if (threads < 1 || threads > ANALYZE_MAX_THREADS) {
+				fprintf(stderr, "Invalid number of threads, must be between 1 and %d: %s\n",
+					ANALYZE_MAX_THREADS, optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'r':
+			if (!(rate = capture_parse_rate(optarg))) {
+				fprintf(stderr, "Invalid sample rate: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'F':
+			format = optarg;
+			break;
+		case 'H':
+			histogram = true;
+			break;
+		default:
+			usage(argv[0]);
+			return ch == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+	if (optind + 1 != argc) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+	if (!(c = capture_open(argv[optind], format))) {
+		return EXIT_FAILURE;
+	}
+	if (!rate) {
+		rate = c->samples_per_second;
+	}
+	if (threads < 1) {
+		threads = 1;
+	}
+	if (capture_seekable(c)) {
+		n_pieces = c->n_samples / ANALYZE_MIN_PIECE + 1;
+		if (n_pieces > threads) {
+			n_pieces = threads;
+		}
+	}
+
+	pieces = calloc(n_pieces, sizeof(struct analyze_piece));
+	if (!pieces) {
+		capture_close(c);
+		return EXIT_FAILURE;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < n_pieces; i++) {
+		pieces[i].filename = argv[optind];
+		pieces[i].format = format;
+		/* a blockz reader has one file position and one cached block, each thread opens its own */
+		pieces[i].shared = c->format == CAPTURE_BLOCKZ ? NULL : c;
+		/* on 64 sample boundaries, so only the last piece has a partial word */
+		pieces[i].start = c->n_samples / 64 * i / n_pieces * 64;
+		pieces[i].end = i + 1 == n_pieces ? c->n_samples : c->n_samples / 64 * (i + 1) / n_pieces * 64;
+		stats_init(&pieces[i].stats, pieces[i].start, 0);
+		if (n_pieces == 1) {
+			analyze_thread(&pieces[i]);
+		} else if (pthread_create(&pieces[i].thread, NULL, analyze_thread, &pieces[i])) {
+			pieces[i].error = 1;
+			pieces[i].thread = 0;
+		}
+	}
+	stats_init(&total, 0, 0);
+	for (i = 0; i < n_pieces; i++) {
+		if (n_pieces > 1 && pieces[i].thread) {
+			pthread_join(pieces[i].thread, NULL);
+		}
+		failed |= pieces[i].error;
+		stats_merge(&total, &pieces[i].stats);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	elapsed = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+	if (failed) {
+		fprintf(stderr, "Failed to read %s\n", argv[optind]);
+	}
+	printf("%llu samples", (unsigned long long)total.n_samples);
+	if (rate) {
+		printf(", %.6fs at %u samples per second", (double)total.n_samples / rate, rate);
+	}
+	printf("\n");
+	print_stats(&total, rate, histogram);
+	printf("analyzed in %.3fs, %.1f Msamples/s, %u threads\n", elapsed, total.n_samples / elapsed / 1e6, n_pieces);
+
+	free(pieces);
+	capture_close(c);
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,161 @@
+// vim: sw=8:ts=8:noexpandtab
+#include "autotune.h"
+#include "slogic.h"
+#include "log.h"
+
+void slogic_autotune_size(struct slogic_ctx *handle, int max_packet_size){
+size_t size;
+
+	if (!handle->autotune.size) {
+		return;
+	}
+	/* one byte per sample */
+	size = (uint64_t)handle->sample_rate->samples_per_second * AUTOTUNE_TRANSFER_USEC / 1000000;
+	if (size > AUTOTUNE_MAX_TRANSFER_SIZE) {
+		size = AUTOTUNE_MAX_TRANSFER_SIZE;
+	}
+	if (size < (size_t)max_packet_size * DEFAULT_TRANSFER_PACKETS) {
+		size = (size_t)max_packet_size * DEFAULT_TRANSFER_PACKETS;
+	}
+	handle->transfer_buffer_size = size - size % max_packet_size;
+}
+
+void slogic_autotune_depth(struct slogic_ctx *handle){
+struct slogic_autotune *at = &handle->autotune;
+unsigned int rate = handle->sample_rate->samples_per_second;
+uint64_t window;
+
+	if (!at->depth) {
+		return;
+	}
+	window = (uint64_t)rate * AUTOTUNE_WINDOW_MSEC / 1000;
+	at->target = (window + handle->transfer_buffer_size - 1) / handle->transfer_buffer_size;
+	if (at->target < AUTOTUNE_MIN_TRANSFERS) {
+		at->target = AUTOTUNE_MIN_TRANSFERS;
+	}
+	handle->n_transfer_buffers = at->target * AUTOTUNE_GROWTH;
+	if (handle->n_transfer_buffers > DEFAULT_N_TRANSFER_BUFFERS) {
+		handle->n_transfer_buffers = DEFAULT_N_TRANSFER_BUFFERS;
+	}
+	at->peak = at->target;
+	at->grown = at->shrunk = at->calm = 0;
+	at->interval_start = at->last_complete = at->max_gap = 0;
+	at->misses = 0;
+	log_printf( DEBUG, "Autotune: %zu byte transfers, %u in flight, %u allocated\n",
+		    handle->transfer_buffer_size, at->target, handle->n_transfer_buffers);
+}
+
+unsigned int slogic_autotune_in_flight(struct slogic_ctx *handle){
+	return handle->autotune.depth ? handle->autotune.target : handle->n_transfer_buffers;
+}
+
+static uint64_t autotune_window_ns(struct slogic_ctx *handle){
+	return (uint64_t)handle->autotune.target * handle->transfer_buffer_size * 1000000000ULL /
+	       handle->sample_rate->samples_per_second;
+}
+
+static void autotune_interval(struct slogic_ctx *handle){
+struct slogic_autotune *at = &handle->autotune;
+uint64_t window = autotune_window_ns(handle);
+bool starved = handle->pool.misses != at->misses;
+unsigned int target = at->target;
+
+	if (at->max_gap * 2 > window) {
+		target = at->target * 2;
+		if (target > handle->n_transfer_buffers) {
+			target = handle->n_transfer_buffers;
+		}
+		at->calm = 0;
+	} else if (at->max_gap * 8 < window || (starved && at->max_gap * 4 < window)) {
+		/* the writer running out of spare buffers does not wait for a calm streak */
+		if (starved || ++at->calm >= AUTOTUNE_CALM_INTERVALS) {
+			target = at->target - at->target / 4;
+			if (target < AUTOTUNE_MIN_TRANSFERS) {
+				target = AUTOTUNE_MIN_TRANSFERS;
+			}
+			at->calm = 0;
+		}
+	} else {
+		at->calm = 0;
+	}
+
+	if (target != at->target) {
+		log_printf( DEBUG, "Autotune: longest completion gap %.3fms of a %.3fms window, %u -> %u in flight\n",
+			    at->max_gap / 1e6, window / 1e6, at->target, target);
+		if (target > at->target) {
+			at->grown++;
+		} else {
+			at->shrunk++;
+		}
+		at->target = target;
+		if (target > at->peak) {
+			at->peak = target;
+		}
+	}
+	at->max_gap = 0;
+	at->misses = handle->pool.misses;
+}
+
+/* submit parked transfers until the in flight set is back at target, leaving 'skip' to the caller */
+static void autotune_refill(struct slogic_ctx *handle, unsigned int skip){
+struct slogic_pool *pool = &handle->pool;
+struct libusb_transfer *transfer;
+unsigned int transfer_id;
+
+	for (transfer_id = 0; transfer_id < handle->n_transfer_buffers; transfer_id++) {
+		if (handle->transfer_count + 1 >= handle->autotune.target) {
+			return;
+		}
+		if (transfer_id != skip && handle->transfers[transfer_id].state == 0) {
+			transfer = handle->transfers[transfer_id].transfer;
+			/* a slice of the output's file from before it was parked is behind the writer now, take a new one */
+			if (transfer->buffer >= pool->external && transfer->buffer < pool->external + pool->external_size) {
+				transfer->buffer = NULL;
+			}
+			slogic_prime_data(handle, transfer_id);
+			if (slogic_pump_data(handle, transfer_id)) {
+				return;
+			}
+		}
+	}
+}
+
+bool slogic_autotune_complete(struct slogic_ctx *handle, unsigned int transfer_id){
+struct slogic_autotune *at = &handle->autotune;
+uint64_t now;
+
+	if (!at->depth) {
+		return true;
+	}
+	now = slogic_trace_now();
+	if (!at->interval_start) {
+		at->interval_start = now;
+	} else if (now - at->last_complete > at->max_gap) {
+		at->max_gap = now - at->last_complete;
+	}
+	at->last_complete = now;
+	if (now - at->interval_start >= AUTOTUNE_INTERVAL_MSEC * 1000000ULL) {
+		autotune_interval(handle);
+		at->interval_start = now;
+	}
+
+	if (handle->transfer_count >= at->target) {
+		return false;
+	}
+	autotune_refill(handle, transfer_id);
+	return true;
+}
+
+void slogic_autotune_report(struct slogic_ctx *handle){
+struct slogic_autotune *at = &handle->autotune;
+
+	if (!at->size && !at->depth) {
+		return;
+	}
+	if (at->depth) {
+		log_printf( NOTICE, "Autotune: grew %u and shrank %u times, peak %u of %u transfers in flight\n",
+			    at->grown, at->shrunk, at->peak, handle->n_transfer_buffers);
+	}
+	log_printf( NOTICE, "Autotune: to reuse these settings pass -b %zu -t %u\n",
+		    handle->transfer_buffer_size, at->depth ? at->peak : handle->n_transfer_buffers);
+}
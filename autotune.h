@@ -0,0 +1,55 @@
+// vim: sw=8:ts=8:noexpandtab
+#ifndef __AUTOTUNE_H__
+#define __AUTOTUNE_H__
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/*
+ * Picks the transfer size (-b auto) and the number of transfers kept in
+ * flight (-t auto) from the sample rate, then keeps adjusting the in flight
+ * set while capturing.
+ *
+ * The Logic has only a small fifo, so what matters is how long the host can
+ * leave it alone: the submitted transfers cover 'window' = in flight * size /
+ * rate of samples. The longest gap between two completions is the longest the
+ * event thread was away. When that comes near half the window, the window
+ * doubles. When it stays far below it, and when the writer is short of spare
+ * buffers, a quarter of the transfers are parked so their memory goes back to
+ * the writer.
+ */
+
+#define AUTOTUNE_TRANSFER_USEC 1000	/* samples per transfer */
+#define AUTOTUNE_MAX_TRANSFER_SIZE (256 * 1024)
+#define AUTOTUNE_WINDOW_MSEC 50		/* initial in flight window */
+#define AUTOTUNE_MIN_TRANSFERS 4
+#define AUTOTUNE_GROWTH 8		/* transfers allocated per initial in flight transfer */
+#define AUTOTUNE_INTERVAL_MSEC 100	/* how often the in flight set is reconsidered */
+#define AUTOTUNE_CALM_INTERVALS 10	/* quiet intervals before shrinking */
+
+struct slogic_ctx;
+
+struct slogic_autotune {
+	bool				size;		/* -b auto */
+	bool				depth;		/* -t auto */
+	unsigned int			target;		/* transfers to keep in flight */
+	unsigned int			peak;
+	unsigned int			grown;
+	unsigned int			shrunk;
+	unsigned int			calm;
+	uint64_t			interval_start;
+	uint64_t			last_complete;
+	uint64_t			max_gap;	/* ns, this interval */
+	unsigned long			misses;		/* pool misses at interval start */
+};
+
+/* called from slogic_open(), fill in transfer_buffer_size and then n_transfer_buffers */
+void slogic_autotune_size(struct slogic_ctx *handle, int max_packet_size);
+void slogic_autotune_depth(struct slogic_ctx *handle);
+/* transfers slogic_execute_recording() submits up front */
+unsigned int slogic_autotune_in_flight(struct slogic_ctx *handle);
+/* completion callback: returns false if this transfer should be parked instead of resubmitted */
+bool slogic_autotune_complete(struct slogic_ctx *handle, unsigned int transfer_id);
+void slogic_autotune_report(struct slogic_ctx *handle);
+
+#endif
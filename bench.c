@@ -0,0 +1,317 @@
+// vim: sw=8:ts=8:noexpandtab
+/*
+ * Throughput benchmark for the capture pipeline. Every run goes through the
+ * real transfer submission, slogic_read_samples_callback(), the writer
+ * thread and one output format, fed by the simulated Logic (synthetic
+ * patterns or a recorded raw capture). One JSON object per run on stdout.
+ */
+#include "slogic.h"
+#include "output.h"
+#include "transport.h"
+#include "log.h"
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#define BENCH_DEFAULT_SAMPLES 480000000
+#define BENCH_DEFAULT_INPUT "sim:speed=max"
+
+/*
+ * Allocation counting, only armed while a capture is running
+ */
+
+#ifdef __GLIBC__
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static _Atomic int counting;
+static _Atomic unsigned long allocations;
+
+void *malloc(size_t size){
+	if (atomic_load_explicit(&counting, memory_order_relaxed)) {
+		atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+	}
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size){
+	if (atomic_load_explicit(&counting, memory_order_relaxed)) {
+		atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+	}
+	return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size){
+	if (atomic_load_explicit(&counting, memory_order_relaxed)) {
+		atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+	}
+	return __libc_realloc(ptr, size);
+}
+#define BENCH_COUNT_ALLOCATIONS(on) do { if (on) atomic_store(&allocations, 0); atomic_store(&counting, on); } while (0)
+#define BENCH_ALLOCATIONS() ((long)atomic_load(&allocations))
+#else
+#define BENCH_COUNT_ALLOCATIONS(on)
+#define BENCH_ALLOCATIONS() (-1L)
+#endif
+
+/*
+ * Per completion latency: every transfer's callback is wrapped
+ */
+
+static uint32_t *latencies;
+static size_t n_latencies, max_latencies;
+
+static uint64_t bench_ns(clockid_t clock){
+struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void bench_callback(struct libusb_transfer *transfer){
+uint64_t t0 = bench_ns(CLOCK_MONOTONIC);
+
+	slogic_read_samples_callback(transfer);
+	if (n_latencies < max_latencies) {
+		latencies[n_latencies++] = bench_ns(CLOCK_MONOTONIC) - t0;
+	}
+}
+
+static int cmp_u32(const void *a, const void *b){
+uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double percentile(double p){
+	if (!n_latencies) {
+		return 0;
+	}
+	return latencies[(size_t)(p * (n_latencies - 1))] / 1000.0;
+}
+
+static double bench_cpu_seconds(){
+struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+/*
+ * One run
+ */
+
+struct bench_options {
+	const char			*input;
+	struct slogic_sample_rate	*sample_rate;
+	size_t				n_samples;
+	char				*output;
+	int				compress_level;
+	unsigned int			n_compress_workers;
+	unsigned int			n_transfer_buffers;
+	bool				autotune;
+};
+
+static int bench_run(struct bench_options *opts, struct slogic_output_format *format, const char *args, int run){
+struct slogic_ctx *handle;
+unsigned int transfer_id;
+uint64_t t0, t1;
+double cpu0, cpu1, seconds, mbytes;
+long allocs;
+
+	handle = slogic_init();
+	handle->sample_rate = opts->sample_rate;
+	handle->n_samples_requested = opts->n_samples;
+	handle->compress_level = opts->compress_level;
+	handle->n_compress_workers = opts->n_compress_workers;
+	if (opts->n_transfer_buffers) {
+		handle->n_transfer_buffers = opts->n_transfer_buffers;
+	}
+	handle->autotune.depth = opts->autotune;
+	slogic_set_output_format(handle, format);
+	handle->output_args = args;
+	if (slogic_set_transport(handle, opts->input) || slogic_open(handle, 0) ||
+	    !slogic_is_firmware_uploaded(handle)) {
+		log_printf(ERR, "Failed to open %s\n", opts->input);
+		slogic_close(handle);
+		return 1;
+	}
+	for (transfer_id = 0; transfer_id < handle->n_transfer_buffers; transfer_id++) {
+		handle->transfers[transfer_id].transfer->callback = bench_callback;
+	}
+
+	max_latencies = opts->n_samples / handle->transfer_buffer_size + handle->n_transfer_buffers + 1;
+	latencies = calloc(max_latencies, sizeof(uint32_t));
+	n_latencies = 0;
+	assert(latencies);
+
+	if (!handle->data_callback_open(handle, opts->output)) {
+		perror(opts->output);
+		slogic_close(handle);
+		return 1;
+	}
+
+	cpu0 = bench_cpu_seconds();
+	t0 = bench_ns(CLOCK_MONOTONIC);
+	BENCH_COUNT_ALLOCATIONS(1);
+	slogic_execute_recording(handle);
+	BENCH_COUNT_ALLOCATIONS(0);
+	handle->data_callback_close(handle);
+	t1 = bench_ns(CLOCK_MONOTONIC);
+	cpu1 = bench_cpu_seconds();
+	allocs = BENCH_ALLOCATIONS();
+
+	qsort(latencies, n_latencies, sizeof(uint32_t), cmp_u32);
+	seconds = (t1 - t0) / 1e9;
+	mbytes = handle->n_samples_fulfilled / 1e6;
+
+	printf("{\"run\":%d,\"input\":\"%s\",\"format\":\"%s\",\"options\":\"%s\",\"rate\":\"%s\",\"level\":%d,"
+	       "\"state\":%u,\"samples\":%zu,\"transfers\":%u,\"transfer_size\":%zu,\"seconds\":%.6f,"
+	       "\"mb_per_s\":%.2f,\"cpu_s_per_mb\":%.6f,"
+	       "\"lat_p50_us\":%.2f,\"lat_p90_us\":%.2f,\"lat_p99_us\":%.2f,\"lat_p999_us\":%.2f,\"lat_max_us\":%.2f,"
+	       "\"allocations\":%ld,\"pool_misses\":%lu,\"queue_high_water\":%zu,\"queue_full_waits\":%lu}\n",
+	       run, opts->input, format->name, args, opts->sample_rate->text, opts->compress_level,
+	       handle->recording_state, handle->n_samples_fulfilled, handle->transfer_counter,
+	       handle->transfer_buffer_size, seconds, mbytes / seconds, mbytes ? (cpu1 - cpu0) / mbytes : 0,
+	       percentile(0.5), percentile(0.9), percentile(0.99), percentile(0.999), percentile(1.0),
+	       allocs, handle->pool.misses, handle->pipeline.filled.high_water, handle->pipeline.full_waits);
+	fflush(stdout);
+
+	free(latencies);
+	latencies = NULL;
+	run = handle->recording_state != COMPLETED_SUCCESSFULLY;
+	slogic_close(handle);
+	return run;
+}
+
+static void usage(char **argv){
+const struct slogic_output_format *format = slogic_get_output_formats();
+
+	fprintf(stderr, "usage: %s [-F \"<format>[:<options>] ...\"] [-i <input>] [-r <sample rate>] [-n <samples>]\n", argv[0]);
+	fprintf(stderr, "\n");
+	fprintf(stderr, " -F: Output formats to measure, defaults to all of:");
+	for (; format->name != NULL; format++) {
+		fprintf(stderr, " %s", format->name);
+	}
+	fprintf(stderr, "\n");
+	fprintf(stderr, " -i: Sample source, defaults to '%s'. Use sim:speed=max,file=<raw capture>\n", BENCH_DEFAULT_INPUT);
+	fprintf(stderr, "     to replay a recording, or any other sim option (see sim.h).\n");
+	fprintf(stderr, " -r: Sample rate, defaults to 24MHz.\n");
+	fprintf(stderr, " -n: Samples per run, defaults to %d.\n", BENCH_DEFAULT_SAMPLES);
+	fprintf(stderr, " -f: Output file, defaults to a temporary file in $TMPDIR or /tmp, removed afterwards.\n");
+	fprintf(stderr, " -z: Compression level, defaults to %d.\n", SLOGIC_COMPRESS_LEVEL);
+	fprintf(stderr, " -j: Compression workers for blockz.\n");
+	fprintf(stderr, " -t: Number of transfer buffers, or 'auto'.\n");
+	fprintf(stderr, " -R: Repeat every run this many times, defaults to 1.\n");
+	fprintf(stderr, " -d: log level: 0 to 5. Defaults to '1'.\n");
+}
+
+int main(int argc, char **argv){
+struct bench_options opts;
+struct slogic_output_format *format;
+char *formats = NULL, *name, *f, *save = NULL, *tmpdir, *tmpname = NULL;
+int c, fd, repeat = 1, run, failed = 0, failed_early = 0;
+
+	memset(&opts, 0, sizeof(opts));
+	opts.input = BENCH_DEFAULT_INPUT;
+	opts.sample_rate = slogic_parse_sample_rate("24MHz");
+	opts.n_samples = BENCH_DEFAULT_SAMPLES;
+	opts.output = NULL;
+	opts.compress_level = SLOGIC_COMPRESS_LEVEL;
+	current_log_level = ERR;
+
+	while ((c = getopt(argc, argv, "F:i:r:n:f:z:j:t:R:d:h")) != -1) {
+		switch (c) {
+		case 'F':
+			formats = optarg;
+			break;
+		case 'i':
+			opts.input = optarg;
+			break;
+		case 'r':
+			if (!(opts.sample_rate = slogic_parse_sample_rate(optarg))) {
+				fprintf(stderr, "Invalid sample rate: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'n':
+			opts.n_samples = strtoull(optarg, NULL, 10);
+			break;
+		case 'f':
+			opts.output = optarg;
+			break;
+		case 'z':
+			opts.compress_level = atoi(optarg);
+			break;
+		case 'j':
+			opts.n_compress_workers = atoi(optarg);
+			break;
+		case 't':
+			if (strcmp(optarg, "auto") == 0) {
+				opts.autotune = true;
+				break;
+			}
+			opts.n_transfer_buffers = atoi(optarg);
+			break;
+		case 'R':
+			repeat = atoi(optarg);
+			break;
+		case 'd':
+			current_log_level = atoi(optarg);
+			break;
+		default:
+			usage(argv);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (!opts.output) {
+		/* a regular file, raw maps and preallocates its output and /dev/null can do neither */
+		tmpdir = getenv("TMPDIR");
+		if (!tmpdir || !*tmpdir) {
+			tmpdir = "/tmp";
+		}
+		if (!(tmpname = malloc(strlen(tmpdir) + sizeof("/slogic-bench-XXXXXX")))) {
+			return EXIT_FAILURE;
+		}
+		sprintf(tmpname, "%s/slogic-bench-XXXXXX", tmpdir);
+		if ((fd = mkstemp(tmpname)) < 0) {
+			perror(tmpname);
+			free(tmpname);
+			return EXIT_FAILURE;
+		}
+		close(fd);
+		opts.output = tmpname;
+	}
+
+	for (run = 0; run < repeat && !failed_early; run++) {
+		if (!formats) {
+			for (format = slogic_get_output_formats(); format->name != NULL; format++) {
+				failed |= bench_run(&opts, format, "", run);
+			}
+			continue;
+		}
+		name = strdup(formats);
+		/* formats are separated by spaces here, their options use commas */
+		for (f = strtok_r(name, " ", &save); f; f = strtok_r(NULL, " ", &save)) {
+			if (!(format = slogic_parse_output_format(f))) {
+				fprintf(stderr, "Invalid output format: %s\n", f);
+				failed_early = 1;
+				break;
+			}
+			failed |= bench_run(&opts, format, slogic_output_args(f), run);
+		}
+		free(name);
+	}
+	if (tmpname) {
+		unlink(tmpname);
+		free(tmpname);
+	}
+	return failed || failed_early ? EXIT_FAILURE : EXIT_SUCCESS;
+}
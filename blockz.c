@@ -0,0 +1,581 @@
+// vim: sw=8:ts=8:noexpandtab
+#include "blockz.h"
+#include "slogic.h"
+#include "log.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <zlib.h>
+
+enum blockz_job_state {
+	JOB_FREE = 0,
+	JOB_QUEUED,
+	JOB_COMPRESSING,
+	JOB_DONE
+};
+
+struct blockz_job {
+	enum blockz_job_state		state;
+	uint8_t				*in;
+	size_t				in_len;
+	uint8_t				*out;
+	size_t				out_len;
+};
+
+/*
+ * Jobs form a ring of 2 * workers slots indexed by block sequence number.
+ * The writer thread fills jobs[next_fill], workers compress anything queued
+ * and the writer thread writes finished jobs back strictly in order.
+ */
+struct blockz_writer {
+	FILE				*file;
+	char				*filename;
+	int				level;
+	uint32_t			samples_per_second;
+	uint8_t				channel_mask;
+	int64_t				start_time;
+	uint64_t			n_samples;
+	size_t				block_size;
+	size_t				out_cap;
+
+	pthread_mutex_t			lock;
+	pthread_cond_t			work;
+	pthread_cond_t			done;
+	pthread_t			*workers;
+	unsigned int			n_workers;
+	unsigned int			started;	/* workers past deflateInit(), or failed there */
+	unsigned int			failed;
+	bool				stopping;
+
+	struct blockz_job		*jobs;
+	unsigned int			n_jobs;
+	uint64_t			next_fill;
+	uint64_t			next_compress;
+	uint64_t			next_write;
+
+	struct blockz_index_entry	*index;
+	size_t				index_cap;
+	uint64_t			raw_offset;
+	uint64_t			file_offset;
+	int				error;
+};
+
+static void put_le16(uint8_t *p, uint16_t v){
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static void put_le32(uint8_t *p, uint32_t v){
+	put_le16(p, v);
+	put_le16(p + 2, v >> 16);
+}
+
+static void put_le64(uint8_t *p, uint64_t v){
+	put_le32(p, v);
+	put_le32(p + 4, v >> 32);
+}
+
+static uint16_t get_le16(const uint8_t *p){
+	return p[0] | (p[1] << 8);
+}
+
+static uint32_t get_le32(const uint8_t *p){
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t get_le64(const uint8_t *p){
+	return get_le32(p) | ((uint64_t)get_le32(p + 4) << 32);
+}
+
+/*
+ * Workers
+ */
+
+static void *blockz_worker(void *arg){
+struct blockz_writer *w = arg;
+struct blockz_job *job;
+z_stream strm;
+int ret;
+
+	memset(&strm, 0, sizeof(strm));
+	ret = deflateInit(&strm, w->level);
+
+	pthread_mutex_lock(&w->lock);
+	/* blockz_callback_open() waits for every worker to get here */
+	w->started++;
+	w->failed += ret != Z_OK;
+	pthread_cond_broadcast(&w->done);
+	if (ret != Z_OK) {
+		pthread_mutex_unlock(&w->lock);
+		return NULL;
+	}
+	while (1) {
+		while (!w->stopping && (w->next_compress == w->next_fill ||
+					w->jobs[w->next_compress % w->n_jobs].state != JOB_QUEUED)) {
+			pthread_cond_wait(&w->work, &w->lock);
+		}
+		if (w->next_compress == w->next_fill) {
+			break;	/* stopping and nothing left */
+		}
+		job = &w->jobs[w->next_compress++ % w->n_jobs];
+		job->state = JOB_COMPRESSING;
+		pthread_mutex_unlock(&w->lock);
+
+		deflateReset(&strm);
+		strm.next_in = job->in;
+		strm.avail_in = job->in_len;
+		strm.next_out = job->out;
+		strm.avail_out = w->out_cap;
+		ret = deflate(&strm, Z_FINISH);
+		assert(ret == Z_STREAM_END);	/* out_cap is deflateBound() */
+		job->out_len = w->out_cap - strm.avail_out;
+
+		pthread_mutex_lock(&w->lock);
+		job->state = JOB_DONE;
+		pthread_cond_broadcast(&w->done);
+	}
+	pthread_mutex_unlock(&w->lock);
+	deflateEnd(&strm);
+	return NULL;
+}
+
+/* write out every finished block that is next in line; called with the lock held */
+static void blockz_flush_done(struct blockz_writer *w){
+struct blockz_job *job;
+struct blockz_index_entry *entry;
+
+	while (w->next_write < w->next_fill) {
+		job = &w->jobs[w->next_write % w->n_jobs];
+		if (job->state != JOB_DONE) {
+			return;
+		}
+		pthread_mutex_unlock(&w->lock);
+
+		if (w->next_write == w->index_cap) {
+			w->index_cap = w->index_cap ? w->index_cap * 2 : 1024;
+			w->index = realloc(w->index, w->index_cap * sizeof(struct blockz_index_entry));
+			assert(w->index);
+		}
+		entry = &w->index[w->next_write];
+		entry->raw_offset = w->raw_offset;
+		entry->file_offset = w->file_offset;
+		entry->csize = job->out_len;
+		entry->rsize = job->in_len;
+		if (fwrite(job->out, 1, job->out_len, w->file) != job->out_len) {
+			w->error = 1;
+		}
+		w->raw_offset += job->in_len;
+		w->file_offset += job->out_len;
+
+		pthread_mutex_lock(&w->lock);
+		job->in_len = 0;
+		job->state = JOB_FREE;
+		w->next_write++;
+	}
+}
+
+/* hand the block being filled to the workers and wait for the next slot to be free */
+static void blockz_queue(struct blockz_writer *w){
+	pthread_mutex_lock(&w->lock);
+	w->jobs[w->next_fill % w->n_jobs].state = JOB_QUEUED;
+	w->next_fill++;
+	pthread_cond_signal(&w->work);
+
+	blockz_flush_done(w);
+	while (w->jobs[w->next_fill % w->n_jobs].state != JOB_FREE) {
+		pthread_cond_wait(&w->done, &w->lock);
+		blockz_flush_done(w);
+	}
+	pthread_mutex_unlock(&w->lock);
+}
+
+/*
+ * Output backend
+ */
+
+static void blockz_stop_workers(struct blockz_writer *w){
+unsigned int i;
+
+	pthread_mutex_lock(&w->lock);
+	w->stopping = true;
+	pthread_cond_broadcast(&w->work);
+	pthread_mutex_unlock(&w->lock);
+	for (i = 0; i < w->n_workers; i++) {
+		pthread_join(w->workers[i], NULL);
+	}
+}
+
+static void blockz_free(struct blockz_writer *w){
+unsigned int i;
+
+	for (i = 0; i < w->n_jobs; i++) {
+		free(w->jobs[i].in);
+		free(w->jobs[i].out);
+	}
+	pthread_cond_destroy(&w->work);
+	pthread_cond_destroy(&w->done);
+	pthread_mutex_destroy(&w->lock);
+	free(w->jobs);
+	free(w->workers);
+	free(w->index);
+	free(w);
+}
+
+int blockz_callback_open(struct slogic_ctx *handle, char *openstring){
+struct blockz_writer *w;
+uint8_t header[BLOCKZ_HEADER_SIZE + BLOCKZ_INFO_SIZE];
+unsigned int i;
+
+	handle->data_callback_opts = w = calloc(1, sizeof(struct blockz_writer));
+	if (!w) {
+		return 0;
+	}
+	w->filename = openstring;
+	w->level = handle->compress_level;
+	w->samples_per_second = handle->sample_rate ? handle->sample_rate->samples_per_second : 0;
+	w->channel_mask = handle->pack.mask;
+	w->block_size = BLOCKZ_DEFAULT_BLOCK_SIZE;
+	w->out_cap = compressBound(w->block_size) + 64;
+	w->n_workers = handle->n_compress_workers ? handle->n_compress_workers : BLOCKZ_DEFAULT_WORKERS;
+	w->n_jobs = w->n_workers * 2;
+
+	if ((w->file = fopen(w->filename, "wb")) == NULL) {
+		free(w);
+		handle->data_callback_opts = NULL;
+		return 0;
+	}
+
+	memcpy(header, BLOCKZ_MAGIC, 4);
+	put_le16(header + 4, BLOCKZ_VERSION);
+	put_le16(header + 6, 0);
+	put_le32(header + 8, w->block_size);
+	put_le32(header + 12, w->level);
+	put_le32(header + 16, sizeof(header));
+	/* start_time and n_samples are known at close, see blockz_write_info() */
+	memset(header + BLOCKZ_HEADER_SIZE, 0, BLOCKZ_INFO_SIZE);
+	if (fwrite(header, 1, sizeof(header), w->file) != sizeof(header)) {
+		w->error = 1;
+	}
+	w->file_offset = sizeof(header);
+
+	/* all block memory is set up front, the write path only copies */
+	w->jobs = calloc(w->n_jobs, sizeof(struct blockz_job));
+	assert(w->jobs);
+	for (i = 0; i < w->n_jobs; i++) {
+		w->jobs[i].in = malloc(w->block_size);
+		w->jobs[i].out = malloc(w->out_cap);
+		assert(w->jobs[i].in && w->jobs[i].out);
+	}
+
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->work, NULL);
+	pthread_cond_init(&w->done, NULL);
+	w->workers = calloc(w->n_workers, sizeof(pthread_t));
+	assert(w->workers);
+	for (i = 0; i < w->n_workers; i++) {
+		if (pthread_create(&w->workers[i], NULL, blockz_worker, w)) {
+			log_printf(ERR, "Failed to start compression worker %u\n", i);
+			w->n_workers = i;
+			break;
+		}
+	}
+	pthread_mutex_lock(&w->lock);
+	while (w->started < w->n_workers) {
+		pthread_cond_wait(&w->done, &w->lock);
+	}
+	pthread_mutex_unlock(&w->lock);
+	/* a worker short would leave its blocks queued forever */
+	if (!w->n_workers || w->failed) {
+		if (w->failed) {
+			log_printf(ERR, "Failed to set up compression in %u workers\n", w->failed);
+		}
+		blockz_stop_workers(w);
+		fclose(w->file);
+		blockz_free(w);
+		handle->data_callback_opts = NULL;
+		return 0;
+	}
+	log_printf(DEBUG, "Block compressor: %u workers, level %d, %zu byte blocks\n", w->n_workers, w->level,
+		   w->block_size);
+	return 1;
+}
+
+/* the info block of the header, written again over the placeholder on close */
+static void blockz_write_info(struct blockz_writer *w){
+uint8_t info[BLOCKZ_INFO_SIZE];
+
+	put_le32(info, w->samples_per_second);
+	put_le16(info + 4, w->channel_mask ? __builtin_popcount(w->channel_mask) : SLOGIC_CHANNELS);
+	put_le16(info + 6, w->channel_mask);
+	put_le64(info + 8, w->start_time);
+	put_le64(info + 16, w->n_samples);
+	if (fseeko(w->file, BLOCKZ_HEADER_SIZE, SEEK_SET) || fwrite(info, 1, sizeof(info), w->file) != sizeof(info)) {
+		w->error = 1;
+	}
+}
+
+size_t blockz_callback_write(struct slogic_ctx *handle, uint8_t *data, size_t size){
+struct blockz_writer *w = handle->data_callback_opts;
+struct blockz_job *job;
+struct timespec now;
+size_t n, left = size;
+
+	if (!w) {
+		return 0;
+	}
+	if (!w->start_time && size) {
+		/* the first block was sampled over the time it took to fill */
+		clock_gettime(CLOCK_REALTIME, &now);
+		w->start_time = now.tv_sec * 1000000000ll + now.tv_nsec;
+		if (w->samples_per_second) {
+			w->start_time -= (int64_t)(size * 8 / pack_width(w->channel_mask)) * 1000000000ll /
+					 w->samples_per_second;
+		}
+	}
+	while (left) {
+		/* the slot at next_fill is always JOB_FREE outside blockz_queue() */
+		job = &w->jobs[w->next_fill % w->n_jobs];
+		n = w->block_size - job->in_len;
+		if (n > left) {
+			n = left;
+		}
+		memcpy(job->in + job->in_len, data, n);
+		job->in_len += n;
+		data += n;
+		left -= n;
+		if (job->in_len == w->block_size) {
+			blockz_queue(w);
+		}
+	}
+	if (w->error) {
+		if (slogic_pipeline_fail(handle)) {
+			log_printf(ERR, "Failed to write %s, stopping the capture\n", w->filename);
+		}
+		return 0;
+	}
+	return size;
+}
+
+void blockz_callback_close(struct slogic_ctx *handle){
+struct blockz_writer *w = handle->data_callback_opts;
+uint8_t entry[BLOCKZ_INDEX_ENTRY_SIZE];
+uint8_t trailer[BLOCKZ_TRAILER_SIZE];
+uint64_t i;
+
+	if (!w) {
+		return;
+	}
+	if (w->jobs[w->next_fill % w->n_jobs].in_len) {
+		blockz_queue(w);
+	}
+
+	pthread_mutex_lock(&w->lock);
+	while (w->next_write < w->next_fill) {
+		blockz_flush_done(w);
+		if (w->next_write < w->next_fill) {
+			pthread_cond_wait(&w->done, &w->lock);
+		}
+	}
+	pthread_mutex_unlock(&w->lock);
+	blockz_stop_workers(w);
+
+	for (i = 0; i < w->next_write; i++) {
+		put_le64(entry, w->index[i].raw_offset);
+		put_le64(entry + 8, w->index[i].file_offset);
+		put_le32(entry + 16, w->index[i].csize);
+		put_le32(entry + 20, w->index[i].rsize);
+		if (fwrite(entry, 1, sizeof(entry), w->file) != sizeof(entry)) {
+			w->error = 1;
+		}
+	}
+	put_le64(trailer, w->file_offset);
+	put_le64(trailer + 8, w->next_write);
+	put_le64(trailer + 16, w->raw_offset);
+	memcpy(trailer + 24, BLOCKZ_TRAILER_MAGIC, 4);
+	put_le32(trailer + 28, 0);
+	if (fwrite(trailer, 1, sizeof(trailer), w->file) != sizeof(trailer)) {
+		w->error = 1;
+	}
+	/* packed blocks hold more samples than bytes, the packing counted them */
+	w->n_samples = w->channel_mask ? handle->pack.samples : w->raw_offset;
+	blockz_write_info(w);
+	if (fclose(w->file) || w->error) {
+		log_printf(ERR, "Failed to write %s\n", w->filename);
+		slogic_pipeline_fail(handle);
+	}
+	blockz_free(w);
+	handle->data_callback_opts = NULL;
+}
+
+/*
+ * Reader
+ */
+
+struct blockz_reader *blockz_open(const char *filename){
+struct blockz_reader *r;
+uint8_t header[BLOCKZ_HEADER_SIZE];
+uint8_t info[BLOCKZ_INFO_SIZE];
+uint8_t trailer[BLOCKZ_TRAILER_SIZE];
+uint8_t entry[BLOCKZ_INDEX_ENTRY_SIZE];
+uint64_t index_offset, i;
+
+	if (!(r = calloc(1, sizeof(struct blockz_reader)))) {
+		return NULL;
+	}
+	r->cached = -1;
+	if ((r->file = fopen(filename, "rb")) == NULL) {
+		free(r);
+		return NULL;
+	}
+	if (fread(header, 1, sizeof(header), r->file) != sizeof(header) || memcmp(header, BLOCKZ_MAGIC, 4) ||
+	    fseeko(r->file, -(off_t)sizeof(trailer), SEEK_END) ||
+	    fread(trailer, 1, sizeof(trailer), r->file) != sizeof(trailer) ||
+	    memcmp(trailer + 24, BLOCKZ_TRAILER_MAGIC, 4)) {
+		log_printf(ERR, "%s: not a block compressed capture\n", filename);
+		goto fail;
+	}
+	r->version = get_le16(header + 4);
+	r->block_size = get_le32(header + 8);
+	if (r->version >= 2) {
+		if (get_le32(header + 16) < sizeof(header) + sizeof(info) || fseeko(r->file, sizeof(header), SEEK_SET) ||
+		    fread(info, 1, sizeof(info), r->file) != sizeof(info)) {
+			log_printf(ERR, "%s: truncated header\n", filename);
+			goto fail;
+		}
+		r->samples_per_second = get_le32(info);
+		r->channels = get_le16(info + 4);
+		r->start_time = (int64_t)get_le64(info + 8);
+	}
+	if (r->version >= 3) {
+		r->channel_mask = get_le16(info + 6);
+	}
+	index_offset = get_le64(trailer);
+	r->n_blocks = get_le64(trailer + 8);
+	r->raw_size = get_le64(trailer + 16);
+	r->n_samples = r->version >= 2 ? get_le64(info + 16) : r->raw_size;
+
+	r->index = calloc(r->n_blocks ? r->n_blocks : 1, sizeof(struct blockz_index_entry));
+	r->block = malloc(r->block_size);
+	r->cblock = malloc(compressBound(r->block_size) + 64);
+	if (r->channel_mask && !(r->packed = malloc(r->block_size))) {
+		goto fail;
+	}
+	if (!r->index || !r->block || !r->cblock || fseeko(r->file, index_offset, SEEK_SET)) {
+		goto fail;
+	}
+	for (i = 0; i < r->n_blocks; i++) {
+		if (fread(entry, 1, sizeof(entry), r->file) != sizeof(entry)) {
+			goto fail;
+		}
+		r->index[i].raw_offset = get_le64(entry);
+		r->index[i].file_offset = get_le64(entry + 8);
+		r->index[i].csize = get_le32(entry + 16);
+		r->index[i].rsize = get_le32(entry + 20);
+	}
+	return r;
+
+fail:
+	blockz_close(r);
+	return NULL;
+}
+
+static int blockz_load(struct blockz_reader *r, uint64_t block){
+struct blockz_index_entry *e = &r->index[block];
+uLongf len = r->block_size;
+
+	if ((int64_t)block == r->cached) {
+		return 0;
+	}
+	if (e->rsize > r->block_size || e->csize > compressBound(r->block_size) + 64 ||
+	    fseeko(r->file, e->file_offset, SEEK_SET) || fread(r->cblock, 1, e->csize, r->file) != e->csize ||
+	    uncompress(r->block, &len, r->cblock, e->csize) != Z_OK || len != e->rsize) {
+		r->cached = -1;
+		return -1;
+	}
+	r->cached = block;
+	return 0;
+}
+
+/* reads 'size' bytes starting at raw offset 'offset', only inflating the blocks involved */
+static ssize_t blockz_read_raw(struct blockz_reader *r, uint64_t offset, uint8_t *out, size_t size){
+uint64_t lo = 0, hi = r->n_blocks, mid;
+size_t done = 0, skip, n;
+
+	if (offset >= r->raw_size) {
+		return 0;
+	}
+	/* last block whose raw_offset <= offset */
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		if (r->index[mid].raw_offset <= offset) {
+			lo = mid;
+		} else {
+			hi = mid;
+		}
+	}
+	while (done < size && lo < r->n_blocks) {
+		if (blockz_load(r, lo)) {
+			return -1;
+		}
+		skip = offset + done - r->index[lo].raw_offset;
+		n = r->index[lo].rsize - skip;
+		if (n > size - done) {
+			n = size - done;
+		}
+		memcpy(out + done, r->block + skip, n);
+		done += n;
+		lo++;
+	}
+	return done;
+}
+
+ssize_t blockz_read(struct blockz_reader *r, uint64_t offset, uint8_t *out, size_t size){
+unsigned int per_byte = 8 / pack_width(r->channel_mask);
+size_t done = 0, n;
+ssize_t got;
+
+	if (!r->channel_mask) {
+		return blockz_read_raw(r, offset, out, size);
+	}
+	if (offset >= r->n_samples) {
+		return 0;
+	}
+	if (size > r->n_samples - offset) {
+		size = r->n_samples - offset;
+	}
+	while (done < size) {
+		/* a byte less than the scratch holds, for a start half way into one */
+		n = (size_t)(r->block_size - 1) * per_byte;
+		if (n > size - done) {
+			n = size - done;
+		}
+		/* whole bytes from the one holding sample 'offset + done' */
+		got = blockz_read_raw(r, (offset + done) / per_byte, r->packed,
+				      (offset + done + n - 1) / per_byte - (offset + done) / per_byte + 1);
+		if (got <= 0) {
+			return done ? (ssize_t)done : got;
+		}
+		if ((size_t)got * per_byte < n) {
+			n = got * per_byte - (offset + done) % per_byte;
+		}
+		pack_unpack(r->channel_mask, r->packed, offset + done, n, out + done);
+		done += n;
+	}
+	return done;
+}
+
+void blockz_close(struct blockz_reader *r){
+	if (!r) {
+		return;
+	}
+	if (r->file) {
+		fclose(r->file);
+	}
+	free(r->index);
+	free(r->block);
+	free(r->cblock);
+	free(r->packed);
+	free(r);
+}
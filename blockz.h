@@ -0,0 +1,83 @@
+// vim: sw=8:ts=8:noexpandtab
+#ifndef __BLOCKZ_H__
+#define __BLOCKZ_H__
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+/*
+ * Seekable block compressed container, written pigz style: the sample stream
+ * is cut into fixed size blocks, each block is deflated on its own by a pool
+ * of worker threads and the blocks are written back in order. An index at
+ * the end maps every block to its raw and file offsets.
+ *
+ * Layout (all integers little endian):
+ *   header   "SLBZ" u16 version u16 flags u32 block_size u32 level u32 header_size
+ *   info     u32 samples_per_second u16 channels u16 channel_mask i64 start_time u64 n_samples
+ *   blocks   one complete zlib stream per block
+ *   index    n_blocks * { u64 raw_offset u64 file_offset u32 csize u32 rsize }
+ *   trailer  u64 index_offset u64 n_blocks u64 raw_size "SLBX" u32 0
+ *
+ * The info block came with version 2, version 1 files end the header after
+ * 20 bytes with header_size 0. start_time is the wall clock time of the
+ * first sample in nanoseconds since the epoch; it and n_samples are filled
+ * in when the capture is closed, a file that was never closed has neither
+ * them nor an index. Seeking to a sample is a binary search of the index
+ * and one block inflate.
+ *
+ * channel_mask came with version 3: when it is not 0 the blocks hold the
+ * samples packed to those channels (-m, see pack.h), 'channels' of them,
+ * and n_samples is no longer the raw size. blockz_read() unpacks them.
+ */
+
+#define BLOCKZ_MAGIC "SLBZ"
+#define BLOCKZ_TRAILER_MAGIC "SLBX"
+#define BLOCKZ_VERSION 3
+#define BLOCKZ_HEADER_SIZE 20
+#define BLOCKZ_INFO_SIZE 24
+#define BLOCKZ_INDEX_ENTRY_SIZE 24
+#define BLOCKZ_TRAILER_SIZE 32
+
+#define BLOCKZ_DEFAULT_BLOCK_SIZE (1024 * 1024)
+#define BLOCKZ_DEFAULT_WORKERS 4
+#define BLOCKZ_MAX_WORKERS 64
+
+struct slogic_ctx;
+
+struct blockz_index_entry {
+	uint64_t			raw_offset;
+	uint64_t			file_offset;
+	uint32_t			csize;
+	uint32_t			rsize;
+};
+
+/* output backend, see slogic_get_output_formats() */
+int blockz_callback_open(struct slogic_ctx *handle, char *openstring);
+size_t blockz_callback_write(struct slogic_ctx *handle, uint8_t *data, size_t size);
+void blockz_callback_close(struct slogic_ctx *handle);
+
+/* random access reader */
+struct blockz_reader {
+	FILE				*file;
+	uint32_t			block_size;
+	uint64_t			n_blocks;
+	uint64_t			raw_size;
+	uint16_t			version;
+	uint32_t			samples_per_second;	/* 0 if the file does not say, version 1 */
+	uint16_t			channels;
+	uint8_t				channel_mask;	/* packed channels, 0 if a byte per sample */
+	uint64_t			n_samples;
+	int64_t				start_time;	/* ns since the epoch, 0 if unknown */
+	struct blockz_index_entry	*index;
+	uint8_t				*cblock;	/* compressed scratch */
+	uint8_t				*block;		/* last block inflated */
+	uint8_t				*packed;	/* scratch for unpacking */
+	int64_t				cached;		/* index of 'block', -1 if none */
+};
+
+struct blockz_reader *blockz_open(const char *filename);
+/* samples [offset, offset + size), a byte each also when the capture is packed */
+ssize_t blockz_read(struct blockz_reader *reader, uint64_t offset, uint8_t *out, size_t size);
+void blockz_close(struct blockz_reader *reader);
+
+#endif
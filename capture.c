@@ -0,0 +1,225 @@
+// vim: sw=8:ts=8:noexpandtab
+#include "capture.h"
+#include "blockz.h"
+#include "log.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static const char *capture_formats[] = {"raw", "blockz", "zlib", "rle", NULL};
+
+/* what the first bytes say; a zlib header is two bytes whose big endian value is a multiple of 31 */
+static enum capture_format capture_detect(const uint8_t *p, size_t n){
+	if (n >= 4 && memcmp(p, BLOCKZ_MAGIC, 4) == 0) {
+		return CAPTURE_BLOCKZ;
+	}
+	if (n >= 4 && memcmp(p, RLE_MAGIC, 4) == 0) {
+		return CAPTURE_RLE;
+	}
+	if (n >= 2 && (p[0] & 0x0f) == Z_DEFLATED && (p[0] >> 4) <= 7 && ((p[0] << 8) | p[1]) % 31 == 0) {
+		return CAPTURE_ZLIB;
+	}
+	return CAPTURE_RAW;
+}
+
+static int capture_open_raw(struct capture_reader *c, const char *filename){
+struct stat st;
+int fd;
+
+	if ((fd = open(filename, O_RDONLY)) < 0) {
+		return -1;
+	}
+	if (fstat(fd, &st)) {
+		close(fd);
+		return -1;
+	}
+	c->map_size = st.st_size;
+	c->n_samples = st.st_size;
+	if (c->map_size) {
+		c->map = mmap(NULL, c->map_size, PROT_READ, MAP_SHARED, fd, 0);
+		if (c->map == MAP_FAILED) {
+			c->map = NULL;
+			close(fd);
+			return -1;
+		}
+		madvise((void *)c->map, c->map_size, MADV_SEQUENTIAL);
+	}
+	close(fd);
+	return 0;
+}
+
+static int capture_open_stream(struct capture_reader *c, const char *filename){
+uint8_t header[RLE_HEADER_SIZE];
+
+	c->n_samples = CAPTURE_UNKNOWN;
+	if (!(c->file = fopen(filename, "rb")) || !(c->in = malloc(CAPTURE_IN_SIZE))) {
+		return -1;
+	}
+	if (c->format == CAPTURE_RLE) {
+		if (fread(header, 1, sizeof(header), c->file) != sizeof(header)) {
+			return -1;
+		}
+		rle_decoder_init(&c->rle);
+		return 0;
+	}
+	memset(&c->strm, 0, sizeof(c->strm));
+	return inflateInit(&c->strm) == Z_OK ? 0 : -1;
+}
+
+struct capture_reader *capture_open(const char *filename, const char *format){
+struct capture_reader *c;
+uint8_t magic[4];
+size_t n = 0;
+unsigned int i;
+FILE *file;
+int ret;
+
+	if (!(c = calloc(1, sizeof(struct capture_reader)))) {
+		return NULL;
+	}
+	if (format) {
+		for (i = 0; capture_formats[i] && strcmp(capture_formats[i], format); i++) {
+		}
+		if (!capture_formats[i]) {
+			log_printf( ERR, "Unknown capture format %s\n", format);
+			free(c);
+			return NULL;
+		}
+		c->format = i;
+	} else if ((file = fopen(filename, "rb"))) {
+		n = fread(magic, 1, sizeof(magic), file);
+		fclose(file);
+		c->format = capture_detect(magic, n);
+	} else {
+		free(c);
+		return NULL;
+	}
+
+	switch (c->format) {
+	case CAPTURE_BLOCKZ:
+		ret = (c->blockz = blockz_open(filename)) ? 0 : -1;
+		if (!ret) {
+			c->n_samples = c->blockz->n_samples;
+			c->samples_per_second = c->blockz->samples_per_second;
+		}
+		break;
+	case CAPTURE_ZLIB:
+	case CAPTURE_RLE:
+		ret = capture_open_stream(c, filename);
+		break;
+	case CAPTURE_RAW:
+	default:
+		ret = capture_open_raw(c, filename);
+		break;
+	}
+	if (ret) {
+		log_printf( ERR, "Failed to open the %s capture %s\n", capture_formats[c->format], filename);
+		capture_close(c);
+		return NULL;
+	}
+	return c;
+}
+
+/* refill the input buffer of a stream, false at the end of the file */
+static bool capture_fill(struct capture_reader *c){
+	if (c->in_pos < c->in_len) {
+		return true;
+	}
+	c->in_pos = 0;
+	c->in_len = fread(c->in, 1, CAPTURE_IN_SIZE, c->file);
+	return c->in_len > 0;
+}
+
+static ssize_t capture_read_stream(struct capture_reader *c, uint8_t *out, size_t size){
+size_t done = 0, used, n;
+int ret;
+
+	while (done < size && !c->eof) {
+		if (!capture_fill(c)) {
+			c->eof = true;
+			break;
+		}
+		if (c->format == CAPTURE_RLE) {
+			n = rle_decode(&c->rle, c->in + c->in_pos, c->in_len - c->in_pos, &used, out + done, size - done);
+			c->in_pos += used;
+			done += n;
+			continue;
+		}
+		c->strm.next_in = c->in + c->in_pos;
+		c->strm.avail_in = c->in_len - c->in_pos;
+		c->strm.next_out = out + done;
+		c->strm.avail_out = size - done;
+		ret = inflate(&c->strm, Z_NO_FLUSH);
+		c->in_pos = c->in_len - c->strm.avail_in;
+		done = size - c->strm.avail_out;
+		if (ret == Z_STREAM_END) {
+			c->eof = true;
+		} else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+			return -1;
+		}
+	}
+	c->pos += done;
+	return done;
+}
+
+ssize_t capture_read(struct capture_reader *c, uint64_t offset, uint8_t *out, size_t size){
+	switch (c->format) {
+	case CAPTURE_BLOCKZ:
+		return blockz_read(c->blockz, offset, out, size);
+	case CAPTURE_ZLIB:
+	case CAPTURE_RLE:
+		if (offset != c->pos) {
+			return -1;
+		}
+		return capture_read_stream(c, out, size);
+	case CAPTURE_RAW:
+	default:
+		if (offset >= c->map_size) {
+			return 0;
+		}
+		if (size > c->map_size - offset) {
+			size = c->map_size - offset;
+		}
+		memcpy(out, c->map + offset, size);
+		return size;
+	}
+}
+
+void capture_close(struct capture_reader *c){
+	if (!c) {
+		return;
+	}
+	if (c->map) {
+		munmap((void *)c->map, c->map_size);
+	}
+	blockz_close(c->blockz);
+	if (c->format == CAPTURE_ZLIB && c->file) {
+		inflateEnd(&c->strm);
+	}
+	if (c->file) {
+		fclose(c->file);
+	}
+	free(c->in);
+	free(c);
+}
+
+uint32_t capture_parse_rate(const char *arg){
+char *end;
+double n = strtod(arg, &end);
+
+	if (*end == 'M') {
+		n *= 1e6;
+		end++;
+	} else if (*end == 'k') {
+		n *= 1e3;
+		end++;
+	}
+	if (strcmp(end, "Hz") != 0 && *end != '\0') {
+		return 0;
+	}
+	return n >= 1 && n < 4e9 ? (uint32_t)n : 0;
+}
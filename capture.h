@@ -0,0 +1,62 @@
+// vim: sw=8:ts=8:noexpandtab
+#ifndef __CAPTURE_H__
+#define __CAPTURE_H__
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <zlib.h>
+#include "rle.h"
+
+/*
+ * Reads back what the output formats wrote, as the byte per sample stream,
+ * for the offline tools. raw and blockz files can be read anywhere and by
+ * several readers at once; zlib and rle are streams that only read forward.
+ * The format is taken from the file's magic unless one is given, a file
+ * without one is raw.
+ */
+
+#define CAPTURE_IN_SIZE (256 * 1024)
+#define CAPTURE_UNKNOWN UINT64_MAX	/* n_samples of a stream */
+
+enum capture_format {
+	CAPTURE_RAW = 0,
+	CAPTURE_BLOCKZ,
+	CAPTURE_ZLIB,
+	CAPTURE_RLE
+};
+
+struct capture_reader {
+	enum capture_format		format;
+	uint64_t			n_samples;
+	uint32_t			samples_per_second;	/* 0 if the file does not say */
+
+	const uint8_t			*map;		/* raw */
+	size_t				map_size;
+	struct blockz_reader		*blockz;
+
+	/* zlib and rle */
+	FILE				*file;
+	z_stream			strm;
+	struct rle_decoder		rle;
+	uint64_t			pos;		/* next sample of the stream */
+	uint8_t				*in;
+	size_t				in_pos;
+	size_t				in_len;
+	bool				eof;
+};
+
+/* 'format' is "raw", "blockz", "zlib", "rle" or NULL to tell from the file */
+struct capture_reader *capture_open(const char *filename, const char *format);
+/* samples from 'offset'; a stream only reads on from where the last read ended */
+ssize_t capture_read(struct capture_reader *c, uint64_t offset, uint8_t *out, size_t size);
+static inline bool capture_seekable(struct capture_reader *c){
+	return c->format == CAPTURE_RAW || c->format == CAPTURE_BLOCKZ;
+}
+void capture_close(struct capture_reader *c);
+
+/* a sample rate on the command line: "24MHz", "24M", "500k", "16000000"; 0 if invalid */
+uint32_t capture_parse_rate(const char *arg);
+
+#endif
@@ -0,0 +1,459 @@
+// vim: sw=8:ts=8:noexpandtab
+#include "decode.h"
+#include "slogic.h"
+#include "log.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static const struct decoder_type *decoder_types[] = {
+	&uart_decoder_type,
+	&spi_decoder_type,
+	&i2c_decoder_type,
+	NULL
+};
+
+static const char *decode_event_names[] = {"data", "start", "stop", "address", "word", "gap"};
+
+int decode_channel(const char *value){
+char *end;
+long ch = strtol(value, &end, 10);
+
+	return *value && !*end && ch >= 0 && ch < SLOGIC_CHANNELS ? ch : -1;
+}
+
+int decode_add(struct slogic_decode *decode, const char *spec){
+const struct decoder_type **type;
+struct decoder *d;
+const char *args = strchr(spec, ':');
+size_t len = args ? (size_t)(args - spec) : strlen(spec);
+
+	if (decode->n_decoders == DECODE_MAX) {
+		return -1;
+	}
+	for (type = decoder_types; *type; type++) {
+		if (strlen((*type)->name) == len && strncmp((*type)->name, spec, len) == 0) {
+			break;
+		}
+	}
+	if (!*type) {
+		return -1;
+	}
+	d = &decode->decoders[decode->n_decoders];
+	memset(d, 0, sizeof(*d));
+	d->type = *type;
+	d->spec = strdup(spec);
+	d->index = decode->n_decoders++;
+	return d->spec ? 0 : -1;
+}
+
+/*
+ * Frames
+ */
+
+static void decode_put_le(uint8_t *p, uint64_t v, unsigned int n){
+unsigned int i;
+
+	for (i = 0; i < n; i++) {
+		p[i] = v >> (8 * i);
+	}
+}
+
+static void decode_write_text(struct decoder *d, const struct decode_frame *f){
+FILE *file = d->output->file;
+
+	fprintf(file, "%llu %llu %.9f %s#%u %s", (unsigned long long)f->start, (unsigned long long)f->end,
+		d->samples_per_second ? (double)f->start / d->samples_per_second : 0.0, d->type->name, f->decoder,
+		decode_event_names[f->type]);
+	switch (f->type) {
+	case DECODE_DATA:
+		fprintf(file, " 0x%02x", f->data);
+		if (f->data >= 0x20 && f->data < 0x7f) {
+			fprintf(file, " '%c'", f->data);
+		}
+		break;
+	case DECODE_ADDRESS:
+		fprintf(file, " 0x%02x %s", f->data, f->flags & DECODE_FLAG_READ ? "read" : "write");
+		break;
+	case DECODE_WORD:
+		fprintf(file, " 0x%x 0x%x", f->data, f->data2);
+		break;
+	case DECODE_GAP:
+		fprintf(file, " %llu", ((unsigned long long)f->data2 << 32) | f->data);
+		break;
+	}
+	if (f->flags & DECODE_FLAG_FRAMING) {
+		fprintf(file, " framing-error");
+	}
+	if (f->flags & DECODE_FLAG_PARITY) {
+		fprintf(file, " parity-error");
+	}
+	if (f->flags & DECODE_FLAG_NACK) {
+		fprintf(file, " nack");
+	}
+	if (f->flags & DECODE_FLAG_PARTIAL) {
+		fprintf(file, " partial");
+	}
+	fputc('\n', file);
+}
+
+static void decode_write_binary(struct decoder *d, const struct decode_frame *f){
+uint8_t rec[DECODE_FRAME_SIZE];
+
+	memset(rec, 0, sizeof(rec));
+	decode_put_le(rec, f->start, 8);
+	decode_put_le(rec + 8, f->end, 8);
+	rec[16] = f->decoder;
+	rec[17] = f->type;
+	rec[18] = f->flags;
+	decode_put_le(rec + 20, f->data, 4);
+	decode_put_le(rec + 24, f->data2, 4);
+	fwrite(rec, 1, sizeof(rec), d->output->file);
+}
+
+/* the decoder's frames to the output, in one go so decoders on other threads do not interleave them */
+static void decode_flush(struct decoder *d){
+unsigned int i;
+
+	if (!d->n_frames) {
+		return;
+	}
+	pthread_mutex_lock(&d->output->lock);
+	for (i = 0; i < d->n_frames; i++) {
+		if (d->output->binary) {
+			decode_write_binary(d, &d->frames[i]);
+		} else {
+			decode_write_text(d, &d->frames[i]);
+		}
+	}
+	fflush(d->output->file);
+	pthread_mutex_unlock(&d->output->lock);
+	d->total_frames += d->n_frames;
+	d->n_frames = 0;
+}
+
+void decode_emit(struct decoder *d, uint8_t type, uint64_t start, uint64_t end, uint32_t data, uint32_t data2,
+		 uint8_t flags){
+struct decode_frame *f;
+
+	if (d->n_frames == DECODE_FRAME_BATCH) {
+		decode_flush(d);
+	}
+	f = &d->frames[d->n_frames++];
+	f->start = start;
+	f->end = end;
+	f->decoder = d->index;
+	f->type = type;
+	f->flags = flags;
+	f->data = data;
+	f->data2 = data2;
+}
+
+static void decode_run(struct decoder *d, const uint8_t *p, size_t n, uint64_t base){
+	if (!n) {
+		return;
+	}
+	d->type->feed(d, p, n, base);
+	d->started = true;
+	decode_flush(d);
+}
+
+static void decode_gap(struct decoder *d, uint64_t at, uint64_t samples){
+	d->type->reset(d);
+	d->started = false;
+	decode_emit(d, DECODE_GAP, at, at + samples, samples, samples >> 32, 0);
+	decode_flush(d);
+}
+
+/*
+ * Setup
+ */
+
+static int decode_output_open(struct decode_output *o, const char *spec, struct slogic_decode *decode){
+uint8_t header[8];
+unsigned int i;
+
+	o->binary = false;
+	if (spec && strncmp(spec, "bin:", 4) == 0) {
+		o->binary = true;
+		spec += 4;
+	} else if (spec && strncmp(spec, "text:", 5) == 0) {
+		spec += 5;
+	}
+	if (!spec || strcmp(spec, "-") == 0) {
+		o->file = stdout;
+	} else if (!(o->file = fopen(spec, o->binary ? "wb" : "w"))) {
+		log_printf( ERR, "Failed to open the decoder output %s: %s\n", spec, strerror(errno));
+		return -1;
+	}
+	pthread_mutex_init(&o->lock, NULL);
+	if (o->binary) {
+		memcpy(header, DECODE_MAGIC, 4);
+		decode_put_le(header + 4, DECODE_VERSION, 2);
+		decode_put_le(header + 6, decode->n_decoders, 2);
+		fwrite(header, 1, sizeof(header), o->file);
+		for (i = 0; i < decode->n_decoders; i++) {
+			fwrite(decode->decoders[i].spec, 1, strlen(decode->decoders[i].spec) + 1, o->file);
+		}
+	}
+	return 0;
+}
+
+/* removes the 'thread' option, which is ours and not the decoder's */
+static bool decode_take_thread(char *options){
+char *opt = options, *end;
+size_t len;
+
+	while (*opt) {
+		end = strchr(opt, ',');
+		len = end ? (size_t)(end - opt) : strlen(opt);
+		if (len == 6 && strncmp(opt, "thread", 6) == 0) {
+			if (end) {
+				memmove(opt, end + 1, strlen(end + 1) + 1);
+			} else {
+				*(opt > options ? opt - 1 : opt) = '\0';
+			}
+			return true;
+		}
+		if (!end) {
+			break;
+		}
+		opt = end + 1;
+	}
+	return false;
+}
+
+int decode_start(struct slogic_decode *decode, uint32_t samples_per_second, const char *output){
+struct decoder *d;
+const char *args;
+char *options;
+unsigned int i;
+int ret;
+
+	for (i = 0; i < decode->n_decoders; i++) {
+		d = &decode->decoders[i];
+		d->samples_per_second = samples_per_second;
+		d->output = &decode->output;
+		d->started = false;
+		args = strchr(d->spec, ':');
+		if (!(options = strdup(args ? args + 1 : ""))) {
+			return -1;
+		}
+		d->own_thread = decode_take_thread(options);
+		ret = d->type->init(d, options);
+		free(options);
+		if (ret) {
+			log_printf( ERR, "Invalid decoder: %s\n", d->spec);
+			return -1;
+		}
+		d->type->reset(d);
+	}
+	return decode_output_open(&decode->output, output, decode);
+}
+
+void decode_feed(struct slogic_decode *decode, const uint8_t *p, size_t n, uint64_t base){
+unsigned int i;
+
+	for (i = 0; i < decode->n_decoders; i++) {
+		decode_run(&decode->decoders[i], p, n, base);
+	}
+}
+
+void decode_finish(struct slogic_decode *decode){
+unsigned int i;
+
+	for (i = 0; i < decode->n_decoders; i++) {
+		decode_flush(&decode->decoders[i]);
+		log_printf( DEBUG, "Decoder %s: %llu frames\n", decode->decoders[i].spec,
+			    decode->decoders[i].total_frames);
+		free(decode->decoders[i].spec);
+		decode->decoders[i].spec = NULL;
+	}
+	if (decode->output.file && decode->output.file != stdout) {
+		fclose(decode->output.file);
+	}
+	decode->output.file = NULL;
+	pthread_mutex_destroy(&decode->output.lock);
+	decode->n_decoders = 0;
+}
+
+/*
+ * Live decoding
+ */
+
+static void *decode_thread_main(void *arg){
+struct decode_thread *t = arg;
+struct slogic_block block;
+struct timespec idle = { 0, PIPELINE_IDLE_USEC * 1000 };
+unsigned int i;
+
+	while (1) {
+		if (slogic_ring_pop(&t->filled, &block)) {
+			for (i = 0; i < t->n_decoders; i++) {
+				if (block.data) {
+					decode_run(t->decoders[i], block.data, block.size, t->base);
+				} else {
+					decode_gap(t->decoders[i], t->base, block.size);
+				}
+			}
+			t->base += block.size;
+			if (block.data) {
+				slogic_ring_push(&t->free, block.data, DECODE_CHUNK);
+			}
+			continue;
+		}
+		if (!atomic_load(&t->running) && !slogic_ring_count(&t->filled)) {
+			break;
+		}
+		nanosleep(&idle, NULL);
+	}
+	return NULL;
+}
+
+static int decode_thread_start(struct decode_thread *t){
+unsigned int i;
+
+	t->arena = mmap(NULL, (size_t)DECODE_CHUNKS * DECODE_CHUNK, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | SLOGIC_MAP_POPULATE, -1, 0);
+	if (t->arena == MAP_FAILED) {
+		t->arena = NULL;
+		return -1;
+	}
+	/* room for a gap marker in front of every chunk */
+	if (slogic_ring_init(&t->filled, DECODE_CHUNKS * 2) || slogic_ring_init(&t->free, DECODE_CHUNKS)) {
+		return -1;
+	}
+	for (i = 0; i < DECODE_CHUNKS; i++) {
+		slogic_ring_push(&t->free, t->arena + (size_t)i * DECODE_CHUNK, DECODE_CHUNK);
+	}
+	t->base = t->gap = t->dropped = 0;
+	t->chunk = NULL;
+	t->fill = 0;
+	atomic_store(&t->running, 1);
+	if (pthread_create(&t->thread, NULL, decode_thread_main, t)) {
+		atomic_store(&t->running, 0);
+		return -1;
+	}
+	return 0;
+}
+
+int slogic_decode_arm(struct slogic_ctx *handle, const char *output){
+struct slogic_decode *decode = &handle->decode;
+struct decode_thread *shared = NULL, *t;
+struct decoder *d;
+unsigned int i;
+
+	if (decode_start(decode, handle->sample_rate->samples_per_second, output)) {
+		return -1;
+	}
+	decode->n_threads = 0;
+	for (i = 0; i < decode->n_decoders; i++) {
+		d = &decode->decoders[i];
+		if (d->own_thread || !shared) {
+			t = &decode->threads[decode->n_threads++];
+			memset(t, 0, sizeof(*t));
+			if (!d->own_thread) {
+				shared = t;
+			}
+		} else {
+			t = shared;
+		}
+		t->decoders[t->n_decoders++] = d;
+	}
+	for (i = 0; i < decode->n_threads; i++) {
+		if (decode_thread_start(&decode->threads[i])) {
+			log_printf( ERR, "Failed to start decode thread %u\n", i);
+			decode->n_threads = i;
+			slogic_decode_disarm(handle);
+			return -1;
+		}
+	}
+
+	decode->sink = handle->data_callback_write;
+	handle->data_callback_write = slogic_decode_write;
+	log_printf( DEBUG, "Decoding with %u decoders on %u threads\n", decode->n_decoders, decode->n_threads);
+	return 0;
+}
+
+/* hands the chunk being filled, and the gap before it, to the decode thread */
+static void decode_thread_push(struct decode_thread *t){
+	if (t->gap) {
+		slogic_ring_push(&t->filled, NULL, t->gap);
+		t->gap = 0;
+	}
+	if (t->chunk) {
+		slogic_ring_push(&t->filled, t->chunk, t->fill);
+		t->chunk = NULL;
+		t->fill = 0;
+	}
+}
+
+/*
+ * writer thread: a copy for every decode thread that has room, the output is
+ * not held up for it. Chunks are handed over when full, or straight away when
+ * the decode thread is waiting, so a busy one gets few large chunks and an
+ * idle one sees the samples with little delay.
+ */
+size_t slogic_decode_write(struct slogic_ctx *handle, uint8_t *data, size_t size){
+struct slogic_decode *decode = &handle->decode;
+struct decode_thread *t;
+struct slogic_block chunk;
+size_t n, left;
+uint8_t *p;
+unsigned int i;
+
+	for (i = 0; i < decode->n_threads; i++) {
+		t = &decode->threads[i];
+		for (p = data, left = size; left; p += n, left -= n) {
+			if (!t->chunk) {
+				if (!slogic_ring_pop(&t->free, &chunk)) {
+					t->gap += left;
+					t->dropped += left;
+					break;
+				}
+				t->chunk = chunk.data;
+			}
+			n = left < DECODE_CHUNK - t->fill ? left : DECODE_CHUNK - t->fill;
+			memcpy(t->chunk + t->fill, p, n);
+			t->fill += n;
+			if (t->fill == DECODE_CHUNK) {
+				decode_thread_push(t);
+			}
+		}
+		if (t->chunk && !slogic_ring_count(&t->filled)) {
+			decode_thread_push(t);
+		}
+	}
+	return decode->sink(handle, data, size);
+}
+
+void slogic_decode_disarm(struct slogic_ctx *handle){
+struct slogic_decode *decode = &handle->decode;
+struct decode_thread *t;
+unsigned int i;
+
+	if (decode->sink) {
+		handle->data_callback_write = decode->sink;
+		decode->sink = NULL;
+	}
+	for (i = 0; i < decode->n_threads; i++) {
+		t = &decode->threads[i];
+		decode_thread_push(t);
+		if (atomic_exchange(&t->running, 0)) {
+			pthread_join(t->thread, NULL);
+		}
+		if (t->dropped) {
+			log_printf( ERR, "Decode thread %u fell behind, %llu samples were not decoded\n", i, t->dropped);
+		}
+		slogic_ring_free(&t->filled);
+		slogic_ring_free(&t->free);
+		if (t->arena) {
+			munmap(t->arena, (size_t)DECODE_CHUNKS * DECODE_CHUNK);
+			t->arena = NULL;
+		}
+	}
+	decode->n_threads = 0;
+	decode_finish(decode);
+}
@@ -0,0 +1,205 @@
+// vim: sw=8:ts=8:noexpandtab
+#ifndef __DECODE_H__
+#define __DECODE_H__
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "pipeline.h"
+
+/*
+ * Protocol decoders (-D), fed the samples the output gets. The writer
+ * thread only copies each block into a decode thread's queue; the decoders
+ * run there, all of them on one thread or the ones given 'thread' on their
+ * own. When a decode thread falls so far behind that its queue is full the
+ * samples are dropped for it, never waited for, and its decoders restart
+ * after a DECODE_GAP frame. The decoders are streaming state machines over
+ * the byte per sample stream, so decoding a recorded capture (sdecode) gives
+ * the same frames as decoding it live.
+ *
+ *   -D uart:rx=<ch>,baud=<n>[,bits=5..9][,parity=none|even|odd][,stop=1|2][,invert]
+ *   -D spi:clk=<ch>[,mosi=<ch>][,miso=<ch>][,cs=<ch>][,mode=0..3][,bits=1..32][,lsb][,cs_high]
+ *   -D i2c:scl=<ch>,sda=<ch>
+ *   each one can add ',thread' to get a thread of its own
+ *
+ * Frames go to -O [text:|bin:]<file> (text on stdout by default), written
+ * and flushed as each block is decoded:
+ *   text   <start sample> <end sample> <start time> <decoder>#<n> <event> [<value>] [<flags>]
+ *   bin    "SLDC" u16 version u16 n_decoders, a NUL terminated spec per decoder,
+ *          then 32 byte frames: u64 start u64 end u8 decoder u8 type u8 flags
+ *          u8 0 u32 data u32 data2, little endian
+ */
+
+#define DECODE_MAX 8
+#define DECODE_CHUNK (256 * 1024)	/* samples per queued chunk */
+#define DECODE_CHUNKS 256		/* queued copies per thread, 64MiB of samples */
+#define DECODE_FRAME_BATCH 256		/* frames buffered per decoder between flushes */
+#define DECODE_MAGIC "SLDC"
+#define DECODE_VERSION 1
+#define DECODE_FRAME_SIZE 32
+
+enum decode_event {
+	DECODE_DATA = 0,	/* uart or i2c byte */
+	DECODE_START,		/* i2c start or repeated start, spi chip select */
+	DECODE_STOP,		/* i2c stop, spi chip deselect */
+	DECODE_ADDRESS,		/* i2c address, data is the 7 bit address */
+	DECODE_WORD,		/* spi, data is mosi and data2 miso */
+	DECODE_GAP		/* data2:data samples were not decoded */
+};
+
+#define DECODE_FLAG_FRAMING 0x01	/* uart stop bit low */
+#define DECODE_FLAG_PARITY 0x02
+#define DECODE_FLAG_NACK 0x04
+#define DECODE_FLAG_READ 0x08		/* i2c address with the read bit */
+#define DECODE_FLAG_PARTIAL 0x10	/* spi word cut short by chip select */
+
+struct decode_frame {
+	uint64_t			start;
+	uint64_t			end;
+	uint8_t				decoder;
+	uint8_t				type;
+	uint8_t				flags;
+	uint32_t			data;
+	uint32_t			data2;
+};
+
+struct uart_decoder {
+	uint8_t				rx;
+	unsigned int			bits;
+	char				parity;		/* 'n', 'e' or 'o' */
+	unsigned int			stop;
+	uint8_t				invert;
+	uint32_t			baud;
+	double				spb;		/* samples per bit */
+	/* state */
+	bool				busy;
+	uint64_t			t0;		/* start bit edge */
+	uint64_t			next;		/* sample to take the next bit at */
+	unsigned int			bit;		/* 0 is the start bit */
+	uint32_t			value;
+	uint8_t				flags;
+	uint8_t				prev;
+};
+
+struct spi_decoder {
+	int				clk, mosi, miso, cs;	/* -1 if not used */
+	unsigned int			mode;
+	unsigned int			bits;
+	bool				lsb;
+	bool				cs_high;
+	/* state */
+	uint8_t				prev;
+	bool				selected;
+	unsigned int			bit;
+	uint32_t			mosi_word;
+	uint32_t			miso_word;
+	uint64_t			word_start;
+};
+
+enum i2c_state {
+	I2C_IDLE = 0,
+	I2C_ADDRESS,
+	I2C_DATA
+};
+
+struct i2c_decoder {
+	uint8_t				scl, sda;
+	/* state */
+	uint8_t				prev;
+	enum i2c_state			state;
+	unsigned int			bit;
+	uint32_t			byte;
+	uint64_t			byte_start;
+};
+
+struct slogic_ctx;
+struct decoder;
+
+struct decoder_type {
+	const char *name;
+	int (*init)(struct decoder *d, char *options);
+	/* the samples p[0..n) from sample 'base'; p[-1] is not there, decoders keep what they need */
+	void (*feed)(struct decoder *d, const uint8_t *p, size_t n, uint64_t base);
+	/* forget the frame in progress; the next feed() starts from scratch, as after the first sample */
+	void (*reset)(struct decoder *d);
+};
+
+struct decode_output {
+	FILE				*file;
+	bool				binary;
+	pthread_mutex_t			lock;
+};
+
+struct decoder {
+	const struct decoder_type	*type;
+	char				*spec;
+	unsigned int			index;
+	bool				own_thread;
+	bool				started;	/* feed() has seen a sample since init or reset */
+	uint32_t			samples_per_second;
+	struct decode_output		*output;
+	struct decode_frame		frames[DECODE_FRAME_BATCH];
+	unsigned int			n_frames;
+	unsigned long long		total_frames;
+	union {
+		struct uart_decoder	uart;
+		struct spi_decoder	spi;
+		struct i2c_decoder	i2c;
+	};
+};
+
+struct decode_thread {
+	pthread_t			thread;
+	struct decoder			*decoders[DECODE_MAX];
+	unsigned int			n_decoders;
+	struct slogic_ring		filled;		/* writer -> decode thread, NULL data is a gap */
+	struct slogic_ring		free;		/* decode thread -> writer */
+	uint8_t				*arena;
+	uint8_t				*chunk;		/* writer: being filled */
+	size_t				fill;
+	_Atomic int			running;
+	uint64_t			base;		/* decode thread: next sample */
+	uint64_t			gap;		/* writer: samples dropped since the last push */
+	unsigned long long		dropped;
+};
+
+struct slogic_decode {
+	struct decoder			decoders[DECODE_MAX];
+	unsigned int			n_decoders;
+	struct decode_output		output;
+	struct decode_thread		threads[DECODE_MAX];
+	unsigned int			n_threads;
+	size_t				(*sink)(struct slogic_ctx *handle, uint8_t *data, size_t size);
+};
+
+/* decoder implementations, uart.c spi.c i2c.c */
+extern const struct decoder_type uart_decoder_type;
+extern const struct decoder_type spi_decoder_type;
+extern const struct decoder_type i2c_decoder_type;
+
+/* "0" to "7" for the decoders' options, -1 if it is not a channel */
+int decode_channel(const char *value);
+
+/* "name:options" */
+int decode_add(struct slogic_decode *decode, const char *spec);
+static inline bool slogic_decode_enabled(struct slogic_decode *decode){
+	return decode->n_decoders > 0;
+}
+/* opens the frame output, "-" or NULL for stdout, and sets up the decoders */
+int decode_start(struct slogic_decode *decode, uint32_t samples_per_second, const char *output);
+/* decoders call this for every frame */
+void decode_emit(struct decoder *d, uint8_t type, uint64_t start, uint64_t end, uint32_t data, uint32_t data2,
+		 uint8_t flags);
+/* every decoder over p[0..n) on the calling thread, for recorded captures */
+void decode_feed(struct slogic_decode *decode, const uint8_t *p, size_t n, uint64_t base);
+void decode_finish(struct slogic_decode *decode);
+
+/* decode_start() plus the decode threads, and puts them in front of data_callback_write() */
+int slogic_decode_arm(struct slogic_ctx *handle, const char *output);
+size_t slogic_decode_write(struct slogic_ctx *handle, uint8_t *data, size_t size);
+/* drains the queues, stops the threads and restores data_callback_write() */
+void slogic_decode_disarm(struct slogic_ctx *handle);
+
+#endif
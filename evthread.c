@@ -0,0 +1,168 @@
+// vim: sw=8:ts=8:noexpandtab
+#define _GNU_SOURCE	/* pthread_attr_setaffinity_np() */
+#include "evthread.h"
+#include "slogic.h"
+#include "log.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+int slogic_evthread_parse(struct slogic_evthread *evthread, const char *arg){
+char *copy, *opt, *value, *end, *save = NULL;
+long n;
+int ret = 0;
+
+	evthread->priority = EVTHREAD_DEFAULT_PRIORITY;
+	evthread->cpu = -1;
+	evthread->lock = true;
+	if (strncmp(arg, "rt", 2) != 0 || (arg[2] != '\0' && arg[2] != ':')) {
+		return -1;
+	}
+	if (!(copy = strdup(arg[2] ? arg + 3 : ""))) {
+		return -1;
+	}
+	for (opt = strtok_r(copy, ",", &save); opt && !ret; opt = strtok_r(NULL, ",", &save)) {
+		if (!strcmp(opt, "nolock")) {
+			evthread->lock = false;
+			continue;
+		}
+		if (!(value = strchr(opt, '='))) {
+			ret = -1;
+			break;
+		}
+		*value++ = '\0';
+		n = strtol(value, &end, 10);
+		if (*end || end == value) {
+			ret = -1;
+		} else if (!strcmp(opt, "prio") && n >= 1 && n <= 99) {
+			evthread->priority = n;
+		} else if (!strcmp(opt, "cpu") && n >= 0 && n < CPU_SETSIZE) {
+			evthread->cpu = n;
+		} else {
+			ret = -1;
+		}
+	}
+	free(copy);
+	evthread->enabled = !ret;
+	return ret;
+}
+
+void slogic_evthread_reset(struct slogic_ctx *handle, unsigned int in_flight){
+struct slogic_evthread *evthread = &handle->evthread;
+
+	evthread->period_ns = (uint64_t)handle->transfer_buffer_size * 1000000000ULL / handle->sample_rate->samples_per_second;
+	evthread->window_ns = evthread->period_ns * (in_flight > 1 ? in_flight / 2 : 1);
+	evthread->last_ns = 0;
+	evthread->completions = 0;
+	evthread->late = 0;
+	evthread->critical = 0;
+	evthread->max_late_ns = 0;
+}
+
+void slogic_evthread_complete(struct slogic_ctx *handle){
+struct slogic_evthread *evthread = &handle->evthread;
+uint64_t now = slogic_trace_now(), gap;
+
+	evthread->completions++;
+	if (evthread->last_ns) {
+		gap = now - evthread->last_ns;
+		if (gap > evthread->period_ns && gap - evthread->period_ns > evthread->max_late_ns) {
+			evthread->max_late_ns = gap - evthread->period_ns;
+		}
+		/* jitter around the period is normal, a whole transfer behind is not */
+		evthread->late += gap > 2 * evthread->period_ns;
+		evthread->critical += gap > evthread->window_ns;
+	}
+	evthread->last_ns = now;
+}
+
+/* everything mapped now, the transfer arenas at least; the writers' buffers are already there too */
+static void evthread_lock(struct slogic_ctx **handles, unsigned int n){
+unsigned int i;
+int err = 0;
+
+	if (!mlockall(MCL_CURRENT)) {
+		log_printf( DEBUG, "Locked the address space into memory\n");
+		return;
+	}
+	log_printf( NOTICE, "mlockall: %s, locking only the transfer buffers\n", strerror(errno));
+	for (i = 0; i < n; i++) {
+		if (handles[i]->pool.arena && mlock(handles[i]->pool.arena, handles[i]->pool.arena_size)) {
+			err = errno;
+		}
+	}
+	if (err) {
+		log_printf( NOTICE, "mlock: %s, the transfer buffers can still be paged out\n", strerror(err));
+	}
+}
+
+struct evthread_args {
+	struct slogic_ctx		**handles;
+	unsigned int			n;
+	void				(*loop)(struct slogic_ctx **handles, unsigned int n);
+};
+
+static void *evthread_main(void *arg){
+struct evthread_args *args = arg;
+
+	args->loop(args->handles, args->n);
+	return NULL;
+}
+
+int slogic_evthread_run(struct slogic_ctx **handles, unsigned int n,
+			void (*loop)(struct slogic_ctx **handles, unsigned int n)){
+struct slogic_evthread *evthread = &handles[0]->evthread;
+struct evthread_args args = { handles, n, loop };
+struct sched_param param = { .sched_priority = evthread->priority };
+pthread_attr_t attr;
+pthread_t thread;
+#ifdef __linux__
+cpu_set_t set;
+#endif
+int err;
+
+	if (evthread->lock) {
+		evthread_lock(handles, n);
+	}
+	pthread_attr_init(&attr);
+	pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+	pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+	pthread_attr_setschedparam(&attr, &param);
+#ifdef __linux__
+	if (evthread->cpu >= 0) {
+		CPU_ZERO(&set);
+		CPU_SET(evthread->cpu, &set);
+		pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+	}
+#endif
+	if ((err = pthread_create(&thread, &attr, evthread_main, &args)) == EPERM) {
+		/* no CAP_SYS_NICE or RLIMIT_RTPRIO, still a thread of its own */
+		log_printf( NOTICE, "No permission for SCHED_FIFO, the event thread runs at the normal policy\n");
+		pthread_attr_setinheritsched(&attr, PTHREAD_INHERIT_SCHED);
+		err = pthread_create(&thread, &attr, evthread_main, &args);
+	}
+	pthread_attr_destroy(&attr);
+	if (err) {
+		log_printf( ERR, "Failed to start the event thread: %s\n", strerror(err));
+		return 1;
+	}
+	log_printf( DEBUG, "Event thread running%s\n", evthread->cpu >= 0 ? ", pinned" : "");
+	pthread_join(thread, NULL);
+	if (evthread->lock) {
+		munlockall();
+	}
+	return 0;
+}
+
+void slogic_evthread_report(struct slogic_ctx *handle){
+struct slogic_evthread *evthread = &handle->evthread;
+
+	log_printf( evthread->enabled ? NOTICE : DEBUG,
+		    "Late completions: %lu of %lu a transfer (%.2f ms) or more late, %lu past half the in flight transfers, "
+		    "%.2f ms late at most\n", evthread->late, evthread->completions, evthread->period_ns / 1e6, evthread->critical,
+		    evthread->max_late_ns / 1e6);
+}
@@ -0,0 +1,59 @@
+// vim: sw=8:ts=8:noexpandtab
+#ifndef __EVTHREAD_H__
+#define __EVTHREAD_H__
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/*
+ * The usb event loop on a thread of its own (-E rt[:prio=<n>][,cpu=<n>][,nolock]).
+ * The completion callbacks resubmit the transfers, so a loop that is not
+ * scheduled in time, or that page faults, lets the in flight transfers run
+ * out and the Logic's fifo overflow. The thread runs SCHED_FIFO at 'priority'
+ * (without the privilege for it, at the normal policy with a notice),
+ * pinned to 'cpu' if given, and everything mapped is locked into memory
+ * before the capture starts; where mlockall() is not allowed, at least the
+ * transfer arena is. The main thread only waits for it.
+ *
+ * Whether or not the thread is used, the callbacks keep how late the
+ * completions came: a gap between two of them of more than twice the time a
+ * transfer takes to fill at the sample rate means the loop (or the bus) was
+ * a transfer late, and one longer than half the in flight transfers is where
+ * overflows start.
+ */
+
+#define EVTHREAD_DEFAULT_PRIORITY 50
+
+struct slogic_ctx;
+
+struct slogic_evthread {
+	bool				enabled;
+	int				priority;	/* SCHED_FIFO priority, 1 to 99 */
+	int				cpu;		/* -1 if not pinned */
+	bool				lock;		/* mlockall() ahead of the capture */
+
+	/* kept by the usb callback */
+	uint64_t			period_ns;	/* one transfer at the sample rate */
+	uint64_t			window_ns;	/* half the in flight transfers */
+	uint64_t			last_ns;
+	unsigned long			completions;
+	unsigned long			late;		/* gaps longer than two period_ns */
+	unsigned long			critical;	/* gaps longer than window_ns */
+	uint64_t			max_late_ns;
+};
+
+static inline bool slogic_evthread_enabled(struct slogic_evthread *evthread){
+	return evthread->enabled;
+}
+/* "rt[:prio=<n>][,cpu=<n>][,nolock]"; non zero if invalid */
+int slogic_evthread_parse(struct slogic_evthread *evthread, const char *arg);
+/* resets the lateness for a capture of 'in_flight' transfers, before the first one is submitted */
+void slogic_evthread_reset(struct slogic_ctx *handle, unsigned int in_flight);
+/* usb callback, a transfer completed */
+void slogic_evthread_complete(struct slogic_ctx *handle);
+/* runs loop(handles, n) on the event thread set up as handles[0] says and waits for it */
+int slogic_evthread_run(struct slogic_ctx **handles, unsigned int n,
+			void (*loop)(struct slogic_ctx **handles, unsigned int n));
+void slogic_evthread_report(struct slogic_ctx *handle);
+
+#endif
@@ -26,6 +26,8 @@
 #include <errno.h>
 #include <string.h>
 #include "slogic.h"
+#include "ezusb.h"
+#include "firmware.h"
 #include "usbutil.h"
 #include "log.h"
 //#include "config.h"
@@ -44,33 +46,62 @@ unsigned char buf[1];
 	return err;
 }
 
+/* the runs of the image, FIRMWARE_MAX_WRITE bytes per control transfer */
 int ezusb_install_firmware(libusb_device_handle *hdl, const char *filename){
-FILE *fw;
-int offset, chunksize, err, result;
-unsigned char buf[4096];
+const struct firmware_image *image;
+unsigned int i, writes = 0;
+uint32_t offset, chunksize;
+int err;
 
 	log_printf(DEBUG,"Uploading firmware at %s\n", filename);
-	if ((fw = fopen(filename, "r")) == NULL) {
-		perror(filename);
+	if ((image = firmware_load(filename)) == NULL) {
 		return 1;
 	}
 
-	result = offset = 0;
-	while (1) {
-		chunksize = fread(buf, 1, sizeof(buf), fw);
-		if (chunksize == 0)
-			break;
-		if((err = libusb_control_transfer(hdl, LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_ENDPOINT_OUT, 0xa0, offset, 0x0000, buf, chunksize, 100)) < 0) {
-			//g_warning("Unable to send firmware to device: %d", err);
-			result = 1;
-			break;
+	for (i = 0; i < image->n_segments; i++) {
+		for (offset = 0; offset < image->segments[i].length; offset += chunksize) {
+			chunksize = image->segments[i].length - offset;
+			if (chunksize > FIRMWARE_MAX_WRITE) {
+				chunksize = FIRMWARE_MAX_WRITE;
+			}
+			if((err = libusb_control_transfer(hdl, LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_ENDPOINT_OUT, 0xa0,
+							  image->segments[i].address + offset, 0x0000,
+							  (unsigned char *)image->data + image->segments[i].address + offset,
+							  chunksize, EZUSB_WRITE_TIMEOUT)) < 0) {
+				log_printf(ERR, "Unable to send firmware to device: %s\n", usbutil_error_to_string(err));
+				return 1;
+			}
+			writes++;
 		}
-		log_printf(DEBUG,"Uploaded %d bytes\n", chunksize);
-		offset += chunksize;
 	}
-	fclose(fw);
-	log_printf(DEBUG,"Firmware upload done\n");
+	log_printf(DEBUG,"Firmware upload done, %zu bytes in %u writes\n", image->size, writes);
 
-	return result;
+	return 0;
 }
 
+/* reads the image's identity windows back; anything that cannot be read does not match */
+bool ezusb_firmware_matches(libusb_device_handle *hdl, const char *filename){
+const struct firmware_image *image;
+unsigned char buf[FIRMWARE_IDENTITY_WINDOW];
+uint16_t address;
+size_t length;
+unsigned int n;
+int err;
+
+	if ((image = firmware_load(filename)) == NULL) {
+		return false;
+	}
+	for (n = 0; firmware_window(image, n, &address, &length); n++) {
+		if ((err = libusb_control_transfer(hdl, LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_ENDPOINT_IN, 0xa0, address, 0x0000,
+						   buf, length, EZUSB_READ_TIMEOUT)) != (int)length) {
+			log_printf(DEBUG, "Could not read the firmware back at 0x%04x: %s\n", address,
+				   err < 0 ? usbutil_error_to_string(err) : "short read");
+			return false;
+		}
+		if (memcmp(buf, image->data + address, length) != 0) {
+			log_printf(DEBUG, "The firmware running differs from %s at 0x%04x\n", filename, address);
+			return false;
+		}
+	}
+	return true;
+}
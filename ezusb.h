@@ -1,7 +1,14 @@
 #ifndef __EZUSBH__
 #define __EZUSBH__
+#include <libusb.h>
+#include <stdbool.h>
 
 int ezusb_reset(struct libusb_device_handle *hdl, int set_clear);
+#define EZUSB_WRITE_TIMEOUT 1000
+#define EZUSB_READ_TIMEOUT 100
+
 int ezusb_install_firmware(libusb_device_handle *hdl, const char *filename);
+/* whether the FX2 runs the image in 'filename', see firmware.h */
+bool ezusb_firmware_matches(libusb_device_handle *hdl, const char *filename);
 
 #endif
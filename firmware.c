@@ -0,0 +1,220 @@
+// vim: sw=8:ts=8:noexpandtab
+#include "firmware.h"
+#include "log.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static struct firmware_image *firmware_cache = NULL;
+
+static uint64_t firmware_hash(const uint8_t *data, size_t size){
+uint64_t hash = 0xcbf29ce484222325ull;
+size_t i;
+
+	for (i = 0; i < size; i++) {
+		hash = (hash ^ data[i]) * 0x100000001b3ull;
+	}
+	return hash;
+}
+
+static int firmware_hex_digit(char c){
+	if (c >= '0' && c <= '9') {
+		return c - '0';
+	}
+	if (c >= 'a' && c <= 'f') {
+		return c - 'a' + 10;
+	}
+	if (c >= 'A' && c <= 'F') {
+		return c - 'A' + 10;
+	}
+	return -1;
+}
+
+/* ":LLAAAATTDD..CC" records; data (00), end of file (01) and the extended addresses (02, 04) */
+static int firmware_parse_ihex(struct firmware_image *image, uint8_t *present, const char *text, size_t size,
+			       const char *filename){
+uint8_t record[5 + 255];
+const char *p = text, *end = text + size;
+unsigned int line = 1, n, i, sum;
+uint32_t base = 0, address;
+int hi, lo;
+
+	while (p < end) {
+		while (p < end && (*p == '\r' || *p == '\n' || *p == ' ' || *p == '\t')) {
+			line += *p == '\n';
+			p++;
+		}
+		if (p == end) {
+			break;
+		}
+		if (*p++ != ':') {
+			log_printf( ERR, "%s:%u: not an Intel HEX record\n", filename, line);
+			return -1;
+		}
+		/* count, address, type, data and checksum as bytes */
+		for (n = 0, sum = 0; n < sizeof(record); n++) {
+			if (end - p < 2 || (hi = firmware_hex_digit(p[0])) < 0 || (lo = firmware_hex_digit(p[1])) < 0) {
+				break;
+			}
+			record[n] = hi << 4 | lo;
+			sum += record[n];
+			p += 2;
+		}
+		if (n < 5 || n != 5u + record[0]) {
+			log_printf( ERR, "%s:%u: truncated Intel HEX record\n", filename, line);
+			return -1;
+		}
+		if (sum & 0xff) {
+			log_printf( ERR, "%s:%u: Intel HEX checksum mismatch\n", filename, line);
+			return -1;
+		}
+		switch (record[3]) {
+		case 0x00:
+			address = base + (record[1] << 8 | record[2]);
+			if (address + record[0] > FIRMWARE_MAX_SIZE) {
+				log_printf( ERR, "%s:%u: data at 0x%x is past the 64 KB the FX2 has\n", filename, line, address);
+				return -1;
+			}
+			memcpy(image->data + address, record + 4, record[0]);
+			for (i = 0; i < record[0]; i++) {
+				present[(address + i) / 8] |= 1 << ((address + i) % 8);
+			}
+			break;
+		case 0x01:
+			return 0;
+		case 0x02:
+			base = (record[4] << 8 | record[5]) << 4;
+			break;
+		case 0x04:
+			base = (record[4] << 8 | record[5]) << 16;
+			break;
+		default:
+			/* start addresses mean nothing to the FX2, it starts at 0 */
+			break;
+		}
+	}
+	log_printf( ERR, "%s: no Intel HEX end of file record\n", filename);
+	return -1;
+}
+
+/* the present bytes as runs of consecutive addresses */
+static int firmware_segments(struct firmware_image *image, const uint8_t *present, const char *filename){
+uint32_t address = 0, start;
+
+	while (address < FIRMWARE_MAX_SIZE) {
+		if (!(present[address / 8] >> (address % 8) & 1)) {
+			address++;
+			continue;
+		}
+		for (start = address; address < FIRMWARE_MAX_SIZE && (present[address / 8] >> (address % 8) & 1); address++);
+		if (image->n_segments == FIRMWARE_MAX_SEGMENTS) {
+			log_printf( ERR, "%s: more than %u separate pieces of memory\n", filename, FIRMWARE_MAX_SEGMENTS);
+			return -1;
+		}
+		image->segments[image->n_segments].address = start;
+		image->segments[image->n_segments].length = address - start;
+		image->n_segments++;
+		image->size += address - start;
+	}
+	if (!image->size) {
+		log_printf( ERR, "%s: empty firmware image\n", filename);
+		return -1;
+	}
+	return 0;
+}
+
+const struct firmware_image *firmware_load(const char *filename){
+static uint8_t present[FIRMWARE_MAX_SIZE / 8];
+struct firmware_image *image;
+uint8_t *file;
+uint64_t hash;
+size_t size;
+FILE *f;
+
+	if (!filename || !(f = fopen(filename, "rb"))) {
+		log_printf( ERR, "Could not open the firmware %s: %s\n", filename ? filename : "", strerror(filename ? errno : ENOENT));
+		return NULL;
+	}
+	if (!(file = malloc(FIRMWARE_MAX_FILE + 1))) {
+		fclose(f);
+		return NULL;
+	}
+	size = fread(file, 1, FIRMWARE_MAX_FILE + 1, f);
+	fclose(f);
+	if (size > FIRMWARE_MAX_FILE) {
+		log_printf( ERR, "%s is too big to be firmware\n", filename);
+		free(file);
+		return NULL;
+	}
+
+	hash = firmware_hash(file, size);
+	for (image = firmware_cache; image; image = image->next) {
+		if (image->hash == hash) {
+			log_printf( DEBUG, "Firmware %s (%016llx) already parsed\n", filename, (unsigned long long)hash);
+			free(file);
+			return image;
+		}
+	}
+
+	if (!(image = calloc(1, sizeof(*image)))) {
+		free(file);
+		return NULL;
+	}
+	image->hash = hash;
+	memset(present, 0, sizeof(present));
+	image->ihex = size && file[0] == ':';
+	if (image->ihex) {
+		if (firmware_parse_ihex(image, present, (const char *)file, size, filename)) {
+			goto fail;
+		}
+	} else if (size > FIRMWARE_MAX_SIZE) {
+		log_printf( ERR, "%s: a binary image is at most 64 KB\n", filename);
+		goto fail;
+	} else {
+		memcpy(image->data, file, size);
+		memset(present, 0xff, size / 8);
+		if (size % 8) {
+			present[size / 8] = (1 << (size % 8)) - 1;
+		}
+	}
+	if (firmware_segments(image, present, filename)) {
+		goto fail;
+	}
+	free(file);
+	log_printf( DEBUG, "Firmware %s: %s, %zu bytes in %u pieces, %016llx\n", filename, image->ihex ? "Intel HEX" : "binary",
+		    image->size, image->n_segments, (unsigned long long)hash);
+	image->next = firmware_cache;
+	firmware_cache = image;
+	return image;
+fail:
+	free(file);
+	free(image);
+	return NULL;
+}
+
+bool firmware_window(const struct firmware_image *image, unsigned int n, uint16_t *address, size_t *length){
+size_t at, left;
+unsigned int i;
+
+	if (n >= FIRMWARE_IDENTITY_WINDOWS || (image->size <= FIRMWARE_IDENTITY_WINDOW && n > 0)) {
+		return false;
+	}
+	/* spread over the image's bytes, the last one ends at its end */
+	at = (image->size - 1) * n / (FIRMWARE_IDENTITY_WINDOWS - 1);
+	for (i = 0; i < image->n_segments && at >= image->segments[i].length; i++) {
+		at -= image->segments[i].length;
+	}
+	left = image->segments[i].length - at;
+	if (n == FIRMWARE_IDENTITY_WINDOWS - 1 && at + 1 >= FIRMWARE_IDENTITY_WINDOW) {
+		at = at + 1 - FIRMWARE_IDENTITY_WINDOW;
+		left = FIRMWARE_IDENTITY_WINDOW;
+	} else if (n == FIRMWARE_IDENTITY_WINDOWS - 1) {
+		left = at + 1;
+		at = 0;
+	}
+	*address = image->segments[i].address + at;
+	*length = left < FIRMWARE_IDENTITY_WINDOW ? left : FIRMWARE_IDENTITY_WINDOW;
+	return true;
+}
@@ -0,0 +1,54 @@
+// vim: sw=8:ts=8:noexpandtab
+#ifndef __FIRMWARE_H__
+#define __FIRMWARE_H__
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/*
+ * The FX2 firmware of a Logic. The file is either Intel HEX, like the fw.hex
+ * the README cuts out of the Saleae software, or the flat binary objcopy
+ * used to make of it, loaded at 0. The records end up as the contiguous runs
+ * of memory they cover, whatever order they come in, so an upload is one
+ * control transfer per FIRMWARE_MAX_WRITE bytes of each run instead of one
+ * per 16 byte record, and the gaps a binary is padded with are not sent.
+ *
+ * Images are parsed once per process and cached by the FNV-1a hash of the
+ * file's contents: the devices of a multi device run share one, and a file
+ * changed on disk is parsed again.
+ *
+ * firmware_window() gives a few spread out pieces of an image. The USB core
+ * of the FX2 answers the 0xa0 request the upload writes with whatever
+ * firmware runs, so reading those pieces back tells whether a Logic already
+ * runs this image (see ezusb_firmware_matches()); code does not change once
+ * loaded, a window that landed on data only costs a needless upload.
+ */
+
+#define FIRMWARE_MAX_SIZE 0x10000	/* the 8051's 16 bit address space */
+#define FIRMWARE_MAX_FILE (1024 * 1024)
+#define FIRMWARE_MAX_SEGMENTS 256
+#define FIRMWARE_MAX_WRITE 4096	/* usbfs takes up to a page per control transfer */
+#define FIRMWARE_IDENTITY_WINDOWS 4
+#define FIRMWARE_IDENTITY_WINDOW 64	/* bytes read back per window */
+
+struct firmware_segment {
+	uint16_t			address;
+	uint32_t			length;
+};
+
+struct firmware_image {
+	uint64_t			hash;		/* of the file's contents */
+	bool				ihex;
+	uint8_t				data[FIRMWARE_MAX_SIZE];
+	struct firmware_segment		segments[FIRMWARE_MAX_SEGMENTS];
+	unsigned int			n_segments;
+	size_t				size;		/* bytes in the segments */
+	struct firmware_image		*next;
+};
+
+/* the image in 'filename', parsed or from the cache; NULL (logged) if it cannot be read */
+const struct firmware_image *firmware_load(const char *filename);
+/* window 'n' of FIRMWARE_IDENTITY_WINDOWS, false past the last one a small image has */
+bool firmware_window(const struct firmware_image *image, unsigned int n, uint16_t *address, size_t *length);
+
+#endif
@@ -0,0 +1,106 @@
+// vim: sw=8:ts=8:noexpandtab
+/*
+ * I2C. SDA falling while SCL is high is a start (or a repeated one), SDA
+ * rising while SCL is high a stop; anything else only counts on a rising
+ * SCL edge. The first byte after a start is the 7 bit address and the
+ * read bit, the ninth bit of every byte is the acknowledge. 10 bit
+ * addresses come out as an address and a data byte.
+ */
+#include "decode.h"
+#include "log.h"
+
+#include <string.h>
+
+static int i2c_init(struct decoder *d, char *options){
+struct i2c_decoder *c = &d->i2c;
+char *opt, *value, *save = NULL;
+int scl = -1, sda = -1;
+
+	memset(c, 0, sizeof(*c));
+	for (opt = strtok_r(options, ",", &save); opt; opt = strtok_r(NULL, ",", &save)) {
+		value = strchr(opt, '=');
+		if (value) {
+			*value++ = '\0';
+		}
+		if (strcmp(opt, "scl") == 0 && value) {
+			scl = decode_channel(value);
+		} else if (strcmp(opt, "sda") == 0 && value) {
+			sda = decode_channel(value);
+		} else {
+			log_printf( ERR, "i2c: bad option '%s'\n", opt);
+			return -1;
+		}
+	}
+	if (scl < 0 || sda < 0 || scl == sda) {
+		log_printf( ERR, "i2c: needs scl=<channel> and sda=<channel>\n");
+		return -1;
+	}
+	c->scl = scl;
+	c->sda = sda;
+	return 0;
+}
+
+static void i2c_reset(struct decoder *d){
+	d->i2c.state = I2C_IDLE;
+	d->i2c.bit = 0;
+	d->i2c.byte = 0;
+}
+
+static void i2c_sample(struct decoder *d, uint8_t sample, uint64_t at){
+struct i2c_decoder *c = &d->i2c;
+uint8_t scl = (sample >> c->scl) & 1, sda = (sample >> c->sda) & 1;
+uint8_t prev_scl = (c->prev >> c->scl) & 1, prev_sda = (c->prev >> c->sda) & 1;
+
+	c->prev = sample;
+	if (scl && prev_scl && sda != prev_sda) {
+		i2c_reset(d);
+		if (!sda) {
+			c->state = I2C_ADDRESS;
+		}
+		decode_emit(d, sda ? DECODE_STOP : DECODE_START, at, at, 0, 0, 0);
+		return;
+	}
+	if (!scl || prev_scl || c->state == I2C_IDLE) {
+		return;
+	}
+	if (c->bit < 8) {
+		if (!c->bit) {
+			c->byte_start = at;
+		}
+		c->byte = (c->byte << 1) | sda;
+		c->bit++;
+		return;
+	}
+	if (c->state == I2C_ADDRESS) {
+		decode_emit(d, DECODE_ADDRESS, c->byte_start, at, c->byte >> 1, 0,
+			    (c->byte & 1 ? DECODE_FLAG_READ : 0) | (sda ? DECODE_FLAG_NACK : 0));
+		c->state = I2C_DATA;
+	} else {
+		decode_emit(d, DECODE_DATA, c->byte_start, at, c->byte, 0, sda ? DECODE_FLAG_NACK : 0);
+	}
+	c->bit = 0;
+	c->byte = 0;
+}
+
+static void i2c_feed(struct decoder *d, const uint8_t *p, size_t n, uint64_t base){
+struct i2c_decoder *c = &d->i2c;
+uint8_t mask = (1 << c->scl) | (1 << c->sda);
+size_t i;
+
+	if (!d->started) {
+		/* after a gap the next start gets it going again */
+		c->prev = p[0];
+	}
+	for (i = 0; i < n; i++) {
+		if ((p[i] ^ c->prev) & mask) {
+			i2c_sample(d, p[i], base + i);
+		}
+	}
+}
+
+const struct decoder_type i2c_decoder_type = {
+	.name = "i2c",
+	.init = i2c_init,
+	.feed = i2c_feed,
+	.reset = i2c_reset,
+};
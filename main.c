@@ -4,7 +4,10 @@
 #include "log.h"
 #include "main.h"
 #include "ezusb.h"
+#include "output.h"
+#include "blockz.h"
 #include <assert.h>
+#include <errno.h>
 #include <libusb.h>
 #include <stdarg.h>
 #include <stdbool.h>
@@ -13,11 +16,26 @@
 #include <string.h>
 #include <unistd.h>
 #include <signal.h>
+#include <time.h>
 
 /* Command line arguments */
 
 int user_forced_shutdown = 0;
 char *outputfilename = "saleae_output.bin";
+char *tracefilename = NULL;
+long pre_trigger = -1;
+char *ring_size = NULL;
+char *segment_size = NULL;
+char *tindexfilename = NULL;
+char *decodefilename = NULL;
+char *shmname = NULL;
+uint8_t pack_mask = 0;
+char *device_specs[SLOGIC_MAX_DEVICES];
+unsigned int n_devices = 0;
+static struct slogic_ctx *signal_handles[SLOGIC_MAX_DEVICES];
+static unsigned int n_signal_handles = 0;
+static uint64_t startup_ns;
+static uint64_t firmware_ns[SLOGIC_MAX_DEVICES];	/* spent on the upload and the device coming back */
 
 
 void short_usage(int argc, char **argv,const char *message, ...){
@@ -33,12 +51,15 @@ va_list ap;
 
 void full_usage(int argc, char **argv){
 const struct slogic_sample_rate *sample_iterator = slogic_get_sample_rates();
+const struct slogic_output_format *format_iterator = slogic_get_output_formats();
+const struct slogic_transport *transport_iterator = slogic_get_transports();
 
 	printf( "usage: %s -f <output file> -r <sample rate> [-n <number of samples>]\n", argv[0]);
 	printf( "\n");
 	printf( " -n: Number of samples to record\n");
 	printf( "     Defaults to one second of samples for the specified sample rate\n");
-	printf( " -f: The output file. Using '-' means that the bytes will be output to stdout.\n");
+	printf( " -f: The output file. Using '-' means that the bytes will be output to stdout,\n"
+		"     uncompressed (-F pipe) unless the format is zlib or rle.\n");
 	printf( " -h: This help message.\n");
 	printf( " -r: Select sample rate for the Logic.\n");
 	printf( "     Available sample rates:\n");
@@ -46,25 +67,95 @@ const struct slogic_sample_rate *sample_iterator = slogic_get_sample_rates();
 		printf( "      o %s\n", sample_iterator->text);
 		sample_iterator++;
 	}
+	printf( " -F: Output format, <name>[:<options>]. Defaults to '%s'.\n", DEFAULT_OUTPUT_FORMAT);
+	printf( "     Available output formats:\n");
+	while (format_iterator->name != NULL) {
+		printf( "      o %-8s %s\n", format_iterator->name, format_iterator->text);
+		format_iterator++;
+	}
+	printf( " -z: Compression level: 0 to 9. Defaults to '%d'.\n", SLOGIC_COMPRESS_LEVEL);
+	printf( " -T: Trigger, only the samples around it are written. <stage>[;<stage>...] where\n");
+	printf( "     a stage is <channel>=<0|1|r|f|e>[,...] and/or mask=<bits>,value=<bits>, see trigger.h.\n");
+	printf( " -p: Samples to keep from before the trigger, part of -n. Defaults to a tenth of -n.\n");
+	printf( " -R: Capture continuously into a ring of this many samples (k, M, G) or this long\n");
+	printf( "     (s, ms, us) and write it out on a stop event: the trigger, SIGINT or SIGUSR1,\n");
+	printf( "     or -n samples if given. Captures for as long as it takes otherwise.\n");
+	printf( " -c: Capture until SIGINT or SIGUSR1 (or -n samples) into <file>.000000, <file>.000001, ...\n");
+	printf( "     with a .hdr file each; a new segment every this many samples (k, M, G) or this long\n");
+	printf( "     (s, min, h).\n");
+	printf( " -X: Write a transition index of the output to this file, see tindex.h and tquery.\n");
+	printf( " -D: Decode a protocol as it is captured, can be given more than once, see decode.h:\n");
+	printf( "     uart:rx=<ch>,baud=<n>  spi:clk=<ch>,mosi=<ch>,miso=<ch>,cs=<ch>  i2c:scl=<ch>,sda=<ch>\n");
+	printf( " -O: Where the decoded frames go, [text:|bin:]<file>. Defaults to text on stdout.\n");
+	printf( " -m: Only write the channels in this mask (0x03, 5), packed to 1, 2 or 4 bits per sample.\n");
+	printf( "     At most %d channels, see pack.h.\n", PACK_MAX_CHANNELS);
+	printf( " -j: Number of compression worker threads for 'blockz'. Defaults to '%d'.\n", BLOCKZ_DEFAULT_WORKERS);
 	printf( "\n");
 	printf( "Advanced options:\n");
-	printf( " -b: Transfer buffer size.\n");
-	printf( " -t: Number of transfer buffers.\n");
+	printf( " -b: Transfer buffer size, rounded up to whole usb packets. Defaults to %d packets.\n", DEFAULT_TRANSFER_PACKETS);
+	printf( "     'auto' sizes transfers for the sample rate.\n");
+	printf( " -t: Number of transfer buffers. Defaults to '%d'.\n", DEFAULT_N_TRANSFER_BUFFERS);
+	printf( "     'auto' picks the number kept in flight from the sample rate and\n");
+	printf( "     adjusts it while capturing, the choice is logged at -d 3.\n");
 	printf( " -o: Transfer timeout.\n");
+	printf( " -i: Input device, <name>[:<options>]. Defaults to '%s'. Given more than once, all of\n", DEFAULT_TRANSPORT);
+	printf( "     them capture at once into <file>.0, <file>.1, ... (up to %d).\n", SLOGIC_MAX_DEVICES);
+	while (transport_iterator->name != NULL) {
+		printf( "      o %-8s %s\n", transport_iterator->name, transport_iterator->text);
+		transport_iterator++;
+	}
+	printf( " -P: Record the submit and completion time of every transfer and write them\n");
+	printf( "     to this file, with latency histograms in the log (-d 3).\n");
+	printf( " -S: Publish the transfers live in the POSIX shared memory object /<name> (/<name>.<n>\n");
+	printf( "     with several devices) for other processes, see sshm.\n");
+	printf( " -E: rt[:prio=<1..99>][,cpu=<n>][,nolock]: Handle the usb events on a thread of their\n");
+	printf( "     own at SCHED_FIFO priority (default %d), on that cpu, with memory locked.\n", EVTHREAD_DEFAULT_PRIORITY);
 	printf( " -u: libusb debug level: 0 to 3, 3 is most verbose. Defaults to '0'.\n");
 	printf( " -d: log level: 0 to 5, 5 is most verbose. Defaults to '1'.\n");
 	printf( "\n");
 }
 
+/* samples with an optional k, M or G, or a duration in h, min, s, ms or us at 'rate'; 0 if invalid */
+static size_t parse_length(const char *arg, unsigned int rate){
+char *endptr;
+double n = strtod(arg, &endptr);
+
+	if (endptr == arg || n <= 0) {
+		return 0;
+	}
+	if (strcmp(endptr, "k") == 0) {
+		n *= 1e3;
+	} else if (strcmp(endptr, "M") == 0) {
+		n *= 1e6;
+	} else if (strcmp(endptr, "G") == 0) {
+		n *= 1e9;
+	} else if (strcmp(endptr, "h") == 0) {
+		n *= 3600.0 * rate;
+	} else if (strcmp(endptr, "min") == 0) {
+		n *= 60.0 * rate;
+	} else if (strcmp(endptr, "s") == 0) {
+		n *= rate;
+	} else if (strcmp(endptr, "ms") == 0) {
+		n *= rate / 1e3;
+	} else if (strcmp(endptr, "us") == 0) {
+		n *= rate / 1e6;
+	} else if (*endptr != '\0') {
+		return 0;
+	}
+	return n >= 1 && n <= SIZE_MAX ? (size_t)n : 0;
+}
+
 /* Returns true if everything was OK */
 bool parse_args(int argc, char **argv, struct slogic_ctx *handle){
 char c;
 int libusb_debug_level = 0;
 char *endptr;
+struct slogic_output_format *format;
 	
 	optind = 1; //reset incase i need to reparse
+	n_devices = 0;
 	/* TODO: Add a -d flag to turn on internal debugging */
-	while ((c = getopt(argc, argv, "n:f:r:hb:t:o:u:d:s:")) != -1) {
+	while ((c = getopt(argc, argv, "n:f:r:hb:t:o:u:d:s:F:z:j:i:P:T:p:R:c:X:D:O:m:E:S:")) != -1) {
 		switch (c) {
 		case 'n':
 			handle->n_samples_requested = strtol(optarg, &endptr, 10);
@@ -82,6 +173,104 @@ char *endptr;
 			outputfilename = optarg;
 			break;
 
+		case 'F':
+			if (!(format = slogic_parse_output_format(optarg))) {
+				short_usage(argc,argv,"Invalid output format: %s", optarg);
+				return false;
+			}
+			slogic_set_output_format(handle, format);
+			handle->output_args = slogic_output_args(optarg);
+			break;
+
+		case 'z':
+			handle->compress_level = strtol(optarg, &endptr, 10);
+			if (*endptr != '\0' || handle->compress_level < 0 || handle->compress_level > 9) {
+				short_usage(argc,argv,"Invalid compression level, must be between 0 and 9: %s", optarg);
+				return false;
+			}
+			break;
+
+		case 'j':
+			handle->n_compress_workers = strtol(optarg, &endptr, 10);
+			if (*endptr != '\0' || handle->n_compress_workers < 1 || handle->n_compress_workers > BLOCKZ_MAX_WORKERS) {
+				short_usage(argc,argv,"Invalid number of compression workers, must be between 1 and %d: %s",
+					    BLOCKZ_MAX_WORKERS, optarg);
+				return false;
+			}
+			break;
+
+		case 'i':
+			if (slogic_set_transport(handle, optarg)) {
+				short_usage(argc,argv,"Invalid input device: %s", optarg);
+				return false;
+			}
+			if (n_devices == SLOGIC_MAX_DEVICES) {
+				short_usage(argc,argv,"At most %d input devices", SLOGIC_MAX_DEVICES);
+				return false;
+			}
+			device_specs[n_devices++] = optarg;
+			break;
+
+		case 'T':
+			if (slogic_trigger_parse(&handle->trigger, optarg)) {
+				short_usage(argc,argv,"Invalid trigger: %s", optarg);
+				return false;
+			}
+			break;
+
+		case 'p':
+			pre_trigger = strtol(optarg, &endptr, 10);
+			if (*endptr != '\0' || pre_trigger < 0) {
+				short_usage(argc,argv,"Invalid number of pre trigger samples: %s", optarg);
+				return false;
+			}
+			break;
+
+		case 'P':
+			tracefilename = optarg;
+			break;
+
+		case 'S':
+			shmname = optarg;
+			break;
+
+		case 'E':
+			if (slogic_evthread_parse(&handle->evthread, optarg)) {
+				short_usage(argc, argv, "Invalid event thread options: %s", optarg);
+				return false;
+			}
+			break;
+
+		case 'R':
+			ring_size = optarg;
+			break;
+
+		case 'c':
+			segment_size = optarg;
+			break;
+
+		case 'X':
+			tindexfilename = optarg;
+			break;
+
+		case 'D':
+			if (decode_add(&handle->decode, optarg)) {
+				short_usage(argc,argv,"Invalid decoder: %s", optarg);
+				return false;
+			}
+			break;
+
+		case 'O':
+			decodefilename = optarg;
+			break;
+
+		case 'm':
+			if (!(pack_mask = pack_parse_mask(optarg))) {
+				short_usage(argc,argv,"Invalid channel mask, 1 to %d channels: %s", PACK_MAX_CHANNELS, optarg);
+				return false;
+			}
+			break;
+
 		case 'r':
 			handle->sample_rate = slogic_parse_sample_rate(optarg);
 			if (!handle->sample_rate) {
@@ -95,6 +284,10 @@ char *endptr;
 			return false;
 				
 		case 'b':
+			if (strcmp(optarg, "auto") == 0) {
+				handle->autotune.size = true;
+				break;
+			}
 			handle->transfer_buffer_size = strtol(optarg, &endptr, 10);
 			if (*endptr != '\0' || handle->transfer_buffer_size <= 0) {
 				short_usage(argc,argv,"Invalid transfer buffer size, must be a positive integer: %s", optarg);
@@ -104,6 +297,10 @@ char *endptr;
 			
 				
 		case 't':
+			if (strcmp(optarg, "auto") == 0) {
+				handle->autotune.depth = true;
+				break;
+			}
 			handle->n_transfer_buffers = strtol(optarg, &endptr, 10);
 			if (*endptr != '\0' || handle->n_transfer_buffers <= 0) {
 				short_usage(argc,argv,"Invalid transfer buffer count, must be a positive integer: %s", optarg);
@@ -150,163 +347,328 @@ char *endptr;
 		return false;
 	}
 
+	/* blockz, raw and uring seek in or map their file, stdout gets the samples as they come */
+	if (strcmp(outputfilename, "-") == 0 && !handle->output_format->stdout_ok) {
+		log_printf( NOTICE, "%s cannot write to stdout, using -F pipe\n", handle->output_format->name);
+		slogic_set_output_format(handle, slogic_parse_output_format("pipe"));
+		handle->output_args = "";
+	}
+
 	if (!handle->sample_rate) {
 		short_usage(argc,argv,"A sample rate has to be specified.", optarg);
 		return false;
 	}
 
+	if (segment_size) {
+		if (ring_size || slogic_trigger_enabled(&handle->trigger)) {
+			short_usage(argc,argv,"-c cannot be combined with -R or -T");
+			return false;
+		}
+		/* -n becomes a stop event, the output is opened for one segment at a time */
+		handle->rotate.stop_after = handle->n_samples_requested;
+		handle->rotate.segment = parse_length(segment_size, handle->sample_rate->samples_per_second);
+		if (!handle->rotate.segment) {
+			short_usage(argc,argv,"Invalid segment size: %s", segment_size);
+			return false;
+		}
+		handle->n_samples_requested = handle->rotate.segment;
+	}
+
+	if (ring_size) {
+		handle->trigger.continuous = true;
+		/* -n becomes a stop event, the output only ever gets the ring */
+		handle->trigger.stop_after = handle->n_samples_requested;
+		handle->n_samples_requested = parse_length(ring_size, handle->sample_rate->samples_per_second);
+		if (!handle->n_samples_requested) {
+			short_usage(argc,argv,"Invalid ring size: %s", ring_size);
+			return false;
+		}
+		pre_trigger = handle->n_samples_requested;
+	}
+
 	if (!handle->n_samples_requested) {
 		handle->n_samples_requested = handle->sample_rate->samples_per_second;
 	}
 
+	if (pre_trigger < 0) {
+		pre_trigger = handle->n_samples_requested / DEFAULT_PRE_TRIGGER_DIVISOR;
+	} else if (pre_trigger > handle->n_samples_requested) {
+		pre_trigger = handle->n_samples_requested;
+	}
+
 	return true;
 }
 
 
 
 
-struct callback_test{
-	FILE * file;
-	char * filename;
-	
-};
+void ctrl_c_handler(int sig){
+struct slogic_ctx *handle;
+unsigned int i;
+
+	for (i = 0; i < n_signal_handles; i++) {
+		handle = signal_handles[i];
+		/* with a ring or trigger the writer thread ends the capture once the ring is out */
+		if (slogic_trigger_enabled(&handle->trigger)) {
+			slogic_trigger_stop(handle);
+		} else if (slogic_rotate_enabled(&handle->rotate)) {
+			slogic_rotate_stop(handle);
+		} else {
+			handle->recording_state = ABORT;
+		}
+	}
+}
 
-int data_callback_open(struct slogic_ctx *handle,char * openstring){
-struct callback_test *foo;
-	
-	handle->data_callback_opts = calloc(1,sizeof(struct callback_test));
-	foo = handle->data_callback_opts;
-	foo->filename = openstring;
+/* with several devices every file gets the device number appended */
+static char *device_filename(char *name, unsigned int index){
+char *numbered;
+size_t len;
 
-	handle->strm.zalloc = Z_NULL;
-	handle->strm.zfree = Z_NULL;
-	handle->strm.opaque = Z_NULL;
-    	if(deflateInit(&handle->strm, SLOGIC_COMPRESS_LEVEL) != Z_OK){
-		return -1;
+	if (n_devices < 2 || !name || strcmp(name, "-") == 0) {
+		return name;
 	}
+	len = strlen(name) + 16;
+	numbered = malloc(len);
+	assert(numbered);
+	snprintf(numbered, len, "%s.%u", name, index);
+	return numbered;
+}
 
-	if((foo->file = fopen(foo->filename,"wb")) == 0){
-		free(foo);
-		return 0;
+/* the how manyth device of its transport it is, "-i sim -i usb -i sim" makes the second sim #1 */
+static unsigned int device_ordinal(unsigned int index){
+unsigned int i, ordinal = 0;
+size_t len = strcspn(device_specs[index], ":");
+
+	for (i = 0; i < index; i++) {
+		if (strcspn(device_specs[i], ":") == len && strncmp(device_specs[i], device_specs[index], len) == 0) {
+			ordinal++;
+		}
 	}
-	return 1;
+	return ordinal;
 }
 
-size_t data_callback_write(struct slogic_ctx *handle, uint8_t * data, size_t size){
-struct callback_test *foo = handle->data_callback_opts;
-unsigned int have;
-char * out;
-int ret;
-
-	if(!(out = malloc(size + 1024))){
-		perror("data_callbac_write");
-		exit(0); 
-	}
-	assert(out);
-	handle->strm.avail_in = size;
-	handle->strm.next_in = data;
-	do {
-            handle->strm.avail_out = (unsigned int)CHUNK;
-            handle->strm.next_out = out;
-            ret = deflate(&handle->strm, Z_NO_FLUSH);    /* no bad return value */
-            assert(ret != Z_STREAM_ERROR);  /* state not clobbered */
-            have = CHUNK - handle->strm.avail_out;
-            if (fwrite(out, 1, have, foo->file) != have || ferror(foo->file)) {
-                (void)deflateEnd(&handle->strm);
-                return Z_ERRNO;
-            }
-        } while(handle->strm.avail_out == 0);
-
-	free(out);
-	return size;
-
-//	return fwrite(data,1,size,foo->file);	
+static struct slogic_ctx *open_logic(int argc, char **argv, struct slogic_ctx *first, unsigned int index){
+struct slogic_ctx *handle;
+uint64_t upload_start;
+long cpus;
 
-}
+	handle = first ? slogic_init_shared(first->usb_context) : slogic_init();
+	if (!handle) {
+		log_printf( INFO, "Failed initialize logic\n");
+		exit(42);
+	}
 
-void data_callback_close(struct slogic_ctx *handle){
-struct callback_test *foo = handle->data_callback_opts;
+	//defaults 
+	handle->fwfile = "saleae-logic.firmware";
+	current_log_level = INFO;
 	
+	slogic_set_output_format(handle, slogic_parse_output_format(DEFAULT_OUTPUT_FORMAT));
 
-	deflateEnd(&handle->strm);
-	fclose(foo->file);
-	free(foo);
-	handle->data_callback_opts = 0;
-	return ;
-}
-
-void ctrl_c_handler(int sig){
-//FIXME i dont yet have a program based struct which can handle the ctrlc	
-}
+	if (!parse_args(argc, argv, handle)) {
+		exit(EXIT_FAILURE);
+	}
 
+	if (n_devices > 1) {
+		slogic_set_transport(handle, device_specs[index]);
+		handle->logic_index = device_ordinal(index);
+		/* the writers get a core each, the first one is left to the event thread */
+		cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		handle->pipeline.cpu = cpus > 1 ? (int)(1 + index % (cpus - 1)) : -1;
+	}
 
+	if (shmname && slogic_shm_set_name(handle, device_filename(shmname, index))) {
+		short_usage(argc, argv, "Invalid shared memory name: %s", shmname);
+		exit(EXIT_FAILURE);
+	}
 
-int main(int argc, char **argv){
-struct slogic_ctx *handle = NULL;
+	if (slogic_open(handle,handle->logic_index) != 0) {
+		log_printf( INFO, "Failed to open the logic analyzer %s\n", n_devices > 1 ? device_specs[index] : "");
+		exit(EXIT_FAILURE);
+	}
 	
-	do{
-		if(handle){
-			sleep(2);
-			slogic_close(handle); //we must be retrying for a reason..
-		}
-		handle = slogic_init();
-		
-		//defaults 
-		handle->fwfile = "saleae-logic.firmware";
-		current_log_level = INFO;
-		handle->data_callback_open = data_callback_open;
-		handle->data_callback_write = data_callback_write;
-		handle->data_callback_close= data_callback_close;
-		
-		if (!handle) {
-			log_printf( INFO, "Failed initialize logic\n");
-			exit(42);
-		}
-
-		if (!parse_args(argc, argv, handle)) {
+	/* the device comes back under a new address, slogic_upload_firmware() waits for it on the same context */
+	if (!handle->firmware_uploaded) {
+		log_printf( INFO, "Uploading the firmware\n");
+		upload_start = slogic_trace_now();
+		if (slogic_upload_firmware(handle)) {
+			log_printf( ERR, "Failed to bring up the firmware %s\n", n_devices > 1 ? device_specs[index] : "");
 			exit(EXIT_FAILURE);
 		}
+		firmware_ns[index] = slogic_trace_now() - upload_start;
+	}
+	handle->recording_state = INITALIZED;
+	return handle;
+}
 
-		if (slogic_open(handle,handle->logic_index) != 0) {
-			log_printf( INFO, "Failed to open the logic analyzer\n");
-			exit(EXIT_FAILURE);
-		}
-		
-		if (!slogic_is_firmware_uploaded(handle)) {
-			log_printf( INFO, "Uploading the firmware\n");
-			ezusb_upload_firmware(handle,1 ,handle->fwfile);
-			//libusb_reset_device(handle->dev);
-		}else{
-			handle->recording_state = INITALIZED;
-		}
-	}while(handle->recording_state != INITALIZED);
-
-	handle->transfer_buffer_size = libusb_get_max_packet_size (handle->dev, SALEAE_STREAMING_DATA_IN_ENDPOINT) * 8;
+static void arm_device(struct slogic_ctx *handle, unsigned int index){
+char *filename = device_filename(outputfilename, index);
 
-	signal(SIGINT,&ctrl_c_handler);
-	
-	log_printf( DEBUG, "Transfer buffers:     %d\n", handle->n_transfer_buffers);
+	log_printf( DEBUG, "Transfer buffers:     %d (%u in flight)\n", handle->n_transfer_buffers, slogic_autotune_in_flight(handle));
 	log_printf( DEBUG, "Transfer buffer size: %zu\n", handle->transfer_buffer_size);
 	log_printf( DEBUG, "Transfer timeout:     %u\n", handle->transfer_timeout);
 	log_printf( DEBUG, "sample rate:     %u\n", handle->sample_rate->samples_per_second);
-	log_printf( INFO, "Begin Capture\n");
 
-	if(!handle->data_callback_open(handle,outputfilename)){
-		perror("in callback open()");
+	if (tracefilename && slogic_trace_open(handle, device_filename(tracefilename, index), DEFAULT_TRACE_DEPTH)) {
+		exit(EXIT_FAILURE);
 	}
 
-	//slogic_set_capture(handle);
-	slogic_execute_recording(handle);
-	
+	if (pack_mask && slogic_pack_arm(handle, pack_mask)) {
+		exit(EXIT_FAILURE);
+	}
+
+	if (tindexfilename && slogic_tindex_arm(handle, device_filename(tindexfilename, index))) {
+		exit(EXIT_FAILURE);
+	}
+
+	if (slogic_decode_enabled(&handle->decode) &&
+	    slogic_decode_arm(handle, device_filename(decodefilename, index))) {
+		exit(EXIT_FAILURE);
+	}
+
+	errno = 0;
+	if (slogic_rotate_enabled(&handle->rotate)) {
+		if (slogic_rotate_arm(handle, filename)) {
+			exit(EXIT_FAILURE);
+		}
+	} else if(!handle->data_callback_open(handle,filename)){
+		/* the writer thread has nothing to write to, there is no point in capturing */
+		log_printf( ERR, "Failed to open %s as %s%s%s\n", filename, handle->output_format->name,
+			    errno ? ": " : "", errno ? strerror(errno) : "");
+		exit(EXIT_FAILURE);
+	}
+
+	if (slogic_trigger_enabled(&handle->trigger) && slogic_trigger_arm(handle, pre_trigger,
+							handle->trigger.continuous ? 0 : handle->n_samples_requested - pre_trigger)) {
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void disarm_device(struct slogic_ctx *handle){
+	if (slogic_trigger_enabled(&handle->trigger)) {
+		slogic_trigger_disarm(handle);
+	}
 	
-	handle->data_callback_close(handle);
+	if (slogic_rotate_enabled(&handle->rotate)) {
+		slogic_rotate_disarm(handle);
+	} else {
+		handle->data_callback_close(handle);
+	}
+	if (slogic_decode_enabled(&handle->decode)) {
+		slogic_decode_disarm(handle);
+	}
+	if (slogic_tindex_enabled(&handle->tindex)) {
+		slogic_tindex_disarm(handle);
+	}
+	if (slogic_pack_enabled(&handle->pack)) {
+		slogic_pack_disarm(handle);
+	}
+}
+
+/* <file>.time, for smerge to put the devices' captures on one timeline */
+static void write_timing(struct slogic_ctx *handle, unsigned int index){
+char *filename = device_filename(outputfilename, index), *timingname;
+size_t len;
+
+	if (!filename || strcmp(filename, "-") == 0) {
+		return;
+	}
+	/* the file has to hold the samples from the start command on */
+	if (slogic_trigger_enabled(&handle->trigger) || slogic_rotate_enabled(&handle->rotate)) {
+		log_printf( NOTICE, "%s: no timing with a trigger or ring, the capture does not start at the start command\n", filename);
+		return;
+	}
+	len = strlen(filename) + sizeof(".time");
+	timingname = malloc(len);
+	assert(timingname);
+	snprintf(timingname, len, "%s.time", filename);
+	slogic_timing_write(handle, timingname);
+	free(timingname);
+}
 
+static void report_device(struct slogic_ctx *handle, unsigned int index, double elapsed){
+	if (n_devices > 1) {
+		log_printf( NOTICE, "Device %u (%s): %.1f MB/s\n", index, device_specs[index],
+			    handle->pipeline.bytes_written / elapsed / 1e6);
+	}
+	if (handle->timing.first_completion_ns) {
+		log_printf( NOTICE, "Time to first sample: %.1f ms (firmware %.1f ms, start command to first transfer %.1f ms)\n",
+			    (handle->timing.first_completion_ns - startup_ns) / 1e6, firmware_ns[index] / 1e6,
+			    (handle->timing.first_completion_ns - handle->timing.command_ns) / 1e6);
+	}
 	log_printf( INFO, "Capture finished with exit code %d\n",handle->recording_state);
-	log_printf( NOTICE , "Total number of samples requested: %i\n", handle->n_samples_requested);
-	log_printf( NOTICE, "Total number of samples read: %i\n", handle->n_samples_fulfilled);
+	log_printf( NOTICE , "Total number of samples requested: %zu\n", handle->n_samples_requested);
+	log_printf( NOTICE, "Total number of samples read: %zu\n", handle->n_samples_fulfilled);
 	log_printf( NOTICE, "Total number of transfers: %i\n", handle->transfer_counter);
+	slogic_pipeline_report(handle);
+	slogic_autotune_report(handle);
+	slogic_evthread_report(handle);
+	slogic_shm_report(handle);
+	slogic_trace_close(handle);
+}
+
 
-	slogic_close(handle);
 
-	exit(EXIT_SUCCESS);
+int main(int argc, char **argv){
+struct slogic_ctx *handles[SLOGIC_MAX_DEVICES];
+struct timespec t0, t1;
+unsigned long long bytes = 0, dropped = 0;
+unsigned int i, n;
+double elapsed;
+int failed;
+
+	startup_ns = slogic_trace_now();
+	handles[0] = open_logic(argc, argv, NULL, 0);
+	n = n_devices > 1 ? n_devices : 1;
+	/* one libusb context, and so one event thread, for all of them */
+	for (i = 1; i < n; i++) {
+		handles[i] = open_logic(argc, argv, handles[0], i);
+	}
+
+	for (i = 0; i < n; i++) {
+		signal_handles[i] = handles[i];
+	}
+	n_signal_handles = n;
+	signal(SIGINT,&ctrl_c_handler);
+	signal(SIGUSR1,&ctrl_c_handler);
+	
+	for (i = 0; i < n; i++) {
+		arm_device(handles[i], i);
+	}
+	log_printf( INFO, "Begin Capture\n");
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	//slogic_set_capture(handle);
+	if (n == 1) {
+		failed = slogic_execute_recording(handles[0]);
+	} else {
+		failed = slogic_execute_recordings(handles, n);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	elapsed = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+	for (i = 0; i < n; i++) {
+		disarm_device(handles[i]);
+		if (n > 1) {
+			write_timing(handles[i], i);
+		}
+		report_device(handles[i], i, elapsed);
+		/* an output that could not write its tail fails in its close() */
+		if (handles[i]->pipeline.output_failed) {
+			failed = 1;
+		}
+		bytes += handles[i]->pipeline.bytes_written;
+		dropped += handles[i]->pipeline.dropped;
+	}
+	if (n > 1) {
+		log_printf( NOTICE, "All %u devices: %llu bytes in %.3fs, %.1f MB/s, %llu bytes dropped%s\n", n, bytes,
+			    elapsed, bytes / elapsed / 1e6, dropped, failed ? ", not all of them completed" : "");
+	}
+
+	/* the first handle owns the shared libusb context */
+	n_signal_handles = 0;
+	for (i = n; i-- > 0;) {
+		slogic_close(handles[i]);
+	}
+
+	exit(failed ? EXIT_FAILURE : EXIT_SUCCESS);
 }
@@ -0,0 +1,148 @@
+// vim: sw=8:ts=8:noexpandtab
+#include "output.h"
+#include "slogic.h"
+#include "blockz.h"
+#include "rle.h"
+#include "raw.h"
+#include "uring.h"
+#include "pipe.h"
+#include "log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct slogic_output_format output_formats[] = {
+	{"zlib", "single deflate stream, no header", zlib_callback_open, zlib_callback_write, zlib_callback_close,
+	 NULL, NULL, true},
+	{"blockz", "parallel block deflate with a header and seek index (default)", blockz_callback_open, blockz_callback_write,
+	 blockz_callback_close},
+	{"rle", "run length encoded transitions, fastest", rle_callback_open, rle_callback_write, rle_callback_close,
+	 NULL, NULL, true},
+	{"raw", "uncompressed, transfers land in a preallocated mapped file", raw_callback_open, raw_callback_write,
+	 raw_callback_close, raw_callback_buffer},
+	{"uring", "uncompressed, batched asynchronous writes (uring:direct for O_DIRECT, see uring.h)",
+	 uring_callback_open, uring_callback_write, uring_callback_close},
+	{"pipe", "uncompressed to stdout or a fifo, vmsplice()d without a copy (pipe:copy to copy, see pipe.h)",
+	 pipe_callback_open, pipe_callback_write, pipe_callback_close, NULL, pipe_callback_take, true},
+	{NULL, NULL, NULL, NULL, NULL, NULL, NULL, false},
+};
+
+struct slogic_output_format *slogic_get_output_formats(){
+	return output_formats;
+}
+
+/* "name[:args]", the args are for the format's open(), see slogic_output_args() */
+struct slogic_output_format *slogic_parse_output_format(const char *str){
+	struct slogic_output_format *format = slogic_get_output_formats();
+	const char *args = strchr(str, ':');
+	size_t len = args ? (size_t)(args - str) : strlen(str);
+	while (format->name != NULL) {
+		if (strlen(format->name) == len && strncmp(format->name, str, len) == 0) {
+			return format;
+		}
+		format++;
+	}
+	return NULL;
+}
+
+const char *slogic_output_args(const char *str){
+	const char *args = strchr(str, ':');
+	return args ? args + 1 : "";
+}
+
+void slogic_set_output_format(struct slogic_ctx *handle, struct slogic_output_format *format){
+	handle->output_format = format;
+	handle->data_callback_open = format->open;
+	handle->data_callback_write = format->write;
+	handle->data_callback_close = format->close;
+	handle->data_callback_buffer = format->buffer;
+}
+
+/*
+ * zlib stream writer
+ */
+
+struct callback_test{
+	FILE * file;
+	char * filename;
+	unsigned char out[CHUNK];	/* deflate output, reused for every write */
+};
+
+int zlib_callback_open(struct slogic_ctx *handle,char * openstring){
+struct callback_test *foo;
+	
+	handle->data_callback_opts = calloc(1,sizeof(struct callback_test));
+	foo = handle->data_callback_opts;
+	foo->filename = openstring;
+
+	handle->strm.zalloc = Z_NULL;
+	handle->strm.zfree = Z_NULL;
+	handle->strm.opaque = Z_NULL;
+    	if(deflateInit(&handle->strm, handle->compress_level) != Z_OK){
+		return -1;
+	}
+
+	if((foo->file = slogic_output_fopen(foo->filename)) == 0){
+		free(foo);
+		return 0;
+	}
+	return 1;
+}
+
+size_t zlib_callback_write(struct slogic_ctx *handle, uint8_t * data, size_t size){
+struct callback_test *foo = handle->data_callback_opts;
+unsigned int have;
+unsigned char * out = foo->out;
+int ret;
+
+	handle->strm.avail_in = size;
+	handle->strm.next_in = data;
+	do {
+            handle->strm.avail_out = (unsigned int)CHUNK;
+            handle->strm.next_out = out;
+            ret = deflate(&handle->strm, Z_NO_FLUSH);    /* no bad return value */
+            assert(ret != Z_STREAM_ERROR);  /* state not clobbered */
+            have = CHUNK - handle->strm.avail_out;
+            if (fwrite(out, 1, have, foo->file) != have || ferror(foo->file)) {
+                if (slogic_pipeline_fail(handle)) {
+                    log_printf(ERR, "Failed to write %s, stopping the capture\n", foo->filename);
+                }
+                return 0;
+            }
+        } while(handle->strm.avail_out == 0);
+
+	return size;
+
+//	return fwrite(data,1,size,foo->file);	
+
+}
+
+void zlib_callback_close(struct slogic_ctx *handle){
+struct callback_test *foo = handle->data_callback_opts;
+unsigned int have;
+int ret, failed = 0;
+
+	/* terminate the stream, otherwise the tail is stuck in zlib and the file is truncated */
+	handle->strm.avail_in = 0;
+	handle->strm.next_in = Z_NULL;
+	do {
+		handle->strm.avail_out = (unsigned int)CHUNK;
+		handle->strm.next_out = foo->out;
+		ret = deflate(&handle->strm, Z_FINISH);
+		have = CHUNK - handle->strm.avail_out;
+		if (fwrite(foo->out, 1, have, foo->file) != have) {
+			failed = 1;
+			break;
+		}
+	} while (ret == Z_OK);
+
+	deflateEnd(&handle->strm);
+	if (fclose(foo->file) || failed) {
+		log_printf(ERR, "Failed to write %s\n", foo->filename);
+		slogic_pipeline_fail(handle);
+	}
+	free(foo);
+	handle->data_callback_opts = 0;
+	return ;
+}
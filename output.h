@@ -0,0 +1,61 @@
+// vim: sw=8:ts=8:noexpandtab
+#ifndef __OUTPUT_H__
+#define __OUTPUT_H__
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+struct slogic_ctx;
+
+/*
+ * Output backends. Each one implements the data_callback_open/write/close
+ * trio of slogic_ctx; write() is always called from the writer thread.
+ * buffer() runs on the usb side as each transfer is submitted, returning
+ * NULL there falls back to the transfer buffer pool.
+ */
+struct slogic_output_format {
+	const char *name;	/* the name used with -F ("zlib") */
+	const char *text;	/* a one line description for the usage text */
+	int (*open)(struct slogic_ctx *handle, char *openstring);
+	size_t (*write)(struct slogic_ctx *handle, uint8_t *data, size_t size);
+	void (*close)(struct slogic_ctx *handle);
+	/* optional: the buffer for the next transfer, for backends the transfers fill directly */
+	uint8_t *(*buffer)(struct slogic_ctx *handle);
+	/* optional: write() for a pool buffer the writer hands over, given back with slogic_pool_put() once done */
+	size_t (*take)(struct slogic_ctx *handle, uint8_t *data, size_t size);
+	bool stdout_ok;		/* writes '-' as stdout */
+};
+
+#define DEFAULT_OUTPUT_FORMAT "blockz"
+
+/* returns an array of output formats terminated by an entry with a NULL name */
+struct slogic_output_format *slogic_get_output_formats();
+struct slogic_output_format *slogic_parse_output_format(const char *str);
+const char *slogic_output_args(const char *str);
+void slogic_set_output_format(struct slogic_ctx *handle, struct slogic_output_format *format);
+/* fopen() for writing, with '-' for stdout; a copy of it, so fclose() leaves stdout open */
+static inline FILE *slogic_output_fopen(const char *filename){
+int fd;
+FILE *file;
+
+	if (strcmp(filename, "-") != 0) {
+		return fopen(filename, "wb");
+	}
+	if ((fd = dup(STDOUT_FILENO)) < 0) {
+		return NULL;
+	}
+	if (!(file = fdopen(fd, "wb"))) {
+		close(fd);
+	}
+	return file;
+}
+
+/* the plain zlib stream writer */
+int zlib_callback_open(struct slogic_ctx *handle, char *openstring);
+size_t zlib_callback_write(struct slogic_ctx *handle, uint8_t *data, size_t size);
+void zlib_callback_close(struct slogic_ctx *handle);
+
+#endif
@@ -0,0 +1,273 @@
+// vim: sw=8:ts=8:noexpandtab
+#include "pack.h"
+#include "slogic.h"
+#include "output.h"
+#include "log.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#include <immintrin.h>
+#define PACK_HAVE_X86 1
+#endif
+
+#define PACK_BYTE_LANES 0x0101010101010101ull
+
+uint8_t pack_parse_mask(const char *arg){
+char *end;
+unsigned long mask = strtoul(arg, &end, 0);
+
+	if (*end || !mask || mask > 0xff || __builtin_popcount(mask) > PACK_MAX_CHANNELS) {
+		return 0;
+	}
+	return mask;
+}
+
+unsigned int pack_width(uint8_t mask){
+	switch (__builtin_popcount(mask)) {
+	case 1:
+		return 1;
+	case 2:
+		return 2;
+	case 3:
+	case 4:
+		return 4;
+	}
+	return 8;
+}
+
+/* the channels of 'mask' in one sample, next to each other from bit 0 */
+static inline unsigned int pack_extract(uint8_t mask, uint8_t sample){
+unsigned int v = 0, k = 0, c;
+
+	for (c = 0; c < SLOGIC_CHANNELS; c++) {
+		if ((mask >> c) & 1) {
+			v |= ((sample >> c) & 1) << k++;
+		}
+	}
+	return v;
+}
+
+static void pack_samples_scalar(uint8_t mask, const uint8_t *in, size_t n, uint8_t *out){
+uint8_t table[256];
+unsigned int width = pack_width(mask), i, k;
+uint64_t v;
+
+	for (i = 0; i < 256; i++) {
+		table[i] = pack_extract(mask, i);
+	}
+	for (; n; n -= 8, in += 8, out += width) {
+		for (v = 0, i = 0; i < 8; i++) {
+			v |= (uint64_t)table[in[i]] << (i * width);
+		}
+		for (k = 0; k < width; k++) {
+			out[k] = v >> (8 * k);
+		}
+	}
+}
+
+#ifdef PACK_HAVE_X86
+/* eight samples are one word: pext takes the masked bits of every byte, pdep spreads three channels to nibbles */
+__attribute__((target("bmi2")))
+static void pack_samples_bmi2(uint8_t mask, const uint8_t *in, size_t n, uint8_t *out){
+unsigned int width = pack_width(mask);
+uint64_t lanes = mask * PACK_BYTE_LANES, x, v;
+bool spread = __builtin_popcount(mask) == 3;
+
+	for (; n; n -= 8, in += 8, out += width) {
+		memcpy(&x, in, 8);
+		v = _pext_u64(x, lanes);
+		if (spread) {
+			v = _pdep_u64(v, 0x77777777ull);
+		}
+		memcpy(out, &v, width);
+	}
+}
+
+/* a single channel: shifted to the top of every byte it is a movemask, 16 samples to two bytes */
+static void pack_samples_sse2(uint8_t mask, const uint8_t *in, size_t n, uint8_t *out){
+__m128i shift = _mm_cvtsi32_si128(7 - __builtin_ctz(mask));
+uint16_t bits;
+
+	for (; n >= 16; n -= 16, in += 16, out += 2) {
+		bits = _mm_movemask_epi8(_mm_sll_epi16(_mm_loadu_si128((const __m128i *)in), shift));
+		memcpy(out, &bits, 2);
+	}
+	if (n) {
+		pack_samples_scalar(mask, in, n, out);
+	}
+}
+
+__attribute__((target("avx2")))
+static void pack_samples_avx2(uint8_t mask, const uint8_t *in, size_t n, uint8_t *out){
+__m128i shift = _mm_cvtsi32_si128(7 - __builtin_ctz(mask));
+uint32_t bits;
+
+	for (; n >= 32; n -= 32, in += 32, out += 4) {
+		bits = _mm256_movemask_epi8(_mm256_sll_epi16(_mm256_loadu_si256((const __m256i *)in), shift));
+		memcpy(out, &bits, 4);
+	}
+	if (n) {
+		pack_samples_sse2(mask, in, n, out);
+	}
+}
+#endif
+
+static void pack_single_resolve(uint8_t mask, const uint8_t *in, size_t n, uint8_t *out);
+static void pack_multi_resolve(uint8_t mask, const uint8_t *in, size_t n, uint8_t *out);
+static void (*pack_single)(uint8_t mask, const uint8_t *in, size_t n, uint8_t *out) = pack_single_resolve;
+static void (*pack_multi)(uint8_t mask, const uint8_t *in, size_t n, uint8_t *out) = pack_multi_resolve;
+
+/* picks the widest implementation the cpu supports on first use */
+static void pack_single_resolve(uint8_t mask, const uint8_t *in, size_t n, uint8_t *out){
+#ifdef PACK_HAVE_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		pack_single = pack_samples_avx2;
+	} else {
+		pack_single = __builtin_cpu_supports("sse2") ? pack_samples_sse2 : pack_samples_scalar;
+	}
+#else
+	pack_single = pack_samples_scalar;
+#endif
+	pack_single(mask, in, n, out);
+}
+
+static void pack_multi_resolve(uint8_t mask, const uint8_t *in, size_t n, uint8_t *out){
+#ifdef PACK_HAVE_X86
+	__builtin_cpu_init();
+	pack_multi = __builtin_cpu_supports("bmi2") ? pack_samples_bmi2 : pack_samples_scalar;
+#else
+	pack_multi = pack_samples_scalar;
+#endif
+	pack_multi(mask, in, n, out);
+}
+
+void pack_samples(uint8_t mask, const uint8_t *in, size_t n, uint8_t *out){
+	if (__builtin_popcount(mask) == 1) {
+		pack_single(mask, in, n, out);
+	} else {
+		pack_multi(mask, in, n, out);
+	}
+}
+
+void pack_unpack(uint8_t mask, const uint8_t *in, uint64_t first, size_t n, uint8_t *out){
+uint8_t table[16];
+unsigned int width = pack_width(mask), per_byte = 8 / width, f, k, c;
+uint64_t s;
+size_t i;
+
+	/* a field back to its channels */
+	for (f = 0; f < (1u << width); f++) {
+		table[f] = 0;
+		for (k = 0, c = 0; c < SLOGIC_CHANNELS; c++) {
+			if ((mask >> c) & 1) {
+				table[f] |= ((f >> k++) & 1) << c;
+			}
+		}
+	}
+	for (i = 0; i < n; i++) {
+		s = first + i;
+		out[i] = table[(in[s / per_byte - first / per_byte] >> (s % per_byte * width)) & ((1u << width) - 1)];
+	}
+}
+
+/*
+ * Writer
+ */
+
+/* the carried samples, padded, out ahead of the output's close() */
+static void pack_close(struct slogic_ctx *handle){
+struct slogic_pack *pack = &handle->pack;
+
+	if (pack->n_carry) {
+		memset(pack->carry + pack->n_carry, 0, sizeof(pack->carry) - pack->n_carry);
+		pack_samples(pack->mask, pack->carry, 8, pack->out);
+		pack->sink(handle, pack->out, (pack->n_carry * pack->width + 7) / 8);
+		pack->n_carry = 0;
+	}
+	pack->close(handle);
+	pack->samples = 0;
+}
+
+int slogic_pack_arm(struct slogic_ctx *handle, uint8_t mask){
+struct slogic_pack *pack = &handle->pack;
+
+	if (!(pack->out = malloc((size_t)PACK_CHUNK * PACK_MAX_CHANNELS / 8))) {
+		return -1;
+	}
+	pack->mask = mask;
+	pack->channels = __builtin_popcount(mask);
+	pack->width = pack_width(mask);
+	pack->samples = 0;
+	pack->n_carry = 0;
+
+	pack->sink = handle->data_callback_write;
+	pack->close = handle->data_callback_close;
+	handle->data_callback_write = slogic_pack_write;
+	handle->data_callback_close = pack_close;
+	/* the output's own buffers would get the samples unpacked */
+	handle->data_callback_buffer = NULL;
+	log_printf( DEBUG, "Packing channels 0x%02x, %u bits per sample\n", mask, pack->width);
+	return 0;
+}
+
+size_t slogic_pack_write(struct slogic_ctx *handle, uint8_t *data, size_t size){
+struct slogic_pack *pack = &handle->pack;
+size_t n, left = size, bytes, done;
+uint8_t *p = data;
+
+	if (pack->n_carry) {
+		n = sizeof(pack->carry) - pack->n_carry < left ? sizeof(pack->carry) - pack->n_carry : left;
+		memcpy(pack->carry + pack->n_carry, p, n);
+		pack->n_carry += n;
+		p += n;
+		left -= n;
+		if (pack->n_carry < sizeof(pack->carry)) {
+			pack->samples += size;
+			return size;
+		}
+		pack_samples(pack->mask, pack->carry, 8, pack->out);
+		pack->n_carry = 0;
+		if ((bytes = pack->sink(handle, pack->out, pack->width)) != pack->width) {
+			/* the first 8 - n samples of the group came with earlier writes */
+			done = bytes * 8 / pack->width;
+			done = done > 8 - n ? done - (8 - n) : 0;
+			pack->samples += done;
+			return done;
+		}
+	}
+	while (left >= 8) {
+		n = left / 8 * 8 < PACK_CHUNK ? left / 8 * 8 : PACK_CHUNK;
+		bytes = n * pack->width / 8;
+		pack_samples(pack->mask, p, n, pack->out);
+		if ((done = pack->sink(handle, pack->out, bytes)) != bytes) {
+			/* a whole byte out is 8 / width whole samples */
+			done = p - data + done * 8 / pack->width;
+			pack->samples += done;
+			return done;
+		}
+		p += n;
+		left -= n;
+	}
+	memcpy(pack->carry, p, left);
+	pack->n_carry = left;
+	pack->samples += size;
+	return size;
+}
+
+void slogic_pack_disarm(struct slogic_ctx *handle){
+struct slogic_pack *pack = &handle->pack;
+
+	if (!pack->sink) {
+		return;
+	}
+	handle->data_callback_write = pack->sink;
+	handle->data_callback_close = pack->close;
+	handle->data_callback_buffer = handle->output_format ? handle->output_format->buffer : NULL;
+	pack->sink = NULL;
+	pack->close = NULL;
+	free(pack->out);
+	pack->out = NULL;
+}
@@ -0,0 +1,65 @@
+// vim: sw=8:ts=8:noexpandtab
+#ifndef __PACK_H__
+#define __PACK_H__
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/*
+ * Channel packing (-m <mask>). With only some probes in use a byte per
+ * sample is mostly zeros; the writer thread packs the channels in 'mask'
+ * into 'width' bits per sample, 1 for one channel, 2 for two and 4 for
+ * three or four, before the output compresses or writes anything.
+ *
+ * Sample i is bits [(i % (8 / width)) * width, + width) of byte i / (8 /
+ * width), the lowest channel of the mask in the lowest bit; the unused bit
+ * of three channels in a nibble is 0, and so are the bits after the last
+ * sample. Eight samples at a time are one pext of a 64 bit word (and a
+ * pdep for three channels) where the cpu has BMI2, a movemask for a single
+ * channel with AVX2 or SSE2, and a table otherwise.
+ *
+ * The packing sits between everything else and the output: the trigger,
+ * decoders and index still see a byte per sample. blockz captures record
+ * the mask and their readers unpack transparently; raw, zlib and rle ones
+ * carry nothing, the mask is in the segment headers of -c.
+ */
+
+#define PACK_MAX_CHANNELS 4	/* with more a sample still takes a byte */
+#define PACK_CHUNK (64 * 1024)	/* samples packed per output write */
+
+struct slogic_ctx;
+
+struct slogic_pack {
+	uint8_t				mask;		/* 0 if not packing */
+	unsigned int			channels;
+	unsigned int			width;		/* bits per sample */
+	uint64_t			samples;	/* since the output was opened */
+	uint8_t				carry[8];	/* samples short of a group of eight */
+	unsigned int			n_carry;
+	uint8_t				*out;
+	size_t				(*sink)(struct slogic_ctx *handle, uint8_t *data, size_t size);
+	void				(*close)(struct slogic_ctx *handle);
+};
+
+/* "0x0b", "11": the mask; 0 if it is empty or has too many channels */
+uint8_t pack_parse_mask(const char *arg);
+/* bits per sample for 'mask', 8 for 0 (not packed) */
+unsigned int pack_width(uint8_t mask);
+/* packs groups of eight samples, n a multiple of 8, into n * width / 8 bytes */
+void pack_samples(uint8_t mask, const uint8_t *in, size_t n, uint8_t *out);
+/*
+ * samples [first, first + n) of a packed stream back to a byte per sample,
+ * zeros for the other channels; 'in' is the byte that holds sample 'first'
+ */
+void pack_unpack(uint8_t mask, const uint8_t *in, uint64_t first, size_t n, uint8_t *out);
+
+static inline bool slogic_pack_enabled(struct slogic_pack *pack){
+	return pack->mask != 0;
+}
+/* puts the packing in front of the output's write() and close(); arm it before anything else */
+int slogic_pack_arm(struct slogic_ctx *handle, uint8_t mask);
+/* returns the input bytes whose samples went out or wait in the carry, short of size once the sink fails */
+size_t slogic_pack_write(struct slogic_ctx *handle, uint8_t *data, size_t size);
+void slogic_pack_disarm(struct slogic_ctx *handle);
+
+#endif
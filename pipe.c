@@ -0,0 +1,263 @@
+// vim: sw=8:ts=8:noexpandtab
+#define _GNU_SOURCE	/* vmsplice(), F_SETPIPE_SZ */
+#include "pipe.h"
+#include "slogic.h"
+#include "log.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+
+static int pipe_parse_args(struct pipe_output *out, const char *args){
+char *copy, *opt, *save = NULL;
+int ret = 0;
+
+	if (!(copy = strdup(args))) {
+		return -1;
+	}
+	for (opt = strtok_r(copy, ",", &save); opt; opt = strtok_r(NULL, ",", &save)) {
+		if (!strcmp(opt, "copy")) {
+			out->splice = false;
+		} else {
+			log_printf(ERR, "pipe: bad option '%s'\n", opt);
+			ret = -1;
+			break;
+		}
+	}
+	free(copy);
+	return ret;
+}
+
+/* room for half the pool in the pipe, the rest stays for the transfers and the queue */
+static void pipe_grow(struct slogic_ctx *handle, struct pipe_output *out){
+#ifdef F_SETPIPE_SZ
+long want = (long)handle->n_transfer_buffers * handle->transfer_buffer_size;
+int size = fcntl(out->fd, F_GETPIPE_SZ);
+
+	if (want > PIPE_MAX_SIZE) {
+		want = PIPE_MAX_SIZE;
+	}
+	if (size > 0 && size < want && fcntl(out->fd, F_SETPIPE_SZ, (int)want) < 0) {
+		log_printf( DEBUG, "pipe: keeping the pipe at %d bytes: %s\n", size, strerror(errno));
+	}
+#endif
+}
+
+int pipe_callback_open(struct slogic_ctx *handle, char *openstring){
+struct pipe_output *out;
+struct stat st;
+
+	out = calloc(1, sizeof(struct pipe_output));
+	if (!out) {
+		return 0;
+	}
+	out->splice = true;
+	if (pipe_parse_args(out, handle->output_args ? handle->output_args : "")) {
+		free(out);
+		return 0;
+	}
+	/* a fifo blocks here until its reader is there */
+	if (strcmp(openstring, "-") == 0) {
+		out->fd = STDOUT_FILENO;
+	} else if ((out->fd = open(openstring, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+		log_printf( ERR, "pipe: %s: %s\n", openstring, strerror(errno));
+		free(out);
+		return 0;
+	}
+	if (fstat(out->fd, &st) || !S_ISFIFO(st.st_mode)) {
+		out->splice = false;
+	}
+	if (out->splice) {
+		/* everything the pipe can hold, plus a batch, plus the one being waited for */
+		out->held_size = handle->n_transfer_buffers * 2 + PIPE_BATCH + 1;
+		if (!(out->held = calloc(out->held_size, sizeof(struct pipe_held)))) {
+			if (out->fd != STDOUT_FILENO) {
+				close(out->fd);
+			}
+			free(out);
+			return 0;
+		}
+		pipe_grow(handle, out);
+	}
+	/* a reader that went away is an error on the write, not the end of the process */
+	signal(SIGPIPE, SIG_IGN);
+	handle->data_callback_opts = out;
+	log_printf( DEBUG, "pipe: writing to %s with %s\n", strcmp(openstring, "-") ? openstring : "stdout",
+		    out->splice ? "vmsplice" : "writev");
+	return 1;
+}
+
+static void pipe_broken(struct slogic_ctx *handle, struct pipe_output *out, int err){
+	if (!out->broken) {
+		log_printf( ERR, "pipe: %s, stopping the capture\n", strerror(err));
+		out->broken = true;
+		slogic_pipeline_fail(handle);
+	}
+}
+
+/* hands back the spliced buffers the reader is past, waiting for it while 'keep' or more are left (0 never waits) */
+static void pipe_release(struct slogic_ctx *handle, struct pipe_output *out, unsigned int keep){
+struct pipe_held *held;
+struct pollfd pfd = { out->fd, POLLOUT, 0 };
+int queued;
+
+	while (out->n_held) {
+		if (out->broken || ioctl(out->fd, FIONREAD, &queued)) {
+			/* nobody will read what is left, the pages are the pipe's until it is gone */
+			queued = 0;
+		}
+		while (out->n_held) {
+			held = &out->held[out->held_first];
+			if (held->end + queued > out->piped) {
+				break;
+			}
+			slogic_pool_put(handle, held->data);
+			out->held_first = (out->held_first + 1) % out->held_size;
+			out->n_held--;
+		}
+		if (out->n_held < keep || !keep) {
+			break;
+		}
+		out->waits++;
+		if (poll(&pfd, 1, PIPE_DRAIN_MSEC) > 0 && (pfd.revents & POLLERR)) {
+			pipe_broken(handle, out, EPIPE);
+		}
+	}
+}
+
+static void pipe_hold(struct pipe_output *out, uint8_t *data){
+	out->held[(out->held_first + out->n_held) % out->held_size] = (struct pipe_held){ data, out->piped };
+	out->n_held++;
+}
+
+/* all of iov, advancing it; non zero on error */
+static int pipe_writev(struct slogic_ctx *handle, struct pipe_output *out, struct iovec *iov, unsigned int n){
+ssize_t done;
+
+	while (n && !out->broken) {
+		if ((done = writev(out->fd, iov, n)) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			pipe_broken(handle, out, errno);
+			return -1;
+		}
+		out->copies++;
+		out->piped += done;
+		for (; n && (size_t)done >= iov->iov_len; n--, iov++) {
+			done -= iov->iov_len;
+		}
+		if (n) {
+			iov->iov_base = (uint8_t *)iov->iov_base + done;
+			iov->iov_len -= done;
+		}
+	}
+	return out->broken ? -1 : 0;
+}
+
+/* the pool buffers of the batch go into the pipe, whatever vmsplice() does not take goes with writev() */
+static void pipe_flush(struct slogic_ctx *handle, struct pipe_output *out){
+struct iovec iov[PIPE_BATCH];
+unsigned int n = out->n_batch, i = 0;
+size_t first = 0;
+ssize_t done;
+
+	if (!n) {
+		return;
+	}
+	memcpy(iov, out->batch, n * sizeof(struct iovec));
+	while (out->splice && i < n && !out->broken) {
+		if ((done = vmsplice(out->fd, iov + i, n - i, 0)) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EPIPE) {
+				pipe_broken(handle, out, errno);
+				break;
+			}
+			/* EFAULT for memory without struct pages, usbfs dma memory, or no vmsplice() at all */
+			log_printf( NOTICE, "pipe: vmsplice: %s, writing with writev\n", strerror(errno));
+			out->splice = false;
+			break;
+		}
+		out->splices++;
+		out->piped += done;
+		/* the buffers it went past are the pipe's now, the one it stopped in is partly */
+		for (; i < n && (size_t)done >= iov[i].iov_len; i++) {
+			done -= iov[i].iov_len;
+			pipe_release(handle, out, out->held_size);
+			pipe_hold(out, out->batch[i].iov_base);
+		}
+		if (i < n && done) {
+			iov[i].iov_base = (uint8_t *)iov[i].iov_base + done;
+			iov[i].iov_len -= done;
+		}
+	}
+	/* a buffer the pipe has the start of stays out until that is read */
+	if (i < n && iov[i].iov_base != out->batch[i].iov_base) {
+		first = 1;
+	}
+	pipe_writev(handle, out, iov + i, n - i);
+	if (first) {
+		pipe_release(handle, out, out->held_size);
+		pipe_hold(out, out->batch[i].iov_base);
+	}
+	for (i += first; i < n; i++) {
+		slogic_pool_put(handle, out->batch[i].iov_base);
+	}
+	out->n_batch = 0;
+	pipe_release(handle, out, 0);
+}
+
+/* samples in someone else's buffer, they are copied */
+size_t pipe_callback_write(struct slogic_ctx *handle, uint8_t *data, size_t size){
+struct pipe_output *out = handle->data_callback_opts;
+struct iovec iov = { data, size };
+
+	pipe_flush(handle, out);
+	return pipe_writev(handle, out, &iov, 1) ? 0 : size;
+}
+
+/* a pool buffer from the writer thread, it goes back to the pool from here once the pipe is done with it */
+size_t pipe_callback_take(struct slogic_ctx *handle, uint8_t *data, size_t size){
+struct pipe_output *out = handle->data_callback_opts;
+
+	if (out->broken) {
+		slogic_pool_put(handle, data);
+		return 0;
+	}
+	out->batch[out->n_batch].iov_base = data;
+	out->batch[out->n_batch].iov_len = size;
+	out->n_batch++;
+	/* batches only build up while the writer is behind, an idle one flushes every buffer */
+	if (out->n_batch == PIPE_BATCH || !slogic_ring_count(&handle->pipeline.filled)) {
+		pipe_flush(handle, out);
+	}
+	return size;
+}
+
+void pipe_callback_close(struct slogic_ctx *handle){
+struct pipe_output *out = handle->data_callback_opts;
+
+	if (!out) {
+		return;
+	}
+	pipe_flush(handle, out);
+	/* the buffers may be handed to transfers again, -c opens the next segment while capturing */
+	pipe_release(handle, out, 1);
+	log_printf( DEBUG, "pipe: %lu vmsplice and %lu writev calls, waited for the reader %lu times\n", out->splices,
+		    out->copies, out->waits);
+	if (out->fd != STDOUT_FILENO) {
+		close(out->fd);
+	}
+	free(out->held);
+	free(out);
+	handle->data_callback_opts = 0;
+}
@@ -0,0 +1,59 @@
+// vim: sw=8:ts=8:noexpandtab
+#ifndef __PIPE_H__
+#define __PIPE_H__
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <sys/uio.h>
+
+/*
+ * Uncompressed samples to stdout ('-') or a fifo, for a consumer that takes
+ * them live (-F pipe[:copy]). The transfer buffers the writer thread gets
+ * straight from the pool are vmsplice()d: the pipe takes references to their
+ * pages instead of a copy of them. Those pages are only read when the
+ * consumer gets to them, so a buffer is kept from the pool until the pipe has
+ * drained past it (what was put in against FIONREAD) and only then handed
+ * to a transfer again. The pipe is grown to half the transfer pool, up to
+ * PIPE_MAX_SIZE, so that many buffers can be out at once.
+ *
+ * Samples from -T, -k, -D and the like are in their buffers, reused on the
+ * next write, and go out with writev(); so does everything when the output
+ * is not a pipe, when vmsplice() refuses the memory (usbfs dma memory) or
+ * with 'copy'. A consumer that splice()s the pages on instead of reading
+ * them could see a buffer after its reuse, it needs 'copy'.
+ */
+
+#define PIPE_BATCH 16				/* buffers per vmsplice()/writev() */
+#define PIPE_MAX_SIZE (1024 * 1024)		/* the most the pipe is grown to */
+#define PIPE_DRAIN_MSEC 1			/* between looks at a full pipe */
+
+struct slogic_ctx;
+
+struct pipe_held {
+	uint8_t				*data;
+	uint64_t			end;		/* 'piped' once its last byte was in the pipe */
+};
+
+struct pipe_output {
+	int				fd;
+	bool				splice;		/* vmsplice() the pool's buffers */
+	bool				broken;		/* the reader went away */
+	struct iovec			batch[PIPE_BATCH];
+	unsigned int			n_batch;
+	struct pipe_held		*held;		/* spliced buffers, oldest first */
+	unsigned int			held_size;
+	unsigned int			held_first;
+	unsigned int			n_held;
+	uint64_t			piped;		/* bytes put into the pipe, by vmsplice() and writev() alike */
+	unsigned long			splices;
+	unsigned long			copies;		/* writev() calls */
+	unsigned long			waits;		/* for the pipe to drain before a buffer could go back */
+};
+
+/* output backend, see slogic_get_output_formats() */
+int pipe_callback_open(struct slogic_ctx *handle, char *openstring);
+size_t pipe_callback_write(struct slogic_ctx *handle, uint8_t *data, size_t size);
+size_t pipe_callback_take(struct slogic_ctx *handle, uint8_t *data, size_t size);
+void pipe_callback_close(struct slogic_ctx *handle);
+
+#endif
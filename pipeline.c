@@ -0,0 +1,312 @@
+// vim: sw=8:ts=8:noexpandtab
+#define _GNU_SOURCE	/* pthread_setaffinity_np() */
+#include "pipeline.h"
+#include "slogic.h"
+#include "output.h"
+#include "log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/mman.h>
+
+/*
+ * SPSC ring
+ */
+
+int slogic_ring_init(struct slogic_ring *ring, size_t depth){
+	assert(depth && (depth & (depth - 1)) == 0);
+
+	ring->slots = calloc(depth, sizeof(struct slogic_block));
+	if (!ring->slots) {
+		return -1;
+	}
+	ring->mask = depth - 1;
+	ring->high_water = 0;
+	atomic_init(&ring->head, 0);
+	atomic_init(&ring->tail, 0);
+	return 0;
+}
+
+void slogic_ring_free(struct slogic_ring *ring){
+	free(ring->slots);
+	ring->slots = NULL;
+}
+
+bool slogic_ring_push(struct slogic_ring *ring, uint8_t *data, size_t size){
+size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+size_t used;
+
+	if (head - tail > ring->mask) {
+		return false;
+	}
+	ring->slots[head & ring->mask].data = data;
+	ring->slots[head & ring->mask].size = size;
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+
+	used = head + 1 - tail;
+	if (used > ring->high_water) {
+		ring->high_water = used;
+	}
+	return true;
+}
+
+bool slogic_ring_pop(struct slogic_ring *ring, struct slogic_block *block){
+size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+	if (tail == head) {
+		return false;
+	}
+	*block = ring->slots[tail & ring->mask];
+	atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+	return true;
+}
+
+size_t slogic_ring_count(struct slogic_ring *ring){
+	return atomic_load_explicit(&ring->head, memory_order_acquire) -
+	       atomic_load_explicit(&ring->tail, memory_order_acquire);
+}
+
+/*
+ * Buffer pool
+ */
+
+int slogic_pool_alloc(struct slogic_ctx *handle, unsigned int n_buffers){
+struct slogic_pool *pool = &handle->pool;
+size_t depth = 1;
+
+	pool->buffer_size = handle->transfer_buffer_size;
+	pool->n_buffers = n_buffers;
+	pool->arena_size = pool->buffer_size * n_buffers;
+	pool->misses = 0;
+	pool->dev_mem = false;
+	pool->shm = false;
+	pool->arena = NULL;
+
+	if (slogic_shm_enabled(&handle->shm)) {
+		if (!(pool->arena = slogic_shm_create(handle, pool->buffer_size, n_buffers))) {
+			return 1;
+		}
+		pool->shm = true;
+	}
+#if defined(__linux__) && defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+	/* usbfs can dma straight into memory it mapped for us, saving the kernel a copy */
+	if (!pool->arena && handle->device_handle && (pool->arena = libusb_dev_mem_alloc(handle->device_handle, pool->arena_size))) {
+		pool->dev_mem = true;
+	}
+#endif
+	if (!pool->arena) {
+		/* populate up front so the first pass through the arena does not page fault */
+		pool->arena = mmap(NULL, pool->arena_size, PROT_READ | PROT_WRITE,
+				   MAP_PRIVATE | MAP_ANONYMOUS | SLOGIC_MAP_POPULATE, -1, 0);
+		if (pool->arena == MAP_FAILED) {
+			pool->arena = NULL;
+			log_printf(ERR, "Failed to map a %zu byte transfer arena\n", pool->arena_size);
+			return 1;
+		}
+	}
+
+	while (depth < n_buffers) {
+		depth <<= 1;
+	}
+	if (slogic_ring_init(&pool->free, depth)) {
+		slogic_pool_free(handle);
+		return 1;
+	}
+	log_printf(DEBUG, "Transfer arena: %u buffers of %zu bytes%s\n", n_buffers, pool->buffer_size,
+		   pool->dev_mem ? " (usbfs dma memory)" : pool->shm ? " (shared)" : "");
+	return 0;
+}
+
+void slogic_pool_free(struct slogic_ctx *handle){
+struct slogic_pool *pool = &handle->pool;
+
+	if (pool->free.slots) {
+		slogic_ring_free(&pool->free);
+	}
+	if (!pool->arena) {
+		return;
+	}
+	if (pool->shm) {
+		slogic_shm_destroy(handle);
+		pool->arena = NULL;
+		return;
+	}
+#if defined(__linux__) && defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+	if (pool->dev_mem) {
+		libusb_dev_mem_free(handle->device_handle, pool->arena, pool->arena_size);
+		pool->arena = NULL;
+		return;
+	}
+#endif
+	munmap(pool->arena, pool->arena_size);
+	pool->arena = NULL;
+}
+
+uint8_t *slogic_pool_buffer(struct slogic_ctx *handle, unsigned int index){
+	assert(index < handle->pool.n_buffers);
+	return handle->pool.arena + (size_t)index * handle->pool.buffer_size;
+}
+
+static bool slogic_pool_owns(struct slogic_pool *pool, uint8_t *data){
+	return data >= pool->arena && data < pool->arena + pool->arena_size;
+}
+
+/*
+ * usb callback side. Never blocks: when the writer has not returned any
+ * buffer yet we fall back to the heap and count it, so a non zero 'misses'
+ * means the pool was too small for the run.
+ */
+uint8_t *slogic_pool_get(struct slogic_ctx *handle){
+struct slogic_pool *pool = &handle->pool;
+struct slogic_block block;
+uint8_t *data;
+
+	if (handle->data_callback_buffer && (data = handle->data_callback_buffer(handle))) {
+		return data;
+	}
+	if (slogic_ring_pop(&pool->free, &block)) {
+		return block.data;
+	}
+	pool->misses++;
+	data = malloc(pool->buffer_size);
+	assert(data);
+	return data;
+}
+
+/* writer side. The free ring holds every arena buffer, so a push cannot fail */
+void slogic_pool_put(struct slogic_ctx *handle, uint8_t *data){
+struct slogic_pool *pool = &handle->pool;
+bool returned;
+
+	if (!data || (data >= pool->external && data < pool->external + pool->external_size)) {
+		return;
+	}
+	if (!slogic_pool_owns(pool, data)) {
+		free(data);
+		return;
+	}
+	returned = slogic_ring_push(&pool->free, data, 0);
+	assert(returned);
+	(void)returned;
+}
+
+/*
+ * Writer thread
+ */
+
+static void *slogic_pipeline_writer(void *arg){
+struct slogic_ctx *handle = arg;
+struct slogic_pipeline *p = &handle->pipeline;
+struct slogic_block block;
+struct timespec idle = { 0, PIPELINE_IDLE_USEC * 1000 };
+size_t (*take)(struct slogic_ctx *, uint8_t *, size_t) = handle->output_format ? handle->output_format->take : NULL;
+
+	while (1) {
+		if (slogic_ring_pop(&p->filled, &block)) {
+			/* nothing in front of the output, it may keep the buffer past the write */
+			if (take && handle->data_callback_write == handle->output_format->write) {
+				take(handle, block.data, block.size);
+			} else {
+				handle->data_callback_write(handle, block.data, block.size);
+				slogic_pool_put(handle, block.data);
+			}
+			p->bytes_written += block.size;
+			continue;
+		}
+		/* only leave once the producer is gone and everything is drained */
+		if (!atomic_load(&p->running) && !slogic_ring_count(&p->filled)) {
+			break;
+		}
+		nanosleep(&idle, NULL);
+	}
+	return NULL;
+}
+
+int slogic_pipeline_start(struct slogic_ctx *handle){
+struct slogic_pipeline *p = &handle->pipeline;
+int err;
+#ifdef __linux__
+cpu_set_t set;
+#endif
+
+	if (!p->depth) {
+		p->depth = DEFAULT_PIPELINE_DEPTH;
+	}
+	if (slogic_ring_init(&p->filled, p->depth)) {
+		log_printf(ERR, "Failed to allocate the writer queue\n");
+		return 1;
+	}
+	p->full_waits = 0;
+	p->dropped = 0;
+	p->bytes_written = 0;
+	atomic_store(&p->output_failed, 0);
+	atomic_store(&p->running, 1);
+
+	if ((err = pthread_create(&p->writer, NULL, slogic_pipeline_writer, handle))) {
+		log_printf(ERR, "Failed to start the writer thread: %s\n", strerror(err));
+		atomic_store(&p->running, 0);
+		slogic_ring_free(&p->filled);
+		return 1;
+	}
+#ifdef __linux__
+	if (p->cpu >= 0) {
+		CPU_ZERO(&set);
+		CPU_SET(p->cpu, &set);
+		if ((err = pthread_setaffinity_np(p->writer, sizeof(set), &set))) {
+			log_printf(NOTICE, "Failed to pin the writer thread to cpu %d: %s\n", p->cpu, strerror(err));
+		}
+	}
+#endif
+	return 0;
+}
+
+/*
+ * Called from the usb callback. Ownership of 'data' moves to the pipeline,
+ * which returns it to the pool once written. Returns non zero if the
+ * pipeline is not running, in which case the caller still owns the buffer.
+ */
+int slogic_pipeline_submit(struct slogic_ctx *handle, uint8_t *data, size_t size){
+struct slogic_pipeline *p = &handle->pipeline;
+
+	if (!atomic_load_explicit(&p->running, memory_order_relaxed)) {
+		return 1;
+	}
+	/* the writer is behind; this is the point where data starts getting late */
+	while (!slogic_ring_push(&p->filled, data, size)) {
+		p->full_waits++;
+		if (p->drop_when_full) {
+			/* the caller keeps the buffer and fills it again */
+			p->dropped += size;
+			return 1;
+		}
+		sched_yield();
+	}
+	return 0;
+}
+
+void slogic_pipeline_stop(struct slogic_ctx *handle){
+struct slogic_pipeline *p = &handle->pipeline;
+
+	if (!atomic_exchange(&p->running, 0)) {
+		return;
+	}
+	pthread_join(p->writer, NULL);
+	slogic_ring_free(&p->filled);
+}
+
+void slogic_pipeline_report(struct slogic_ctx *handle){
+struct slogic_pipeline *p = &handle->pipeline;
+
+	log_printf(NOTICE, "Writer queue high-water mark: %zu of %zu buffers\n", p->filled.high_water, p->depth);
+	log_printf(NOTICE, "Writer queue full waits: %lu\n", p->full_waits);
+	if (p->drop_when_full) {
+		log_printf(NOTICE, "Bytes dropped with the writer queue full: %llu\n", p->dropped);
+	}
+	log_printf(NOTICE, "Total number of bytes handed to the writer: %llu\n", p->bytes_written);
+	log_printf(NOTICE, "Buffer allocations while capturing: %lu\n", handle->pool.misses);
+}
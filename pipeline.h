@@ -0,0 +1,97 @@
+// vim: sw=8:ts=8:noexpandtab
+#ifndef __PIPELINE_H__
+#define __PIPELINE_H__
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#ifdef MAP_POPULATE
+#define SLOGIC_MAP_POPULATE MAP_POPULATE
+#else
+#define SLOGIC_MAP_POPULATE 0
+#endif
+
+#define DEFAULT_PIPELINE_DEPTH 8192	/* must be a power of two */
+#define PIPELINE_IDLE_USEC 200		/* writer back-off when the queue is empty */
+
+struct slogic_ctx;
+
+/* a filled transfer buffer on its way from the usb callback to the writer */
+struct slogic_block {
+	uint8_t				*data;
+	size_t				size;
+};
+
+/*
+ * Single producer / single consumer ring. Only the producer moves head and
+ * only the consumer moves tail, so neither side ever takes a lock. The two
+ * indices live on separate cache lines to keep the cores from fighting.
+ */
+struct slogic_ring {
+	struct slogic_block		*slots;
+	size_t				mask;
+	_Alignas(64) _Atomic size_t	head;
+	size_t				high_water;	/* producer side only */
+	_Alignas(64) _Atomic size_t	tail;
+};
+
+int slogic_ring_init(struct slogic_ring *ring, size_t depth);
+void slogic_ring_free(struct slogic_ring *ring);
+bool slogic_ring_push(struct slogic_ring *ring, uint8_t *data, size_t size);
+bool slogic_ring_pop(struct slogic_ring *ring, struct slogic_block *block);
+size_t slogic_ring_count(struct slogic_ring *ring);
+
+/*
+ * Transfer buffer pool. Every buffer lives in one page aligned arena that is
+ * allocated once in slogic_open(). A buffer is always owned by exactly one
+ * of: a transfer, the filled queue, the writer, or the free ring. The writer
+ * hands buffers back through 'free' (writer -> usb callback, again SPSC).
+ */
+struct slogic_pool {
+	uint8_t				*arena;
+	size_t				arena_size;
+	size_t				buffer_size;
+	unsigned int			n_buffers;
+	bool				dev_mem;	/* arena is libusb_dev_mem_alloc() memory */
+	bool				shm;		/* arena is in the shared memory object of -S */
+	struct slogic_ring		free;
+	unsigned long			misses;		/* buffers malloc'd while capturing */
+	uint8_t				*external;	/* buffers from data_callback_buffer(), not ours */
+	size_t				external_size;
+};
+
+int slogic_pool_alloc(struct slogic_ctx *handle, unsigned int n_buffers);
+void slogic_pool_free(struct slogic_ctx *handle);
+uint8_t *slogic_pool_buffer(struct slogic_ctx *handle, unsigned int index);
+/* the output's data_callback_buffer() first if it has one */
+uint8_t *slogic_pool_get(struct slogic_ctx *handle);
+void slogic_pool_put(struct slogic_ctx *handle, uint8_t *data);
+
+/*
+ * The capture pipeline: the usb callback pushes completed buffers into
+ * 'filled' and a dedicated writer thread runs data_callback_write() on them,
+ * so compression and disk io never delay the re-submission of a transfer.
+ * An output with take() and nothing in front of it keeps the buffer instead.
+ */
+struct slogic_pipeline {
+	struct slogic_ring		filled;
+	pthread_t			writer;
+	_Atomic int			running;
+	_Atomic int			output_failed;	/* set by the writer, seen by the usb callback */
+	size_t				depth;
+	int				cpu;		/* the writer is pinned to it, -1 for anywhere */
+	bool				drop_when_full;	/* rather than wait, when the event thread is shared */
+	unsigned long			full_waits;	/* callback found the queue full */
+	unsigned long long		dropped;	/* bytes not queued with drop_when_full */
+	unsigned long long		bytes_written;
+};
+
+int slogic_pipeline_start(struct slogic_ctx *handle);
+int slogic_pipeline_submit(struct slogic_ctx *handle, uint8_t *data, size_t size);
+void slogic_pipeline_stop(struct slogic_ctx *handle);
+void slogic_pipeline_report(struct slogic_ctx *handle);
+
+#endif
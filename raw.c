@@ -0,0 +1,171 @@
+// vim: sw=8:ts=8:noexpandtab
+#define _GNU_SOURCE	/* fallocate() */
+#include "raw.h"
+#include "slogic.h"
+#include "log.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define RAW_RESERVE_FLAGS (MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE)
+
+static size_t raw_round_up(size_t size, size_t to){
+	return (size + to - 1) / to * to;
+}
+
+static int raw_preallocate(struct raw_output *raw){
+#ifdef __linux__
+	if (fallocate(raw->fd, 0, 0, raw->size) == 0) {
+		return 0;
+	}
+	if (errno != EOPNOTSUPP) {
+		return -1;
+	}
+	/* the filesystem cannot reserve blocks, a sparse file still maps fine */
+#endif
+	return ftruncate(raw->fd, raw->size);
+}
+
+int raw_callback_open(struct slogic_ctx *handle, char *openstring){
+struct raw_output *raw;
+size_t page = sysconf(_SC_PAGESIZE);
+
+	if (strcmp(openstring, "-") == 0) {
+		log_printf( ERR, "The raw output maps its file and cannot write to stdout\n");
+		return 0;
+	}
+	raw = calloc(1, sizeof(struct raw_output));
+	if (!raw) {
+		return 0;
+	}
+	raw->filename = openstring;
+	/* the transfers still in flight when the last sample arrives land past the end */
+	raw->size = raw_round_up(handle->n_samples_requested + (handle->n_transfer_buffers + 2) * handle->transfer_buffer_size,
+				 page);
+
+	if ((raw->fd = open(raw->filename, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+		free(raw);
+		return 0;
+	}
+	if (raw_preallocate(raw)) {
+		log_printf( ERR, "Failed to preallocate %zu bytes for %s: %s\n", raw->size, raw->filename, strerror(errno));
+		close(raw->fd);
+		free(raw);
+		return 0;
+	}
+	raw->base = mmap(NULL, raw_round_up(raw->size, RAW_WINDOW_SIZE), PROT_NONE, RAW_RESERVE_FLAGS, -1, 0);
+	if (raw->base == MAP_FAILED) {
+		log_printf( ERR, "Failed to reserve %zu bytes of address space\n", raw->size);
+		close(raw->fd);
+		free(raw);
+		return 0;
+	}
+
+	/* buffers inside the file are the output's, the pool must not take them back */
+	handle->pool.external = raw->base;
+	handle->pool.external_size = raw->size;
+	handle->data_callback_opts = raw;
+	log_printf( DEBUG, "raw: preallocated %zu bytes in %s\n", raw->size, raw->filename);
+	return 1;
+}
+
+/* map windows until 'end' is covered */
+static int raw_map(struct raw_output *raw, size_t end){
+size_t len;
+uint8_t *data;
+
+	while (raw->mapped_hi < end) {
+		len = raw->size - raw->mapped_hi < RAW_WINDOW_SIZE ? raw->size - raw->mapped_hi : RAW_WINDOW_SIZE;
+		data = mmap(raw->base + raw->mapped_hi, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, raw->fd,
+			    raw->mapped_hi);
+		if (data == MAP_FAILED) {
+			log_printf( ERR, "Failed to map %s at %zu: %s\n", raw->filename, raw->mapped_hi, strerror(errno));
+			return -1;
+		}
+		madvise(data, len, MADV_SEQUENTIAL);
+		raw->mapped_hi += len;
+	}
+	return 0;
+}
+
+/*
+ * usb callback side, called as each transfer is primed. Transfers complete
+ * in the order they were submitted, so handing out consecutive slices of the
+ * file in submission order puts every sample where it belongs.
+ */
+uint8_t *raw_callback_buffer(struct slogic_ctx *handle){
+struct raw_output *raw = handle->data_callback_opts;
+size_t size = handle->transfer_buffer_size;
+uint8_t *data;
+
+	if (!raw || raw->next + size > raw->size || raw_map(raw, raw->next + size)) {
+		return NULL;
+	}
+	data = raw->base + raw->next;
+	raw->next += size;
+	return data;
+}
+
+/* hand a window the writer is done with back to the page cache and drop the mapping */
+static void raw_release_window(struct raw_output *raw){
+	msync(raw->base + raw->mapped_lo, RAW_WINDOW_SIZE, MS_ASYNC);
+	mmap(raw->base + raw->mapped_lo, RAW_WINDOW_SIZE, PROT_NONE, RAW_RESERVE_FLAGS | MAP_FIXED, -1, 0);
+#ifdef POSIX_FADV_DONTNEED
+	/* the window before this one has had a window's time to reach the disk */
+	if (raw->mapped_lo >= RAW_WINDOW_SIZE) {
+		posix_fadvise(raw->fd, raw->mapped_lo - RAW_WINDOW_SIZE, RAW_WINDOW_SIZE, POSIX_FADV_DONTNEED);
+	}
+#endif
+	raw->mapped_lo += RAW_WINDOW_SIZE;
+}
+
+size_t raw_callback_write(struct slogic_ctx *handle, uint8_t *data, size_t size){
+struct raw_output *raw = handle->data_callback_opts;
+uint8_t *dst = raw->base + raw->written;
+
+	if (raw->written + size > raw->mapped_hi) {
+		/*
+		 * Without the buffer hook (a trigger in front of us) the writer maps
+		 * for itself. With it, only a pool buffer after mapping failed gets here.
+		 */
+		if (handle->data_callback_buffer || raw->written + size > raw->size ||
+		    raw_map(raw, raw->written + size)) {
+			if (slogic_pipeline_fail(handle)) {
+				log_printf( ERR, "raw: samples past the mapped part of %s, stopping the capture\n", raw->filename);
+			}
+			return 0;
+		}
+	}
+	if (data != dst) {
+		/* a short transfer before this one, or a pool buffer; slices only ever move down */
+		memmove(dst, data, size);
+		raw->moved++;
+	}
+	raw->written += size;
+	while (raw->written >= raw->mapped_lo + RAW_WINDOW_SIZE) {
+		raw_release_window(raw);
+	}
+	return size;
+}
+
+void raw_callback_close(struct slogic_ctx *handle){
+struct raw_output *raw = handle->data_callback_opts;
+
+	munmap(raw->base, raw_round_up(raw->size, RAW_WINDOW_SIZE));
+	if (ftruncate(raw->fd, raw->written)) {
+		log_printf( ERR, "Failed to truncate %s: %s\n", raw->filename, strerror(errno));
+		slogic_pipeline_fail(handle);
+	}
+	close(raw->fd);
+	log_printf( DEBUG, "raw: %zu samples, %lu writes had to move data\n", raw->written, raw->moved);
+
+	handle->pool.external = NULL;
+	handle->pool.external_size = 0;
+	free(raw);
+	handle->data_callback_opts = 0;
+}
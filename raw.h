@@ -0,0 +1,43 @@
+// vim: sw=8:ts=8:noexpandtab
+#ifndef __RAW_H__
+#define __RAW_H__
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Uncompressed byte per sample output, written without a copy in user
+ * space: the file is preallocated for the whole capture and the transfers
+ * are submitted with buffers that point into a shared mapping of it, so the
+ * kernel's usbfs copy is the only one. The writer thread only moves data when
+ * a short transfer left a hole, and unmaps the file behind itself.
+ *
+ * One address range as large as the file is reserved up front, so a
+ * transfer's buffer is always base + its file offset. It is mapped in
+ * RAW_WINDOW_SIZE windows just ahead of the transfers and released again
+ * once the writer is past them, so captures bigger than memory only ever
+ * keep a few windows mapped.
+ */
+
+#define RAW_WINDOW_SIZE (64 * 1024 * 1024)	/* must be a multiple of the page size */
+
+struct slogic_ctx;
+
+struct raw_output {
+	int				fd;
+	char				*filename;
+	uint8_t				*base;		/* reservation, file offset 0 */
+	size_t				size;		/* preallocated file size */
+	size_t				next;		/* offset of the next transfer buffer (usb side) */
+	size_t				mapped_hi;	/* end of the mapped windows (usb side) */
+	size_t				mapped_lo;	/* start of the mapped windows (writer side) */
+	size_t				written;	/* samples in the file (writer side) */
+	unsigned long			moved;		/* writes that had to close a gap */
+};
+
+/* output backend, see slogic_get_output_formats() */
+int raw_callback_open(struct slogic_ctx *handle, char *openstring);
+uint8_t *raw_callback_buffer(struct slogic_ctx *handle);
+size_t raw_callback_write(struct slogic_ctx *handle, uint8_t *data, size_t size);
+void raw_callback_close(struct slogic_ctx *handle);
+
+#endif
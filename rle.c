@@ -0,0 +1,262 @@
+// vim: sw=8:ts=8:noexpandtab
+#include "rle.h"
+#include "slogic.h"
+#include "output.h"
+#include "log.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#include <immintrin.h>
+#define RLE_HAVE_X86 1
+#endif
+
+/*
+ * Transition scan
+ */
+
+static size_t rle_scan_scalar(const uint8_t *p, size_t n, uint8_t v){
+uint64_t pattern = v * 0x0101010101010101ULL;
+uint64_t word;
+size_t i = 0;
+
+	/* eight samples per step: any non zero byte of the xor is a transition */
+	for (; i + 8 <= n; i += 8) {
+		memcpy(&word, p + i, 8);
+		word ^= pattern;
+		if (word) {
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+			return i + (__builtin_clzll(word) >> 3);
+#else
+			return i + (__builtin_ctzll(word) >> 3);
+#endif
+		}
+	}
+	for (; i < n; i++) {
+		if (p[i] != v) {
+			return i;
+		}
+	}
+	return n;
+}
+
+#ifdef RLE_HAVE_X86
+static size_t rle_scan_sse2(const uint8_t *p, size_t n, uint8_t v){
+__m128i pattern = _mm_set1_epi8(v);
+unsigned int mask;
+size_t i = 0;
+
+	for (; i + 16 <= n; i += 16) {
+		mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + i)), pattern));
+		if (mask != 0xffff) {
+			return i + __builtin_ctz(~mask);
+		}
+	}
+	return i + rle_scan_scalar(p + i, n - i, v);
+}
+
+__attribute__((target("avx2")))
+static size_t rle_scan_avx2(const uint8_t *p, size_t n, uint8_t v){
+__m256i pattern = _mm256_set1_epi8(v);
+unsigned int mask;
+size_t i = 0;
+
+	for (; i + 32 <= n; i += 32) {
+		mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + i)), pattern));
+		if (mask != 0xffffffff) {
+			return i + __builtin_ctz(~mask);
+		}
+	}
+	return i + rle_scan_sse2(p + i, n - i, v);
+}
+#endif
+
+static size_t rle_scan_resolve(const uint8_t *p, size_t n, uint8_t v);
+static size_t (*rle_scan_impl)(const uint8_t *p, size_t n, uint8_t v) = rle_scan_resolve;
+
+/* picks the widest implementation the cpu supports on first use */
+static size_t rle_scan_resolve(const uint8_t *p, size_t n, uint8_t v){
+#ifdef RLE_HAVE_X86
+	__builtin_cpu_init();
+	rle_scan_impl = __builtin_cpu_supports("avx2") ? rle_scan_avx2 : rle_scan_sse2;
+#else
+	rle_scan_impl = rle_scan_scalar;
+#endif
+	return rle_scan_impl(p, n, v);
+}
+
+size_t rle_scan(const uint8_t *p, size_t n, uint8_t v){
+	return rle_scan_impl(p, n, v);
+}
+
+/*
+ * Encoder
+ */
+
+static void rle_flush(struct rle_encoder *enc){
+	if (enc->fill && fwrite(enc->out, 1, enc->fill, enc->file) != enc->fill) {
+		enc->error = 1;
+	}
+	enc->fill = 0;
+}
+
+static void rle_emit(struct rle_encoder *enc){
+uint64_t run = enc->run;
+
+	if (enc->fill + RLE_MAX_RECORD > RLE_OUT_SIZE) {
+		rle_flush(enc);
+	}
+	while (run >= 0x80) {
+		enc->out[enc->fill++] = (run & 0x7f) | 0x80;
+		run >>= 7;
+	}
+	enc->out[enc->fill++] = run;
+	enc->out[enc->fill++] = enc->value;
+	enc->records++;
+}
+
+void rle_encoder_init(struct rle_encoder *enc, FILE *file){
+	enc->file = file;
+	enc->value = 0;
+	enc->run = 0;
+	enc->samples = 0;
+	enc->records = 0;
+	enc->fill = 0;
+	enc->error = 0;
+}
+
+int rle_encode(struct rle_encoder *enc, const uint8_t *data, size_t size){
+size_t i = 0, n;
+
+	if (!size) {
+		return enc->error;
+	}
+	if (!enc->samples) {
+		enc->value = data[0];
+	}
+	enc->samples += size;
+
+	while (1) {
+		n = rle_scan(data + i, size - i, enc->value);
+		enc->run += n;
+		i += n;
+		if (i == size) {
+			break;	/* the run may go on in the next buffer */
+		}
+		rle_emit(enc);
+		enc->value = data[i];
+		enc->run = 0;
+	}
+	return enc->error;
+}
+
+int rle_encoder_finish(struct rle_encoder *enc){
+	if (enc->run) {
+		rle_emit(enc);
+		enc->run = 0;
+	}
+	rle_flush(enc);
+	return enc->error;
+}
+
+/*
+ * Decoder, restartable at any byte boundary of the input
+ */
+
+void rle_decoder_init(struct rle_decoder *dec){
+	memset(dec, 0, sizeof(struct rle_decoder));
+}
+
+size_t rle_decode(struct rle_decoder *dec, const uint8_t *in, size_t in_len, size_t *consumed,
+		  uint8_t *out, size_t out_len){
+size_t i = 0, o = 0, n;
+uint8_t b;
+
+	while (o < out_len) {
+		if (dec->left) {
+			n = dec->left < out_len - o ? dec->left : out_len - o;
+			memset(out + o, dec->value, n);
+			o += n;
+			dec->left -= n;
+			continue;
+		}
+		if (i == in_len) {
+			break;
+		}
+		b = in[i++];
+		if (dec->want_value) {
+			dec->value = b;
+			dec->left = dec->acc;
+			dec->acc = 0;
+			dec->shift = 0;
+			dec->want_value = 0;
+			continue;
+		}
+		if (dec->shift < 64) {
+			dec->acc |= (uint64_t)(b & 0x7f) << dec->shift;
+		}
+		dec->shift += 7;
+		if (!(b & 0x80)) {
+			dec->want_value = 1;
+		}
+	}
+	*consumed = i;
+	return o;
+}
+
+/*
+ * Output backend
+ */
+
+int rle_callback_open(struct slogic_ctx *handle, char *openstring){
+struct rle_encoder *enc;
+uint8_t header[RLE_HEADER_SIZE] = RLE_MAGIC;
+FILE *file;
+
+	if ((file = slogic_output_fopen(openstring)) == NULL) {
+		return 0;
+	}
+	if (!(enc = malloc(sizeof(struct rle_encoder)))) {
+		fclose(file);
+		return 0;
+	}
+	rle_encoder_init(enc, file);
+	header[4] = RLE_VERSION;
+	header[5] = RLE_VERSION >> 8;
+	header[6] = 0;
+	header[7] = 0;
+	if (fwrite(header, 1, sizeof(header), file) != sizeof(header)) {
+		enc->error = 1;
+	}
+	handle->data_callback_opts = enc;
+	return 1;
+}
+
+size_t rle_callback_write(struct slogic_ctx *handle, uint8_t *data, size_t size){
+struct rle_encoder *enc = handle->data_callback_opts;
+
+	if (rle_encode(enc, data, size)) {
+		if (slogic_pipeline_fail(handle)) {
+			log_printf(ERR, "Failed to write the run length encoded capture, stopping\n");
+		}
+		return 0;
+	}
+	return size;
+}
+
+void rle_callback_close(struct slogic_ctx *handle){
+struct rle_encoder *enc = handle->data_callback_opts;
+
+	if (!enc) {
+		return;
+	}
+	if (rle_encoder_finish(enc) | fclose(enc->file)) {
+		log_printf(ERR, "Failed to write the run length encoded capture\n");
+		slogic_pipeline_fail(handle);
+	}
+	log_printf(DEBUG, "rle: %llu samples in %llu records\n", (unsigned long long)enc->samples,
+		   (unsigned long long)enc->records);
+	free(enc);
+	handle->data_callback_opts = NULL;
+}
@@ -0,0 +1,61 @@
+// vim: sw=8:ts=8:noexpandtab
+#ifndef __RLE_H__
+#define __RLE_H__
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+
+/*
+ * Transition codec for the byte per sample stream. Logic analyzer data is
+ * mostly long runs of the same value, so instead of deflating it we store
+ * one record per transition: the value and the number of samples it lasted,
+ * as an LEB128 varint. Finding the next transition is a SIMD compare.
+ *
+ * Layout: "SLRL" u16 version u16 flags (little endian), then records of
+ *         varint run_length, u8 value   until the end of the file.
+ */
+
+#define RLE_MAGIC "SLRL"
+#define RLE_VERSION 1
+#define RLE_HEADER_SIZE 8
+#define RLE_OUT_SIZE (64 * 1024)
+#define RLE_MAX_RECORD 11	/* 10 varint bytes for a 64 bit run plus the value */
+
+struct slogic_ctx;
+
+struct rle_encoder {
+	FILE				*file;
+	uint8_t				value;
+	uint64_t			run;
+	uint64_t			samples;
+	uint64_t			records;
+	size_t				fill;
+	int				error;
+	uint8_t				out[RLE_OUT_SIZE];
+};
+
+struct rle_decoder {
+	uint8_t				value;
+	uint64_t			left;		/* samples of 'value' still to emit */
+	uint64_t			acc;		/* varint being assembled */
+	unsigned int			shift;
+	int				want_value;
+};
+
+/* index of the first byte in p[0..n) that differs from v, n if there is none */
+size_t rle_scan(const uint8_t *p, size_t n, uint8_t v);
+
+void rle_encoder_init(struct rle_encoder *enc, FILE *file);
+int rle_encode(struct rle_encoder *enc, const uint8_t *data, size_t size);
+int rle_encoder_finish(struct rle_encoder *enc);
+
+void rle_decoder_init(struct rle_decoder *dec);
+size_t rle_decode(struct rle_decoder *dec, const uint8_t *in, size_t in_len, size_t *consumed,
+		  uint8_t *out, size_t out_len);
+
+/* output backend, see slogic_get_output_formats() */
+int rle_callback_open(struct slogic_ctx *handle, char *openstring);
+size_t rle_callback_write(struct slogic_ctx *handle, uint8_t *data, size_t size);
+void rle_callback_close(struct slogic_ctx *handle);
+
+#endif
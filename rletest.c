@@ -0,0 +1,151 @@
+// vim: sw=8:ts=8:noexpandtab
+/*
+ * Round trip checks for the transition codec, see rle.h; run by make test.
+ *
+ * Every stream is encoded in one piece and again in odd sized chunks, the
+ * two encodings have to match, and decoded with the input cut at every byte
+ * and the output handed out in small pieces it has to give the stream back.
+ */
+#include "rle.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int failures = 0;
+
+#define CHECK(cond, ...) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "%s:%d: ", __FILE__, __LINE__); \
+		fprintf(stderr, __VA_ARGS__); \
+		fprintf(stderr, "\n"); \
+		failures++; \
+	} \
+} while (0)
+
+/* encodes data in chunks of the sizes given, cycling through them; 0 terminates the list */
+static uint8_t *encode(const uint8_t *data, size_t size, const size_t *chunks, size_t *len){
+struct rle_encoder *enc = malloc(sizeof(struct rle_encoder));
+char *buf = NULL;
+size_t off = 0, n, c = 0;
+FILE *f;
+
+	if (!enc || !(f = open_memstream(&buf, len))) {
+		abort();
+	}
+	rle_encoder_init(enc, f);
+	while (off < size) {
+		n = chunks[c] < size - off ? chunks[c] : size - off;
+		CHECK(rle_encode(enc, data + off, n) == 0, "rle_encode failed");
+		off += n;
+		c = chunks[c + 1] ? c + 1 : 0;
+	}
+	CHECK(rle_encoder_finish(enc) == 0, "rle_encoder_finish failed");
+	fclose(f);
+	free(enc);
+	return (uint8_t *)buf;
+}
+
+/* decodes in[0..len) with the input cut at 'cut' and at most 'step' samples out per call */
+static size_t decode(const uint8_t *in, size_t len, size_t cut, size_t step, uint8_t *out, size_t out_size){
+struct rle_decoder dec;
+size_t pos = 0, end, o = 0, n, consumed;
+
+	rle_decoder_init(&dec);
+	for (end = cut; ; end = len) {
+		do {
+			n = out_size - o < step ? out_size - o : step;
+			n = rle_decode(&dec, in + pos, end - pos, &consumed, out + o, n);
+			o += n;
+			pos += consumed;
+		} while (n || consumed);
+		if (end == len) {
+			break;
+		}
+	}
+	CHECK(pos == len, "decoder stopped at %zu of %zu input bytes", pos, len);
+	return o;
+}
+
+static void roundtrip(const char *name, const uint8_t *data, size_t size, int every_cut){
+static const size_t whole[] = { (size_t)-1, 0 };
+static const size_t odd[] = { 1, 3, 7, 4093, 5, 65537, 2, 0 };
+uint8_t *ref, *enc, *out;
+size_t ref_len, enc_len, n, cut;
+
+	ref = encode(data, size, whole, &ref_len);
+	enc = encode(data, size, odd, &enc_len);
+	CHECK(ref_len == enc_len && !memcmp(ref, enc, ref_len), "%s: chunked encoding differs", name);
+
+	if (!(out = malloc(size + 1))) {
+		abort();
+	}
+	for (cut = 0; cut <= ref_len; cut += every_cut ? 1 : ref_len / 97 + 1) {
+		memset(out, 0, size + 1);
+		n = decode(ref, ref_len, cut, cut % 2 ? 13 : size + 1, out, size + 1);
+		if (n != size || memcmp(out, data, size)) {
+			CHECK(0, "%s: %zu of %zu samples back, input cut at %zu", name, n, size, cut);
+			break;
+		}
+	}
+	free(out);
+	free(enc);
+	free(ref);
+}
+
+/* runs of random length and value, now and then a long one */
+static uint8_t *random_stream(size_t size){
+uint8_t *p = malloc(size);
+size_t i = 0, run;
+
+	if (!p) {
+		abort();
+	}
+	while (i < size) {
+		run = rand() % 8 ? 1 + rand() % 40 : 1 + rand() % 70000;
+		if (run > size - i) {
+			run = size - i;
+		}
+		memset(p + i, rand() & 0xff, run);
+		i += run;
+	}
+	return p;
+}
+
+int main(int argc, char **argv){
+static const size_t lengths[] = { 127, 128, 129, 16383, 16384, 16385, 2097152 + 5 };
+uint8_t single = 0xa5, *p;
+size_t i;
+int seed;
+
+	roundtrip("empty", &single, 0, 1);
+	roundtrip("single sample", &single, 1, 1);
+
+	for (i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+		/* a run of each length between two short ones, the varint is 1 to 4 bytes */
+		p = malloc(lengths[i] + 2);
+		if (!p) {
+			abort();
+		}
+		memset(p, 0x11, lengths[i] + 2);
+		p[0] = 0x00;
+		p[lengths[i] + 1] = 0xff;
+		roundtrip("long run", p, lengths[i] + 2, 1);
+		free(p);
+	}
+
+	for (seed = 1; seed <= 20; seed++) {
+		srand(seed);
+		i = 1 + rand() % 300000;
+		p = random_stream(i);
+		roundtrip("random", p, i, seed <= 4);
+		free(p);
+	}
+
+	if (failures) {
+		fprintf(stderr, "%d rle checks failed\n", failures);
+		return EXIT_FAILURE;
+	}
+	printf("rle: all round trips passed\n");
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,167 @@
+// vim: sw=8:ts=8:noexpandtab
+#include "rotate.h"
+#include "slogic.h"
+#include "output.h"
+#include "log.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+static void rotate_write_header(struct slogic_ctx *handle, bool complete){
+struct slogic_rotate *rotate = &handle->rotate;
+unsigned int rate = handle->sample_rate->samples_per_second;
+struct timespec start = rotate->t0;
+char name[sizeof(rotate->filename) + 4];
+FILE *file;
+
+	/* the clock of sample 0 plus the samples before this segment */
+	start.tv_sec += rotate->start / rate;
+	start.tv_nsec += (rotate->start % rate) * 1000000000ull / rate;
+	if (start.tv_nsec >= 1000000000) {
+		start.tv_sec++;
+		start.tv_nsec -= 1000000000;
+	}
+	snprintf(name, sizeof(name), "%s.hdr", rotate->filename);
+	if (!(file = fopen(name, "w"))) {
+		log_printf( ERR, "Failed to write the segment header %s: %s\n", name, strerror(errno));
+		return;
+	}
+	fprintf(file, "slogic segment 1\n");
+	fprintf(file, "index=%u\n", rotate->index);
+	fprintf(file, "format=%s\n", handle->output_format ? handle->output_format->name : "");
+	fprintf(file, "sample_rate=%u\n", rate);
+	fprintf(file, "channel_mask=0x%02x\n", slogic_pack_enabled(&handle->pack) ? handle->pack.mask : 0xff);
+	fprintf(file, "start_sample=%llu\n", (unsigned long long)rotate->start);
+	fprintf(file, "samples=%llu\n", (unsigned long long)rotate->fill);
+	fprintf(file, "start_time=%lld.%09ld\n", (long long)start.tv_sec, (long)start.tv_nsec);
+	fprintf(file, "dropped=%llu\n", (unsigned long long)rotate->dropped);
+	fprintf(file, "complete=%d\n", complete);
+	fclose(file);
+}
+
+static int rotate_open(struct slogic_ctx *handle){
+struct slogic_rotate *rotate = &handle->rotate;
+
+	snprintf(rotate->filename, sizeof(rotate->filename), "%s.%0*u", rotate->base, ROTATE_SEGMENT_DIGITS,
+		 rotate->index);
+	rotate->start = rotate->seen;
+	rotate->fill = 0;
+	rotate->dropped = 0;
+	if (!handle->data_callback_open(handle, rotate->filename)) {
+		if (!rotate->failing) {
+			log_printf( ERR, "Failed to open segment %s, dropping samples until one opens\n", rotate->filename);
+		}
+		rotate->failing = true;
+		return -1;
+	}
+	rotate->failing = false;
+	rotate->open = true;
+	rotate_write_header(handle, false);
+	log_printf( DEBUG, "Segment %s starts at sample %llu\n", rotate->filename, (unsigned long long)rotate->start);
+	return 0;
+}
+
+static void rotate_close(struct slogic_ctx *handle){
+struct slogic_rotate *rotate = &handle->rotate;
+
+	handle->data_callback_close(handle);
+	rotate->open = false;
+	rotate_write_header(handle, true);
+	if (rotate->dropped) {
+		log_printf( ERR, "Segment %s: %llu samples dropped\n", rotate->filename,
+			    (unsigned long long)rotate->dropped);
+	}
+	rotate->index++;
+}
+
+int slogic_rotate_arm(struct slogic_ctx *handle, const char *base){
+struct slogic_rotate *rotate = &handle->rotate;
+
+	if (strcmp(base, "-") == 0) {
+		log_printf( ERR, "Segments are files, rotation cannot write to stdout\n");
+		return -1;
+	}
+	rotate->base = base;
+	rotate->open = rotate->failing = false;
+	rotate->index = 0;
+	rotate->seen = 0;
+	rotate->dropped_total = 0;
+	rotate->t0.tv_sec = rotate->t0.tv_nsec = 0;
+	atomic_init(&rotate->done, 0);
+	/* an unwritable destination should fail now, not on the first sample */
+	if (rotate_open(handle)) {
+		return -1;
+	}
+
+	/* one output per segment, transfers cannot land in a file that is about to be closed */
+	rotate->sink = handle->data_callback_write;
+	handle->data_callback_write = slogic_rotate_write;
+	handle->data_callback_buffer = NULL;
+	log_printf( DEBUG, "Rotation: %llu samples per segment%s\n", (unsigned long long)rotate->segment,
+		    rotate->stop_after ? "" : ", until stopped");
+	return 0;
+}
+
+size_t slogic_rotate_write(struct slogic_ctx *handle, uint8_t *data, size_t size){
+struct slogic_rotate *rotate = &handle->rotate;
+size_t n, total = size;
+uint64_t ns;
+
+	if (!rotate->seen && size) {
+		/* the first block was sampled over the time it took to fill */
+		clock_gettime(CLOCK_REALTIME, &rotate->t0);
+		ns = (uint64_t)size * 1000000000ull / handle->sample_rate->samples_per_second;
+		ns = rotate->t0.tv_sec * 1000000000ull + rotate->t0.tv_nsec - ns;
+		rotate->t0.tv_sec = ns / 1000000000ull;
+		rotate->t0.tv_nsec = ns % 1000000000ull;
+	}
+	if (rotate->stop_after && rotate->seen + size >= rotate->stop_after) {
+		size = rotate->stop_after - rotate->seen;
+		atomic_store(&rotate->done, 1);
+	}
+	while (size) {
+		if (!rotate->open && rotate_open(handle)) {
+			/* a gap, the next segment's start_sample shows it */
+			rotate->seen += size;
+			rotate->dropped_total += size;
+			break;
+		}
+		n = rotate->segment - rotate->fill;
+		if (n > size) {
+			n = size;
+		}
+		if (rotate->sink(handle, data, n) != n) {
+			rotate->dropped += n;
+			rotate->dropped_total += n;
+		} else {
+			rotate->fill += n;
+		}
+		rotate->seen += n;
+		data += n;
+		size -= n;
+		if (rotate->fill + rotate->dropped == rotate->segment) {
+			rotate_close(handle);
+		}
+	}
+	return total;
+}
+
+void slogic_rotate_stop(struct slogic_ctx *handle){
+	atomic_store(&handle->rotate.done, 1);
+}
+
+void slogic_rotate_disarm(struct slogic_ctx *handle){
+struct slogic_rotate *rotate = &handle->rotate;
+
+	if (rotate->open) {
+		rotate_close(handle);
+	}
+	if (rotate->sink) {
+		handle->data_callback_write = rotate->sink;
+		handle->data_callback_buffer = handle->output_format ? handle->output_format->buffer : NULL;
+		rotate->sink = NULL;
+	}
+	log_printf( NOTICE, "Wrote %u segments, %llu samples, %llu dropped\n", rotate->index,
+		    (unsigned long long)(rotate->seen - rotate->dropped_total), (unsigned long long)rotate->dropped_total);
+}
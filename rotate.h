@@ -0,0 +1,73 @@
+// vim: sw=8:ts=8:noexpandtab
+#ifndef __ROTATE_H__
+#define __ROTATE_H__
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <time.h>
+
+/*
+ * Endless capture into a series of segment files (-c). The stream is cut
+ * every 'segment' samples, exactly on the sample, and each piece goes to
+ * <file>.<n> through the selected output, closed like a capture of its own
+ * so it decodes without its neighbours. Next to it <file>.<n>.hdr holds
+ * what a segment cannot say about itself:
+ *
+ *   slogic segment 1
+ *   index=<n>
+ *   format=<output format>
+ *   sample_rate=<samples per second>
+ *   channel_mask=<the channels in the file, packed (-m, pack.h) unless 0xff>
+ *   start_sample=<index of the first sample in the whole capture>
+ *   samples=<in this segment>
+ *   start_time=<unix time of the first sample, seconds.nanoseconds>
+ *   dropped=<samples that belonged here but could not be written>
+ *   complete=<0 while the segment is written, 1 once it is closed>
+ *
+ * start_sample of segment n+1 is start_sample + samples + dropped of
+ * segment n, so a reader can tell a gap from a clean boundary.
+ *
+ * Rotation runs on the writer thread like every other write, the usb
+ * callback only ever sees the pipeline queue; closing one segment and
+ * opening the next is absorbed by the queue. The capture goes on until
+ * SIGINT, SIGUSR1 or 'stop_after' samples.
+ */
+
+#define ROTATE_SEGMENT_DIGITS 6
+
+struct slogic_ctx;
+
+struct slogic_rotate {
+	uint64_t			segment;	/* samples per segment, 0 when not rotating */
+	uint64_t			stop_after;	/* stop at this sample, 0 for never */
+	const char			*base;
+
+	/* writer thread state */
+	bool				open;
+	bool				failing;	/* the last open failed, logged once */
+	unsigned int			index;		/* of the open segment, or the next one */
+	uint64_t			seen;		/* samples handed to us */
+	uint64_t			start;		/* first sample of the open segment */
+	uint64_t			fill;		/* samples written to it */
+	uint64_t			dropped;	/* samples lost in it */
+	uint64_t			dropped_total;
+	struct timespec			t0;		/* wall clock time of sample 0 */
+	char				filename[4096];	/* the output keeps a pointer to it */
+	size_t				(*sink)(struct slogic_ctx *handle, uint8_t *data, size_t size);
+
+	_Atomic int			done;		/* seen by the usb callback */
+};
+
+static inline bool slogic_rotate_enabled(struct slogic_rotate *rotate){
+	return rotate->segment > 0;
+}
+/* opens the first segment and puts the rotation in front of data_callback_write() */
+int slogic_rotate_arm(struct slogic_ctx *handle, const char *base);
+size_t slogic_rotate_write(struct slogic_ctx *handle, uint8_t *data, size_t size);
+/* async signal safe, ends the capture; what is queued still goes to the open segment */
+void slogic_rotate_stop(struct slogic_ctx *handle);
+/* closes the last segment and restores data_callback_write() */
+void slogic_rotate_disarm(struct slogic_ctx *handle);
+
+#endif
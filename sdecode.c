@@ -0,0 +1,99 @@
+// vim: sw=8:ts=8:noexpandtab
+/*
+ * Runs the protocol decoders of -D over a recorded capture, giving the
+ * frames the live decoders would have, see decode.h.
+ *
+ *   sdecode [-r <sample rate>] [-F <format>] [-O [text:|bin:]<file>] -D <decoder> [-D ...] <capture>
+ */
+#include "capture.h"
+#include "decode.h"
+#include "log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define SDECODE_CHUNK (1024 * 1024)	/* samples read at a time */
+
+static void usage(const char *name){
+	fprintf(stderr, "usage: %s [-r <sample rate>] [-F raw|blockz|zlib|rle] [-O [text:|bin:]<file>] "
+		"-D <decoder> [-D ...] <capture>\n", name);
+	fprintf(stderr, " -r: Sample rate (\"24MHz\", \"500k\", \"16000000\"), blockz captures carry theirs.\n");
+	fprintf(stderr, " -F: Capture format, told from the file by default.\n");
+	fprintf(stderr, " -O: Where the frames go. Defaults to text on stdout.\n");
+	fprintf(stderr, " -D: uart:rx=<ch>,baud=<n>[,bits=5..9][,parity=none|even|odd][,stop=1|2][,invert]\n");
+	fprintf(stderr, "     spi:clk=<ch>[,mosi=<ch>][,miso=<ch>][,cs=<ch>][,mode=0..3][,bits=1..32][,lsb][,cs_high]\n");
+	fprintf(stderr, "     i2c:scl=<ch>,sda=<ch>\n");
+}
+
+int main(int argc, char **argv){
+static struct slogic_decode decode;
+struct capture_reader *c;
+const char *format = NULL, *output = NULL;
+uint32_t rate = 0;
+uint64_t at = 0;
+uint8_t *buf;
+ssize_t n;
+int ch, failed = 0;
+
+	current_log_level = ERR;
+	while ((ch = getopt(argc, argv, "r:F:O:D:h")) != -1) {
+		switch (ch) {
+		case 'r':
+			if (!(rate = capture_parse_rate(optarg))) {
+				fprintf(stderr, "Invalid sample rate: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'F':
+			format = optarg;
+			break;
+		case 'O':
+			output = optarg;
+			break;
+		case 'D':
+			if (decode_add(&decode, optarg)) {
+				fprintf(stderr, "Invalid decoder: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		default:
+			usage(argv[0]);
+			return ch == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+	if (optind + 1 != argc || !slogic_decode_enabled(&decode)) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+	if (!(c = capture_open(argv[optind], format))) {
+		return EXIT_FAILURE;
+	}
+	if (!rate && !(rate = c->samples_per_second)) {
+		fprintf(stderr, "%s does not say its sample rate, give it with -r\n", argv[optind]);
+		capture_close(c);
+		return EXIT_FAILURE;
+	}
+	if (!(buf = malloc(SDECODE_CHUNK)) || decode_start(&decode, rate, output)) {
+		free(buf);
+		capture_close(c);
+		return EXIT_FAILURE;
+	}
+	while (at < c->n_samples) {
+		n = capture_read(c, at, buf, c->n_samples - at < SDECODE_CHUNK ? c->n_samples - at : SDECODE_CHUNK);
+		if (n <= 0) {
+			failed = n < 0 || c->n_samples != CAPTURE_UNKNOWN;
+			break;
+		}
+		decode_feed(&decode, buf, n, at);
+		at += n;
+	}
+	decode_finish(&decode);
+	if (failed) {
+		fprintf(stderr, "Failed to read %s\n", argv[optind]);
+	}
+	free(buf);
+	capture_close(c);
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
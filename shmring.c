@@ -0,0 +1,278 @@
+// vim: sw=8:ts=8:noexpandtab
+#include "shmring.h"
+#include "slogic.h"
+#include "log.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define SHM_ALIGN(x, a) (((x) + (a) - 1) / (a) * (a))
+
+/*
+ * Writer
+ */
+
+int slogic_shm_set_name(struct slogic_ctx *handle, const char *name){
+struct slogic_shm *shm = &handle->shm;
+size_t len;
+
+	if (*name == '/') {
+		name++;
+	}
+	len = strlen(name);
+	if (!len || len > NAME_MAX - 1 || strchr(name, '/')) {
+		return -1;
+	}
+	free(shm->name);
+	shm->name = malloc(len + 2);
+	if (!shm->name) {
+		return -1;
+	}
+	shm->name[0] = '/';
+	memcpy(shm->name + 1, name, len + 1);
+	return 0;
+}
+
+uint8_t *slogic_shm_create(struct slogic_ctx *handle, size_t buffer_size, unsigned int n_buffers){
+struct slogic_shm *shm = &handle->shm;
+struct shm_header *header;
+size_t page = sysconf(_SC_PAGESIZE), slots, generations, arena, size;
+int fd;
+
+	slots = SHM_ALIGN(sizeof(struct shm_header), 64);
+	generations = slots + SHM_SLOTS * sizeof(struct shm_slot);
+	arena = SHM_ALIGN(generations + n_buffers * sizeof(uint64_t), page);
+	size = arena + buffer_size * n_buffers;
+
+	/* a name left over from a capture that did not end cleanly is ours to take */
+	if ((fd = shm_open(shm->name, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+		log_printf( ERR, "shm_open %s: %s\n", shm->name, strerror(errno));
+		return NULL;
+	}
+	if (ftruncate(fd, size)) {
+		log_printf( ERR, "Could not size %s to %zu bytes: %s\n", shm->name, size, strerror(errno));
+		close(fd);
+		shm_unlink(shm->name);
+		return NULL;
+	}
+	header = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | SLOGIC_MAP_POPULATE, fd, 0);
+	close(fd);
+	if (header == MAP_FAILED) {
+		log_printf( ERR, "Could not map %s: %s\n", shm->name, strerror(errno));
+		shm_unlink(shm->name);
+		return NULL;
+	}
+
+	header->samples_per_second = handle->sample_rate ? handle->sample_rate->samples_per_second : 0;
+	header->n_slots = SHM_SLOTS;
+	header->n_buffers = n_buffers;
+	header->buffer_size = buffer_size;
+	header->slots_offset = slots;
+	header->generations_offset = generations;
+	header->arena_offset = arena;
+	header->size = size;
+	atomic_init(&header->head, 0);
+	atomic_init(&header->state, SHM_STARTING);
+	header->pid = getpid();
+	shm->header = header;
+	shm->slots = (struct shm_slot *)((uint8_t *)header + slots);
+	shm->generations = (_Atomic uint64_t *)((uint8_t *)header + generations);
+	shm->arena = (uint8_t *)header + arena;
+	/* the magic last, a reader that sees it sees the rest */
+	atomic_thread_fence(memory_order_release);
+	memcpy(header->magic, SHM_MAGIC, sizeof(header->magic));
+	log_printf( DEBUG, "Exporting the transfer arena as %s, %zu bytes\n", shm->name, size);
+	return shm->arena;
+}
+
+void slogic_shm_destroy(struct slogic_ctx *handle){
+struct slogic_shm *shm = &handle->shm;
+
+	if (!shm->header) {
+		return;
+	}
+	atomic_store(&shm->header->state, SHM_DONE);
+	shm_unlink(shm->name);
+	munmap(shm->header, shm->header->size);
+	shm->header = NULL;
+	shm->arena = NULL;
+}
+
+void slogic_shm_start(struct slogic_ctx *handle){
+struct slogic_shm *shm = &handle->shm;
+
+	if (!shm->header) {
+		return;
+	}
+	shm->header->samples_per_second = handle->sample_rate->samples_per_second;
+	/* an output's own buffers are not in the arena, readers would not get them */
+	handle->data_callback_buffer = NULL;
+	shm->samples = 0;
+	shm->published = 0;
+	shm->unpublished = 0;
+	atomic_store(&shm->header->state, SHM_RUNNING);
+}
+
+void slogic_shm_stop(struct slogic_ctx *handle){
+	if (handle->shm.header) {
+		atomic_store(&handle->shm.header->state, SHM_DONE);
+	}
+}
+
+void slogic_shm_publish(struct slogic_ctx *handle, uint8_t *data, size_t size){
+struct slogic_shm *shm = &handle->shm;
+struct shm_slot *slot;
+uint64_t head, buffer;
+
+	if (!shm->header) {
+		return;
+	}
+	if (data < shm->arena || data >= shm->arena + (size_t)shm->header->n_buffers * shm->header->buffer_size) {
+		shm->unpublished++;
+		shm->samples += size;
+		return;
+	}
+	buffer = (data - shm->arena) / shm->header->buffer_size;
+	head = atomic_load_explicit(&shm->header->head, memory_order_relaxed);
+	slot = &shm->slots[head & (SHM_SLOTS - 1)];
+	/* readers of the old publication in this slot see the seq change under them */
+	atomic_store_explicit(&slot->seq, 0, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	slot->buffer = buffer;
+	slot->length = size;
+	slot->generation = atomic_load_explicit(&shm->generations[buffer], memory_order_relaxed);
+	slot->first_sample = shm->samples;
+	atomic_store_explicit(&slot->seq, head + 1, memory_order_release);
+	atomic_store_explicit(&shm->header->head, head + 1, memory_order_release);
+	shm->samples += size;
+	shm->published++;
+}
+
+void slogic_shm_reuse(struct slogic_ctx *handle, uint8_t *data){
+struct slogic_shm *shm = &handle->shm;
+uint64_t buffer;
+
+	if (!shm->header || data < shm->arena ||
+	    data >= shm->arena + (size_t)shm->header->n_buffers * shm->header->buffer_size) {
+		return;
+	}
+	buffer = (data - shm->arena) / shm->header->buffer_size;
+	/* before the transfer is submitted, so before the first byte of new data */
+	atomic_fetch_add_explicit(&shm->generations[buffer], 1, memory_order_seq_cst);
+}
+
+void slogic_shm_report(struct slogic_ctx *handle){
+struct slogic_shm *shm = &handle->shm;
+
+	if (shm->header) {
+		log_printf( NOTICE, "Published in %s: %lu transfers, %lu in heap buffers not\n", shm->name, shm->published,
+			    shm->unpublished);
+	}
+}
+
+/*
+ * Reader
+ */
+
+struct shm_reader *shm_reader_open(const char *name){
+struct shm_reader *reader;
+struct shm_header *header;
+struct stat st;
+char path[NAME_MAX + 1];
+int fd;
+
+	snprintf(path, sizeof(path), "%s%s", *name == '/' ? "" : "/", name);
+	if ((fd = shm_open(path, O_RDONLY, 0)) < 0) {
+		return NULL;
+	}
+	if (fstat(fd, &st) || (size_t)st.st_size < sizeof(struct shm_header)) {
+		close(fd);
+		errno = EINVAL;
+		return NULL;
+	}
+	header = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (header == MAP_FAILED) {
+		return NULL;
+	}
+	if (memcmp(header->magic, SHM_MAGIC, sizeof(header->magic)) != 0 || header->size > (uint64_t)st.st_size) {
+		munmap(header, st.st_size);
+		errno = EINVAL;
+		return NULL;
+	}
+	atomic_thread_fence(memory_order_acquire);
+	if (!(reader = calloc(1, sizeof(*reader)))) {
+		munmap(header, st.st_size);
+		return NULL;
+	}
+	reader->header = header;
+	reader->slots = (const struct shm_slot *)((const uint8_t *)header + header->slots_offset);
+	reader->generations = (const _Atomic uint64_t *)((const uint8_t *)header + header->generations_offset);
+	reader->arena = (const uint8_t *)header + header->arena_offset;
+	reader->size = st.st_size;
+	reader->cursor = atomic_load_explicit(&header->head, memory_order_acquire);
+	return reader;
+}
+
+void shm_reader_close(struct shm_reader *reader){
+	if (reader) {
+		munmap((void *)reader->header, reader->size);
+		free(reader);
+	}
+}
+
+int shm_reader_next(struct shm_reader *reader, struct shm_block *block){
+const struct shm_slot *slot;
+uint64_t head;
+uint32_t state;
+
+	for (;;) {
+		state = atomic_load_explicit(&reader->header->state, memory_order_acquire);
+		head = atomic_load_explicit(&reader->header->head, memory_order_acquire);
+		if (reader->cursor == head) {
+			return state == SHM_DONE ? -1 : 0;
+		}
+		if (head - reader->cursor > reader->header->n_slots) {
+			reader->overruns++;
+			reader->cursor = head - 1;
+			continue;
+		}
+		slot = &reader->slots[reader->cursor & (reader->header->n_slots - 1)];
+		if (atomic_load_explicit(&slot->seq, memory_order_acquire) != reader->cursor + 1) {
+			reader->overruns++;
+			reader->cursor = head - 1;
+			continue;
+		}
+		block->buffer = slot->buffer;
+		block->length = slot->length;
+		block->generation = slot->generation;
+		block->first_sample = slot->first_sample;
+		/* the slot may have been taken for a newer publication while it was copied */
+		atomic_thread_fence(memory_order_acquire);
+		if (atomic_load_explicit(&slot->seq, memory_order_relaxed) != reader->cursor + 1 ||
+		    block->buffer >= reader->header->n_buffers || block->length > reader->header->buffer_size) {
+			reader->overruns++;
+			reader->cursor = head - 1;
+			continue;
+		}
+		block->data = reader->arena + (size_t)block->buffer * reader->header->buffer_size;
+		reader->cursor++;
+		return 1;
+	}
+}
+
+bool shm_reader_valid(struct shm_reader *reader, const struct shm_block *block){
+	atomic_thread_fence(memory_order_acquire);
+	if (atomic_load_explicit(&reader->generations[block->buffer], memory_order_relaxed) != block->generation) {
+		reader->overruns++;
+		return false;
+	}
+	return true;
+}
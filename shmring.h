@@ -0,0 +1,123 @@
+// vim: sw=8:ts=8:noexpandtab
+#ifndef __SHMRING_H__
+#define __SHMRING_H__
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+/*
+ * Live samples for other processes (-S <name>, read with sshm or the reader
+ * below). The transfer arena itself is put in the POSIX shared memory object
+ * /<name>, so a completed transfer is published by writing its descriptor
+ * into a ring, no sample is copied. The usb callback is the only writer;
+ * readers map the object read only, keep their own cursor and never hold
+ * the capture up.
+ *
+ * A reader falls behind in two ways, both detected on its side: the
+ * descriptor ring wrapped past its cursor (the slot's seq is not the one it
+ * expects), or the buffer a descriptor points to was handed to a transfer
+ * again while it was being read (the buffer's generation moved on). Either
+ * way it counts an overrun and continues at the newest transfer.
+ *
+ * Only arena buffers can be published; the transfers filled into heap
+ * buffers when the pool ran dry show up as a gap in first_sample. With -S
+ * the output's own buffers are not used and neither is usbfs dma memory.
+ * The object is unlinked when the capture ends, mapped readers keep it.
+ *
+ * Object layout, in the writer's byte order:
+ *   struct shm_header, struct shm_slot[n_slots] at slots_offset,
+ *   _Atomic uint64_t generation[n_buffers] at generations_offset,
+ *   the arena, n_buffers of buffer_size bytes, at arena_offset (page aligned)
+ */
+
+#define SHM_MAGIC "SLSHM001"
+#define SHM_SLOTS 4096	/* published transfers a reader can be behind, a power of two */
+
+enum shm_state {
+	SHM_STARTING = 0,
+	SHM_RUNNING = 1,
+	SHM_DONE = 2
+};
+
+struct shm_slot {
+	_Atomic uint64_t		seq;		/* n + 1 once it holds publication n */
+	uint32_t			buffer;
+	uint32_t			length;
+	uint64_t			generation;	/* of the buffer when it was published */
+	uint64_t			first_sample;
+};
+
+struct shm_header {
+	char				magic[8];
+	uint32_t			samples_per_second;
+	uint32_t			n_slots;
+	uint32_t			n_buffers;
+	uint32_t			buffer_size;
+	uint64_t			slots_offset;
+	uint64_t			generations_offset;
+	uint64_t			arena_offset;
+	uint64_t			size;
+	_Atomic uint64_t		head;		/* publications so far */
+	_Atomic uint32_t		state;		/* enum shm_state */
+	uint32_t			pid;
+};
+
+struct slogic_ctx;
+
+/* writer side, in the capture */
+struct slogic_shm {
+	char				*name;		/* "/<name>", NULL if not exported */
+	struct shm_header		*header;
+	struct shm_slot			*slots;
+	_Atomic uint64_t		*generations;
+	uint8_t				*arena;
+	uint64_t			samples;
+	unsigned long			published;
+	unsigned long			unpublished;	/* transfers in heap buffers */
+};
+
+static inline bool slogic_shm_enabled(struct slogic_shm *shm){
+	return shm->name != NULL;
+}
+/* "name" or "/name"; non zero if it is not a valid object name */
+int slogic_shm_set_name(struct slogic_ctx *handle, const char *name);
+/* creates the object with room for the arena, for slogic_pool_alloc(); NULL on error */
+uint8_t *slogic_shm_create(struct slogic_ctx *handle, size_t buffer_size, unsigned int n_buffers);
+void slogic_shm_destroy(struct slogic_ctx *handle);
+void slogic_shm_start(struct slogic_ctx *handle);
+void slogic_shm_stop(struct slogic_ctx *handle);
+/* usb callback: a transfer completed into 'data' */
+void slogic_shm_publish(struct slogic_ctx *handle, uint8_t *data, size_t size);
+/* 'data' is about to be submitted and overwritten */
+void slogic_shm_reuse(struct slogic_ctx *handle, uint8_t *data);
+void slogic_shm_report(struct slogic_ctx *handle);
+
+/* reader side, in any process */
+struct shm_reader {
+	const struct shm_header		*header;
+	const struct shm_slot		*slots;
+	const _Atomic uint64_t		*generations;
+	const uint8_t			*arena;
+	size_t				size;
+	uint64_t			cursor;		/* next publication to read */
+	unsigned long			overruns;
+};
+
+struct shm_block {
+	const uint8_t			*data;		/* in the writer's arena, check shm_reader_valid() after use */
+	size_t				length;
+	uint64_t			first_sample;
+	uint32_t			buffer;
+	uint64_t			generation;
+};
+
+/* maps /<name> and starts at the newest transfer; NULL (with errno) on error */
+struct shm_reader *shm_reader_open(const char *name);
+void shm_reader_close(struct shm_reader *reader);
+/* 1 with the next block, 0 if there is none yet, -1 once the capture is done and everything read */
+int shm_reader_next(struct shm_reader *reader, struct shm_block *block);
+/* whether the block was not overwritten while it was used; counts an overrun if it was */
+bool shm_reader_valid(struct shm_reader *reader, const struct shm_block *block);
+
+#endif
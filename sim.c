@@ -0,0 +1,455 @@
+// vim: sw=8:ts=8:noexpandtab
+#include "sim.h"
+#include "slogic.h"
+#include "log.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* survives slogic_close() like a real unit keeps its firmware until unplugged */
+static int sim_firmware_loaded = -1;
+
+static void sim_now(struct timespec *ts){
+	clock_gettime(CLOCK_MONOTONIC, ts);
+}
+
+static void sim_sleep_until(const struct timespec *ts){
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, ts, NULL) == EINTR)
+		;
+}
+
+static void sim_add_ns(struct timespec *ts, uint64_t ns){
+	ts->tv_sec += ns / 1000000000;
+	ts->tv_nsec += ns % 1000000000;
+	if (ts->tv_nsec >= 1000000000) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+
+static int sim_cmp(const struct timespec *a, const struct timespec *b){
+	if (a->tv_sec != b->tv_sec) {
+		return a->tv_sec < b->tv_sec ? -1 : 1;
+	}
+	return a->tv_nsec < b->tv_nsec ? -1 : a->tv_nsec > b->tv_nsec;
+}
+
+/* number of samples the device has taken since the capture started */
+static uint64_t sim_due(struct sim_logic *sim, const struct timespec *now){
+time_t sec = now->tv_sec - sim->start.tv_sec;
+long nsec = now->tv_nsec - sim->start.tv_nsec;
+
+	if (nsec < 0) {
+		sec--;
+		nsec += 1000000000;
+	}
+	return (uint64_t)sec * sim->samples_per_second + (uint64_t)nsec * sim->samples_per_second / 1000000000;
+}
+
+/* the moment sample 'n' has been taken */
+static void sim_time_of(struct sim_logic *sim, uint64_t n, struct timespec *ts){
+	*ts = sim->start;
+	ts->tv_sec += n / sim->samples_per_second;
+	sim_add_ns(ts, (n % sim->samples_per_second) * 1000000000ULL / sim->samples_per_second);
+}
+
+/*
+ * What the probes see
+ */
+
+static void sim_fill(struct sim_logic *sim, uint8_t *buffer, size_t length){
+uint64_t n = sim->produced, x;
+size_t i = 0, run;
+
+	switch (sim->pattern) {
+	case SIM_PATTERN_COUNTER:
+		/* channels count up every 64 samples */
+		while (i < length) {
+			run = 64 - ((n + i) & 63);
+			if (run > length - i) {
+				run = length - i;
+			}
+			memset(buffer + i, (uint8_t)((n + i) >> 6), run);
+			i += run;
+		}
+		break;
+	case SIM_PATTERN_CLOCK:
+		/* channel 0 a clock at rate/8, channel 1 a strobe every 1000 samples */
+		for (; i < length; i++) {
+			buffer[i] = (((n + i) >> 2) & 1) | (((n + i) % 1000) == 0) << 1;
+		}
+		break;
+	case SIM_PATTERN_RANDOM:
+		x = sim->random;
+		for (; i + 8 <= length; i += 8) {
+			x ^= x << 13;
+			x ^= x >> 7;
+			x ^= x << 17;
+			memcpy(buffer + i, &x, 8);
+		}
+		for (; i < length; i++) {
+			buffer[i] = x >> (8 * (i & 7));
+		}
+		sim->random = x;
+		break;
+	case SIM_PATTERN_IDLE:
+		memset(buffer, 0xff, length);
+		break;
+	case SIM_PATTERN_FILE:
+		while (i < length) {
+			x = (n + i) % sim->recording_size;
+			run = sim->recording_size - x;
+			if (run > length - i) {
+				run = length - i;
+			}
+			memcpy(buffer + i, sim->recording + x, run);
+			i += run;
+		}
+		break;
+	}
+}
+
+/*
+ * Transfer queue
+ */
+
+static struct libusb_transfer *sim_pop(struct sim_logic *sim){
+struct libusb_transfer *transfer;
+
+	if (!sim->queue_count) {
+		return NULL;
+	}
+	transfer = sim->queue[sim->queue_head];
+	sim->queue_head = (sim->queue_head + 1) % sim->queue_cap;
+	sim->queue_count--;
+	sim->queued_bytes -= transfer->length;
+	return transfer;
+}
+
+static void sim_complete(struct sim_logic *sim, struct libusb_transfer *transfer, enum libusb_transfer_status status){
+	transfer->status = status;
+	transfer->actual_length = 0;
+	if (status == LIBUSB_TRANSFER_COMPLETED) {
+		sim_fill(sim, transfer->buffer, transfer->length);
+		transfer->actual_length = transfer->length;
+		sim->produced += transfer->length;
+	}
+	transfer->callback(transfer);
+}
+
+/* completes the transfer at the head of the queue, or fails it if it is the one chosen for a fault */
+static void sim_complete_next(struct sim_logic *sim){
+struct libusb_transfer *transfer = sim_pop(sim);
+unsigned long seq = ++sim->completed;
+
+	if (seq == sim->gone_at) {
+		log_printf(DEBUG, "sim: device lost at transfer %lu\n", seq);
+		sim->gone = true;
+		sim->stopped = true;
+		sim_complete(sim, transfer, LIBUSB_TRANSFER_NO_DEVICE);
+		/* libusb fails everything that was still pending on a vanished device */
+		while ((transfer = sim_pop(sim))) {
+			sim_complete(sim, transfer, LIBUSB_TRANSFER_NO_DEVICE);
+		}
+		return;
+	}
+	if (seq == sim->timeout_at) {
+		sim->stopped = true;
+		sim_complete(sim, transfer, LIBUSB_TRANSFER_TIMED_OUT);
+	} else if (seq == sim->stall_at) {
+		sim->stopped = true;
+		sim_complete(sim, transfer, LIBUSB_TRANSFER_STALL);
+	} else if (seq == sim->overflow_at) {
+		sim->stopped = true;
+		sim_complete(sim, transfer, LIBUSB_TRANSFER_OVERFLOW);
+	} else {
+		sim_complete(sim, transfer, LIBUSB_TRANSFER_COMPLETED);
+	}
+}
+
+/*
+ * Transport
+ */
+
+static int sim_map_recording(struct sim_logic *sim, const char *filename){
+struct stat st;
+int fd;
+
+	if ((fd = open(filename, O_RDONLY)) < 0) {
+		perror(filename);
+		return -1;
+	}
+	if (fstat(fd, &st) || st.st_size == 0) {
+		log_printf(ERR, "sim: %s is empty\n", filename);
+		close(fd);
+		return -1;
+	}
+	sim->recording = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (sim->recording == MAP_FAILED) {
+		sim->recording = NULL;
+		perror(filename);
+		return -1;
+	}
+	sim->recording_size = st.st_size;
+	sim->pattern = SIM_PATTERN_FILE;
+	return 0;
+}
+
+static int sim_parse_args(struct sim_logic *sim, const char *args, bool *nofw){
+char *copy, *opt, *save = NULL, *value;
+int ret = 0;
+
+	if (!(copy = strdup(args))) {
+		return -1;
+	}
+	for (opt = strtok_r(copy, ",", &save); opt; opt = strtok_r(NULL, ",", &save)) {
+		value = strchr(opt, '=');
+		if (value) {
+			*value++ = '\0';
+		}
+		if (!strcmp(opt, "nofw")) {
+			*nofw = true;
+		} else if (!value) {
+			ret = -1;
+		} else if (!strcmp(opt, "speed")) {
+			if (!strcmp(value, "real")) {
+				sim->realtime = true;
+			} else if (!strcmp(value, "max")) {
+				sim->realtime = false;
+			} else {
+				ret = -1;
+			}
+		} else if (!strcmp(opt, "pattern")) {
+			if (!strcmp(value, "counter")) {
+				sim->pattern = SIM_PATTERN_COUNTER;
+			} else if (!strcmp(value, "clock")) {
+				sim->pattern = SIM_PATTERN_CLOCK;
+			} else if (!strcmp(value, "random")) {
+				sim->pattern = SIM_PATTERN_RANDOM;
+			} else if (!strcmp(value, "idle")) {
+				sim->pattern = SIM_PATTERN_IDLE;
+			} else {
+				ret = -1;
+			}
+		} else if (!strcmp(opt, "file")) {
+			if (sim_map_recording(sim, value)) {
+				ret = -1;
+			}
+		} else if (!strcmp(opt, "fifo")) {
+			sim->fifo = strtoul(value, NULL, 0);
+		} else if (!strcmp(opt, "timeout")) {
+			sim->timeout_at = strtoul(value, NULL, 0);
+		} else if (!strcmp(opt, "stall")) {
+			sim->stall_at = strtoul(value, NULL, 0);
+		} else if (!strcmp(opt, "overflow")) {
+			sim->overflow_at = strtoul(value, NULL, 0);
+		} else if (!strcmp(opt, "gone")) {
+			sim->gone_at = strtoul(value, NULL, 0);
+		} else {
+			ret = -1;
+		}
+		if (ret) {
+			log_printf(ERR, "sim: bad option '%s'\n", opt);
+			break;
+		}
+	}
+	free(copy);
+	return ret;
+}
+
+int sim_transport_open(struct slogic_ctx *handle, int logic_index){
+struct sim_logic *sim;
+bool nofw = false;
+
+	if (!(sim = calloc(1, sizeof(struct sim_logic)))) {
+		return -1;
+	}
+	sim->realtime = true;
+	sim->pattern = SIM_PATTERN_COUNTER;
+	sim->fifo = SIM_DEFAULT_FIFO;
+	sim->random = 0x9e3779b97f4a7c15ULL + logic_index;
+	if (sim_parse_args(sim, handle->transport_args ? handle->transport_args : "", &nofw)) {
+		handle->transport_opts = sim;
+		sim_transport_close(handle);
+		return -1;
+	}
+	if (sim_firmware_loaded < 0) {
+		sim_firmware_loaded = !nofw;
+	}
+
+	sim->queue_cap = handle->n_transfer_buffers + 1;
+	sim->queue = calloc(sim->queue_cap, sizeof(struct libusb_transfer *));
+	sim->cancelled = calloc(sim->queue_cap, sizeof(struct libusb_transfer *));
+	handle->transport_opts = sim;
+	if (!sim->queue || !sim->cancelled) {
+		sim_transport_close(handle);
+		return -1;
+	}
+	log_printf(DEBUG, "sim: virtual Logic #%d, %s\n", logic_index, sim->realtime ? "real time" : "full speed");
+	return 0;
+}
+
+void sim_transport_close(struct slogic_ctx *handle){
+struct sim_logic *sim = handle->transport_opts;
+
+	if (!sim) {
+		return;
+	}
+	if (sim->recording) {
+		munmap(sim->recording, sim->recording_size);
+	}
+	free(sim->queue);
+	free(sim->cancelled);
+	free(sim);
+	handle->transport_opts = NULL;
+}
+
+bool sim_transport_is_firmware_uploaded(struct slogic_ctx *handle){
+	return sim_firmware_loaded > 0;
+}
+
+int sim_transport_upload_firmware(struct slogic_ctx *handle, const char *filename){
+	log_printf(DEBUG, "sim: pretending to upload %s\n", filename);
+	sim_firmware_loaded = 1;
+	return 0;
+}
+
+/* the simulated unit is back at once */
+int sim_transport_renumerate(struct slogic_ctx *handle, unsigned int timeout_ms){
+	return 0;
+}
+
+int sim_transport_max_packet_size(struct slogic_ctx *handle){
+	return SIM_MAX_PACKET_SIZE;
+}
+
+int sim_transport_command(struct slogic_ctx *handle, uint8_t *data, int length, bool async){
+struct sim_logic *sim = handle->transport_opts;
+struct slogic_sample_rate *rate;
+
+	if (sim->gone) {
+		return LIBUSB_ERROR_NO_DEVICE;
+	}
+	if (length < 2 || data[0] != SALEAE_LOGIC_COMMAND_SET_SAMPLE_DELAY) {
+		return 0;	/* like the firmware probe in slogic_is_firmware_uploaded() */
+	}
+	for (rate = slogic_get_sample_rates(); rate->text != NULL; rate++) {
+		if (rate->sample_delay == data[1]) {
+			break;
+		}
+	}
+	if (rate->text == NULL) {
+		log_printf(ERR, "sim: unknown sample delay %u\n", data[1]);
+		return 0;
+	}
+	sim->samples_per_second = rate->samples_per_second;
+	sim->capturing = true;
+	sim->stopped = false;
+	sim->produced = 0;
+	sim->completed = 0;
+	sim_now(&sim->start);
+	log_printf(DEBUG, "sim: sampling at %s\n", rate->text);
+	return 0;
+}
+
+int sim_transport_submit(struct slogic_ctx *handle, struct libusb_transfer *transfer){
+struct sim_logic *sim = handle->transport_opts;
+
+	if (sim->gone) {
+		return LIBUSB_ERROR_NO_DEVICE;
+	}
+	if (sim->queue_count == sim->queue_cap) {
+		return LIBUSB_ERROR_BUSY;
+	}
+	sim->queue[(sim->queue_head + sim->queue_count++) % sim->queue_cap] = transfer;
+	sim->queued_bytes += transfer->length;
+	return 0;
+}
+
+int sim_transport_cancel(struct slogic_ctx *handle, struct libusb_transfer *transfer){
+struct sim_logic *sim = handle->transport_opts;
+size_t i, j;
+
+	for (i = 0; i < sim->queue_count; i++) {
+		if (sim->queue[(sim->queue_head + i) % sim->queue_cap] == transfer) {
+			break;
+		}
+	}
+	if (i == sim->queue_count) {
+		return LIBUSB_ERROR_NOT_FOUND;
+	}
+	for (j = i; j + 1 < sim->queue_count; j++) {
+		sim->queue[(sim->queue_head + j) % sim->queue_cap] = sim->queue[(sim->queue_head + j + 1) % sim->queue_cap];
+	}
+	sim->queue_count--;
+	sim->queued_bytes -= transfer->length;
+	/* like libusb, the callback only runs from the event loop */
+	sim->cancelled[sim->n_cancelled++] = transfer;
+	return 0;
+}
+
+int sim_transport_handle_events(struct slogic_ctx *handle, struct timeval *timeout){
+struct sim_logic *sim = handle->transport_opts;
+struct timespec now, deadline, next;
+size_t i, n, batch;
+uint64_t due;
+
+	sim_now(&deadline);
+	sim_add_ns(&deadline, timeout->tv_sec * 1000000000ULL + timeout->tv_usec * 1000ULL);
+
+	if (sim->n_cancelled) {
+		n = sim->n_cancelled;
+		sim->n_cancelled = 0;
+		for (i = 0; i < n; i++) {
+			sim_complete(sim, sim->cancelled[i], LIBUSB_TRANSFER_CANCELLED);
+		}
+		return 0;
+	}
+
+	if (!sim->capturing || sim->stopped || !sim->queue_count) {
+		/* nothing the device could complete, a real event loop would just block */
+		sim_sleep_until(&deadline);
+		return 0;
+	}
+
+	if (!sim->realtime) {
+		for (batch = 0; batch < SIM_MAX_BATCH && sim->queue_count && !sim->stopped; batch++) {
+			sim_complete_next(sim);
+		}
+		return 0;
+	}
+
+	while (1) {
+		sim_now(&now);
+		due = sim_due(sim, &now);
+		if (due - sim->produced > sim->fifo + sim->queued_bytes) {
+			/* the host controller ran out of transfers and the fifo filled up, the firmware stops streaming */
+			log_printf(DEBUG, "sim: fifo overflow, %llu samples behind\n",
+				   (unsigned long long)(due - sim->produced));
+			sim->stopped = true;
+			sim_complete(sim, sim_pop(sim), LIBUSB_TRANSFER_OVERFLOW);
+			return 0;
+		}
+		n = 0;
+		while (sim->queue_count && !sim->stopped &&
+		       sim->produced + sim->queue[sim->queue_head]->length <= due) {
+			sim_complete_next(sim);
+			n++;
+		}
+		if (n || !sim->queue_count || sim->stopped) {
+			return 0;
+		}
+		sim_time_of(sim, sim->produced + sim->queue[sim->queue_head]->length, &next);
+		if (sim_cmp(&next, &deadline) > 0) {
+			sim_sleep_until(&deadline);
+			return 0;
+		}
+		sim_sleep_until(&next);
+	}
+}
@@ -0,0 +1,86 @@
+// vim: sw=8:ts=8:noexpandtab
+#ifndef __SIM_H__
+#define __SIM_H__
+#include <libusb.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * A virtual Logic behind the transport interface. It takes the
+ * SALEAE_LOGIC_COMMAND_SET_SAMPLE_DELAY command like the firmware does and
+ * then completes the submitted bulk transfers with generated samples at the
+ * selected rate. Options follow "sim:" comma separated:
+ *
+ *   speed=real|max	pace the samples at the sample rate (default) or
+ *			complete transfers as fast as they are submitted
+ *   pattern=counter|clock|random|idle
+ *			what the probes see, defaults to counter
+ *   file=<path>	replay a raw byte per sample capture instead, looped
+ *   fifo=<bytes>	device fifo; in real time mode, once the samples taken
+ *			exceed everything the submitted transfers can hold by
+ *			this much it is an OVERFLOW (default 16384)
+ *   timeout=<n>, stall=<n>, overflow=<n>, gone=<n>
+ *			fail the n-th completed transfer (1 based) that way;
+ *			after 'gone' the device stays lost
+ *   nofw		start without firmware, like a freshly plugged unit
+ */
+
+#define SIM_DEFAULT_FIFO 16384
+#define SIM_MAX_PACKET_SIZE 512
+#define SIM_MAX_BATCH 64	/* completions per event round in speed=max */
+
+enum sim_pattern {
+	SIM_PATTERN_COUNTER,
+	SIM_PATTERN_CLOCK,
+	SIM_PATTERN_RANDOM,
+	SIM_PATTERN_IDLE,
+	SIM_PATTERN_FILE
+};
+
+struct sim_logic {
+	/* options */
+	bool				realtime;
+	enum sim_pattern		pattern;
+	size_t				fifo;
+	unsigned long			timeout_at;
+	unsigned long			stall_at;
+	unsigned long			overflow_at;
+	unsigned long			gone_at;
+	uint8_t				*recording;	/* mapped file=... */
+	size_t				recording_size;
+
+	/* device state */
+	unsigned int			samples_per_second;
+	bool				capturing;
+	bool				stopped;	/* streaming ended by a fault */
+	bool				gone;
+	struct timespec			start;
+	uint64_t			produced;	/* samples handed to the host */
+	uint64_t			random;
+	unsigned long			completed;
+
+	/* submitted transfers in order, and cancelled ones awaiting their callback */
+	struct libusb_transfer		**queue;
+	size_t				queue_cap;
+	size_t				queue_head;
+	size_t				queue_count;
+	uint64_t			queued_bytes;	/* room in the submitted transfers */
+	struct libusb_transfer		**cancelled;
+	size_t				n_cancelled;
+};
+
+struct slogic_ctx;
+
+int sim_transport_open(struct slogic_ctx *handle, int logic_index);
+void sim_transport_close(struct slogic_ctx *handle);
+bool sim_transport_is_firmware_uploaded(struct slogic_ctx *handle);
+int sim_transport_upload_firmware(struct slogic_ctx *handle, const char *filename);
+int sim_transport_renumerate(struct slogic_ctx *handle, unsigned int timeout_ms);
+int sim_transport_max_packet_size(struct slogic_ctx *handle);
+int sim_transport_command(struct slogic_ctx *handle, uint8_t *data, int length, bool async);
+int sim_transport_submit(struct slogic_ctx *handle, struct libusb_transfer *transfer);
+int sim_transport_cancel(struct slogic_ctx *handle, struct libusb_transfer *transfer);
+int sim_transport_handle_events(struct slogic_ctx *handle, struct timeval *timeout);
+
+#endif
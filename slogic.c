@@ -3,6 +3,7 @@
 #include "log.h"
 #include "main.h"
 #include "ezusb.h"
+#include "transport.h"
 
 #include <assert.h>
 #include <stdbool.h>
@@ -49,13 +50,22 @@ struct slogic_sample_rate *slogic_parse_sample_rate(const char *str){
 
 /* return 1 if the firmware is uploaded 0 if not */
 bool slogic_is_firmware_uploaded(struct slogic_ctx *handle){
-/* just try to perform a normal read, if this fails we assume the firmware is not uploaded */
-unsigned char out_byte = 0x05;
-int transferred;
-int ret;
-	
-	ret = libusb_bulk_transfer(handle->device_handle, SALEAE_COMMAND_OUT_ENDPOINT, &out_byte, 1, &transferred, 100);
-	return ret == 0;	/* probably the firmware is uploaded */
+	return handle->transport->is_firmware_uploaded(handle);
+}
+
+static int slogic_setup_transfers(struct slogic_ctx *handle);
+
+/* uploads, waits for the device to come back with the firmware running and sets up its transfers */
+int slogic_upload_firmware(struct slogic_ctx *handle){
+	if (handle->transport->upload_firmware(handle, handle->fwfile) ||
+	    handle->transport->renumerate(handle, SLOGIC_RENUMERATE_TIMEOUT)) {
+		return -1;
+	}
+	if (!(handle->firmware_uploaded = slogic_is_firmware_uploaded(handle))) {
+		log_printf( ERR, "The Logic came back without its firmware\n");
+		return -1;
+	}
+	return slogic_setup_transfers(handle);
 }
 
 /*
@@ -64,6 +74,10 @@ int ret;
  * a pointer to a pointer.
  */
 struct slogic_ctx *slogic_init(){
+	return slogic_init_shared(NULL);
+}
+
+struct slogic_ctx *slogic_init_shared(libusb_context *usb_context){
 struct slogic_ctx *handle;
 	
 	
@@ -71,121 +85,164 @@ struct slogic_ctx *handle;
 	handle = calloc(1,sizeof(struct slogic_ctx));
 	assert(handle);
 	
-	handle->transfer_buffer_size = DEFAULT_TRANSFER_BUFFER_SIZE;
 	handle->n_transfer_buffers = DEFAULT_N_TRANSFER_BUFFERS;
 	handle->transfer_timeout = DEFAULT_TRANSFER_TIMEOUT;
 	handle->transfer_timeout = 1000;
-	libusb_init(&handle->usb_context);	
+	handle->compress_level = SLOGIC_COMPRESS_LEVEL;
+	handle->output_args = "";
+	handle->pipeline.cpu = -1;
+	slogic_set_transport(handle, DEFAULT_TRANSPORT);
+	if (usb_context) {
+		handle->usb_context = usb_context;
+		handle->shared_context = true;
+	} else {
+		libusb_init(&handle->usb_context);
+	}
 	return handle;
 }
 
 
 
+/* the endpoints are the firmware's, so this waits for it */
 int slogic_open(struct slogic_ctx *handle, int logic_index){
-int err,i;	
-size_t cnt;
-libusb_device **list;
-libusb_device *found = NULL;
-struct libusb_device_descriptor descriptor;	
-	
-	cnt = libusb_get_device_list(handle->usb_context, &list);
-	i = 0;
-	if (cnt < 0) {
-		log_printf( DEBUG,  "Failed to get a list of devices\n");
-		return 0;
-	}
-	
-	for (i = 0; i < cnt; i++) {
-		libusb_device *device = list[i];
-		err = libusb_get_device_descriptor(device, &descriptor);
-		if (err) {
-			log_printf( DEBUG,  "libusb_get_device_descriptor: %s\n", usbutil_error_to_string(err));
-			libusb_free_device_list(list, 1);
-			return 0;
-		}
-		if ((descriptor.idVendor == USB_VENDOR_ID) && (descriptor.idProduct == USB_PRODUCT_ID)) {
-			found = device;
-			usbutil_dump_device_descriptor(&descriptor);
-			break;
-		}
+int err;
+
+	if ((err = handle->transport->open(handle, logic_index)) != 0) {
+		return err;
 	}
-	
-	if (!found) {
-		log_printf( DEBUG,  "Device not found\n");
-		libusb_free_device_list(list, 1);
+	if (!(handle->firmware_uploaded = slogic_is_firmware_uploaded(handle))) {
 		return 0;
 	}
-	
-	if ((err = libusb_open(found, &handle->device_handle))) {
-		log_printf( DEBUG,  "Failed OPEN the device: %s\n", usbutil_error_to_string(err));
-		libusb_free_device_list(list, 1);
-		return 0;
+	return slogic_setup_transfers(handle);
+}
+
+static int slogic_setup_transfers(struct slogic_ctx *handle){
+size_t max_packet_size;
+
+	max_packet_size = handle->transport->max_packet_size(handle);
+	slogic_autotune_size(handle, max_packet_size);
+	if (!handle->transfer_buffer_size) {
+		handle->transfer_buffer_size = max_packet_size * DEFAULT_TRANSFER_PACKETS;
+	} else if (handle->transfer_buffer_size % max_packet_size) {
+		/* a bulk in transfer that is not a whole number of packets can end in LIBUSB_TRANSFER_OVERFLOW */
+		handle->transfer_buffer_size += max_packet_size - handle->transfer_buffer_size % max_packet_size;
+		log_printf( NOTICE, "Transfer buffer size rounded up to %zu\n", handle->transfer_buffer_size);
 	}
-	log_printf( DEBUG,  "libusb_open: %s\n", usbutil_error_to_string(err));	
-	
-	if ((err = claim_device(handle->device_handle, 0)) != 0) {
-		log_printf( DEBUG, "Failed to claim the usb interface: %s\n", usbutil_error_to_string(err));
-		libusb_free_device_list(list, 1);
-		return 0;
-	}	
-	
-	
-	if (!handle->device_handle) {
-		log_printf( ERR, "Failed to open the device\n");
-		libusb_free_device_list(list, 1);
+	slogic_autotune_depth(handle);
+
+	if (slogic_alloc_transfers(handle)) {
+		log_printf( ERR, "Failed to allocate the transfers\n");
 		return -1;
 	}
-	libusb_free_device_list(list, 1);
-	handle->dev = libusb_get_device(handle->device_handle);
-	handle->transfers = calloc(1,sizeof(struct logic_transfers) * handle->n_transfer_buffers);
-
 	return 0;
 }
 
 void slogic_close(struct slogic_ctx *handle){	
-	libusb_close(handle->device_handle);
-	libusb_exit(handle->usb_context);
-	free(handle->transfers);
+	slogic_trace_close(handle);
+	slogic_free_transfers(handle);
+	handle->transport->close(handle);
+	free(handle->shm.name);
+	if (!handle->shared_context) {
+		libusb_exit(handle->usb_context);
+	}
 	free(handle);
 }
 
+/*
+ * All transfers and their buffers are set up once here and then resubmitted
+ * in place for the whole run, nothing on the streaming path allocates.
+ */
+int slogic_alloc_transfers(struct slogic_ctx *handle){
+unsigned int transfer_id;
+struct libusb_transfer *transfer;
 
-int slogic_prime_data(struct slogic_ctx *handle, unsigned int transfer_id){
-char * buffer;	
-struct libusb_transfer *newtransfer;	
-
-	buffer = malloc(handle->transfer_buffer_size);
-	assert(buffer);
-	newtransfer = libusb_alloc_transfer(0);
-	newtransfer->flags |= (LIBUSB_TRANSFER_FREE_BUFFER |  LIBUSB_TRANSFER_FREE_TRANSFER );
-	if (newtransfer == NULL) {
-		log_printf( ERR, "libusb_alloc_transfer failed\n");
-		handle->recording_state = UNKNOWN;
+	handle->transfers = calloc(handle->n_transfer_buffers, sizeof(struct logic_transfers));
+	if (!handle->transfers) {
 		return 1;
 	}
-	
-	handle->transfers[transfer_id].logic_context = handle;
-	handle->transfers[transfer_id].transfer = newtransfer;
-	handle->transfers[transfer_id].transfer_id = transfer_id;
-	handle->transfers[transfer_id].state = 0;
-	
-//FIXME return value?
-	libusb_fill_bulk_transfer(newtransfer, handle->device_handle, SALEAE_STREAMING_DATA_IN_ENDPOINT, (unsigned char *)buffer, handle->transfer_buffer_size,slogic_read_samples_callback,&handle->transfers[transfer_id], handle->transfer_timeout);
+	/* twice the transfers, so every in flight buffer has a spare while the writer holds the other */
+	if (slogic_pool_alloc(handle, handle->n_transfer_buffers * 2)) {
+		return 1;
+	}
+
+	for (transfer_id = 0; transfer_id < handle->n_transfer_buffers; transfer_id++) {
+		if ((transfer = libusb_alloc_transfer(0)) == NULL) {
+			log_printf( ERR, "libusb_alloc_transfer failed\n");
+			return 1;
+		}
+		handle->transfers[transfer_id].logic_context = handle;
+		handle->transfers[transfer_id].transfer = transfer;
+		handle->transfers[transfer_id].transfer_id = transfer_id;
+		handle->transfers[transfer_id].state = 0;
+		libusb_fill_bulk_transfer(transfer, handle->device_handle, SALEAE_STREAMING_DATA_IN_ENDPOINT, slogic_pool_buffer(handle, transfer_id), handle->transfer_buffer_size,slogic_read_samples_callback,&handle->transfers[transfer_id], handle->transfer_timeout);
+	}
+	for (; transfer_id < handle->pool.n_buffers; transfer_id++) {
+		slogic_pool_put(handle, slogic_pool_buffer(handle, transfer_id));
+	}
 	return 0;
+}
 
-	
+void slogic_free_transfers(struct slogic_ctx *handle){
+unsigned int transfer_id;
+
+	if (handle->transfers) {
+		for (transfer_id = 0; transfer_id < handle->n_transfer_buffers; transfer_id++) {
+			if (handle->transfers[transfer_id].transfer) {
+				/* gives back heap buffers picked up when the pool ran dry */
+				slogic_pool_put(handle, handle->transfers[transfer_id].transfer->buffer);
+				libusb_free_transfer(handle->transfers[transfer_id].transfer);
+			}
+		}
+		free(handle->transfers);
+		handle->transfers = NULL;
+	}
+	slogic_pool_free(handle);
+}
+
+/* take the buffers back from transfers that are done, the output they may belong to is closed next */
+void slogic_release_buffers(struct slogic_ctx *handle){
+unsigned int transfer_id;
+
+	for (transfer_id = 0; transfer_id < handle->n_transfer_buffers; transfer_id++) {
+		if (handle->transfers[transfer_id].state == 0) {
+			slogic_pool_put(handle, handle->transfers[transfer_id].transfer->buffer);
+			handle->transfers[transfer_id].transfer->buffer = NULL;
+		}
+	}
+}
+
+/*
+ * re-arm a transfer that is not in flight. Buffers are picked up here rather
+ * than in the callback, so they are handed out in submission order.
+ */
+int slogic_prime_data(struct slogic_ctx *handle, unsigned int transfer_id){
+struct libusb_transfer *transfer = handle->transfers[transfer_id].transfer;
+
+	if (!transfer->buffer) {
+		transfer->buffer = slogic_pool_get(handle);
+	}
+	slogic_shm_reuse(handle, transfer->buffer);
+	transfer->length = handle->transfer_buffer_size;
+	transfer->timeout = handle->transfer_timeout;
+	transfer->actual_length = 0;
+	handle->transfers[transfer_id].state = 0;
+	return 0;
 }
 
 int slogic_pump_data(struct slogic_ctx *handle, unsigned int transfer_id){
 int retval;
 	
 	
-	if((retval = libusb_submit_transfer(handle->transfers[transfer_id].transfer))){
-		handle->transfers[transfer_id].state = 1;
+	if((retval = handle->transport->submit(handle, handle->transfers[transfer_id].transfer))){
 		log_printf( ERR, "libusb_submit_transfer: %s\n", usbutil_error_to_string(retval));
 		handle->recording_state = UNKNOWN;
 		return 1;
 	}
+	handle->transfers[transfer_id].state = 1;
+	handle->transfer_count++;
+	if (slogic_trace_enabled(&handle->trace)) {
+		slogic_trace_submit(handle, &handle->transfers[transfer_id]);
+	}
 	return 0;
 }
 
@@ -196,45 +253,68 @@ i need to reissue another transfer here as fast as i possibly can..
 int slogic_spindown(struct slogic_ctx *handle){
 	unsigned int transfer_id;
 	
+	/* the transfers stay allocated, their callbacks still have to run with LIBUSB_TRANSFER_CANCELLED */
 	for (transfer_id = 0; transfer_id < handle->n_transfer_buffers; transfer_id++) {
 		if(handle->transfers[transfer_id].state == 1){
-			libusb_cancel_transfer(handle->transfers[transfer_id].transfer);
-			libusb_free_transfer(handle->transfers[transfer_id].transfer);
-			handle->transfers[transfer_id].state = 0;
+			handle->transport->cancel(handle, handle->transfers[transfer_id].transfer);
+			handle->transfers[transfer_id].state = 2;
+			if (slogic_trace_enabled(&handle->trace)) {
+				slogic_trace_cancel(handle, &handle->transfers[transfer_id]);
+			}
 		}
 	}
 	return 1; //did i want to do something with this?
 }
 
-void dummy_callback(struct libusb_transfer *transfer){
-	printf("moof");
+/* with a trigger or rotation the writer decides when the capture is over, otherwise it is the sample count */
+static bool slogic_wants_samples(struct slogic_ctx *handle){
+	if (atomic_load_explicit(&handle->pipeline.output_failed, memory_order_relaxed)) {
+		return false;
+	}
+	if (slogic_trigger_enabled(&handle->trigger)) {
+		return !atomic_load_explicit(&handle->trigger.done, memory_order_relaxed);
+	}
+	if (slogic_rotate_enabled(&handle->rotate)) {
+		return !atomic_load_explicit(&handle->rotate.done, memory_order_relaxed);
+	}
+	return handle->n_samples_fulfilled < handle->n_samples_requested;
 }
 
-
 void slogic_read_samples_callback(struct libusb_transfer *transfer){
 struct logic_transfers *ltransfer = transfer->user_data;
 struct slogic_ctx *handle = ltransfer->logic_context;
+uint64_t callback_start = slogic_trace_enabled(&handle->trace) ? slogic_trace_now() : 0;
+
+	ltransfer->state = 0;
+	handle->transfer_count--;
 
 	switch(transfer->status){	
 		case LIBUSB_TRANSFER_COMPLETED :
-			handle->transfer_count--;
 			handle->transfers[ltransfer->transfer_id].seq = handle->transfer_counter++;
 			handle->n_samples_fulfilled += transfer->actual_length;
-			handle->data_callback_write(handle,transfer->buffer,transfer->actual_length);
+			slogic_timing_complete(handle);
+			slogic_evthread_complete(handle);
+			slogic_shm_publish(handle, transfer->buffer, transfer->actual_length);
+			if(!slogic_pipeline_submit(handle,transfer->buffer,transfer->actual_length)){
+				/* the writer owns the filled buffer now, prime picks up a fresh one */
+				transfer->buffer = NULL;
+			}
 
-			
-			if(handle->n_samples_fulfilled < handle->n_samples_requested){
-				slogic_prime_data(handle, ltransfer->transfer_id);
-				slogic_pump_data(handle, ltransfer->transfer_id);
+			if(handle->recording_state != RUNNING){
+				//spinning down, let this one rest
+			}else if(slogic_wants_samples(handle)){
+				/* autotune may park it to shrink the in flight set */
+				if (slogic_autotune_complete(handle, ltransfer->transfer_id)) {
+					slogic_prime_data(handle, ltransfer->transfer_id);
+					slogic_pump_data(handle, ltransfer->transfer_id);
+				}
 			}else{
 				handle->recording_state = SPINDOWN;
-				handle->transfers[ltransfer->transfer_id].state = 0;
 				slogic_spindown(handle);
 				handle->recording_state = COMPLETED_SUCCESSFULLY;
 			}
-			if((handle->recording_state == ABORT) || (handle->recording_state == COMPLETED_SUCCESSFULLY)){
+			if(handle->recording_state == ABORT){
 				handle->recording_state = SPINDOWN;
-				handle->transfers[ltransfer->transfer_id].state = 0;
 				slogic_spindown(handle);
 				handle->recording_state = COMPLETED_SUCCESSFULLY;
 			}
@@ -263,96 +343,100 @@ struct slogic_ctx *handle = ltransfer->logic_context;
 		default:
 			handle->recording_state = UNKNOWN;
 	}
-		
+
+	if (callback_start) {
+		slogic_trace_complete(handle, ltransfer, callback_start);
+	}
 }
 
 
 
 int slogic_set_capture(struct slogic_ctx *handle){
-struct libusb_transfer *transfer;
 struct slogic_command command;	
-int ret,transferred;
-	
-	transfer = libusb_alloc_transfer(0);
-
-	if (transfer == NULL) {
-		log_printf( ERR, "libusb_alloc_transfer failed\n");
-		handle->recording_state = UNKNOWN;
-		ret = 1;
-		return ret;
-	}
 
 	command.command = SALEAE_LOGIC_COMMAND_SET_SAMPLE_DELAY;
 	command.sample_delay = handle->sample_rate->sample_delay;	
-
-	if((ret = libusb_bulk_transfer(handle->device_handle, SALEAE_COMMAND_OUT_ENDPOINT, (unsigned char *)&command, sizeof(command), &transferred, handle->transfer_timeout))){
-		log_printf( ERR, "libusb_bulk_transfer (in): %s\n", usbutil_error_to_string(ret));
-		return ret;
-	}
-	return 0;	
-	
+	return handle->transport->command(handle, (uint8_t *)&command, sizeof(command), false);
 }
 
 int slogic_set_capture_async(struct slogic_ctx *handle){
-	struct libusb_transfer *transfer;
-	struct slogic_command command;	
-	int ret,transferred;
-	
-	transfer = libusb_alloc_transfer(0);
-	
-	if (transfer == NULL) {
-		log_printf( ERR, "libusb_alloc_transfer failed\n");
-		handle->recording_state = UNKNOWN;
-		ret = 1;
-		return ret;
-	}
-	
+struct slogic_command command;	
+
 	command.command = SALEAE_LOGIC_COMMAND_SET_SAMPLE_DELAY;
 	command.sample_delay = handle->sample_rate->sample_delay;	
-	
-	libusb_fill_bulk_transfer(transfer, handle->device_handle, SALEAE_COMMAND_OUT_ENDPOINT, (unsigned char *)&command, sizeof(command),dummy_callback,&transferred, handle->transfer_timeout);
-	libusb_submit_transfer(transfer);	
-	return 0;	
-	
+	slogic_timing_start(handle);
+	return handle->transport->command(handle, (uint8_t *)&command, sizeof(command), true);
 }
 
 
-int slogic_execute_recording(struct slogic_ctx *handle){
-int transfer_id,retval,ret;
-struct timeval timeout;	
+/* wait for the callbacks of cancelled transfers so their buffers are ours again */
+void slogic_drain_transfers(struct slogic_ctx *handle){
+struct timeval timeout;
+int tries = 0;
+
+	while (handle->transfer_count > 0 && tries++ < SLOGIC_DRAIN_TRIES) {
+		timeout.tv_sec = 0;
+		timeout.tv_usec = 100000;
+		if (handle->transport->handle_events(handle, &timeout)) {
+			break;
+		}
+	}
+	if (handle->transfer_count > 0) {
+		log_printf( ERR, "%u transfers did not come back after spindown\n", handle->transfer_count);
+	}
+}
 
 
+/* starts the writer and the first transfers; the event loop is the caller's */
+int slogic_start_recording(struct slogic_ctx *handle){
+int transfer_id;
+unsigned int in_flight = slogic_autotune_in_flight(handle);
+
 	handle->recording_state = WARMING_UP;
+	slogic_shm_start(handle);
+
+	if (slogic_pipeline_start(handle)) {
+		handle->recording_state = UNKNOWN;
+		return 1;
+	}
 	
 	for (transfer_id = 0; transfer_id < handle->n_transfer_buffers; transfer_id++) {
-		slogic_prime_data(handle, transfer_id);
+		/* start from the output's buffers if it lends them */
+		slogic_pool_put(handle, handle->transfers[transfer_id].transfer->buffer);
+		handle->transfers[transfer_id].transfer->buffer = NULL;
+		/* parked ones get theirs when autotune submits them, a raw slice has to be taken in submission order */
+		if (transfer_id < in_flight) {
+			slogic_prime_data(handle, transfer_id);
+		}
 	}
 		
 	handle->recording_state = RUNNING;
+	slogic_evthread_reset(handle, in_flight);
 
 
-	for (transfer_id = 0; transfer_id < handle->n_transfer_buffers; transfer_id++) {
+	for (transfer_id = 0; transfer_id < in_flight; transfer_id++) {
 		if(!transfer_id){
 			slogic_set_capture_async(handle);
 		}
 		slogic_pump_data(handle, transfer_id);
-		handle->transfer_count++;
 	}
+	return 0;
+}
 
-
-	while (handle->recording_state == RUNNING) {		
-		timeout.tv_sec = 1;
-		if((ret = libusb_handle_events_timeout(handle->usb_context, &timeout))){
-			log_printf( ERR, "libusb_handle_events: %s\n", usbutil_error_to_string(ret));
-			break;
-		}
-	}
+/* spins down once the state is no longer RUNNING, returns non zero unless the capture completed */
+int slogic_finish_recording(struct slogic_ctx *handle){
+int retval = 0;
 
 	//spindown!
-
-
-
-
+	slogic_spindown(handle);
+	slogic_drain_transfers(handle);
+	slogic_pipeline_stop(handle);
+	slogic_release_buffers(handle);
+	slogic_shm_stop(handle);
+
+	if (atomic_load(&handle->pipeline.output_failed)) {
+		handle->recording_state = OUTPUT_FAILED;
+	}
 
 	if (handle->recording_state == COMPLETED_SUCCESSFULLY) {
 		log_printf(INFO, "Capture Success!\n");
@@ -365,6 +449,96 @@ struct timeval timeout;
 	return retval;
 }
 
+static bool slogic_shares_events(struct slogic_ctx *a, struct slogic_ctx *b){
+	return a->transport == b->transport && a->transport->shared_events && a->usb_context == b->usb_context;
+}
+
+/*
+ * Handles the events until no device is running. The usb transport services
+ * every device of the shared libusb context in one call; the simulator has
+ * an event loop per device, so those are taken in turns with a short timeout.
+ */
+static void slogic_event_loop(struct slogic_ctx **handles, unsigned int n){
+struct timeval timeout;
+unsigned int i, j, running, sources = 0;
+int ret;
+
+	for (i = 0; i < n; i++) {
+		for (j = 0; j < i && !slogic_shares_events(handles[i], handles[j]); j++);
+		sources += j == i;
+	}
+
+	do {
+		running = 0;
+		for (i = 0; i < n; i++) {
+			if (handles[i]->recording_state != RUNNING) {
+				continue;
+			}
+			running++;
+			for (j = 0; j < i; j++) {
+				if (handles[j]->recording_state == RUNNING && slogic_shares_events(handles[i], handles[j])) {
+					break;
+				}
+			}
+			if (j < i) {
+				/* its events were handled with an earlier device's */
+				continue;
+			}
+			timeout.tv_sec = sources > 1 ? 0 : 1;
+			timeout.tv_usec = sources > 1 ? SLOGIC_MULTI_POLL_USEC : 0;
+			if ((ret = handles[i]->transport->handle_events(handles[i], &timeout))) {
+				log_printf( ERR, "libusb_handle_events: %s\n", usbutil_error_to_string(ret));
+				handles[i]->recording_state = UNKNOWN;
+			}
+		}
+	} while (running);
+}
+
+/* on this thread, or on the event thread of -E */
+static int slogic_run_events(struct slogic_ctx **handles, unsigned int n){
+	if (slogic_evthread_enabled(&handles[0]->evthread)) {
+		return slogic_evthread_run(handles, n, slogic_event_loop);
+	}
+	slogic_event_loop(handles, n);
+	return 0;
+}
+
+int slogic_execute_recording(struct slogic_ctx *handle){
+	if (slogic_start_recording(handle)) {
+		return 1;
+	}
+	if (slogic_run_events(&handle, 1)) {
+		handle->recording_state = ABORT;
+	}
+	return slogic_finish_recording(handle);
+}
+
+/* several devices on one thread */
+int slogic_execute_recordings(struct slogic_ctx **handles, unsigned int n){
+unsigned int i;
+int retval = 0;
+
+	for (i = 0; i < n; i++) {
+		/* a full writer queue must not hold up the other devices' completions */
+		handles[i]->pipeline.drop_when_full = true;
+		if (slogic_start_recording(handles[i])) {
+			retval = 1;
+		}
+	}
+	if (slogic_run_events(handles, n)) {
+		for (i = 0; i < n; i++) {
+			handles[i]->recording_state = ABORT;
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+		if (slogic_finish_recording(handles[i])) {
+			retval = 1;
+		}
+	}
+	return retval;
+}
+
 
 int hex_data_callback_open(struct slogic_ctx *handle,char * openstring){
 struct callback_test *foo;
@@ -7,10 +7,23 @@
 #include <string.h>
 #include <assert.h>
 #include <zlib.h>
+#include "pipeline.h"
+#include "transport.h"
+#include "trace.h"
+#include "autotune.h"
+#include "trigger.h"
+#include "rotate.h"
+#include "tindex.h"
+#include "decode.h"
+#include "pack.h"
+#include "timing.h"
+#include "evthread.h"
+#include "shmring.h"
 
 
 #define SLOGIC_COMPRESS_LEVEL 9
 #define CHUNK  4096
+#define SLOGIC_CHANNELS 8	/* one byte per sample, a bit per probe */
 
 #if defined(MSDOS) || defined(OS2) || defined(WIN32) || defined(__CYGWIN__)
 #  include <fcntl.h>
@@ -22,8 +35,13 @@
 
 
 #define DEFAULT_N_TRANSFER_BUFFERS 4096
-#define DEFAULT_TRANSFER_BUFFER_SIZE 4096 //(4 * 1024)
+#define DEFAULT_TRANSFER_PACKETS 8	/* transfer size in max size packets, unless -b is given */
 #define DEFAULT_TRANSFER_TIMEOUT 1000
+#define SLOGIC_DRAIN_TRIES 20	/* 100ms event loop rounds to wait for cancelled transfers */
+#define SLOGIC_MAX_DEVICES 8
+#define SLOGIC_RENUMERATE_TIMEOUT 5000	/* ms for a Logic to come back after the firmware upload */
+#define SLOGIC_RENUMERATE_POLL_MS 10
+#define SLOGIC_MULTI_POLL_USEC 1000	/* event loop timeout per device when they take turns */
 
 /*
  * define EP1 OUT , EP1 IN, EP2 IN and EP6 OUT
@@ -54,9 +72,10 @@ enum slogic_recording_state {
 	ABORT = 5,
 	DEVICE_GONE = 6,
 	TIMEOUT = 7,
-	STALL = 9,
+	STALL = 8,
 	OVERFLOW = 9,
 	DONE = 10,
+	OUTPUT_FAILED = 11,
 	UNKNOWN = 100
 };
 
@@ -80,6 +99,7 @@ typedef struct logic_transfers{
 	void						*logic_context;
 	unsigned long				transfer_id;
 	unsigned long				state;
+	uint64_t					submit_ns;	/* only kept while tracing */
 }logic_transfers;
 
 
@@ -91,7 +111,12 @@ typedef struct slogic_ctx {
 	libusb_device				*dev;
 	libusb_device_handle		*device_handle;
 	libusb_context				*usb_context;
+	bool						shared_context;	/* the caller's, not exited on close */
 	unsigned int				logic_index;
+	bool						firmware_uploaded;	/* as slogic_open() found it, the transfers wait for it */
+	struct slogic_transport		*transport;
+	const char					*transport_args;
+	void						*transport_opts;
 	
 	//logic probe managemnt
 	char						*fwfile;
@@ -104,13 +129,27 @@ typedef struct slogic_ctx {
 	unsigned int				n_transfer_buffers;
 	unsigned int				transfer_timeout;
 	
-	size_t						transfer_buffer_size;
+	size_t						transfer_buffer_size;	/* 0 until slogic_open() unless set */
+	struct slogic_autotune		autotune;
+	struct slogic_trigger		trigger;
+	struct slogic_rotate		rotate;
+	struct slogic_tindex		tindex;
+	struct slogic_decode		decode;
+	struct slogic_pack		pack;
+	struct slogic_timing		timing;
+	struct slogic_evthread		evthread;
+	struct slogic_shm		shm;
 
 	//output stuff
 	int						(*data_callback_open)(struct slogic_ctx *handle,char * openstring);
 	size_t						(*data_callback_write)(struct slogic_ctx *handle, uint8_t * data, size_t size);
 	void						(*data_callback_close)(struct slogic_ctx *handle);	
+	uint8_t *					(*data_callback_buffer)(struct slogic_ctx *handle);
 	void						*data_callback_opts;	
+	struct slogic_output_format	*output_format;
+	const char					*output_args;	/* "-F name:args" */
+	int						compress_level;
+	unsigned int				n_compress_workers;
 	
 	//state machine state
 	unsigned int				recording_state;
@@ -118,17 +157,44 @@ typedef struct slogic_ctx {
 	unsigned int				transfer_counter;
 	struct logic_transfers		*transfers;
 	z_stream 			strm;
+
+	//usb callback -> writer thread
+	struct slogic_pool			pool;
+	struct slogic_pipeline		pipeline;
+
+	//transfer instrumentation, off unless slogic_trace_open() was called
+	struct slogic_trace			trace;
 }slogic_ctx;
 
+/* writer side: the output cannot take any more, the capture stops and fails; true the first time */
+static inline bool slogic_pipeline_fail(struct slogic_ctx *handle){
+	return !atomic_exchange(&handle->pipeline.output_failed, 1);
+}
+
 struct slogic_ctx *slogic_init();
+/* a handle on a libusb context that several devices share, the caller libusb_exit()s it */
+struct slogic_ctx *slogic_init_shared(libusb_context *usb_context);
 int slogic_open(struct slogic_ctx *handle,int logic_index);
 void slogic_close(struct slogic_ctx *handle);
 bool slogic_is_firmware_uploaded(struct slogic_ctx *handle);
-void slogic_upload_firmware(struct slogic_ctx *handle);
+int slogic_upload_firmware(struct slogic_ctx *handle);
 int slogic_readbyte(struct slogic_ctx *handle, unsigned char *out);
 typedef bool(*slogic_on_data_callback) (uint8_t * data, size_t size, void *user_data);
 void slogic_read_samples_callback(struct libusb_transfer *transfer);
+int slogic_alloc_transfers(struct slogic_ctx *handle);
+int slogic_prime_data(struct slogic_ctx *handle, unsigned int transfer_id);
+int slogic_pump_data(struct slogic_ctx *handle, unsigned int transfer_id);
+void slogic_free_transfers(struct slogic_ctx *handle);
+void slogic_release_buffers(struct slogic_ctx *handle);
+void slogic_drain_transfers(struct slogic_ctx *handle);
+int slogic_set_capture(struct slogic_ctx *handle);
+int slogic_set_capture_async(struct slogic_ctx *handle);
 int slogic_execute_recording(struct slogic_ctx *handle);
+/* slogic_execute_recording() split up, for callers that run the event loop themselves */
+int slogic_start_recording(struct slogic_ctx *handle);
+int slogic_finish_recording(struct slogic_ctx *handle);
+/* every device at once on the calling thread, see slogic_init_shared() */
+int slogic_execute_recordings(struct slogic_ctx **handles, unsigned int n);
 int ezusb_upload_firmware(struct slogic_ctx *handle, int configuration, const char *filename);
 
 #endif
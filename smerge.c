@@ -0,0 +1,228 @@
+// vim: sw=8:ts=8:noexpandtab
+/*
+ * Merges the captures of a multi device run (main -i ... -i ...) into one
+ * raw capture of 8 channels per device, device n's channels in byte n of
+ * every sample, using the <capture>.time each of them got, see timing.h.
+ *
+ *   smerge [-F <format>] [-o <file>] <capture> <capture> [<capture> ...]
+ *
+ * The merged capture runs at the first device's rate, its samples as they
+ * are; for the others each sample is the one taken nearest to it on the
+ * host clock. It covers the time all of them were capturing. The inputs
+ * are read forward once, a chunk at a time, so they can be of any size
+ * and in any format.
+ */
+#include "capture.h"
+#include "timing.h"
+#include "log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define SMERGE_MAX_INPUTS 8
+#define SMERGE_CHUNK (256 * 1024)	/* merged samples at a time */
+
+struct smerge_input {
+	const char			*filename;
+	struct capture_reader		*c;
+	struct timing_info		timing;
+	uint64_t			n_samples;
+	/* sample k of the merged capture is sample (uint64_t)(first + k * step) of this one */
+	double				first;
+	double				step;
+	uint8_t				*buf;
+	size_t				size;
+	uint64_t			base;		/* sample of buf[0] */
+	size_t				len;
+};
+
+static void usage(const char *name){
+	fprintf(stderr, "usage: %s [-F raw|blockz|zlib|rle] [-o <file>] <capture> <capture> [<capture> ...]\n", name);
+	fprintf(stderr, " -F: Capture format of the inputs, told from the files by default.\n");
+	fprintf(stderr, " -o: The merged capture, raw. Defaults to stdout.\n");
+	fprintf(stderr, "Every capture needs the <capture>.time written next to it by a multi device run.\n");
+}
+
+/* samples [lo, hi] of the input in its window, reading on from where the last call left it */
+static int smerge_fill(struct smerge_input *in, uint64_t lo, uint64_t hi){
+size_t keep;
+ssize_t n;
+
+	if (lo < in->base + in->len) {
+		keep = in->base + in->len - lo;
+		memmove(in->buf, in->buf + (lo - in->base), keep);
+		in->len = keep;
+	} else {
+		/* streams only read forward, so what is skipped is read and dropped */
+		in->base += in->len;
+		in->len = 0;
+		while (in->base < lo) {
+			n = capture_read(in->c, in->base, in->buf, lo - in->base < in->size ? lo - in->base : in->size);
+			if (n <= 0) {
+				return -1;
+			}
+			in->base += n;
+		}
+	}
+	in->base = lo;
+	while (in->base + in->len <= hi) {
+		n = capture_read(in->c, in->base + in->len, in->buf + in->len, in->size - in->len);
+		if (n <= 0) {
+			return -1;
+		}
+		in->len += n;
+	}
+	return 0;
+}
+
+static int smerge_open(struct smerge_input *in, const char *filename, const char *format){
+char *timingname;
+size_t len = strlen(filename) + sizeof(".time");
+int r;
+
+	in->filename = filename;
+	timingname = malloc(len);
+	if (!timingname) {
+		return -1;
+	}
+	snprintf(timingname, len, "%s.time", filename);
+	r = timing_read(timingname, &in->timing);
+	free(timingname);
+	if (r || !(in->c = capture_open(filename, format))) {
+		return -1;
+	}
+	in->n_samples = in->timing.samples;
+	if (in->c->n_samples != CAPTURE_UNKNOWN && in->c->n_samples < in->n_samples) {
+		in->n_samples = in->c->n_samples;
+	}
+	if (in->timing.dropped) {
+		fprintf(stderr, "%s: %llu bytes were dropped during the capture, it is not aligned after the first drop\n",
+			filename, (unsigned long long)in->timing.dropped);
+	}
+	if (!in->timing.fitted) {
+		fprintf(stderr, "%s: timing not fitted, aligned by the start command only\n", filename);
+	}
+	return 0;
+}
+
+int main(int argc, char **argv){
+static struct smerge_input inputs[SMERGE_MAX_INPUTS];
+const char *format = NULL, *output = NULL;
+unsigned int n_inputs, i;
+double start = 0, end = 0, t, rate;
+uint64_t n_samples, k, chunk, lo, hi;
+uint8_t *out = NULL;
+FILE *f = stdout;
+int ch, failed = 0;
+
+	current_log_level = ERR;
+	while ((ch = getopt(argc, argv, "F:o:h")) != -1) {
+		switch (ch) {
+		case 'F':
+			format = optarg;
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return ch == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+	n_inputs = argc - optind;
+	if (n_inputs < 2 || n_inputs > SMERGE_MAX_INPUTS) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	/* the time every device was capturing, in ns of the host clock */
+	for (i = 0; i < n_inputs; i++) {
+		if (smerge_open(&inputs[i], argv[optind + i], format)) {
+			failed = 1;
+			goto out;
+		}
+		t = inputs[i].timing.first_sample_time;
+		if (!i || t > start) {
+			start = t;
+		}
+		t += inputs[i].n_samples * 1e9 / inputs[i].timing.measured_rate;
+		if (!i || t < end) {
+			end = t;
+		}
+	}
+	rate = inputs[0].timing.measured_rate;
+	n_samples = end > start ? (uint64_t)((end - start) * rate / 1e9) : 0;
+	for (i = 0; i < n_inputs; i++) {
+		inputs[i].first = (start - inputs[i].timing.first_sample_time) * inputs[i].timing.measured_rate / 1e9 + 0.5;
+		inputs[i].step = inputs[i].timing.measured_rate / rate;
+		/* a chunk's worth of samples at this device's rate, and some slack for the rounding */
+		inputs[i].size = (size_t)(SMERGE_CHUNK * inputs[i].step) + 16;
+		if (!(inputs[i].buf = malloc(inputs[i].size))) {
+			failed = 1;
+			goto out;
+		}
+		fprintf(stderr, "%s: %+.2f ppm, merged from its sample %llu\n", inputs[i].filename,
+			(inputs[i].timing.measured_rate / inputs[i].timing.sample_rate - 1) * 1e6,
+			(unsigned long long)inputs[i].first);
+	}
+	if (!n_samples) {
+		fprintf(stderr, "The captures do not overlap\n");
+		failed = 1;
+		goto out;
+	}
+
+	if (output && strcmp(output, "-") != 0 && !(f = fopen(output, "w"))) {
+		perror(output);
+		failed = 1;
+		goto out;
+	}
+	if (!(out = malloc((size_t)SMERGE_CHUNK * n_inputs))) {
+		failed = 1;
+		goto out;
+	}
+	for (k = 0; k < n_samples && !failed; k += chunk) {
+		chunk = n_samples - k < SMERGE_CHUNK ? n_samples - k : SMERGE_CHUNK;
+		for (i = 0; i < n_inputs; i++) {
+			struct smerge_input *in = &inputs[i];
+			uint64_t j;
+
+			lo = (uint64_t)(in->first + k * in->step);
+			hi = (uint64_t)(in->first + (k + chunk - 1) * in->step);
+			if (hi >= in->n_samples) {
+				hi = in->n_samples - 1;
+			}
+			if (smerge_fill(in, lo, hi)) {
+				fprintf(stderr, "Failed to read %s\n", in->filename);
+				failed = 1;
+				break;
+			}
+			for (j = 0; j < chunk; j++) {
+				lo = (uint64_t)(in->first + (k + j) * in->step);
+				out[j * n_inputs + i] = in->buf[(lo > hi ? hi : lo) - in->base];
+			}
+		}
+		if (!failed && fwrite(out, n_inputs, chunk, f) != chunk) {
+			perror(output ? output : "stdout");
+			failed = 1;
+		}
+	}
+	if (f != stdout && fclose(f)) {
+		perror(output);
+		failed = 1;
+	}
+	if (!failed) {
+		fprintf(stderr, "%llu samples of %u channels at %.3f samples/s\n", (unsigned long long)n_samples,
+			8 * n_inputs, rate);
+	}
+out:
+	free(out);
+	for (i = 0; i < n_inputs; i++) {
+		free(inputs[i].buf);
+		if (inputs[i].c) {
+			capture_close(inputs[i].c);
+		}
+	}
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
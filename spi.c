@@ -0,0 +1,138 @@
+// vim: sw=8:ts=8:noexpandtab
+/*
+ * SPI. The data lines are taken on the sampling edge of the clock, rising
+ * in modes 0 and 3 and falling in modes 1 and 2, while chip select is
+ * active; without a cs channel the bus is always selected. Only samples
+ * that differ from the one before in a channel used are looked at.
+ */
+#include "decode.h"
+#include "log.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static int spi_init(struct decoder *d, char *options){
+struct spi_decoder *s = &d->spi;
+char *opt, *value, *save = NULL;
+int *ch;
+
+	memset(s, 0, sizeof(*s));
+	s->clk = s->mosi = s->miso = s->cs = -1;
+	s->bits = 8;
+	for (opt = strtok_r(options, ",", &save); opt; opt = strtok_r(NULL, ",", &save)) {
+		value = strchr(opt, '=');
+		if (value) {
+			*value++ = '\0';
+		}
+		ch = NULL;
+		if (strcmp(opt, "clk") == 0) {
+			ch = &s->clk;
+		} else if (strcmp(opt, "mosi") == 0) {
+			ch = &s->mosi;
+		} else if (strcmp(opt, "miso") == 0) {
+			ch = &s->miso;
+		} else if (strcmp(opt, "cs") == 0) {
+			ch = &s->cs;
+		}
+		if (ch && value) {
+			if ((*ch = decode_channel(value)) < 0) {
+				log_printf( ERR, "spi: bad channel '%s'\n", value);
+				return -1;
+			}
+		} else if (strcmp(opt, "mode") == 0 && value) {
+			s->mode = strtoul(value, NULL, 10);
+		} else if (strcmp(opt, "bits") == 0 && value) {
+			s->bits = strtoul(value, NULL, 10);
+		} else if (strcmp(opt, "lsb") == 0 && !value) {
+			s->lsb = true;
+		} else if (strcmp(opt, "cs_high") == 0 && !value) {
+			s->cs_high = true;
+		} else {
+			log_printf( ERR, "spi: bad option '%s'\n", opt);
+			return -1;
+		}
+	}
+	if (s->clk < 0 || (s->mosi < 0 && s->miso < 0) || s->mode > 3 || s->bits < 1 || s->bits > 32) {
+		log_printf( ERR, "spi: needs clk=<channel> and mosi or miso, mode 0 to 3 and 1 to 32 bits\n");
+		return -1;
+	}
+	return 0;
+}
+
+static void spi_reset(struct decoder *d){
+	d->spi.bit = 0;
+	d->spi.mosi_word = d->spi.miso_word = 0;
+}
+
+static inline uint8_t spi_level(int ch, uint8_t sample){
+	return ch >= 0 ? (sample >> ch) & 1 : 0;
+}
+
+static inline bool spi_selected(const struct spi_decoder *s, uint8_t sample){
+	return s->cs < 0 || spi_level(s->cs, sample) == s->cs_high;
+}
+
+static void spi_sample(struct decoder *d, uint8_t sample, uint64_t at){
+struct spi_decoder *s = &d->spi;
+bool selected = spi_selected(s, sample);
+uint8_t clk = spi_level(s->clk, sample);
+/* sampling on rising edges when CPOL == CPHA */
+uint8_t active = (s->mode >> 1) == (s->mode & 1);
+
+	if (selected != s->selected) {
+		s->selected = selected;
+		if (!selected && s->bit) {
+			decode_emit(d, DECODE_WORD, s->word_start, at, s->mosi_word, s->miso_word, DECODE_FLAG_PARTIAL);
+		}
+		spi_reset(d);
+		decode_emit(d, selected ? DECODE_START : DECODE_STOP, at, at, 0, 0, 0);
+		s->prev = sample;
+		return;
+	}
+	if (!selected || clk == spi_level(s->clk, s->prev) || clk != active) {
+		s->prev = sample;
+		return;
+	}
+	s->prev = sample;
+	if (!s->bit) {
+		s->word_start = at;
+	}
+	if (s->lsb) {
+		s->mosi_word |= (uint32_t)spi_level(s->mosi, sample) << s->bit;
+		s->miso_word |= (uint32_t)spi_level(s->miso, sample) << s->bit;
+	} else {
+		s->mosi_word = (s->mosi_word << 1) | spi_level(s->mosi, sample);
+		s->miso_word = (s->miso_word << 1) | spi_level(s->miso, sample);
+	}
+	if (++s->bit == s->bits) {
+		decode_emit(d, DECODE_WORD, s->word_start, at, s->mosi_word, s->miso_word, 0);
+		spi_reset(d);
+	}
+}
+
+static void spi_feed(struct decoder *d, const uint8_t *p, size_t n, uint64_t base){
+struct spi_decoder *s = &d->spi;
+uint8_t mask = 1 << s->clk;
+size_t i;
+
+	if (s->cs >= 0) {
+		mask |= 1 << s->cs;
+	}
+	if (!d->started) {
+		/* joining a transfer half way is not worth a START */
+		s->prev = p[0];
+		s->selected = spi_selected(s, p[0]);
+	}
+	for (i = 0; i < n; i++) {
+		if ((p[i] ^ s->prev) & mask) {
+			spi_sample(d, p[i], base + i);
+		}
+	}
+}
+
+const struct decoder_type spi_decoder_type = {
+	.name = "spi",
+	.init = spi_init,
+	.feed = spi_feed,
+	.reset = spi_reset,
+};
@@ -0,0 +1,121 @@
+// vim: sw=8:ts=8:noexpandtab
+/*
+ * Follows the live transfers a capture publishes with -S, see shmring.h,
+ * and writes the samples out raw as they come, until the capture ends.
+ *
+ *   sshm [-o <file>] [-n <samples>] [-w <seconds>] <name>
+ *
+ * Any number can follow one capture. One that falls behind loses samples
+ * rather than holding the capture up; what it lost is on stderr at the end.
+ */
+#include "shmring.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SSHM_IDLE_USEC 1000	/* between looks at an idle ring */
+
+static volatile sig_atomic_t stop = 0;
+
+static void on_signal(int sig){
+	stop = 1;
+}
+
+static void usage(const char *name){
+	fprintf(stderr, "usage: %s [-o <file>] [-n <samples>] [-w <seconds>] <name>\n", name);
+	fprintf(stderr, " -o: Where the samples go, raw. Defaults to stdout.\n");
+	fprintf(stderr, " -n: Stop after this many samples.\n");
+	fprintf(stderr, " -w: Wait this long for the capture to start. Defaults to 0.\n");
+}
+
+int main(int argc, char **argv){
+struct timespec idle = { 0, SSHM_IDLE_USEC * 1000 };
+const char *output = NULL;
+struct shm_reader *reader;
+struct shm_block block;
+unsigned long long limit = 0, samples = 0, lost = 0, next = 0;
+double wait = 0;
+uint8_t *copy;
+FILE *f = stdout;
+size_t n;
+int ch, r, tries, failed = 0;
+bool started = false;
+
+	while ((ch = getopt(argc, argv, "o:n:w:h")) != -1) {
+		switch (ch) {
+		case 'o':
+			output = optarg;
+			break;
+		case 'n':
+			limit = strtoull(optarg, NULL, 0);
+			break;
+		case 'w':
+			wait = strtod(optarg, NULL);
+			break;
+		default:
+			usage(argv[0]);
+			return ch == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+	if (optind + 1 != argc) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+	for (tries = wait * 1e6 / SSHM_IDLE_USEC; !(reader = shm_reader_open(argv[optind])) && tries > 0; tries--) {
+		nanosleep(&idle, NULL);
+	}
+	if (!reader) {
+		fprintf(stderr, "%s: %s\n", argv[optind], strerror(errno));
+		return EXIT_FAILURE;
+	}
+	if (output && strcmp(output, "-") != 0 && !(f = fopen(output, "w"))) {
+		perror(output);
+		shm_reader_close(reader);
+		return EXIT_FAILURE;
+	}
+	if (!(copy = malloc(reader->header->buffer_size))) {
+		shm_reader_close(reader);
+		return EXIT_FAILURE;
+	}
+	signal(SIGINT, on_signal);
+	signal(SIGPIPE, on_signal);
+
+	while (!stop && (!limit || samples < limit)) {
+		if ((r = shm_reader_next(reader, &block)) < 0) {
+			break;
+		}
+		if (!r) {
+			nanosleep(&idle, NULL);
+			continue;
+		}
+		/* the writer may hand the buffer to a transfer again any time, so it is taken out first */
+		memcpy(copy, block.data, block.length);
+		if (!shm_reader_valid(reader, &block)) {
+			continue;
+		}
+		if (started && block.first_sample != next) {
+			lost += block.first_sample - next;
+		}
+		started = true;
+		next = block.first_sample + block.length;
+		n = limit && limit - samples < block.length ? limit - samples : block.length;
+		if (fwrite(copy, 1, n, f) != n) {
+			failed = 1;
+			break;
+		}
+		samples += n;
+	}
+	if (f != stdout ? fclose(f) != 0 : fflush(f) != 0) {
+		failed = 1;
+	}
+	fprintf(stderr, "%llu samples at %u samples/s, %lu overruns, %llu samples lost\n", samples,
+		reader->header->samples_per_second, reader->overruns, lost);
+	free(copy);
+	shm_reader_close(reader);
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,260 @@
+// vim: sw=8:ts=8:noexpandtab
+#include "stats.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#include <immintrin.h>
+#define STATS_HAVE_X86 1
+#endif
+
+#define STATS_BYTE_LANES 0x0101010101010101ull
+
+/*
+ * Bit planes: planes[c] bit i is channel c of sample i, for 64 samples
+ */
+
+/* 8x8 bit matrix transpose, byte i bit c to byte c bit i */
+static inline uint64_t stats_transpose8(uint64_t x){
+uint64_t t;
+
+	t = (x ^ (x >> 7)) & 0x00aa00aa00aa00aaull;
+	x = x ^ t ^ (t << 7);
+	t = (x ^ (x >> 14)) & 0x0000cccc0000ccccull;
+	x = x ^ t ^ (t << 14);
+	t = (x ^ (x >> 28)) & 0x00000000f0f0f0f0ull;
+	x = x ^ t ^ (t << 28);
+	return x;
+}
+
+static void stats_planes_scalar(const uint8_t *p, uint64_t *planes){
+uint64_t x;
+unsigned int g, i, c;
+
+	memset(planes, 0, STATS_CHANNELS * sizeof(uint64_t));
+	for (g = 0; g < 8; g++) {
+		for (x = 0, i = 0; i < 8; i++) {
+			x |= (uint64_t)p[8 * g + i] << (8 * i);
+		}
+		x = stats_transpose8(x);
+		for (c = 0; c < STATS_CHANNELS; c++) {
+			planes[c] |= ((x >> (8 * c)) & 0xff) << (8 * g);
+		}
+	}
+}
+
+#ifdef STATS_HAVE_X86
+/* movemask takes the top bit of every byte; adding a byte to itself moves the next bit up */
+static void stats_planes_sse2(const uint8_t *p, uint64_t *planes){
+__m128i v;
+unsigned int k;
+int c;
+
+	memset(planes, 0, STATS_CHANNELS * sizeof(uint64_t));
+	for (k = 0; k < 4; k++) {
+		v = _mm_loadu_si128((const __m128i *)(p + 16 * k));
+		for (c = STATS_CHANNELS - 1; c >= 0; c--) {
+			planes[c] |= (uint64_t)(uint16_t)_mm_movemask_epi8(v) << (16 * k);
+			v = _mm_add_epi8(v, v);
+		}
+	}
+}
+
+__attribute__((target("avx2")))
+static void stats_planes_avx2(const uint8_t *p, uint64_t *planes){
+__m256i lo = _mm256_loadu_si256((const __m256i *)p), hi = _mm256_loadu_si256((const __m256i *)(p + 32));
+int c;
+
+	for (c = STATS_CHANNELS - 1; c >= 0; c--) {
+		planes[c] = (uint32_t)_mm256_movemask_epi8(lo) | (uint64_t)(uint32_t)_mm256_movemask_epi8(hi) << 32;
+		lo = _mm256_add_epi8(lo, lo);
+		hi = _mm256_add_epi8(hi, hi);
+	}
+}
+#endif
+
+static void stats_planes_resolve(const uint8_t *p, uint64_t *planes);
+static void (*stats_planes)(const uint8_t *p, uint64_t *planes) = stats_planes_resolve;
+
+/* picks the widest implementation the cpu supports on first use */
+static void stats_planes_resolve(const uint8_t *p, uint64_t *planes){
+#ifdef STATS_HAVE_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		stats_planes = stats_planes_avx2;
+	} else {
+		stats_planes = __builtin_cpu_supports("sse2") ? stats_planes_sse2 : stats_planes_scalar;
+	}
+#else
+	stats_planes = stats_planes_scalar;
+#endif
+	stats_planes(p, planes);
+}
+
+/*
+ * Counting
+ */
+
+static void stats_width(struct stats_widths *w, uint64_t width){
+	if (!w->count || width < w->min) {
+		w->min = width;
+	}
+	if (width > w->max) {
+		w->max = width;
+	}
+	w->count++;
+	w->sum += width;
+	w->hist[63 - __builtin_clzll(width)]++;
+}
+
+static void stats_edge(struct stats_channel *ch, uint64_t at, bool rising){
+	if (ch->last_edge == STATS_NONE) {
+		ch->first_edge = at;
+		ch->first_rising = rising;
+	} else {
+		stats_width(ch->last_rising ? &ch->high_pulses : &ch->low_pulses, at - ch->last_edge);
+	}
+	if (rising) {
+		if (ch->first_rise == STATS_NONE) {
+			ch->first_rise = at;
+		}
+		ch->last_rise = at;
+	}
+	ch->last_edge = at;
+	ch->last_rising = rising;
+}
+
+/* the 'valid' samples of the 64 from 'base' */
+static void stats_group(struct stats *s, const uint64_t *planes, uint64_t valid, uint64_t base){
+struct stats_channel *ch;
+uint64_t pl, e;
+unsigned int c, i;
+
+	for (c = 0; c < STATS_CHANNELS; c++) {
+		ch = &s->ch[c];
+		pl = planes[c] & valid;
+		ch->high += __builtin_popcountll(pl);
+		e = (pl ^ ((pl << 1) | ((s->prev >> c) & 1))) & valid;
+		if (!e) {
+			continue;
+		}
+		ch->rising += __builtin_popcountll(e & pl);
+		ch->falling += __builtin_popcountll(e & ~pl);
+		while (e) {
+			i = __builtin_ctzll(e);
+			stats_edge(ch, base + i, (pl >> i) & 1);
+			e &= e - 1;
+		}
+	}
+}
+
+void stats_init(struct stats *s, uint64_t start, uint8_t prev){
+unsigned int c;
+
+	memset(s, 0, sizeof(*s));
+	s->start = start;
+	s->prev = prev;
+	for (c = 0; c < STATS_CHANNELS; c++) {
+		s->ch[c].first_edge = s->ch[c].last_edge = STATS_NONE;
+		s->ch[c].first_rise = s->ch[c].last_rise = STATS_NONE;
+	}
+}
+
+void stats_scan(struct stats *s, const uint8_t *p, size_t n){
+uint64_t planes[STATS_CHANNELS], run, w;
+uint8_t tail[64];
+unsigned int c, g;
+
+	if (!n) {
+		return;
+	}
+	if (!s->n_samples) {
+		s->first = p[0];
+	}
+	run = s->prev * STATS_BYTE_LANES;
+	for (; n >= 64; p += 64, n -= 64) {
+		/* idle lines are most of most captures: 64 samples equal to the last one have no edges */
+		for (g = 0; g < 8; g++) {
+			memcpy(&w, p + 8 * g, 8);
+			if (w != run) {
+				break;
+			}
+		}
+		if (g == 8) {
+			for (c = 0; c < STATS_CHANNELS; c++) {
+				s->ch[c].high += ((s->prev >> c) & 1) * 64;
+			}
+		} else {
+			stats_planes(p, planes);
+			stats_group(s, planes, ~0ull, s->start + s->n_samples);
+			s->prev = p[63];
+			run = s->prev * STATS_BYTE_LANES;
+		}
+		s->n_samples += 64;
+	}
+	if (n) {
+		memset(tail, 0, sizeof(tail));
+		memcpy(tail, p, n);
+		stats_planes(tail, planes);
+		stats_group(s, planes, (1ull << n) - 1, s->start + s->n_samples);
+		s->prev = p[n - 1];
+		s->n_samples += n;
+	}
+}
+
+static void stats_widths_merge(struct stats_widths *t, const struct stats_widths *n){
+unsigned int k;
+
+	if (!n->count) {
+		return;
+	}
+	if (!t->count || n->min < t->min) {
+		t->min = n->min;
+	}
+	if (n->max > t->max) {
+		t->max = n->max;
+	}
+	t->count += n->count;
+	t->sum += n->sum;
+	for (k = 0; k < STATS_HIST_BUCKETS; k++) {
+		t->hist[k] += n->hist[k];
+	}
+}
+
+void stats_merge(struct stats *total, const struct stats *next){
+struct stats_channel *t;
+const struct stats_channel *n;
+unsigned int c;
+
+	if (!total->n_samples) {
+		total->first = next->first;
+	}
+	for (c = 0; c < STATS_CHANNELS; c++) {
+		t = &total->ch[c];
+		n = &next->ch[c];
+		t->high += n->high;
+		t->rising += n->rising;
+		t->falling += n->falling;
+		stats_widths_merge(&t->high_pulses, &n->high_pulses);
+		stats_widths_merge(&t->low_pulses, &n->low_pulses);
+		if (n->first_edge != STATS_NONE) {
+			/* completes the pulse that ran across the boundary */
+			if (t->last_edge != STATS_NONE) {
+				stats_width(t->last_rising ? &t->high_pulses : &t->low_pulses, n->first_edge - t->last_edge);
+			} else {
+				t->first_edge = n->first_edge;
+				t->first_rising = n->first_rising;
+			}
+			t->last_edge = n->last_edge;
+			t->last_rising = n->last_rising;
+		}
+		if (n->first_rise != STATS_NONE) {
+			if (t->first_rise == STATS_NONE) {
+				t->first_rise = n->first_rise;
+			}
+			t->last_rise = n->last_rise;
+		}
+	}
+	total->n_samples += next->n_samples;
+	total->prev = next->prev;
+}
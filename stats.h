@@ -0,0 +1,61 @@
+// vim: sw=8:ts=8:noexpandtab
+#ifndef __STATS_H__
+#define __STATS_H__
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/*
+ * Per channel statistics of the byte per sample stream: edges, time high,
+ * and the widths of the complete high and low pulses. Samples are taken 64
+ * at a time and turned into one 64 bit word per channel (a bit transpose,
+ * SIMD movemask where there is one), after which counting is popcount and
+ * every edge is a ctz.
+ *
+ * A range can be split: scan the pieces into their own struct stats, each
+ * starting with the sample before its first, and stats_merge() them in
+ * order; the pulses that straddle two pieces are completed there.
+ */
+
+#define STATS_CHANNELS 8
+#define STATS_HIST_BUCKETS 64	/* log2 of the width in samples */
+#define STATS_NONE UINT64_MAX
+
+struct stats_widths {
+	uint64_t			count;
+	uint64_t			min;
+	uint64_t			max;
+	uint64_t			sum;
+	uint64_t			hist[STATS_HIST_BUCKETS];	/* [2^k, 2^(k+1)) samples */
+};
+
+struct stats_channel {
+	uint64_t			high;		/* samples */
+	uint64_t			rising;
+	uint64_t			falling;
+	uint64_t			first_edge;	/* sample index, STATS_NONE */
+	uint64_t			last_edge;
+	bool				first_rising;
+	bool				last_rising;
+	uint64_t			first_rise;	/* for the frequency */
+	uint64_t			last_rise;
+	struct stats_widths		high_pulses;
+	struct stats_widths		low_pulses;
+};
+
+struct stats {
+	uint64_t			start;		/* first sample */
+	uint64_t			n_samples;
+	uint8_t				prev;		/* the sample before the next one scanned */
+	uint8_t				first;		/* levels of the first sample */
+	struct stats_channel		ch[STATS_CHANNELS];
+};
+
+/* 'prev' is the sample before 'start', the first sample of a capture is its own */
+void stats_init(struct stats *s, uint64_t start, uint8_t prev);
+/* the next 'n' samples of the range */
+void stats_scan(struct stats *s, const uint8_t *p, size_t n);
+/* appends 'next', which starts where 'total' ends */
+void stats_merge(struct stats *total, const struct stats *next);
+
+#endif
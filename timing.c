@@ -0,0 +1,137 @@
+// vim: sw=8:ts=8:noexpandtab
+#include "timing.h"
+#include "slogic.h"
+#include "log.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+void slogic_timing_start(struct slogic_ctx *handle){
+struct slogic_timing *timing = &handle->timing;
+struct timespec wall;
+
+	memset(timing, 0, sizeof(*timing));
+	timing->command_ns = slogic_trace_now();
+	clock_gettime(CLOCK_REALTIME, &wall);
+	timing->command_wall_ns = wall.tv_sec * 1000000000LL + wall.tv_nsec;
+}
+
+void slogic_timing_complete(struct slogic_ctx *handle){
+struct slogic_timing *timing = &handle->timing;
+double x = handle->n_samples_fulfilled, y, dx;
+
+	if (!timing->command_ns) {
+		return;
+	}
+	/* centred sums, the raw ones lose the slope to rounding after a few billion samples */
+	y = (double)(slogic_trace_now() - timing->command_ns);
+	if (!timing->points++) {
+		timing->first_completion_ns = timing->command_ns + (uint64_t)y;
+	}
+	dx = x - timing->mean_x;
+	timing->mean_x += dx / timing->points;
+	timing->mean_y += (y - timing->mean_y) / timing->points;
+	timing->m2_x += dx * (x - timing->mean_x);
+	timing->c_xy += dx * (y - timing->mean_y);
+}
+
+bool slogic_timing_fit(struct slogic_ctx *handle, uint64_t *first_sample_time, double *rate){
+struct slogic_timing *timing = &handle->timing;
+double nominal = handle->sample_rate->samples_per_second, slope, intercept;
+
+	*first_sample_time = timing->command_ns;
+	*rate = nominal;
+	if (timing->points < TIMING_MIN_POINTS || timing->m2_x <= 0) {
+		return false;
+	}
+	slope = timing->c_xy / timing->m2_x;	/* ns per sample */
+	if (slope <= 0 || 1e9 / slope < nominal * (1 - TIMING_MAX_SKEW) || 1e9 / slope > nominal * (1 + TIMING_MAX_SKEW)) {
+		return false;
+	}
+	intercept = timing->mean_y - slope * timing->mean_x;
+	*rate = 1e9 / slope;
+	/* sample 0 cannot have been taken before it was asked for */
+	*first_sample_time = timing->command_ns + (intercept > 0 ? (uint64_t)intercept : 0);
+	return true;
+}
+
+int slogic_timing_write(struct slogic_ctx *handle, const char *filename){
+uint64_t first;
+int64_t wall;
+double rate;
+bool fitted = slogic_timing_fit(handle, &first, &rate);
+FILE *f;
+
+	if (!(f = fopen(filename, "w"))) {
+		log_printf( ERR, "Could not write %s: %s\n", filename, strerror(errno));
+		return -1;
+	}
+	wall = handle->timing.command_wall_ns + (int64_t)(first - handle->timing.command_ns);
+	fprintf(f, "slogic timing 1\n");
+	fprintf(f, "sample_rate=%u\n", handle->sample_rate->samples_per_second);
+	fprintf(f, "measured_rate=%.3f\n", rate);
+	fprintf(f, "skew_ppm=%.2f\n", (rate / handle->sample_rate->samples_per_second - 1) * 1e6);
+	fprintf(f, "command_time=%llu\n", (unsigned long long)handle->timing.command_ns);
+	fprintf(f, "first_sample_time=%llu\n", (unsigned long long)first);
+	fprintf(f, "wall_time=%lld.%09lld\n", (long long)(wall / 1000000000), (long long)(wall % 1000000000));
+	fprintf(f, "samples=%llu\n", handle->pipeline.bytes_written);
+	fprintf(f, "dropped=%llu\n", handle->pipeline.dropped);
+	fprintf(f, "fitted=%d\n", fitted);
+	if (fclose(f)) {
+		log_printf( ERR, "Could not write %s: %s\n", filename, strerror(errno));
+		return -1;
+	}
+	log_printf( DEBUG, "%s: %.3f samples/s, %.2f ppm, sample 0 %.3f ms after the start command%s\n", filename, rate,
+		    (rate / handle->sample_rate->samples_per_second - 1) * 1e6, (first - handle->timing.command_ns) / 1e6,
+		    fitted ? "" : " (not fitted)");
+	return 0;
+}
+
+int timing_read(const char *filename, struct timing_info *info){
+char line[256], *value;
+FILE *f;
+int fitted = 0;
+
+	memset(info, 0, sizeof(*info));
+	if (!(f = fopen(filename, "r"))) {
+		log_printf( ERR, "Could not open %s: %s\n", filename, strerror(errno));
+		return -1;
+	}
+	if (!fgets(line, sizeof(line), f) || strcmp(line, "slogic timing 1\n") != 0) {
+		log_printf( ERR, "%s is not a timing file\n", filename);
+		fclose(f);
+		return -1;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		if (!(value = strchr(line, '='))) {
+			continue;
+		}
+		*value++ = '\0';
+		if (strcmp(line, "sample_rate") == 0) {
+			info->sample_rate = strtoul(value, NULL, 10);
+		} else if (strcmp(line, "measured_rate") == 0) {
+			info->measured_rate = strtod(value, NULL);
+		} else if (strcmp(line, "first_sample_time") == 0) {
+			info->first_sample_time = strtoull(value, NULL, 10);
+		} else if (strcmp(line, "samples") == 0) {
+			info->samples = strtoull(value, NULL, 10);
+		} else if (strcmp(line, "dropped") == 0) {
+			info->dropped = strtoull(value, NULL, 10);
+		} else if (strcmp(line, "fitted") == 0) {
+			fitted = atoi(value);
+		}
+	}
+	fclose(f);
+	info->fitted = fitted;
+	if (!info->sample_rate || !info->first_sample_time) {
+		log_printf( ERR, "%s does not say its sample rate and start\n", filename);
+		return -1;
+	}
+	if (info->measured_rate <= 0) {
+		info->measured_rate = info->sample_rate;
+	}
+	return 0;
+}
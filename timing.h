@@ -0,0 +1,73 @@
+// vim: sw=8:ts=8:noexpandtab
+#ifndef __TIMING_H__
+#define __TIMING_H__
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/*
+ * Where a capture sits on the host's CLOCK_MONOTONIC, so captures of
+ * several devices taken at once can be put on one timeline (smerge).
+ *
+ * The start command is stamped in slogic_set_capture_async(). After that
+ * every completed transfer adds a point (samples delivered so far, time
+ * of the completion) to a running least squares fit. Its slope is the
+ * device's sample rate as the host clock sees it, which is off the
+ * nominal one by the crystal's error; its intercept is when sample 0 was
+ * taken, plus a transfer's delivery latency. That latency is much the same
+ * for every Logic on a host, so it drops out when the captures are
+ * aligned. When the completions do not follow the sample clock (the
+ * simulator at full speed) the fit is not used and the nominal rate and
+ * the command time stand in.
+ *
+ * Written next to each capture of a multi device run as <file>.time:
+ *
+ *   slogic timing 1
+ *   sample_rate=<nominal samples per second>
+ *   measured_rate=<samples per second on the host clock>
+ *   skew_ppm=<measured against nominal>
+ *   command_time=<CLOCK_MONOTONIC ns of the start command>
+ *   first_sample_time=<CLOCK_MONOTONIC ns of sample 0>
+ *   wall_time=<unix time of sample 0, seconds.nanoseconds>
+ *   samples=<in the capture>
+ *   dropped=<bytes lost to a full writer queue, the capture is not aligned after one>
+ *   fitted=<1 if the times come from the fit>
+ */
+
+#define TIMING_MAX_SKEW 0.01	/* a fitted rate further off the nominal one than this is not believed */
+#define TIMING_MIN_POINTS 16
+
+struct slogic_ctx;
+
+struct slogic_timing {
+	uint64_t			command_ns;
+	int64_t				command_wall_ns;
+	uint64_t			first_completion_ns;
+	/* the fit of completion time (ns after the command) over samples delivered, Welford style */
+	uint64_t			points;
+	double				mean_x;
+	double				mean_y;
+	double				m2_x;
+	double				c_xy;
+};
+
+/* what a <file>.time says */
+struct timing_info {
+	uint32_t			sample_rate;
+	double				measured_rate;
+	uint64_t			first_sample_time;
+	uint64_t			samples;
+	uint64_t			dropped;
+	bool				fitted;
+};
+
+void slogic_timing_start(struct slogic_ctx *handle);
+/* usb callback, after n_samples_fulfilled took in the transfer */
+void slogic_timing_complete(struct slogic_ctx *handle);
+/* the fitted start and rate, or the command time and the nominal rate; true if fitted */
+bool slogic_timing_fit(struct slogic_ctx *handle, uint64_t *first_sample_time, double *rate);
+int slogic_timing_write(struct slogic_ctx *handle, const char *filename);
+
+int timing_read(const char *filename, struct timing_info *info);
+
+#endif
@@ -0,0 +1,375 @@
+// vim: sw=8:ts=8:noexpandtab
+#include "tindex.h"
+#include "slogic.h"
+#include "blockz.h"
+#include "log.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define TINDEX_BYTE_LANES 0x0101010101010101ull	/* bit 0 of every byte of a word */
+
+static void tindex_entry_init(struct tindex_entry *e){
+unsigned int c;
+
+	memset(e, 0, sizeof(*e));
+	for (c = 0; c < TINDEX_CHANNELS; c++) {
+		e->first[c] = e->last[c] = TINDEX_NONE;
+	}
+}
+
+static void tindex_entry_merge(struct tindex_entry *dst, const struct tindex_entry *src){
+unsigned int c;
+
+	for (c = 0; c < TINDEX_CHANNELS; c++) {
+		if (!src->count[c]) {
+			continue;
+		}
+		if (!dst->count[c]) {
+			dst->first[c] = src->first[c];
+		}
+		dst->last[c] = src->last[c];
+		dst->count[c] += src->count[c];
+	}
+}
+
+/* 'd' holds sample ^ previous sample for the eight samples from 'base', one per byte */
+static inline void tindex_account(struct tindex_entry *e, uint64_t d, uint64_t base){
+uint64_t m;
+unsigned int c;
+
+	for (c = 0; c < TINDEX_CHANNELS; c++) {
+		m = d & (TINDEX_BYTE_LANES << c);
+		if (!m) {
+			continue;
+		}
+		e->count[c] += __builtin_popcountll(m);
+		if (e->first[c] == TINDEX_NONE) {
+			e->first[c] = base + (__builtin_ctzll(m) >> 3);
+		}
+		e->last[c] = base + ((63 - __builtin_clzll(m)) >> 3);
+	}
+}
+
+/* count the transitions of p[0..n), the samples from 'base', into 'e'; returns the last sample */
+static uint8_t tindex_scan(struct tindex_entry *e, const uint8_t *p, size_t n, uint64_t base, uint8_t prev){
+size_t i = 0, j;
+uint64_t w, d;
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	/* a word at a time, shifting by a byte lines every sample up with the one before it */
+	for (; i + 8 <= n; i += 8) {
+		memcpy(&w, p + i, 8);
+		d = w ^ ((w << 8) | prev);
+		prev = w >> 56;
+		if (d) {
+			tindex_account(e, d, base + i);
+		}
+	}
+#endif
+	while (i < n) {
+		d = 0;
+		for (j = 0; j < 8 && i + j < n; j++) {
+			d |= (uint64_t)(p[i + j] ^ prev) << (8 * j);
+			prev = p[i + j];
+		}
+		if (d) {
+			tindex_account(e, d, base + i);
+		}
+		i += j;
+	}
+	return prev;
+}
+
+/*
+ * Writer
+ */
+
+static int tindex_write_header(struct slogic_tindex *t){
+	if (fseeko(t->file, 0, SEEK_SET) || fwrite(&t->header, sizeof(t->header), 1, t->file) != 1) {
+		return -1;
+	}
+	return 0;
+}
+
+/* level 0 entry done: to the file, and into the upper levels it belongs to */
+static void tindex_push(struct slogic_tindex *t){
+uint64_t k = t->header.level_count[0], span = 1;
+unsigned int l;
+
+	if (fwrite(&t->current, sizeof(t->current), 1, t->file) != 1) {
+		t->error = 1;
+	}
+	t->header.level_count[0]++;
+	for (l = 1; l < TINDEX_MAX_LEVELS; l++) {
+		span *= TINDEX_FANOUT;
+		if (k % span == 0) {
+			if (t->header.level_count[l] == t->upper_cap[l]) {
+				t->upper_cap[l] = t->upper_cap[l] ? t->upper_cap[l] * 2 : 64;
+				t->upper[l] = realloc(t->upper[l], t->upper_cap[l] * sizeof(struct tindex_entry));
+				assert(t->upper[l]);
+			}
+			t->upper[l][t->header.level_count[l]++] = t->current;
+		} else {
+			tindex_entry_merge(&t->upper[l][t->header.level_count[l] - 1], &t->current);
+		}
+	}
+	tindex_entry_init(&t->current);
+}
+
+int slogic_tindex_arm(struct slogic_ctx *handle, const char *filename){
+struct slogic_tindex *t = &handle->tindex;
+
+	memset(t, 0, sizeof(*t));
+	t->filename = filename;
+	if (!(t->file = fopen(filename, "wb"))) {
+		log_printf( ERR, "Failed to create the transition index %s: %s\n", filename, strerror(errno));
+		return -1;
+	}
+	t->header.magic = TINDEX_MAGIC;
+	t->header.version = TINDEX_VERSION;
+	t->header.block = TINDEX_BLOCK;
+	t->header.fanout = TINDEX_FANOUT;
+	t->header.samples_per_second = handle->sample_rate->samples_per_second;
+	if (tindex_write_header(t)) {
+		log_printf( ERR, "Failed to write the transition index %s: %s\n", filename, strerror(errno));
+		fclose(t->file);
+		return -1;
+	}
+	tindex_entry_init(&t->current);
+
+	t->sink = handle->data_callback_write;
+	handle->data_callback_write = slogic_tindex_write;
+	return 0;
+}
+
+size_t slogic_tindex_write(struct slogic_ctx *handle, uint8_t *data, size_t size){
+struct slogic_tindex *t = &handle->tindex;
+size_t n, left = size;
+uint8_t *p = data;
+
+	if (size && !t->seen) {
+		/* nothing came before the very first sample, so it cannot be an edge */
+		t->prev = data[0];
+	}
+	while (left) {
+		n = TINDEX_BLOCK - t->seen % TINDEX_BLOCK;
+		if (n > left) {
+			n = left;
+		}
+		if (t->seen % TINDEX_BLOCK == 0) {
+			t->current.start = p[0];
+		}
+		t->prev = tindex_scan(&t->current, p, n, t->seen, t->prev);
+		t->seen += n;
+		p += n;
+		left -= n;
+		if (t->seen % TINDEX_BLOCK == 0) {
+			tindex_push(t);
+		}
+	}
+	return t->sink(handle, data, size);
+}
+
+void slogic_tindex_disarm(struct slogic_ctx *handle){
+struct slogic_tindex *t = &handle->tindex;
+struct tindex_header *h = &t->header;
+unsigned int l;
+
+	if (!t->sink) {
+		return;
+	}
+	handle->data_callback_write = t->sink;
+	t->sink = NULL;
+
+	if (t->seen % TINDEX_BLOCK) {
+		tindex_push(t);
+	}
+	h->n_samples = t->seen;
+	h->level_offset[0] = sizeof(*h);
+	/* levels up to and including the first with a single entry */
+	h->levels = h->level_count[0] ? 1 : 0;
+	for (l = 1; l < TINDEX_MAX_LEVELS && h->level_count[l - 1] > 1; l++) {
+		h->level_offset[l] = h->level_offset[l - 1] + h->level_count[l - 1] * sizeof(struct tindex_entry);
+		if (fwrite(t->upper[l], sizeof(struct tindex_entry), h->level_count[l], t->file) != h->level_count[l]) {
+			t->error = 1;
+		}
+		h->levels = l + 1;
+	}
+	for (; l < TINDEX_MAX_LEVELS; l++) {
+		h->level_count[l] = 0;
+	}
+	if (tindex_write_header(t) || fclose(t->file) || t->error) {
+		log_printf( ERR, "Failed to write the transition index %s\n", t->filename);
+	}
+	for (l = 0; l < TINDEX_MAX_LEVELS; l++) {
+		free(t->upper[l]);
+		t->upper[l] = NULL;
+	}
+	log_printf( DEBUG, "Transition index: %llu samples, %u levels, %llu blocks\n", (unsigned long long)h->n_samples,
+		    h->levels, (unsigned long long)h->level_count[0]);
+}
+
+/*
+ * Reader
+ */
+
+struct tindex_reader *tindex_open(const char *filename){
+struct tindex_reader *r;
+struct tindex_header *h;
+struct stat st;
+unsigned int l;
+int fd;
+
+	if ((fd = open(filename, O_RDONLY)) < 0) {
+		return NULL;
+	}
+	if (fstat(fd, &st) || (size_t)st.st_size < sizeof(struct tindex_header) || !(r = calloc(1, sizeof(*r)))) {
+		close(fd);
+		return NULL;
+	}
+	r->map_size = st.st_size;
+	r->map = mmap(NULL, r->map_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (r->map == MAP_FAILED) {
+		free(r);
+		return NULL;
+	}
+	r->header = h = r->map;
+	if (h->magic != TINDEX_MAGIC || h->version != TINDEX_VERSION || h->block == 0 || h->fanout < 2 ||
+	    h->levels > TINDEX_MAX_LEVELS) {
+		log_printf( ERR, "%s: not a transition index, or one from a host of the other byte order\n", filename);
+		goto fail;
+	}
+	for (l = 0; l < h->levels; l++) {
+		if (h->level_offset[l] > r->map_size ||
+		    h->level_count[l] > (r->map_size - h->level_offset[l]) / sizeof(struct tindex_entry)) {
+			log_printf( ERR, "%s: truncated, the capture may not have been closed\n", filename);
+			goto fail;
+		}
+		r->level[l] = (const struct tindex_entry *)((uint8_t *)r->map + h->level_offset[l]);
+	}
+	return r;
+
+fail:
+	tindex_close(r);
+	return NULL;
+}
+
+void tindex_close(struct tindex_reader *r){
+	if (!r) {
+		return;
+	}
+	munmap(r->map, r->map_size);
+	free(r);
+}
+
+/* the first transition on 'channel' in (after, last] from the samples themselves, -1 if they cannot be read */
+static int64_t tindex_refine(struct blockz_reader *data, unsigned int channel, uint64_t after, uint64_t last){
+size_t n = last - after + 1, i;
+uint8_t *buf;
+int64_t at = -1;
+
+	if (!(buf = malloc(n))) {
+		return -1;
+	}
+	if (blockz_read(data, after, buf, n) == (ssize_t)n) {
+		for (i = 1; i < n; i++) {
+			if ((buf[i] ^ buf[i - 1]) & (1 << channel)) {
+				at = after + i;
+				break;
+			}
+		}
+	}
+	free(buf);
+	return at;
+}
+
+int64_t tindex_next_edge(struct tindex_reader *r, unsigned int channel, uint64_t after, struct blockz_reader *data,
+			 bool *exact){
+const struct tindex_header *h = r->header;
+const struct tindex_entry *e;
+uint64_t p;
+unsigned int l;
+int64_t at;
+
+	*exact = true;
+	if (channel >= TINDEX_CHANNELS || !h->levels || after / h->block >= h->level_count[0]) {
+		return -1;
+	}
+	p = after / h->block;
+	e = &r->level[0][p];
+	if (e->count[channel] && e->last[channel] > after) {
+		if (e->first[channel] > after) {
+			return e->first[channel];
+		}
+		if (data && (at = tindex_refine(data, channel, after, e->last[channel])) >= 0) {
+			return at;
+		}
+		*exact = false;
+		return e->last[channel];
+	}
+
+	/* every block from here on is past 'after'; climb while a whole parent is, descend into the first hit */
+	l = 0;
+	p++;
+	while (p < h->level_count[l]) {
+		if (p % h->fanout == 0 && l + 1 < h->levels) {
+			p /= h->fanout;
+			l++;
+			continue;
+		}
+		e = &r->level[l][p];
+		if (e->count[channel]) {
+			return e->first[channel];
+		}
+		p++;
+	}
+	return -1;
+}
+
+int tindex_summary(struct tindex_reader *r, unsigned int channel, uint64_t from, uint64_t to,
+		   struct tindex_bucket *out, size_t n){
+const struct tindex_header *h = r->header;
+const struct tindex_entry *e;
+uint64_t span = h->block, width, start, p;
+unsigned int l = 0;
+size_t i;
+
+	if (to > h->n_samples) {
+		to = h->n_samples;
+	}
+	if (channel >= TINDEX_CHANNELS || !h->levels || !n || from >= to) {
+		return -1;
+	}
+	/* the coarsest level whose blocks still fit in a bucket */
+	width = (to - from) / n;
+	while (l + 1 < h->levels && span * h->fanout <= width) {
+		span *= h->fanout;
+		l++;
+	}
+	for (i = 0; i < n; i++) {
+		start = from + (to - from) * i / n;
+		out[i].transitions = 0;
+		out[i].level = (r->level[l][start / span].start >> channel) & 1;
+	}
+	/* every block counts once, in the bucket its start falls in; the one 'from' is in goes to the first */
+	for (p = from / span; p < h->level_count[l] && p * span < to; p++) {
+		start = p * span < from ? from : p * span;
+		i = (start - from) * n / (to - from);
+		while (i + 1 < n && from + (to - from) * (i + 1) / n <= start) {
+			i++;
+		}
+		while (i && from + (to - from) * i / n > start) {
+			i--;
+		}
+		e = &r->level[l][p];
+		out[i].transitions += e->count[channel];
+	}
+	return 0;
+}
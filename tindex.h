@@ -0,0 +1,117 @@
+// vim: sw=8:ts=8:noexpandtab
+#ifndef __TINDEX_H__
+#define __TINDEX_H__
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+/*
+ * Transition index sidecar (-X). While the writer thread hands samples to
+ * the output it also counts the edges on every channel. For each block of
+ * TINDEX_BLOCK samples it records, per channel, how many transitions there
+ * were and the sample index of the first and the last one, plus the
+ * channel levels at the start of the block. Level n+1 summarises
+ * TINDEX_FANOUT entries of level n, up to a single entry for the whole
+ * capture, so "next edge on channel 3 after sample X" walks up and down the
+ * levels instead of scanning samples, and a zoomed out view of any range
+ * comes from the level whose blocks fit it.
+ *
+ * Sample indexes count the samples written to the output, which with -T or
+ * -R start at the first one kept and with -c run across all the segments.
+ *
+ * Layout, host byte order with the magic telling a reader if it is not:
+ *   header   struct tindex_header, rewritten on close
+ *   level 0  level_count[0] * struct tindex_entry, written as the capture runs
+ *   level 1.. the upper levels, written on close
+ */
+
+#define TINDEX_MAGIC 0x49544c53	/* "SLTI" */
+#define TINDEX_VERSION 1
+#define TINDEX_BLOCK 65536
+#define TINDEX_FANOUT 16
+#define TINDEX_MAX_LEVELS 16
+#define TINDEX_CHANNELS 8
+#define TINDEX_NONE UINT64_MAX	/* first/last of a channel without transitions */
+
+struct slogic_ctx;
+struct blockz_reader;
+
+struct tindex_header {
+	uint32_t			magic;
+	uint32_t			version;
+	uint32_t			block;
+	uint32_t			fanout;
+	uint32_t			levels;
+	uint32_t			samples_per_second;
+	uint64_t			n_samples;
+	uint64_t			level_offset[TINDEX_MAX_LEVELS];	/* file offsets */
+	uint64_t			level_count[TINDEX_MAX_LEVELS];
+};
+
+/* one block at some level; a transition belongs to the sample that differs from the one before */
+struct tindex_entry {
+	uint64_t			count[TINDEX_CHANNELS];
+	uint64_t			first[TINDEX_CHANNELS];
+	uint64_t			last[TINDEX_CHANNELS];
+	uint8_t				start;		/* levels of the first sample */
+	uint8_t				pad[7];
+};
+
+/* writer */
+struct slogic_tindex {
+	FILE				*file;
+	const char			*filename;
+	struct tindex_header		header;
+	struct tindex_entry		current;	/* level 0 entry being filled */
+	uint64_t			seen;
+	uint8_t				prev;
+	struct tindex_entry		*upper[TINDEX_MAX_LEVELS];	/* levels 1.. in memory */
+	size_t				upper_cap[TINDEX_MAX_LEVELS];
+	size_t				(*sink)(struct slogic_ctx *handle, uint8_t *data, size_t size);
+	int				error;
+};
+
+static inline bool slogic_tindex_enabled(struct slogic_tindex *tindex){
+	return tindex->sink != NULL;
+}
+/* puts the index in front of data_callback_write(); arm it before a trigger or rotation */
+int slogic_tindex_arm(struct slogic_ctx *handle, const char *filename);
+size_t slogic_tindex_write(struct slogic_ctx *handle, uint8_t *data, size_t size);
+/* writes the upper levels and the header, restores data_callback_write() */
+void slogic_tindex_disarm(struct slogic_ctx *handle);
+
+/* reader, the file is mapped */
+struct tindex_reader {
+	struct tindex_header		*header;
+	const struct tindex_entry	*level[TINDEX_MAX_LEVELS];
+	void				*map;
+	size_t				map_size;
+};
+
+/* a summary of one bucket of a range, see tindex_summary() */
+struct tindex_bucket {
+	uint64_t			transitions;
+	uint8_t				level;		/* at the start of the block the bucket starts in */
+};
+
+struct tindex_reader *tindex_open(const char *filename);
+void tindex_close(struct tindex_reader *reader);
+/*
+ * The first transition on 'channel' after sample 'after'. When it lies in
+ * the block 'after' is in, only the samples can tell exactly: with 'data'
+ * it is read from there, without it the returned sample is the last
+ * transition of that block and *exact is false. -1 if there is none.
+ */
+int64_t tindex_next_edge(struct tindex_reader *reader, unsigned int channel, uint64_t after,
+			 struct blockz_reader *data, bool *exact);
+/*
+ * Transitions on 'channel' in 'n' equal buckets of [from, to), counted per
+ * index block: a block's transitions all go to the bucket its start falls
+ * in (the block 'from' is in, to the first). The counts add up to the blocks
+ * the range touches, and of buckets narrower than a block only one shows it.
+ */
+int tindex_summary(struct tindex_reader *reader, unsigned int channel, uint64_t from, uint64_t to,
+		   struct tindex_bucket *out, size_t n);
+
+#endif
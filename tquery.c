@@ -0,0 +1,135 @@
+// vim: sw=8:ts=8:noexpandtab
+/*
+ * Answers questions about a capture from its transition index (main -X)
+ * without reading the samples, see tindex.h.
+ *
+ *   tquery <index> info
+ *   tquery [-c <blockz capture>] <index> next <channel> <after>
+ *   tquery <index> summary <channel> <from> <to> <buckets>
+ *
+ * 'next' prints the sample of the first transition after <after>; when that
+ * is in the same block only the capture can pin it down, without -c the
+ * answer is then the last transition of the block, marked as approximate.
+ */
+#include "tindex.h"
+#include "blockz.h"
+#include "log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static void usage(const char *name){
+	fprintf(stderr, "usage: %s <index> info\n", name);
+	fprintf(stderr, "       %s [-c <blockz capture>] <index> next <channel> <after>\n", name);
+	fprintf(stderr, "       %s <index> summary <channel> <from> <to> <buckets>\n", name);
+}
+
+static int query_info(struct tindex_reader *r){
+const struct tindex_header *h = r->header;
+const struct tindex_entry *top;
+unsigned int l, c;
+
+	printf("samples: %llu\n", (unsigned long long)h->n_samples);
+	printf("sample rate: %u\n", h->samples_per_second);
+	printf("block: %u samples, fanout %u, %u levels\n", h->block, h->fanout, h->levels);
+	for (l = 0; l < h->levels; l++) {
+		printf("level %u: %llu entries\n", l, (unsigned long long)h->level_count[l]);
+	}
+	if (!h->levels) {
+		return 0;
+	}
+	top = &r->level[h->levels - 1][0];
+	for (c = 0; c < TINDEX_CHANNELS; c++) {
+		if (top->count[c]) {
+			printf("channel %u: %llu transitions, first at %llu, last at %llu\n", c,
+			       (unsigned long long)top->count[c], (unsigned long long)top->first[c],
+			       (unsigned long long)top->last[c]);
+		} else {
+			printf("channel %u: no transitions, %s\n", c, (top->start >> c) & 1 ? "high" : "low");
+		}
+	}
+	return 0;
+}
+
+static int query_next(struct tindex_reader *r, struct blockz_reader *data, unsigned int channel, uint64_t after){
+int64_t at;
+bool exact;
+
+	at = tindex_next_edge(r, channel, after, data, &exact);
+	if (at < 0) {
+		printf("none\n");
+		return 1;
+	}
+	printf("%lld%s\n", (long long)at, exact ? "" : " (last in its block, use -c for the exact sample)");
+	return 0;
+}
+
+static int query_summary(struct tindex_reader *r, unsigned int channel, uint64_t from, uint64_t to, size_t n){
+struct tindex_bucket *buckets;
+size_t i;
+
+	if (!n || !(buckets = calloc(n, sizeof(*buckets)))) {
+		return 1;
+	}
+	if (tindex_summary(r, channel, from, to, buckets, n)) {
+		free(buckets);
+		return 1;
+	}
+	for (i = 0; i < n; i++) {
+		printf("%llu %llu %u\n", (unsigned long long)(from + (to - from) * i / n),
+		       (unsigned long long)buckets[i].transitions, buckets[i].level);
+	}
+	free(buckets);
+	return 0;
+}
+
+int main(int argc, char **argv){
+struct tindex_reader *r;
+struct blockz_reader *data = NULL;
+char *capture = NULL;
+int c, ret = 1;
+
+	current_log_level = ERR;
+	while ((c = getopt(argc, argv, "c:h")) != -1) {
+		switch (c) {
+		case 'c':
+			capture = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return c == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc < 2) {
+		usage(argv[-optind]);
+		return EXIT_FAILURE;
+	}
+	if (!(r = tindex_open(argv[0]))) {
+		fprintf(stderr, "Failed to open the transition index %s\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	if (capture && !(data = blockz_open(capture))) {
+		fprintf(stderr, "Failed to open the capture %s\n", capture);
+		tindex_close(r);
+		return EXIT_FAILURE;
+	}
+
+	if (strcmp(argv[1], "info") == 0) {
+		ret = query_info(r);
+	} else if (strcmp(argv[1], "next") == 0 && argc == 4) {
+		ret = query_next(r, data, strtoul(argv[2], NULL, 10), strtoull(argv[3], NULL, 10));
+	} else if (strcmp(argv[1], "summary") == 0 && argc == 6) {
+		ret = query_summary(r, strtoul(argv[2], NULL, 10), strtoull(argv[3], NULL, 10),
+				    strtoull(argv[4], NULL, 10), strtoul(argv[5], NULL, 10));
+	} else {
+		usage(argv[-optind]);
+	}
+
+	blockz_close(data);
+	tindex_close(r);
+	return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,193 @@
+// vim: sw=8:ts=8:noexpandtab
+#include "trace.h"
+#include "slogic.h"
+#include "usbutil.h"
+#include "log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+int slogic_trace_open(struct slogic_ctx *handle, char *filename, size_t depth){
+struct slogic_trace *trace = &handle->trace;
+
+	assert(depth && (depth & (depth - 1)) == 0);
+
+	/* touched up front so the first lap around the ring does not page fault */
+	trace->events = mmap(NULL, depth * sizeof(struct slogic_trace_event), PROT_READ | PROT_WRITE,
+			     MAP_PRIVATE | MAP_ANONYMOUS | SLOGIC_MAP_POPULATE, -1, 0);
+	if (trace->events == MAP_FAILED) {
+		trace->events = NULL;
+		log_printf( ERR, "Failed to allocate %zu trace events\n", depth);
+		return -1;
+	}
+	trace->mask = depth - 1;
+	trace->filename = filename;
+	trace->start_ns = slogic_trace_now();
+	trace->last_complete_ns = 0;
+	atomic_init(&trace->head, 0);
+	memset(trace->latency, 0, sizeof(trace->latency));
+	memset(trace->callback, 0, sizeof(trace->callback));
+	memset(trace->gap, 0, sizeof(trace->gap));
+	return 0;
+}
+
+static inline unsigned int trace_bucket(uint64_t ns){
+unsigned int bucket;
+
+	bucket = ns ? 64 - __builtin_clzll(ns) : 0;
+	return bucket < TRACE_HISTOGRAM_BUCKETS ? bucket : TRACE_HISTOGRAM_BUCKETS - 1;
+}
+
+static inline uint32_t trace_clamp(uint64_t ns){
+	return ns > UINT32_MAX ? UINT32_MAX : ns;
+}
+
+static inline struct slogic_trace_event *trace_next(struct slogic_trace *trace, struct logic_transfers *ltransfer,
+						      uint64_t now, uint8_t type){
+uint64_t head = atomic_load_explicit(&trace->head, memory_order_relaxed);
+struct slogic_trace_event *event = &trace->events[head & trace->mask];
+struct slogic_ctx *handle = ltransfer->logic_context;
+
+	event->t_ns = now;
+	event->transfer_id = ltransfer->transfer_id;
+	event->type = type;
+	event->status = 0;
+	event->in_flight = handle->transfer_count > UINT16_MAX ? UINT16_MAX : handle->transfer_count;
+	event->length = 0;
+	event->latency_ns = 0;
+	event->callback_ns = 0;
+	event->seq = ltransfer->seq;
+	return event;
+}
+
+/* single writer, a plain store publishes the event */
+static inline void trace_commit(struct slogic_trace *trace){
+	atomic_store_explicit(&trace->head, atomic_load_explicit(&trace->head, memory_order_relaxed) + 1,
+			      memory_order_release);
+}
+
+void slogic_trace_submit(struct slogic_ctx *handle, struct logic_transfers *ltransfer){
+struct slogic_trace *trace = &handle->trace;
+
+	ltransfer->submit_ns = slogic_trace_now();
+	trace_next(trace, ltransfer, ltransfer->submit_ns, TRACE_SUBMIT);
+	trace_commit(trace);
+}
+
+void slogic_trace_cancel(struct slogic_ctx *handle, struct logic_transfers *ltransfer){
+struct slogic_trace *trace = &handle->trace;
+
+	trace_next(trace, ltransfer, slogic_trace_now(), TRACE_CANCEL);
+	trace_commit(trace);
+}
+
+/*
+ * Called on the way out of the completion callback, 'callback_start' is the
+ * clock on the way in. The completion itself is stamped at callback_start,
+ * anything the callback did (including resubmitting) is its duration.
+ */
+void slogic_trace_complete(struct slogic_ctx *handle, struct logic_transfers *ltransfer, uint64_t callback_start){
+struct slogic_trace *trace = &handle->trace;
+struct slogic_trace_event *event;
+uint64_t now = slogic_trace_now();
+uint64_t latency = callback_start - ltransfer->submit_ns;
+
+	event = trace_next(trace, ltransfer, callback_start, TRACE_COMPLETE);
+	event->status = ltransfer->transfer->status;
+	event->length = ltransfer->transfer->actual_length;
+	event->latency_ns = trace_clamp(latency);
+	event->callback_ns = trace_clamp(now - callback_start);
+	trace_commit(trace);
+
+	trace->latency[trace_bucket(latency)]++;
+	trace->callback[trace_bucket(now - callback_start)]++;
+	if (trace->last_complete_ns) {
+		trace->gap[trace_bucket(callback_start - trace->last_complete_ns)]++;
+	}
+	trace->last_complete_ns = callback_start;
+}
+
+static const char *trace_type_to_string(uint8_t type){
+	switch (type) {
+	case TRACE_SUBMIT:
+		return "submit";
+	case TRACE_COMPLETE:
+		return "complete";
+	case TRACE_CANCEL:
+		return "cancel";
+	}
+	return "?";
+}
+
+static void trace_log_histogram(const char *title, unsigned long *histogram){
+unsigned int bucket;
+unsigned long total = 0, max = 0;
+
+	for (bucket = 0; bucket < TRACE_HISTOGRAM_BUCKETS; bucket++) {
+		total += histogram[bucket];
+		if (histogram[bucket] > max) {
+			max = histogram[bucket];
+		}
+	}
+	log_printf( NOTICE, "%s (%lu):\n", title, total);
+	if (!total) {
+		return;
+	}
+	for (bucket = 0; bucket < TRACE_HISTOGRAM_BUCKETS; bucket++) {
+		if (!histogram[bucket]) {
+			continue;
+		}
+		/* bucket n holds [2^(n-1), 2^n) ns */
+		log_printf( NOTICE, "  < %10.3f us %10lu %-40.*s\n", (double)(1ULL << bucket) / 1000.0, histogram[bucket],
+			    (int)(histogram[bucket] * 40 / max + 1),
+			    "########################################");
+	}
+}
+
+/*
+ * The trace file is plain text, one event per line in the order they
+ * happened, so it can go straight into a spreadsheet or gnuplot:
+ *   time_us event transfer seq status length in_flight latency_us callback_us
+ */
+static int trace_write(struct slogic_trace *trace){
+FILE *f;
+uint64_t head = atomic_load_explicit(&trace->head, memory_order_acquire);
+uint64_t i = head > trace->mask + 1 ? head - trace->mask - 1 : 0;
+struct slogic_trace_event *event;
+
+	if (!(f = fopen(trace->filename, "w"))) {
+		perror(trace->filename);
+		return -1;
+	}
+	fprintf(f, "# time_us event transfer seq status length in_flight latency_us callback_us\n");
+	if (i) {
+		fprintf(f, "# ring wrapped, the first %llu events were dropped\n", (unsigned long long)i);
+	}
+	for (; i < head; i++) {
+		event = &trace->events[i & trace->mask];
+		fprintf(f, "%.3f %s %u %u %s %u %u %.3f %.3f\n",
+			(event->t_ns - trace->start_ns) / 1000.0, trace_type_to_string(event->type),
+			event->transfer_id, event->seq,
+			event->type == TRACE_COMPLETE ? usbutil_transfer_status_to_string(event->status) : "-",
+			event->length, event->in_flight, event->latency_ns / 1000.0, event->callback_ns / 1000.0);
+	}
+	fclose(f);
+	log_printf( NOTICE, "Wrote %llu trace events to %s\n", (unsigned long long)head, trace->filename);
+	return 0;
+}
+
+void slogic_trace_close(struct slogic_ctx *handle){
+struct slogic_trace *trace = &handle->trace;
+
+	if (!slogic_trace_enabled(trace)) {
+		return;
+	}
+	trace_log_histogram("Transfer latency, submit to completion", trace->latency);
+	trace_log_histogram("Completion callback duration", trace->callback);
+	trace_log_histogram("Gap between completions", trace->gap);
+	trace_write(trace);
+
+	munmap(trace->events, (trace->mask + 1) * sizeof(struct slogic_trace_event));
+	trace->events = NULL;
+}
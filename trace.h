@@ -0,0 +1,71 @@
+// vim: sw=8:ts=8:noexpandtab
+#ifndef __TRACE_H__
+#define __TRACE_H__
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#define DEFAULT_TRACE_DEPTH (1 << 20)	/* events kept, must be a power of two */
+#define TRACE_HISTOGRAM_BUCKETS 32	/* log2 of nanoseconds, up to ~4s */
+
+struct slogic_ctx;
+struct logic_transfers;
+
+enum slogic_trace_type {
+	TRACE_SUBMIT = 0,
+	TRACE_COMPLETE = 1,
+	TRACE_CANCEL = 2
+};
+
+/* one submit, completion or cancel of a streaming transfer, 32 bytes */
+struct slogic_trace_event {
+	uint64_t			t_ns;		/* CLOCK_MONOTONIC */
+	uint32_t			transfer_id;
+	uint8_t				type;		/* enum slogic_trace_type */
+	uint8_t				status;		/* libusb_transfer_status on completion */
+	uint16_t			in_flight;	/* transfers submitted after this event */
+	uint32_t			length;		/* actual_length on completion */
+	uint32_t			latency_ns;	/* submit to completion */
+	uint32_t			callback_ns;	/* time spent in the completion callback */
+	uint32_t			seq;
+};
+
+/*
+ * Flight recorder for the streaming transfers. The event thread is the only
+ * writer, so recording an event is a clock read and a store; once the ring
+ * wraps the oldest events are overwritten. Readers (the dump at the end of
+ * the run) only look at 'head' and never block the capture.
+ */
+struct slogic_trace {
+	struct slogic_trace_event	*events;
+	size_t				mask;
+	_Atomic uint64_t		head;
+	uint64_t			start_ns;
+	uint64_t			last_complete_ns;
+	char				*filename;
+	unsigned long			latency[TRACE_HISTOGRAM_BUCKETS];
+	unsigned long			callback[TRACE_HISTOGRAM_BUCKETS];
+	unsigned long			gap[TRACE_HISTOGRAM_BUCKETS];	/* between completions */
+};
+
+static inline uint64_t slogic_trace_now(){
+struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline bool slogic_trace_enabled(struct slogic_trace *trace){
+	return trace->events != NULL;
+}
+
+int slogic_trace_open(struct slogic_ctx *handle, char *filename, size_t depth);
+void slogic_trace_submit(struct slogic_ctx *handle, struct logic_transfers *ltransfer);
+void slogic_trace_cancel(struct slogic_ctx *handle, struct logic_transfers *ltransfer);
+void slogic_trace_complete(struct slogic_ctx *handle, struct logic_transfers *ltransfer, uint64_t callback_start);
+/* writes the trace file and logs the histograms */
+void slogic_trace_close(struct slogic_ctx *handle);
+
+#endif
@@ -0,0 +1,319 @@
+// vim: sw=8:ts=8:noexpandtab
+#include "transport.h"
+#include "slogic.h"
+#include "usbutil.h"
+#include "ezusb.h"
+#include "sim.h"
+#include "log.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * The real thing, through libusb. "usb" opens the logic_index-th Logic on
+ * the bus, "usb:<n>" the n-th and "usb:<bus>.<address>" that one.
+ */
+
+static int usb_transport_open(struct slogic_ctx *handle, int logic_index){
+int err,i;
+ssize_t cnt;
+libusb_device **list;
+libusb_device *found = NULL;
+struct libusb_device_descriptor descriptor;
+unsigned int bus = 0, address = 0, seen = 0;
+char extra;
+
+	if (*handle->transport_args) {
+		if (sscanf(handle->transport_args, "%u.%u%c", &bus, &address, &extra) == 2) {
+			logic_index = -1;
+		} else if (sscanf(handle->transport_args, "%d%c", &logic_index, &extra) != 1 || logic_index < 0) {
+			log_printf( ERR, "usb: expected <index> or <bus>.<address>: %s\n", handle->transport_args);
+			return -1;
+		}
+	}
+
+	cnt = libusb_get_device_list(handle->usb_context, &list);
+	if (cnt < 0) {
+		log_printf( ERR, "Failed to get a list of devices: %s\n", usbutil_error_to_string(cnt));
+		return -1;
+	}
+
+	for (i = 0; i < cnt; i++) {
+		libusb_device *device = list[i];
+		err = libusb_get_device_descriptor(device, &descriptor);
+		if (err) {
+			log_printf( ERR, "libusb_get_device_descriptor: %s\n", usbutil_error_to_string(err));
+			libusb_free_device_list(list, 1);
+			return -1;
+		}
+		if ((descriptor.idVendor == USB_VENDOR_ID) && (descriptor.idProduct == USB_PRODUCT_ID)) {
+			if (logic_index >= 0 ? seen++ != (unsigned int)logic_index :
+			    libusb_get_bus_number(device) != bus || libusb_get_device_address(device) != address) {
+				continue;
+			}
+			found = device;
+			log_printf( DEBUG, "Using the Logic at bus %u address %u\n", libusb_get_bus_number(device),
+				    libusb_get_device_address(device));
+			usbutil_dump_device_descriptor(&descriptor);
+			break;
+		}
+	}
+
+	if (!found) {
+		log_printf( ERR, "Device not found\n");
+		libusb_free_device_list(list, 1);
+		return -1;
+	}
+
+	if ((err = libusb_open(found, &handle->device_handle))) {
+		log_printf( ERR, "Failed OPEN the device: %s\n", usbutil_error_to_string(err));
+		libusb_free_device_list(list, 1);
+		handle->device_handle = NULL;
+		return -1;
+	}
+	libusb_free_device_list(list, 1);
+	log_printf( DEBUG,  "libusb_open: %s\n", usbutil_error_to_string(err));
+
+	if ((err = claim_device(handle->device_handle, 0)) != 0) {
+		log_printf( ERR, "Failed to claim the usb interface: %s\n", usbutil_error_to_string(err));
+		libusb_close(handle->device_handle);
+		handle->device_handle = NULL;
+		return -1;
+	}
+	handle->dev = libusb_get_device(handle->device_handle);
+	return 0;
+}
+
+static void usb_transport_close(struct slogic_ctx *handle){
+	if (handle->device_handle) {
+		libusb_close(handle->device_handle);
+		handle->device_handle = NULL;
+	}
+}
+
+/*
+ * just try to perform a normal read, if this fails we assume the firmware is not uploaded;
+ * if something runs, it has to be the image in fwfile, when there is one to compare with
+ */
+static bool usb_transport_is_firmware_uploaded(struct slogic_ctx *handle){
+unsigned char out_byte = 0x05;
+int transferred;
+int ret;
+
+	ret = libusb_bulk_transfer(handle->device_handle, SALEAE_COMMAND_OUT_ENDPOINT, &out_byte, 1, &transferred, 100);
+	if (ret != 0) {
+		return false;
+	}
+	if (handle->fwfile && access(handle->fwfile, R_OK) == 0 &&
+	    !ezusb_firmware_matches(handle->device_handle, handle->fwfile)) {
+		log_printf( NOTICE, "The Logic runs other firmware than %s\n", handle->fwfile);
+		return false;
+	}
+	return true;	/* probably the firmware is uploaded */
+}
+
+static int usb_transport_upload_firmware(struct slogic_ctx *handle, const char *filename){
+	return ezusb_upload_firmware(handle, 1, filename);
+}
+
+/* where a Logic was plugged in, it comes back there under a new address once its firmware runs */
+struct usb_port {
+	uint8_t				bus;
+	uint8_t				address;
+	uint8_t				ports[8];
+	int				n_ports;
+	libusb_device			*arrived;
+};
+
+static bool usb_at_port(libusb_device *device, struct usb_port *port){
+uint8_t ports[8];
+int n = libusb_get_port_numbers(device, ports, sizeof(ports));
+
+	return libusb_get_bus_number(device) == port->bus && libusb_get_device_address(device) != port->address &&
+	       n == port->n_ports && memcmp(ports, port->ports, n) == 0;
+}
+
+static int LIBUSB_CALL usb_hotplug_arrived(libusb_context *ctx, libusb_device *device, libusb_hotplug_event event,
+					   void *user_data){
+struct usb_port *port = user_data;
+
+	if (!port->arrived && usb_at_port(device, port)) {
+		port->arrived = libusb_ref_device(device);
+	}
+	return 0;
+}
+
+/* without hotplug support the bus is listed every SLOGIC_RENUMERATE_POLL_MS */
+static void usb_scan_port(struct slogic_ctx *handle, struct usb_port *port){
+libusb_device **list;
+struct libusb_device_descriptor descriptor;
+ssize_t cnt, i;
+
+	if ((cnt = libusb_get_device_list(handle->usb_context, &list)) < 0) {
+		return;
+	}
+	for (i = 0; i < cnt && !port->arrived; i++) {
+		if (!libusb_get_device_descriptor(list[i], &descriptor) && descriptor.idVendor == USB_VENDOR_ID &&
+		    descriptor.idProduct == USB_PRODUCT_ID && usb_at_port(list[i], port)) {
+			port->arrived = libusb_ref_device(list[i]);
+		}
+	}
+	libusb_free_device_list(list, 1);
+}
+
+/*
+ * Waits for the Logic to come back after the firmware upload reset it and
+ * opens it again, on the same context; the hotplug callback sees it arrive
+ * (or the bus is polled where libusb has no hotplug) rather than waiting a
+ * fixed time and listing every device again.
+ */
+static int usb_transport_renumerate(struct slogic_ctx *handle, unsigned int timeout_ms){
+struct usb_port port = { .bus = libusb_get_bus_number(handle->dev), .address = libusb_get_device_address(handle->dev) };
+libusb_hotplug_callback_handle callback;
+bool hotplug = false;
+uint64_t start = slogic_trace_now(), deadline = start + timeout_ms * 1000000ULL;
+struct timeval poll;
+int err = LIBUSB_ERROR_NO_DEVICE;
+
+	port.n_ports = libusb_get_port_numbers(handle->dev, port.ports, sizeof(port.ports));
+	usb_transport_close(handle);
+	handle->dev = NULL;
+
+	/* ENUMERATE reports it too if it came back before the callback was in */
+	if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+		hotplug = !libusb_hotplug_register_callback(handle->usb_context, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED,
+							    LIBUSB_HOTPLUG_ENUMERATE, USB_VENDOR_ID, USB_PRODUCT_ID,
+							    LIBUSB_HOTPLUG_MATCH_ANY, usb_hotplug_arrived, &port, &callback);
+	}
+	while (slogic_trace_now() < deadline) {
+		if (!port.arrived) {
+			if (hotplug) {
+				poll.tv_sec = 0;
+				poll.tv_usec = SLOGIC_RENUMERATE_POLL_MS * 1000;
+				libusb_handle_events_timeout_completed(handle->usb_context, &poll, NULL);
+			} else {
+				usb_scan_port(handle, &port);
+				if (!port.arrived) {
+					usleep(SLOGIC_RENUMERATE_POLL_MS * 1000);
+				}
+			}
+			continue;
+		}
+		/* udev may not have given us the new node yet */
+		if (!(err = libusb_open(port.arrived, &handle->device_handle))) {
+			break;
+		}
+		usleep(SLOGIC_RENUMERATE_POLL_MS * 1000);
+	}
+	if (hotplug) {
+		libusb_hotplug_deregister_callback(handle->usb_context, callback);
+	}
+	if (err) {
+		log_printf( ERR, "usb: the Logic did not come back %u ms after the firmware upload: %s\n", timeout_ms,
+			    port.arrived ? usbutil_error_to_string(err) : "not on the bus");
+		if (port.arrived) {
+			libusb_unref_device(port.arrived);
+		}
+		return -1;
+	}
+	libusb_unref_device(port.arrived);
+	if ((err = claim_device(handle->device_handle, 0)) != 0) {
+		log_printf( ERR, "Failed to claim the usb interface: %s\n", usbutil_error_to_string(err));
+		usb_transport_close(handle);
+		return -1;
+	}
+	handle->dev = libusb_get_device(handle->device_handle);
+	log_printf( DEBUG, "The Logic came back at bus %u address %u after %.1f ms%s\n", libusb_get_bus_number(handle->dev),
+		    libusb_get_device_address(handle->dev), (slogic_trace_now() - start) / 1e6, hotplug ? "" : " (polled)");
+	return 0;
+}
+
+static int usb_transport_max_packet_size(struct slogic_ctx *handle){
+	return libusb_get_max_packet_size(handle->dev, SALEAE_STREAMING_DATA_IN_ENDPOINT);
+}
+
+static void usb_command_callback(struct libusb_transfer *transfer){
+	if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+		log_printf( ERR, "command transfer: %s\n", usbutil_transfer_status_to_string(transfer->status));
+	}
+}
+
+static int usb_transport_command(struct slogic_ctx *handle, uint8_t *data, int length, bool async){
+struct libusb_transfer *transfer;
+unsigned char *buffer;
+int ret,transferred;
+
+	if (!async) {
+		if((ret = libusb_bulk_transfer(handle->device_handle, SALEAE_COMMAND_OUT_ENDPOINT, data, length, &transferred, handle->transfer_timeout))){
+			log_printf( ERR, "libusb_bulk_transfer (in): %s\n", usbutil_error_to_string(ret));
+			return ret;
+		}
+		return 0;
+	}
+
+	transfer = libusb_alloc_transfer(0);
+	buffer = malloc(length);
+	if (transfer == NULL || buffer == NULL) {
+		log_printf( ERR, "libusb_alloc_transfer failed\n");
+		libusb_free_transfer(transfer);
+		free(buffer);
+		return 1;
+	}
+	/* the command has to outlive the caller's stack frame */
+	memcpy(buffer, data, length);
+	libusb_fill_bulk_transfer(transfer, handle->device_handle, SALEAE_COMMAND_OUT_ENDPOINT, buffer, length, usb_command_callback, NULL, handle->transfer_timeout);
+	transfer->flags |= LIBUSB_TRANSFER_FREE_BUFFER | LIBUSB_TRANSFER_FREE_TRANSFER;
+	if ((ret = libusb_submit_transfer(transfer))) {
+		log_printf( ERR, "libusb_submit_transfer: %s\n", usbutil_error_to_string(ret));
+		libusb_free_transfer(transfer);
+		return ret;
+	}
+	return 0;
+}
+
+static int usb_transport_submit(struct slogic_ctx *handle, struct libusb_transfer *transfer){
+	return libusb_submit_transfer(transfer);
+}
+
+static int usb_transport_cancel(struct slogic_ctx *handle, struct libusb_transfer *transfer){
+	return libusb_cancel_transfer(transfer);
+}
+
+static int usb_transport_handle_events(struct slogic_ctx *handle, struct timeval *timeout){
+	return libusb_handle_events_timeout(handle->usb_context, timeout);
+}
+
+/*
+ * Transport table
+ */
+
+struct slogic_transport transports[] = {
+	{"usb", "a Logic on the usb bus (default), usb:<n> or usb:<bus>.<address> for one of several", usb_transport_open, usb_transport_close,
+	 usb_transport_is_firmware_uploaded, usb_transport_upload_firmware, usb_transport_renumerate, usb_transport_max_packet_size,
+	 usb_transport_command, usb_transport_submit, usb_transport_cancel, usb_transport_handle_events, true},
+	{"sim", "a simulated Logic, see sim.h for the options", sim_transport_open, sim_transport_close,
+	 sim_transport_is_firmware_uploaded, sim_transport_upload_firmware, sim_transport_renumerate, sim_transport_max_packet_size,
+	 sim_transport_command, sim_transport_submit, sim_transport_cancel, sim_transport_handle_events, false},
+	{NULL},
+};
+
+struct slogic_transport *slogic_get_transports(){
+	return transports;
+}
+
+int slogic_set_transport(struct slogic_ctx *handle, const char *spec){
+struct slogic_transport *transport = slogic_get_transports();
+const char *args = strchr(spec, ':');
+size_t len = args ? (size_t)(args - spec) : strlen(spec);
+
+	while (transport->name != NULL) {
+		if (strlen(transport->name) == len && strncmp(transport->name, spec, len) == 0) {
+			handle->transport = transport;
+			handle->transport_args = args ? args + 1 : "";
+			return 0;
+		}
+		transport++;
+	}
+	return -1;
+}
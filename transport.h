@@ -0,0 +1,42 @@
+// vim: sw=8:ts=8:noexpandtab
+#ifndef __TRANSPORT_H__
+#define __TRANSPORT_H__
+#include <libusb.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/time.h>
+
+struct slogic_ctx;
+
+/*
+ * Everything slogic.c needs from a Logic. The streaming transfers are still
+ * plain struct libusb_transfer, so the completion callback does not care
+ * whether a real device or the simulator filled them in.
+ */
+struct slogic_transport {
+	const char *name;	/* the name used with -i ("usb") */
+	const char *text;	/* a one line description for the usage text */
+	int (*open)(struct slogic_ctx *handle, int logic_index);
+	void (*close)(struct slogic_ctx *handle);
+	bool (*is_firmware_uploaded)(struct slogic_ctx *handle);
+	int (*upload_firmware)(struct slogic_ctx *handle, const char *filename);
+	/* after upload_firmware(): waits up to timeout_ms for the device to come back with it and reopens it */
+	int (*renumerate)(struct slogic_ctx *handle, unsigned int timeout_ms);
+	int (*max_packet_size)(struct slogic_ctx *handle);
+	/* bulk out on the command endpoint; async returns once it is queued */
+	int (*command)(struct slogic_ctx *handle, uint8_t *data, int length, bool async);
+	int (*submit)(struct slogic_ctx *handle, struct libusb_transfer *transfer);
+	int (*cancel)(struct slogic_ctx *handle, struct libusb_transfer *transfer);
+	int (*handle_events)(struct slogic_ctx *handle, struct timeval *timeout);
+	/* one handle_events() serves every device on the same libusb context */
+	bool shared_events;
+};
+
+#define DEFAULT_TRANSPORT "usb"
+
+/* returns an array of transports terminated by an entry with a NULL name */
+struct slogic_transport *slogic_get_transports();
+/* "name[:args]", args are kept in handle->transport_args for the transport's open() */
+int slogic_set_transport(struct slogic_ctx *handle, const char *spec);
+
+#endif
@@ -0,0 +1,380 @@
+// vim: sw=8:ts=8:noexpandtab
+#include "trigger.h"
+#include "slogic.h"
+#include "output.h"
+#include "log.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#include <immintrin.h>
+#define TRIGGER_HAVE_X86 1
+#endif
+
+/*
+ * Matching. A sample s after p matches when
+ *   ((s ^ value) & mask) | (rise & ~(~p & s)) | (fall & ~(p & ~s)) | (change & ~(p ^ s))
+ * is zero, which is a handful of bitwise ops and one compare per 16 or 32
+ * samples in the vector versions.
+ */
+
+static inline bool trigger_match(const struct slogic_trigger_stage *st, uint8_t s, uint8_t p){
+	return !(((s ^ st->value) & st->mask) | (st->rise & ~(~p & s)) | (st->fall & ~(p & ~s)) |
+		 (st->change & ~(p ^ s)));
+}
+
+static size_t trigger_scan_scalar(const struct slogic_trigger_stage *st, const uint8_t *p, size_t n, uint8_t prev){
+size_t i;
+
+	for (i = 0; i < n; i++) {
+		if (trigger_match(st, p[i], i ? p[i - 1] : prev)) {
+			return i;
+		}
+	}
+	return n;
+}
+
+#ifdef TRIGGER_HAVE_X86
+static size_t trigger_scan_sse2(const struct slogic_trigger_stage *st, const uint8_t *p, size_t n, uint8_t prev){
+__m128i mask = _mm_set1_epi8(st->mask), value = _mm_set1_epi8(st->value);
+__m128i rise = _mm_set1_epi8(st->rise), fall = _mm_set1_epi8(st->fall), change = _mm_set1_epi8(st->change);
+__m128i zero = _mm_setzero_si128(), s, q, x;
+unsigned int hits;
+size_t i;
+
+	/* the first sample's predecessor is not in p */
+	if (!n || trigger_match(st, p[0], prev)) {
+		return 0;
+	}
+	for (i = 1; i + 16 <= n; i += 16) {
+		s = _mm_loadu_si128((const __m128i *)(p + i));
+		q = _mm_loadu_si128((const __m128i *)(p + i - 1));
+		x = _mm_and_si128(_mm_xor_si128(s, value), mask);
+		x = _mm_or_si128(x, _mm_andnot_si128(_mm_andnot_si128(q, s), rise));
+		x = _mm_or_si128(x, _mm_andnot_si128(_mm_andnot_si128(s, q), fall));
+		x = _mm_or_si128(x, _mm_andnot_si128(_mm_xor_si128(q, s), change));
+		hits = _mm_movemask_epi8(_mm_cmpeq_epi8(x, zero));
+		if (hits) {
+			return i + __builtin_ctz(hits);
+		}
+	}
+	return i + trigger_scan_scalar(st, p + i, n - i, p[i - 1]);
+}
+
+__attribute__((target("avx2")))
+static size_t trigger_scan_avx2(const struct slogic_trigger_stage *st, const uint8_t *p, size_t n, uint8_t prev){
+__m256i mask = _mm256_set1_epi8(st->mask), value = _mm256_set1_epi8(st->value);
+__m256i rise = _mm256_set1_epi8(st->rise), fall = _mm256_set1_epi8(st->fall), change = _mm256_set1_epi8(st->change);
+__m256i zero = _mm256_setzero_si256(), s, q, x;
+unsigned int hits;
+size_t i;
+
+	if (!n || trigger_match(st, p[0], prev)) {
+		return 0;
+	}
+	for (i = 1; i + 32 <= n; i += 32) {
+		s = _mm256_loadu_si256((const __m256i *)(p + i));
+		q = _mm256_loadu_si256((const __m256i *)(p + i - 1));
+		x = _mm256_and_si256(_mm256_xor_si256(s, value), mask);
+		x = _mm256_or_si256(x, _mm256_andnot_si256(_mm256_andnot_si256(q, s), rise));
+		x = _mm256_or_si256(x, _mm256_andnot_si256(_mm256_andnot_si256(s, q), fall));
+		x = _mm256_or_si256(x, _mm256_andnot_si256(_mm256_xor_si256(q, s), change));
+		hits = _mm256_movemask_epi8(_mm256_cmpeq_epi8(x, zero));
+		if (hits) {
+			return i + __builtin_ctz(hits);
+		}
+	}
+	return i + trigger_scan_sse2(st, p + i, n - i, p[i - 1]);
+}
+#endif
+
+static size_t trigger_scan_resolve(const struct slogic_trigger_stage *st, const uint8_t *p, size_t n, uint8_t prev);
+static size_t (*trigger_scan_impl)(const struct slogic_trigger_stage *st, const uint8_t *p, size_t n, uint8_t prev) =
+	trigger_scan_resolve;
+
+/* picks the widest implementation the cpu supports on first use */
+static size_t trigger_scan_resolve(const struct slogic_trigger_stage *st, const uint8_t *p, size_t n, uint8_t prev){
+#ifdef TRIGGER_HAVE_X86
+	__builtin_cpu_init();
+	trigger_scan_impl = __builtin_cpu_supports("avx2") ? trigger_scan_avx2 : trigger_scan_sse2;
+#else
+	trigger_scan_impl = trigger_scan_scalar;
+#endif
+	return trigger_scan_impl(st, p, n, prev);
+}
+
+size_t slogic_trigger_scan(const struct slogic_trigger_stage *stage, const uint8_t *p, size_t n, uint8_t prev){
+	return trigger_scan_impl(stage, p, n, prev);
+}
+
+/*
+ * Parsing
+ */
+
+static int trigger_parse_stage(struct slogic_trigger_stage *st, char *text){
+char *cond, *save = NULL, *value, *end;
+unsigned long channel, bits;
+uint8_t bit;
+
+	memset(st, 0, sizeof(*st));
+	for (cond = strtok_r(text, ",", &save); cond; cond = strtok_r(NULL, ",", &save)) {
+		if (!(value = strchr(cond, '=')) || !value[1]) {
+			return -1;
+		}
+		*value++ = '\0';
+		if (!strcmp(cond, "mask") || !strcmp(cond, "value")) {
+			bits = strtoul(value, &end, 0);
+			if (*end || bits > 0xff) {
+				return -1;
+			}
+			if (cond[0] == 'm') {
+				st->mask |= bits;
+			} else {
+				st->value |= bits;
+			}
+			continue;
+		}
+		channel = strtoul(cond, &end, 10);
+		if (*end || end == cond || channel > 7 || value[1]) {
+			return -1;
+		}
+		bit = 1 << channel;
+		switch (value[0]) {
+		case '0':
+			st->mask |= bit;
+			st->value &= ~bit;
+			break;
+		case '1':
+			st->mask |= bit;
+			st->value |= bit;
+			break;
+		case 'r':
+			st->rise |= bit;
+			break;
+		case 'f':
+			st->fall |= bit;
+			break;
+		case 'e':
+			st->change |= bit;
+			break;
+		default:
+			return -1;
+		}
+	}
+	st->value &= st->mask;
+	return 0;
+}
+
+int slogic_trigger_parse(struct slogic_trigger *trigger, const char *spec){
+char *copy, *stage, *save = NULL;
+int ret = 0;
+
+	if (!(copy = strdup(spec))) {
+		return -1;
+	}
+	trigger->n_stages = 0;
+	for (stage = strtok_r(copy, ";", &save); stage; stage = strtok_r(NULL, ";", &save)) {
+		if (trigger->n_stages == TRIGGER_MAX_STAGES ||
+		    trigger_parse_stage(&trigger->stages[trigger->n_stages], stage)) {
+			ret = -1;
+			break;
+		}
+		trigger->n_stages++;
+	}
+	free(copy);
+	if (ret || !trigger->n_stages) {
+		trigger->n_stages = 0;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Pre trigger ring
+ */
+
+static void trigger_ring_push(struct slogic_trigger *trigger, const uint8_t *data, size_t size){
+size_t n;
+
+	if (!trigger->pre) {
+		return;
+	}
+	if (size >= trigger->pre) {
+		/* only the newest 'pre' samples survive */
+		memcpy(trigger->ring, data + size - trigger->pre, trigger->pre);
+		trigger->ring_head = 0;
+		trigger->ring_fill = trigger->pre;
+		return;
+	}
+	n = trigger->pre - trigger->ring_head;
+	if (n > size) {
+		n = size;
+	}
+	memcpy(trigger->ring + trigger->ring_head, data, n);
+	memcpy(trigger->ring, data + n, size - n);
+	trigger->ring_head = (trigger->ring_head + size) % trigger->pre;
+	trigger->ring_fill = trigger->ring_fill + size > trigger->pre ? trigger->pre : trigger->ring_fill + size;
+}
+
+/* oldest first */
+static void trigger_ring_flush(struct slogic_ctx *handle){
+struct slogic_trigger *trigger = &handle->trigger;
+size_t start;
+
+	if (!trigger->ring_fill) {
+		return;
+	}
+	if (trigger->ring_fill < trigger->pre) {
+		trigger->sink(handle, trigger->ring, trigger->ring_fill);
+	} else {
+		start = trigger->ring_head;
+		trigger->sink(handle, trigger->ring + start, trigger->pre - start);
+		if (start) {
+			trigger->sink(handle, trigger->ring, start);
+		}
+	}
+	trigger->ring_fill = 0;
+}
+
+/*
+ * Writer thread
+ */
+
+/* async signal safe, the writer thread flushes the ring with the next block it sees */
+void slogic_trigger_stop(struct slogic_ctx *handle){
+	atomic_store(&handle->trigger.stop, 1);
+}
+
+int slogic_trigger_arm(struct slogic_ctx *handle, size_t pre, size_t post){
+struct slogic_trigger *trigger = &handle->trigger;
+
+	trigger->pre = pre;
+	trigger->post = post;
+	trigger->stage = 0;
+	trigger->state = TRIGGER_ARMED;
+	trigger->seen = 0;
+	trigger->ring_head = trigger->ring_fill = 0;
+	trigger->ring = NULL;
+	atomic_init(&trigger->done, 0);
+	atomic_init(&trigger->stop, 0);
+	if (pre) {
+		trigger->ring = mmap(NULL, pre, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | SLOGIC_MAP_POPULATE, -1, 0);
+		if (trigger->ring == MAP_FAILED) {
+			trigger->ring = NULL;
+			log_printf( ERR, "Failed to allocate a %zu sample pre trigger buffer\n", pre);
+			return -1;
+		}
+	}
+
+	/* the output only sees what survives the trigger; a copy of the ring cannot land in its own buffers */
+	trigger->sink = handle->data_callback_write;
+	handle->data_callback_write = slogic_trigger_write;
+	handle->data_callback_buffer = NULL;
+	log_printf( DEBUG, "Trigger: %u stages, %zu samples before and %zu from the trigger%s\n", trigger->n_stages,
+		    trigger->pre, trigger->post, trigger->continuous ? ", until stopped" : "");
+	return 0;
+}
+
+/* offset of the sample the last stage matched, 'size' if the trigger did not fire in this block */
+static size_t trigger_find(struct slogic_trigger *trigger, const uint8_t *data, size_t size){
+size_t pos = 0, hit;
+
+	if (!size || !trigger->n_stages) {
+		return size;
+	}
+	if (!trigger->seen) {
+		/* nothing came before the very first sample, so it cannot be an edge */
+		trigger->prev = data[0];
+	}
+	while (pos < size) {
+		hit = slogic_trigger_scan(&trigger->stages[trigger->stage], data + pos, size - pos,
+					  pos ? data[pos - 1] : trigger->prev);
+		if (hit == size - pos) {
+			break;
+		}
+		pos += hit;
+		if (++trigger->stage == trigger->n_stages) {
+			return pos;
+		}
+		/* the next stage starts at the sample after this match */
+		pos++;
+	}
+	trigger->prev = data[size - 1];
+	return size;
+}
+
+size_t slogic_trigger_write(struct slogic_ctx *handle, uint8_t *data, size_t size){
+struct slogic_trigger *trigger = &handle->trigger;
+size_t at, limit = size, post, n, total = size;
+const char *reason = "triggered";
+
+	if (!size) {
+		return 0;
+	}
+	if (trigger->state == TRIGGER_ARMED) {
+		/* a stop request or the sample count ends the block early, a trigger match may come first */
+		if (atomic_load_explicit(&trigger->stop, memory_order_relaxed)) {
+			limit = 0;
+		} else if (trigger->stop_after && trigger->seen + size >= trigger->stop_after) {
+			limit = trigger->stop_after - trigger->seen;
+		}
+		at = trigger_find(trigger, data, limit);
+		trigger_ring_push(trigger, data, at);
+		trigger->seen += at;
+		if (at == size) {
+			return total;
+		}
+		post = trigger->post;
+		if (trigger->stage < trigger->n_stages || !trigger->n_stages) {
+			/* stopped before the trigger fired, there is nothing after it to write */
+			reason = limit ? "stopped by the sample count" : "stopped";
+			post = 0;
+		}
+		trigger->fired_at = trigger->seen;
+		log_printf( NOTICE, "Capture %s at sample %llu (%.6fs), writing the %zu samples before it\n", reason,
+			    (unsigned long long)trigger->fired_at,
+			    (double)trigger->fired_at / handle->sample_rate->samples_per_second, trigger->ring_fill);
+		trigger_ring_flush(handle);
+		trigger->state = TRIGGER_POST;
+		trigger->remaining = post;
+		data += at;
+		size -= at;
+	}
+	if (trigger->state == TRIGGER_POST) {
+		n = size < trigger->remaining ? size : trigger->remaining;
+		if (n) {
+			trigger->sink(handle, data, n);
+		}
+		trigger->seen += n;
+		trigger->remaining -= n;
+		if (!trigger->remaining) {
+			trigger->state = TRIGGER_DONE;
+			atomic_store(&trigger->done, 1);
+		}
+	}
+	return total;
+}
+
+void slogic_trigger_disarm(struct slogic_ctx *handle){
+struct slogic_trigger *trigger = &handle->trigger;
+
+	if (trigger->state == TRIGGER_ARMED && trigger->continuous && trigger->sink) {
+		/* the capture failed without a stop event, what the ring holds is still worth keeping */
+		log_printf( ERR, "The capture ended before a stop event, writing the last %zu samples\n", trigger->ring_fill);
+		trigger_ring_flush(handle);
+	} else if (trigger->state == TRIGGER_ARMED && !trigger->continuous) {
+		log_printf( ERR, "The trigger did not fire, stage %u of %u not matched in %llu samples\n",
+			    trigger->stage + 1, trigger->n_stages, (unsigned long long)trigger->seen);
+	}
+	if (trigger->sink) {
+		handle->data_callback_write = trigger->sink;
+		handle->data_callback_buffer = handle->output_format ? handle->output_format->buffer : NULL;
+		trigger->sink = NULL;
+	}
+	if (trigger->ring) {
+		munmap(trigger->ring, trigger->pre);
+		trigger->ring = NULL;
+	}
+}
@@ -0,0 +1,98 @@
+// vim: sw=8:ts=8:noexpandtab
+#ifndef __TRIGGER_H__
+#define __TRIGGER_H__
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+/*
+ * Software trigger on the byte per sample stream. A trigger is a sequence
+ * of stages, each one a set of conditions on the eight channels that must
+ * all hold on one sample; stage n+1 is only looked for after stage n
+ * matched, and the trigger fires on the sample that matches the last stage.
+ *
+ *   -T "<stage>[;<stage>...]"
+ *   stage:  <channel>=<condition>[,...]	channel 0 to 7, condition one of
+ *		0 1	level low or high
+ *		r f	rising or falling edge
+ *		e	either edge
+ *	    or mask=<bits>,value=<bits>		a pattern with a mask, which can be
+ *						combined with per channel conditions
+ *
+ * e.g. -T "0=f;1=r,2=1": a falling edge on channel 0, then the first rising
+ * edge on channel 1 while channel 2 is high.
+ *
+ * The trigger sits between the writer thread and the output's write(). Until
+ * it fires the samples only go through a ring that keeps the last 'pre' of
+ * them; then those and n_samples_requested - pre samples from the trigger
+ * on are written, and the capture stops.
+ *
+ * The same ring also serves continuous capture (-R): nothing is written
+ * while the device streams, however long that is, and memory stays at the
+ * ring size. A stop event writes the ring out and ends the capture; that is
+ * a trigger match if there is one, slogic_trigger_stop() (SIGINT, SIGUSR1)
+ * or 'stop_after' samples.
+ */
+
+#define TRIGGER_MAX_STAGES 8
+#define DEFAULT_PRE_TRIGGER_DIVISOR 10	/* default pre trigger: a tenth of -n */
+
+struct slogic_ctx;
+
+/* a sample s with previous sample p matches if all the set bits agree */
+struct slogic_trigger_stage {
+	uint8_t				mask;		/* (s & mask) == value */
+	uint8_t				value;
+	uint8_t				rise;		/* 0 -> 1 */
+	uint8_t				fall;		/* 1 -> 0 */
+	uint8_t				change;		/* either */
+};
+
+enum slogic_trigger_state {
+	TRIGGER_ARMED = 0,
+	TRIGGER_POST = 1,	/* fired, writing what follows */
+	TRIGGER_DONE = 2
+};
+
+struct slogic_trigger {
+	struct slogic_trigger_stage	stages[TRIGGER_MAX_STAGES];
+	unsigned int			n_stages;
+	unsigned int			stage;		/* looking for this one */
+	size_t				pre;
+	size_t				post;
+	bool				continuous;	/* ring capture, no trigger needed */
+	uint64_t			stop_after;	/* stop at this sample, 0 for never */
+
+	/* writer thread state */
+	enum slogic_trigger_state	state;
+	uint8_t				prev;		/* last sample of the previous block */
+	uint64_t			seen;		/* samples looked at */
+	uint64_t			fired_at;
+	size_t				remaining;	/* post trigger samples still to write */
+	size_t				(*sink)(struct slogic_ctx *handle, uint8_t *data, size_t size);
+
+	/* the last 'pre' samples before the trigger */
+	uint8_t				*ring;
+	size_t				ring_head;
+	size_t				ring_fill;
+
+	_Atomic int			done;		/* seen by the usb callback */
+	_Atomic int			stop;		/* set by slogic_trigger_stop() */
+};
+
+/* index of the first sample of p[0..n) that matches 'stage', n if none; 'prev' precedes p[0] */
+size_t slogic_trigger_scan(const struct slogic_trigger_stage *stage, const uint8_t *p, size_t n, uint8_t prev);
+
+int slogic_trigger_parse(struct slogic_trigger *trigger, const char *spec);
+static inline bool slogic_trigger_enabled(struct slogic_trigger *trigger){
+	return trigger->n_stages > 0 || trigger->continuous;
+}
+/* set up the ring and put the trigger in front of data_callback_write() */
+int slogic_trigger_arm(struct slogic_ctx *handle, size_t pre, size_t post);
+void slogic_trigger_stop(struct slogic_ctx *handle);
+size_t slogic_trigger_write(struct slogic_ctx *handle, uint8_t *data, size_t size);
+/* restores data_callback_write() and frees the ring */
+void slogic_trigger_disarm(struct slogic_ctx *handle);
+
+#endif
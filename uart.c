@@ -0,0 +1,148 @@
+// vim: sw=8:ts=8:noexpandtab
+/*
+ * Asynchronous serial. The line idles high; a falling edge starts a frame
+ * and every bit after it is taken in the middle of its cell, timed from
+ * that edge, so only the edges in the idle line are looked at sample by
+ * sample. A start bit that is high again at its middle was a glitch.
+ */
+#include "decode.h"
+#include "log.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define UART_MIN_SAMPLES_PER_BIT 4
+
+static int uart_init(struct decoder *d, char *options){
+struct uart_decoder *u = &d->uart;
+char *opt, *value, *save = NULL;
+int rx = -1;
+
+	memset(u, 0, sizeof(*u));
+	u->bits = 8;
+	u->parity = 'n';
+	u->stop = 1;
+	for (opt = strtok_r(options, ",", &save); opt; opt = strtok_r(NULL, ",", &save)) {
+		value = strchr(opt, '=');
+		if (value) {
+			*value++ = '\0';
+		}
+		if (strcmp(opt, "rx") == 0 && value) {
+			rx = decode_channel(value);
+		} else if (strcmp(opt, "baud") == 0 && value) {
+			u->baud = strtoul(value, NULL, 10);
+		} else if (strcmp(opt, "bits") == 0 && value) {
+			u->bits = strtoul(value, NULL, 10);
+		} else if (strcmp(opt, "parity") == 0 && value &&
+			   (strcmp(value, "none") == 0 || strcmp(value, "even") == 0 || strcmp(value, "odd") == 0)) {
+			u->parity = value[0];
+		} else if (strcmp(opt, "stop") == 0 && value) {
+			u->stop = strtoul(value, NULL, 10);
+		} else if (strcmp(opt, "invert") == 0 && !value) {
+			u->invert = 1;
+		} else {
+			log_printf( ERR, "uart: bad option '%s'\n", opt);
+			return -1;
+		}
+	}
+	if (rx < 0 || !u->baud || u->bits < 5 || u->bits > 9 || u->stop < 1 || u->stop > 2) {
+		log_printf( ERR, "uart: needs rx=<channel> and baud=<rate>, 5 to 9 bits and 1 or 2 stop bits\n");
+		return -1;
+	}
+	u->rx = rx;
+	u->spb = (double)d->samples_per_second / u->baud;
+	if (u->spb < UART_MIN_SAMPLES_PER_BIT) {
+		log_printf( ERR, "uart: %u baud needs a sample rate of at least %u\n", u->baud,
+			    u->baud * UART_MIN_SAMPLES_PER_BIT);
+		return -1;
+	}
+	return 0;
+}
+
+static void uart_reset(struct decoder *d){
+	d->uart.busy = false;
+}
+
+/* cell 'bit' of the frame, 0 is the start bit */
+static inline uint64_t uart_middle(const struct uart_decoder *u, unsigned int bit){
+	return u->t0 + (uint64_t)((bit + 0.5) * u->spb);
+}
+
+static void uart_bit(struct decoder *d, uint8_t level){
+struct uart_decoder *u = &d->uart;
+unsigned int data_end = 1 + u->bits, parity_end = data_end + (u->parity != 'n');
+
+	if (u->bit == 0) {
+		if (level) {
+			u->busy = false;
+			return;
+		}
+	} else if (u->bit < data_end) {
+		u->value |= (uint32_t)level << (u->bit - 1);
+	} else if (u->bit < parity_end) {
+		if ((__builtin_popcount(u->value) + level + (u->parity == 'o')) & 1) {
+			u->flags |= DECODE_FLAG_PARITY;
+		}
+	} else if (!level) {
+		u->flags |= DECODE_FLAG_FRAMING;
+	}
+	if (++u->bit == parity_end + u->stop) {
+		decode_emit(d, DECODE_DATA, u->t0, u->t0 + (uint64_t)(u->bit * u->spb), u->value, 0, u->flags);
+		u->busy = false;
+		return;
+	}
+	u->next = uart_middle(u, u->bit);
+}
+
+static void uart_feed(struct decoder *d, const uint8_t *p, size_t n, uint64_t base){
+struct uart_decoder *u = &d->uart;
+uint8_t level = u->prev;
+size_t i = 0;
+
+	if (!d->started) {
+		u->prev = ((p[0] >> u->rx) & 1) ^ u->invert;
+	}
+	while (i < n) {
+		if (u->busy) {
+			if (u->next >= base + n) {
+				break;
+			}
+			i = u->next - base;
+			level = ((p[i] >> u->rx) & 1) ^ u->invert;
+			uart_bit(d, level);
+			u->prev = level;
+			i++;
+			continue;
+		}
+		/* idle, or the stop bit running out: look for the falling edge of a start bit */
+		for (; i < n; i++) {
+			level = ((p[i] >> u->rx) & 1) ^ u->invert;
+			if (level != u->prev) {
+				break;
+			}
+		}
+		if (i == n) {
+			break;
+		}
+		u->prev = level;
+		if (!level) {
+			u->busy = true;
+			u->t0 = base + i;
+			u->bit = 0;
+			u->value = 0;
+			u->flags = 0;
+			u->next = uart_middle(u, 0);
+		}
+		i++;
+	}
+	if (n && !u->busy) {
+		u->prev = ((p[n - 1] >> u->rx) & 1) ^ u->invert;
+	}
+}
+
+const struct decoder_type uart_decoder_type = {
+	.name = "uart",
+	.init = uart_init,
+	.feed = uart_feed,
+	.reset = uart_reset,
+};
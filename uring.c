@@ -0,0 +1,434 @@
+// vim: sw=8:ts=8:noexpandtab
+#define _GNU_SOURCE	/* O_DIRECT */
+#include "uring.h"
+#include "slogic.h"
+#include "log.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#if defined(__linux__) && defined(__NR_io_uring_setup) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define URING_SUPPORTED
+#endif
+#endif
+
+/*
+ * The ring, through the raw system calls
+ */
+
+#ifdef URING_SUPPORTED
+static int uring_setup(struct uring_output *out){
+struct io_uring_params p;
+uint8_t *sq, *cq;
+
+	memset(&p, 0, sizeof(p));
+	if ((out->ring_fd = syscall(__NR_io_uring_setup, out->depth, &p)) < 0) {
+		return -1;
+	}
+	out->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	out->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (out->cq_ring_size > out->sq_ring_size) {
+			out->sq_ring_size = out->cq_ring_size;
+		}
+		out->cq_ring_size = 0;
+	}
+	out->sq_ring = mmap(NULL, out->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | SLOGIC_MAP_POPULATE,
+			    out->ring_fd, IORING_OFF_SQ_RING);
+	if (out->sq_ring == MAP_FAILED) {
+		out->sq_ring = NULL;
+		return -1;
+	}
+	if (out->cq_ring_size) {
+		out->cq_ring = mmap(NULL, out->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | SLOGIC_MAP_POPULATE,
+				    out->ring_fd, IORING_OFF_CQ_RING);
+		if (out->cq_ring == MAP_FAILED) {
+			out->cq_ring = NULL;
+			return -1;
+		}
+	}
+	out->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	out->sqes = mmap(NULL, out->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | SLOGIC_MAP_POPULATE,
+			 out->ring_fd, IORING_OFF_SQES);
+	if (out->sqes == MAP_FAILED) {
+		out->sqes = NULL;
+		return -1;
+	}
+
+	sq = out->sq_ring;
+	cq = out->cq_ring_size ? out->cq_ring : out->sq_ring;
+	out->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+	out->sq_mask = (unsigned int *)(sq + p.sq_off.ring_mask);
+	out->sq_array = (unsigned int *)(sq + p.sq_off.array);
+	out->cq_head = (unsigned int *)(cq + p.cq_off.head);
+	out->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+	out->cq_mask = (unsigned int *)(cq + p.cq_off.ring_mask);
+	out->cqes = cq + p.cq_off.cqes;
+	return 0;
+}
+
+static void uring_teardown(struct uring_output *out){
+	if (out->sqes) {
+		munmap(out->sqes, out->sqes_size);
+	}
+	if (out->cq_ring) {
+		munmap(out->cq_ring, out->cq_ring_size);
+	}
+	if (out->sq_ring) {
+		munmap(out->sq_ring, out->sq_ring_size);
+	}
+	if (out->ring_fd >= 0) {
+		close(out->ring_fd);
+	}
+	out->sqes = out->cq_ring = out->sq_ring = NULL;
+	out->ring_fd = -1;
+}
+
+/* queue one batch; we are the only submitter, so the tail is ours. On error the sqe is left published */
+static int uring_queue(struct uring_output *out, unsigned int index){
+struct uring_batch *batch = &out->batches[index];
+unsigned int tail = *out->sq_tail;
+unsigned int slot = tail & *out->sq_mask;
+struct io_uring_sqe *sqe = &((struct io_uring_sqe *)out->sqes)[slot];
+int ret;
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_WRITEV;
+	sqe->fd = out->fd;
+	sqe->off = batch->offset;
+	sqe->addr = (unsigned long)&batch->iov;
+	sqe->len = 1;
+	sqe->user_data = index;
+	out->sq_array[slot] = slot;
+	__atomic_store_n(out->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	do {
+		ret = syscall(__NR_io_uring_enter, out->ring_fd, 1, 0, 0, NULL, 0);
+	} while (ret < 0 && errno == EINTR);
+	return ret == 1 ? 0 : -1;
+}
+
+static int uring_reap(struct uring_output *out, unsigned int min_complete){
+unsigned int head, tail;
+struct io_uring_cqe *cqe;
+struct uring_batch *batch;
+ssize_t done;
+int ret;
+
+	if (min_complete) {
+		do {
+			ret = syscall(__NR_io_uring_enter, out->ring_fd, 0, min_complete, IORING_ENTER_GETEVENTS, NULL, 0);
+		} while (ret < 0 && errno == EINTR);
+		if (ret < 0) {
+			return -1;
+		}
+	}
+	head = *out->cq_head;
+	tail = __atomic_load_n(out->cq_tail, __ATOMIC_ACQUIRE);
+	for (; head != tail; head++) {
+		cqe = &((struct io_uring_cqe *)out->cqes)[head & *out->cq_mask];
+		batch = &out->batches[cqe->user_data];
+		if (cqe->res < 0) {
+			log_printf( ERR, "uring: write at %lld: %s\n", (long long)batch->offset, strerror(-cqe->res));
+			out->error = -cqe->res;
+		} else if ((size_t)cqe->res < batch->iov.iov_len) {
+			/* rare for a regular file, finish it the slow way */
+			done = pwrite(out->fd, (uint8_t *)batch->iov.iov_base + cqe->res, batch->iov.iov_len - cqe->res,
+				      batch->offset + cqe->res);
+			if (done != (ssize_t)(batch->iov.iov_len - cqe->res)) {
+				out->error = errno ? errno : EIO;
+			}
+		}
+		batch->busy = false;
+		out->in_flight--;
+	}
+	__atomic_store_n(out->cq_head, head, __ATOMIC_RELEASE);
+	return 0;
+}
+#else
+static int uring_setup(struct uring_output *out){
+	errno = ENOSYS;
+	return -1;
+}
+
+static void uring_teardown(struct uring_output *out){
+	out->ring_fd = -1;
+}
+
+static int uring_queue(struct uring_output *out, unsigned int index){
+	return -1;
+}
+
+static int uring_reap(struct uring_output *out, unsigned int min_complete){
+	return -1;
+}
+#endif
+
+/*
+ * Batching
+ */
+
+static int uring_write_sync(struct uring_output *out, struct uring_batch *batch){
+size_t done = 0;
+ssize_t ret;
+struct iovec iov;
+
+	while (done < batch->iov.iov_len) {
+		iov.iov_base = (uint8_t *)batch->iov.iov_base + done;
+		iov.iov_len = batch->iov.iov_len - done;
+		ret = pwritev(out->fd, &iov, 1, batch->offset + done);
+		if (ret < 0 && errno == EINTR) {
+			continue;
+		}
+		if (ret <= 0) {
+			out->error = ret < 0 ? errno : EIO;
+			log_printf( ERR, "uring: write at %lld: %s\n", (long long)batch->offset, strerror(out->error));
+			return -1;
+		}
+		done += ret;
+	}
+	return 0;
+}
+
+/*
+ * io_uring_enter() did not take a queued sqe. It is still in the ring and
+ * would go with the next submission, so the ring is not used again: what is
+ * in flight is waited for (reaping does not submit), the ring is closed with
+ * the stale sqe in it and everything from here on goes through pwritev().
+ */
+static void uring_abandon(struct uring_output *out){
+unsigned int i;
+
+	log_printf( NOTICE, "uring: io_uring_enter: %s, writing with pwritev from here on\n", strerror(errno));
+	while (out->in_flight && uring_reap(out, 1) == 0) {
+	}
+	if (out->in_flight) {
+		log_printf( ERR, "uring: %u writes did not come back: %s\n", out->in_flight, strerror(errno));
+		out->error = errno ? errno : EIO;
+	}
+	uring_teardown(out);
+	for (i = 0; i < out->depth; i++) {
+		out->batches[i].busy = false;
+	}
+	out->in_flight = 0;
+}
+
+/* send the current batch on its way and move on to the next one */
+static void uring_flush(struct uring_output *out){
+struct uring_batch *batch = &out->batches[out->current];
+size_t len = batch->fill;
+
+	if (!len) {
+		return;
+	}
+	if (out->direct) {
+		/* only the last batch can be short; the file is truncated back on close */
+		len = (len + URING_ALIGN - 1) / URING_ALIGN * URING_ALIGN;
+		memset(batch->data + batch->fill, 0, len - batch->fill);
+	}
+	batch->offset = out->offset;
+	batch->iov.iov_base = batch->data;
+	batch->iov.iov_len = len;
+	out->offset += batch->fill;
+	out->writes++;
+
+	if (out->ring_fd >= 0 && uring_queue(out, out->current) == 0) {
+		batch->busy = true;
+		out->in_flight++;
+	} else {
+		if (out->ring_fd >= 0) {
+			uring_abandon(out);
+		}
+		uring_write_sync(out, batch);
+	}
+	out->current = (out->current + 1) % out->depth;
+}
+
+/* the batch we are about to fill has to be back from the kernel */
+static void uring_wait(struct uring_output *out){
+	if (!out->batches[out->current].busy) {
+		return;
+	}
+	out->waits++;
+	while (out->batches[out->current].busy) {
+		if (uring_reap(out, 1)) {
+			log_printf( ERR, "uring: io_uring_enter: %s\n", strerror(errno));
+			out->error = errno;
+			break;
+		}
+	}
+}
+
+static int uring_parse_args(struct uring_output *out, const char *args){
+char *copy, *opt, *save = NULL, *value;
+int ret = 0;
+
+	if (!(copy = strdup(args))) {
+		return -1;
+	}
+	for (opt = strtok_r(copy, ",", &save); opt; opt = strtok_r(NULL, ",", &save)) {
+		value = strchr(opt, '=');
+		if (value) {
+			*value++ = '\0';
+		}
+		if (!strcmp(opt, "direct")) {
+			out->direct = true;
+		} else if (!value) {
+			ret = -1;
+		} else if (!strcmp(opt, "depth")) {
+			out->depth = strtoul(value, NULL, 0);
+			if (out->depth < 1 || out->depth > URING_MAX_DEPTH) {
+				ret = -1;
+			}
+		} else if (!strcmp(opt, "batch")) {
+			out->batch_size = (strtoul(value, NULL, 0) + URING_ALIGN - 1) / URING_ALIGN * URING_ALIGN;
+			if (!out->batch_size) {
+				ret = -1;
+			}
+		} else {
+			ret = -1;
+		}
+		if (ret) {
+			log_printf(ERR, "uring: bad option '%s'\n", opt);
+			break;
+		}
+	}
+	free(copy);
+	return ret;
+}
+
+int uring_callback_open(struct slogic_ctx *handle, char *openstring){
+struct uring_output *out;
+unsigned int i;
+
+	if (strcmp(openstring, "-") == 0) {
+		log_printf( ERR, "The uring output writes at file offsets and cannot write to stdout\n");
+		return 0;
+	}
+	if (!(out = calloc(1, sizeof(struct uring_output)))) {
+		return 0;
+	}
+	out->filename = openstring;
+	out->depth = URING_DEFAULT_DEPTH;
+	out->batch_size = URING_DEFAULT_BATCH;
+	out->ring_fd = -1;
+	out->fd = -1;
+	handle->data_callback_opts = out;
+	if (uring_parse_args(out, handle->output_args ? handle->output_args : "")) {
+		goto fail;
+	}
+
+	out->fd = open(out->filename, O_WRONLY | O_CREAT | O_TRUNC | (out->direct ? O_DIRECT : 0), 0644);
+	if (out->fd < 0 && out->direct && errno == EINVAL) {
+		log_printf( NOTICE, "uring: %s does not support O_DIRECT, going through the page cache\n", out->filename);
+		out->direct = false;
+		out->fd = open(out->filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	}
+	if (out->fd < 0) {
+		goto fail;
+	}
+
+	if (!(out->batches = calloc(out->depth, sizeof(struct uring_batch)))) {
+		goto fail;
+	}
+	for (i = 0; i < out->depth; i++) {
+		if (posix_memalign((void **)&out->batches[i].data, URING_ALIGN, out->batch_size)) {
+			goto fail;
+		}
+	}
+
+	if (uring_setup(out)) {
+		log_printf( NOTICE, "uring: io_uring unavailable (%s), using pwritev\n", strerror(errno));
+		uring_teardown(out);
+	}
+	log_printf( DEBUG, "uring: %u batches of %zu bytes%s%s\n", out->depth, out->batch_size,
+		    out->direct ? ", O_DIRECT" : "", out->ring_fd >= 0 ? "" : ", synchronous");
+	return 1;
+
+fail:
+	uring_callback_close(handle);
+	return 0;
+}
+
+size_t uring_callback_write(struct slogic_ctx *handle, uint8_t *data, size_t size){
+struct uring_output *out = handle->data_callback_opts;
+struct uring_batch *batch;
+size_t n, left = size;
+
+	if (out->error) {
+		if (slogic_pipeline_fail(handle)) {
+			log_printf( ERR, "uring: failed to write %s, stopping the capture\n", out->filename);
+		}
+		return 0;
+	}
+	while (left) {
+		uring_wait(out);
+		batch = &out->batches[out->current];
+		n = out->batch_size - batch->fill;
+		if (n > left) {
+			n = left;
+		}
+		memcpy(batch->data + batch->fill, data, n);
+		batch->fill += n;
+		data += n;
+		left -= n;
+		if (batch->fill == out->batch_size) {
+			uring_flush(out);
+			/* the next batch is reused from empty */
+			out->batches[out->current].fill = 0;
+		}
+	}
+	/* pick up finished writes without waiting, keeps the completion queue short */
+	if (out->in_flight) {
+		uring_reap(out, 0);
+	}
+	if (out->error && slogic_pipeline_fail(handle)) {
+		log_printf( ERR, "uring: failed to write %s, stopping the capture\n", out->filename);
+	}
+	return size;
+}
+
+void uring_callback_close(struct slogic_ctx *handle){
+struct uring_output *out = handle->data_callback_opts;
+unsigned int i;
+
+	if (!out) {
+		return;
+	}
+	if (out->fd >= 0 && out->batches) {
+		uring_wait(out);
+		uring_flush(out);
+		while (out->in_flight && uring_reap(out, 1) == 0) {
+		}
+		if (out->direct && ftruncate(out->fd, out->offset)) {
+			log_printf( ERR, "uring: failed to truncate %s: %s\n", out->filename, strerror(errno));
+			out->error = errno;
+		}
+		/* the writes still out at the end fail here, not in a write() */
+		if (out->error) {
+			log_printf( ERR, "uring: failed to write %s\n", out->filename);
+			slogic_pipeline_fail(handle);
+		}
+		log_printf( DEBUG, "uring: %lu writes, waited for the disk %lu times\n", out->writes, out->waits);
+	}
+	uring_teardown(out);
+	if (out->fd >= 0) {
+		close(out->fd);
+	}
+	if (out->batches) {
+		for (i = 0; i < out->depth; i++) {
+			free(out->batches[i].data);
+		}
+		free(out->batches);
+	}
+	free(out);
+	handle->data_callback_opts = 0;
+}
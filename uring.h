@@ -0,0 +1,75 @@
+// vim: sw=8:ts=8:noexpandtab
+#ifndef __URING_H__
+#define __URING_H__
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/*
+ * Uncompressed output through asynchronous, batched writes. The writer
+ * thread copies the transfer buffers into a few large aligned batches and
+ * queues each one with io_uring as soon as it is full, so it is never the
+ * one waiting for the disk unless every batch is still being written.
+ * Kernels (or seccomp profiles) without io_uring get the same batching with
+ * pwritev() instead. Options follow "uring:" comma separated:
+ *
+ *   direct		open the file O_DIRECT, bypassing the page cache
+ *   depth=<n>		batches, and so writes in flight, defaults to 8
+ *   batch=<bytes>	batch size, rounded to URING_ALIGN, defaults to 1MiB
+ */
+
+#define URING_DEFAULT_DEPTH 8
+#define URING_MAX_DEPTH 256
+#define URING_DEFAULT_BATCH (1024 * 1024)
+#define URING_ALIGN 4096	/* O_DIRECT buffer, offset and length alignment */
+
+struct slogic_ctx;
+
+struct uring_batch {
+	uint8_t				*data;
+	size_t				fill;
+	off_t				offset;
+	struct iovec			iov;
+	bool				busy;		/* queued and not completed yet */
+};
+
+struct uring_output {
+	int				fd;
+	char				*filename;
+	bool				direct;
+	unsigned int			depth;
+	size_t				batch_size;
+	struct uring_batch		*batches;
+	unsigned int			current;
+	unsigned int			in_flight;
+	off_t				offset;		/* file offset of the current batch */
+	int				error;
+
+	/* the ring, ring_fd < 0 when falling back to pwritev() */
+	int				ring_fd;
+	void				*sq_ring;
+	size_t				sq_ring_size;
+	void				*cq_ring;
+	size_t				cq_ring_size;
+	void				*sqes;
+	size_t				sqes_size;
+	unsigned int			*sq_tail;
+	unsigned int			*sq_mask;
+	unsigned int			*sq_array;
+	unsigned int			*cq_head;
+	unsigned int			*cq_tail;
+	unsigned int			*cq_mask;
+	void				*cqes;
+
+	unsigned long			writes;
+	unsigned long			waits;		/* writer had to wait for a free batch */
+};
+
+/* output backend, see slogic_get_output_formats() */
+int uring_callback_open(struct slogic_ctx *handle, char *openstring);
+size_t uring_callback_write(struct slogic_ctx *handle, uint8_t *data, size_t size);
+void uring_callback_close(struct slogic_ctx *handle);
+
+#endif